@@ -1,5 +1,10 @@
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 
 import Ostrich;
@@ -10,15 +15,110 @@ void print(const std::string_view &s)
     std::cin.get();
 }
 
+void usage()
+{
+    std::cerr << "Usage: Demo [file]\n"
+                 "       Demo --batch <script|-> [file]\n"
+                 "       Demo --steps <count> [--dump] [file]\n"
+                 "       Demo --gdb <port> [file]\n"
+                 "\n"
+                 "--batch runs debugger commands from a script, or stdin if the script is -\n"
+                 "--steps runs count instructions without the UI\n"
+                 "--dump prints the registers and memory as JSON when done\n"
+                 "--gdb waits for gdb to connect to localhost:port and lets it debug the program\n";
+}
+
+struct Options
+{
+    std::optional<std::string> batchScript;
+    std::optional<std::string> steps;
+    bool dump{ false };
+    std::optional<uint16_t> gdbPort;
+    std::optional<std::filesystem::path> file;
+};
+
+Options parseOptions(int argc, char *argv[])
+{
+    Options options;
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string_view argument{ argv[i] };
+        if((argument == "--batch" || argument == "--steps") && i + 1 < argc)
+        {
+            (argument == "--batch" ? options.batchScript : options.steps) = argv[++i];
+        }
+        else if(argument == "--gdb" && i + 1 < argc)
+        {
+            options.gdbPort = static_cast<uint16_t>(std::stoul(argv[++i]));
+        }
+        else if(argument == "--dump")
+        {
+            options.dump = true;
+        }
+        else if(!argument.starts_with("--") && !options.file)
+        {
+            options.file = argv[i];
+        }
+        else
+        {
+            usage();
+            throw std::runtime_error(std::string{ "Bad argument " } + argv[i]);
+        }
+    }
+    return options;
+}
+
+// Runs without ever constructing the UI, so nothing is rendered
+void runHeadless(ostrich::Vm &vm, const Options &options)
+{
+    ostrich::Batch batch{ vm, std::cout };
+    if(options.batchScript)
+    {
+        if(*options.batchScript == "-")
+        {
+            batch.run(std::cin);
+        }
+        else
+        {
+            std::ifstream script{ *options.batchScript };
+            if(!script)
+            {
+                throw std::runtime_error("Failed to open " + *options.batchScript);
+            }
+            batch.run(script);
+        }
+    }
+    if(options.steps)
+    {
+        batch.execute("next " + *options.steps);
+    }
+    if(options.dump)
+    {
+        batch.execute("dump");
+    }
+}
+
 int main(int argc, char *argv[])
 {
     try
     {
-
-        std::cout << argc << std::endl;
-        ostrich::Vm vm{ argc == 2 ? ostrich::parser::parse(std::filesystem::path(argv[1])) :
-                                    ostrich::parser::parse(std::string_view("")),
-                        58 };
+        const auto options = parseOptions(argc, argv);
+        ostrich::Vm vm{ ostrich::Source{}, 58 };
+        if(options.file)
+        {
+            vm.load(*options.file);
+        }
+        if(options.gdbPort)
+        {
+            std::cout << "Waiting for gdb on port " << *options.gdbPort << std::endl;
+            ostrich::GdbStub{ vm }.serve(*options.gdbPort);
+            return 0;
+        }
+        if(options.batchScript || options.steps || options.dump)
+        {
+            runHeadless(vm, options);
+            return 0;
+        }
         ostrich::UI ui(120, 30, vm);
         ui.mainLoop();
     }
@@ -32,4 +132,4 @@ int main(int argc, char *argv[])
         std::cerr << "Unknown exception" << std::endl;
         return 1;
     }
-}
\ No newline at end of file
+}
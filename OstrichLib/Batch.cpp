@@ -0,0 +1,131 @@
+module;
+
+#include <fmt/core.h>
+
+#include <charconv>
+#include <filesystem>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+module Ostrich;
+
+
+namespace ostrich
+{
+    Batch::Batch(Vm &vm, std::ostream &output) : m_vm{ vm }, m_output{ output }
+    {
+    }
+
+    size_t parseCount(const std::string_view &argument)
+    {
+        if(argument.empty())
+        {
+            return 1;
+        }
+        size_t count{ 0 };
+        const auto [end, error] = std::from_chars(argument.data(), argument.data() + argument.size(), count);
+        if(error != std::errc{} || end != argument.data() + argument.size())
+        {
+            throw std::runtime_error(fmt::format("Expected a count, got '{}'", argument));
+        }
+        return count;
+    }
+
+    std::string_view trim(const std::string_view &str)
+    {
+        const auto first = str.find_first_not_of(" \t\r");
+        if(first == std::string_view::npos)
+        {
+            return {};
+        }
+        return str.substr(first, str.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    bool Batch::execute(const std::string_view &commandLine)
+    {
+        const auto line = trim(commandLine);
+        if(line.starts_with("'"))
+        {
+            m_vm.execute(parser::parseInstruction(line.substr(1)));
+            return true;
+        }
+        const auto separator = line.find(' ');
+        const auto command = line.substr(0, separator);
+        const auto argument = separator == std::string_view::npos ? std::string_view{} : trim(line.substr(separator));
+
+        if(command == "s" || command == "step")
+        {
+            // Every step is saved in the history, so there is no stepping past the end
+            for(size_t i = parseCount(argument); i > 0 && m_vm.cpu().nextInstruction() < m_vm.source().size(); --i)
+            {
+                m_vm.step();
+            }
+        }
+        else if(command == "n" || command == "next")
+        {
+            m_vm.run(parseCount(argument));
+        }
+        else if(command == "b" || command == "back")
+        {
+            for(size_t i = parseCount(argument); i > 0; --i)
+            {
+                m_vm.restorePreviousState();
+            }
+        }
+        else if(command == "l" || command == "load")
+        {
+            m_vm.load(std::filesystem::path(argument));
+        }
+        else if(command == "r" || command == "registers")
+        {
+            m_output << fmt::format("{{{}}}\n", cpuJson(StateDump::of(m_vm)));
+        }
+        else if(command == "m" || command == "memory")
+        {
+            m_output << fmt::format("{{{}}}\n", memoryJson(StateDump::of(m_vm)));
+        }
+        else if(command == "d" || command == "dump")
+        {
+            m_output << StateDump::of(m_vm).toJson() << "\n";
+        }
+        else if(command == "q" || command == "quit")
+        {
+            return false;
+        }
+        else
+        {
+            throw std::runtime_error(fmt::format("Syntax error: '{}'", line));
+        }
+        return true;
+    }
+
+    void Batch::run(std::istream &input)
+    {
+        std::string line;
+        size_t lineNumber{ 0 };
+        while(std::getline(input, line))
+        {
+            ++lineNumber;
+            const auto command = trim(line);
+            if(command.empty() || command.starts_with("#"))
+            {
+                continue;
+            }
+            try
+            {
+                if(!execute(command))
+                {
+                    break;
+                }
+            }
+            catch(const std::exception &e)
+            {
+                throw std::runtime_error(fmt::format("Line {}: {}", lineNumber, e.what()));
+            }
+        }
+        m_output.flush();
+    }
+} // namespace ostrich
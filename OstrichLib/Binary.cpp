@@ -0,0 +1,713 @@
+module;
+
+#include "Overloaded.h"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+module Ostrich;
+
+// Layout, all integers little endian:
+//
+// Header      magic "OSTRICH\0", u16 version, u16 reserved, u32 instruction count,
+//             u32 string count, u32 string table offset, u32 source name (string index)
+// Program     one record per instruction: u8 opcode, u32 text (string index), operands
+// Strings     u32 length followed by the characters, for each string
+//
+// The string table holds the source file name and the text of each instruction, so that errors in
+// a binary program can be reported in terms of the source it was made from.
+
+namespace ostrich::binary
+{
+    constexpr std::array<uint8_t, 8> magic{ 'O', 'S', 'T', 'R', 'I', 'C', 'H', '\0' };
+    constexpr size_t headerSize{ 28 };
+    // A string is at least its u32 length, an instruction at least its u8 opcode and u32 text
+    constexpr size_t minimumStringSize{ 4 };
+    constexpr size_t minimumInstructionSize{ 5 };
+    constexpr uint8_t noIndex{ 0xff };
+
+    enum class Opcode : uint8_t { inc = 1, dec, add, push, pop, mov, sub, cmp, pushf, label, jmp, jcc, packed };
+    enum class OperandKind : uint8_t { registerName = 1, immediate, memory, subRegister, vectorRegister };
+
+    class Writer
+    {
+    public:
+        void u8(uint8_t value)
+        {
+            m_data.push_back(value);
+        }
+
+        void u16(uint16_t value)
+        {
+            integer(value, 2);
+        }
+
+        void u32(uint32_t value)
+        {
+            integer(value, 4);
+        }
+
+        void u64(uint64_t value)
+        {
+            integer(value, 8);
+        }
+
+        void patchU32(size_t offset, uint32_t value)
+        {
+            for(size_t i = 0; i < 4; ++i)
+            {
+                m_data[offset + i] = static_cast<uint8_t>(value >> i * 8);
+            }
+        }
+
+        void bytes(std::span<const uint8_t> bytes)
+        {
+            m_data.insert(m_data.end(), bytes.begin(), bytes.end());
+        }
+
+        size_t size() const
+        {
+            return m_data.size();
+        }
+
+        std::vector<uint8_t> release()
+        {
+            return std::move(m_data);
+        }
+
+    private:
+        void integer(uint64_t value, size_t byteCount)
+        {
+            for(size_t i = 0; i < byteCount; ++i)
+            {
+                m_data.push_back(static_cast<uint8_t>(value >> i * 8));
+            }
+        }
+
+        std::vector<uint8_t> m_data;
+    };
+
+    class Reader
+    {
+    public:
+        explicit Reader(std::span<const uint8_t> data) : m_data{ data }
+        {
+        }
+
+        uint8_t u8()
+        {
+            return static_cast<uint8_t>(integer(1));
+        }
+
+        uint16_t u16()
+        {
+            return static_cast<uint16_t>(integer(2));
+        }
+
+        uint32_t u32()
+        {
+            return static_cast<uint32_t>(integer(4));
+        }
+
+        uint64_t u64()
+        {
+            return integer(8);
+        }
+
+        std::string_view string(size_t length)
+        {
+            require(length);
+            const std::string_view result{ reinterpret_cast<const char *>(m_data.data() + m_position), length };
+            m_position += length;
+            return result;
+        }
+
+        void seek(size_t position)
+        {
+            if(position > m_data.size())
+            {
+                throw std::runtime_error(
+                fmt::format("Corrupt binary program, offset {} is past the end ({} bytes)", position, m_data.size()));
+            }
+            m_position = position;
+        }
+
+        size_t position() const
+        {
+            return m_position;
+        }
+
+        // For checking counts from the file before allocating for them
+        void requireRecords(uint32_t count, size_t minimumSize, std::string_view what) const
+        {
+            if(count > (m_data.size() - m_position) / minimumSize)
+            {
+                throw std::runtime_error(fmt::format("Corrupt binary program, {} {} don't fit in the {} bytes "
+                                                     "after offset {}",
+                                                     count, what, m_data.size() - m_position, m_position));
+            }
+        }
+
+    private:
+        void require(size_t byteCount) const
+        {
+            if(byteCount > m_data.size() - m_position)
+            {
+                throw std::runtime_error(fmt::format(
+                "Truncated binary program, tried to read {} bytes at offset {} of {}", byteCount, m_position, m_data.size()));
+            }
+        }
+
+        uint64_t integer(size_t byteCount)
+        {
+            require(byteCount);
+            uint64_t result{ 0 };
+            for(size_t i = 0; i < byteCount; ++i)
+            {
+                result |= static_cast<uint64_t>(m_data[m_position + i]) << i * 8;
+            }
+            m_position += byteCount;
+            return result;
+        }
+
+        std::span<const uint8_t> m_data;
+        size_t m_position{ 0 };
+    };
+
+    class StringTable
+    {
+    public:
+        uint32_t add(const std::string &string)
+        {
+            const auto [it, inserted] = m_indices.try_emplace(string, static_cast<uint32_t>(m_strings.size()));
+            if(inserted)
+            {
+                m_strings.push_back(string);
+            }
+            return it->second;
+        }
+
+        void write(Writer &writer) const
+        {
+            for(const auto &string : m_strings)
+            {
+                writer.u32(static_cast<uint32_t>(string.size()));
+                writer.bytes({ reinterpret_cast<const uint8_t *>(string.data()), string.size() });
+            }
+        }
+
+        uint32_t size() const
+        {
+            return static_cast<uint32_t>(m_strings.size());
+        }
+
+    private:
+        std::vector<std::string> m_strings;
+        std::unordered_map<std::string, uint32_t> m_indices;
+    };
+
+    void writeRegister(Writer &writer, RegisterName registerName)
+    {
+        writer.u8(static_cast<uint8_t>(registerName));
+    }
+
+    void writeVectorRegister(Writer &writer, VectorRegister vectorRegister)
+    {
+        writer.u8(vectorRegister.number);
+        writer.u8(vectorRegister.wide ? 1 : 0);
+    }
+
+    void writeMemory(Writer &writer, const MemoryAddress &address)
+    {
+        writeRegister(writer, address.base);
+        writer.u8(static_cast<uint8_t>(address.indexOperator));
+        writer.u8(address.index ? static_cast<uint8_t>(*address.index) : noIndex);
+        writer.u8(address.scale);
+        writer.u8(static_cast<uint8_t>(address.displacementOperator));
+        writer.u64(address.displacement);
+    }
+
+    void writeOperand(Writer &writer, const RegisterOrImmediateOrMemory &operand)
+    {
+        std::visit(overloaded{
+                   [&](const RegisterName name) {
+                       writer.u8(static_cast<uint8_t>(OperandKind::registerName));
+                       writeRegister(writer, name);
+                   },
+                   [&](const uint64_t value) {
+                       writer.u8(static_cast<uint8_t>(OperandKind::immediate));
+                       writer.u64(value);
+                   },
+                   [&](const MemoryAddress &address) {
+                       writer.u8(static_cast<uint8_t>(OperandKind::memory));
+                       writeMemory(writer, address);
+                   },
+                   [&](const SubRegister subRegister) {
+                       writer.u8(static_cast<uint8_t>(OperandKind::subRegister));
+                       writeRegister(writer, subRegister.registerName);
+                       writer.u8(static_cast<uint8_t>(subRegister.width));
+                   },
+                   },
+                   operand);
+    }
+
+    void writeVectorOperand(Writer &writer, const VectorRegisterOrMemory &operand)
+    {
+        std::visit(overloaded{
+                   [&](const VectorRegister vectorRegister) {
+                       writer.u8(static_cast<uint8_t>(OperandKind::vectorRegister));
+                       writeVectorRegister(writer, vectorRegister);
+                   },
+                   [&](const MemoryAddress &address) {
+                       writer.u8(static_cast<uint8_t>(OperandKind::memory));
+                       writeMemory(writer, address);
+                   },
+                   },
+                   operand);
+    }
+
+    std::vector<uint8_t> serialize(const Source &source, const std::string &sourceName)
+    {
+        Writer writer;
+        StringTable strings;
+        writer.bytes(magic);
+        writer.u16(formatVersion);
+        writer.u16(0);
+        writer.u32(static_cast<uint32_t>(source.size()));
+        const size_t stringCountOffset = writer.size();
+        writer.u32(0);
+        writer.u32(0);
+        writer.u32(strings.add(sourceName));
+
+        for(const auto &instruction : source)
+        {
+            std::visit(overloaded{
+                       [&](const Inc &inc) {
+                           writer.u8(static_cast<uint8_t>(Opcode::inc));
+                           writer.u32(strings.add(inc.toString()));
+                           writeRegister(writer, inc.registerName);
+                           writer.u8(static_cast<uint8_t>(inc.width));
+                       },
+                       [&](const Dec &dec) {
+                           writer.u8(static_cast<uint8_t>(Opcode::dec));
+                           writer.u32(strings.add(dec.toString()));
+                           writeRegister(writer, dec.registerName);
+                           writer.u8(static_cast<uint8_t>(dec.width));
+                       },
+                       [&](const Add &add) {
+                           writer.u8(static_cast<uint8_t>(Opcode::add));
+                           writer.u32(strings.add(add.toString()));
+                           writeRegister(writer, add.destination);
+                           writeOperand(writer, add.source);
+                           writer.u8(static_cast<uint8_t>(add.width));
+                       },
+                       [&](const Push &push) {
+                           writer.u8(static_cast<uint8_t>(Opcode::push));
+                           writer.u32(strings.add(push.toString()));
+                           writeRegister(writer, push.registerName);
+                       },
+                       [&](const Pop &pop) {
+                           writer.u8(static_cast<uint8_t>(Opcode::pop));
+                           writer.u32(strings.add(pop.toString()));
+                           writeRegister(writer, pop.registerName);
+                       },
+                       [&](const Mov &mov) {
+                           writer.u8(static_cast<uint8_t>(Opcode::mov));
+                           writer.u32(strings.add(mov.toString()));
+                           writeRegister(writer, mov.destination);
+                           writeOperand(writer, mov.source);
+                           writer.u8(static_cast<uint8_t>(mov.width));
+                       },
+                       [&](const Sub &sub) {
+                           writer.u8(static_cast<uint8_t>(Opcode::sub));
+                           writer.u32(strings.add(sub.toString()));
+                           writeRegister(writer, sub.destination);
+                           writeOperand(writer, sub.source);
+                           writer.u8(static_cast<uint8_t>(sub.width));
+                       },
+                       [&](const Cmp &cmp) {
+                           writer.u8(static_cast<uint8_t>(Opcode::cmp));
+                           writer.u32(strings.add(cmp.toString()));
+                           writeRegister(writer, cmp.destination);
+                           writeOperand(writer, cmp.source);
+                           writer.u8(static_cast<uint8_t>(cmp.width));
+                       },
+                       [&](const Pushf &pushf) {
+                           writer.u8(static_cast<uint8_t>(Opcode::pushf));
+                           writer.u32(strings.add(pushf.toString()));
+                       },
+                       [&](const Label &label) {
+                           writer.u8(static_cast<uint8_t>(Opcode::label));
+                           writer.u32(strings.add(label.toString()));
+                           writer.u32(strings.add(label.name));
+                       },
+                       [&](const Jmp &jmp) {
+                           writer.u8(static_cast<uint8_t>(Opcode::jmp));
+                           writer.u32(strings.add(jmp.toString()));
+                           writer.u32(strings.add(jmp.label));
+                           writer.u64(jmp.target);
+                       },
+                       [&](const Jcc &jcc) {
+                           writer.u8(static_cast<uint8_t>(Opcode::jcc));
+                           writer.u32(strings.add(jcc.toString()));
+                           writer.u8(static_cast<uint8_t>(jcc.conditionCode));
+                           writer.u32(strings.add(jcc.label));
+                           writer.u64(jcc.target);
+                       },
+                       [&](const Packed &packed) {
+                           writer.u8(static_cast<uint8_t>(Opcode::packed));
+                           writer.u32(strings.add(packed.toString()));
+                           writer.u8(static_cast<uint8_t>(packed.operation));
+                           writer.u8(packed.vex ? 1 : 0);
+                           writeVectorRegister(writer, packed.destination);
+                           writeVectorRegister(writer, packed.first);
+                           writeVectorOperand(writer, packed.source);
+                       },
+                       },
+                       instruction);
+        }
+
+        writer.patchU32(stringCountOffset, strings.size());
+        writer.patchU32(stringCountOffset + 4, static_cast<uint32_t>(writer.size()));
+        strings.write(writer);
+        return writer.release();
+    }
+
+    std::vector<std::string_view> readStrings(Reader &reader, uint32_t count)
+    {
+        reader.requireRecords(count, minimumStringSize, "strings");
+        std::vector<std::string_view> strings;
+        strings.reserve(count);
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            strings.push_back(reader.string(reader.u32()));
+        }
+        return strings;
+    }
+
+    std::string_view lookup(const std::vector<std::string_view> &strings, uint32_t index)
+    {
+        if(index >= strings.size())
+        {
+            throw std::runtime_error(
+            fmt::format("Corrupt binary program, string {} is out of range ({} strings)", index, strings.size()));
+        }
+        return strings[index];
+    }
+
+    // Decodes the instructions. Errors are reported with the source name and the original text of
+    // the instruction being decoded.
+    class ProgramReader
+    {
+    public:
+        ProgramReader(Reader &reader, const std::vector<std::string_view> &strings, std::string_view sourceName)
+        : m_reader{ reader }, m_strings{ strings }, m_sourceName{ sourceName }
+        {
+        }
+
+        Instruction instruction(size_t index)
+        {
+            m_index = index;
+            const auto opcode = static_cast<Opcode>(m_reader.u8());
+            m_text = lookup(m_strings, m_reader.u32());
+            switch(opcode)
+            {
+            case Opcode::inc:
+            {
+                const auto name = registerName();
+                return Inc{ name, width() };
+            }
+            case Opcode::dec:
+            {
+                const auto name = registerName();
+                return Dec{ name, width() };
+            }
+            case Opcode::add:
+            {
+                const auto destination = registerName();
+                const auto source = operand();
+                return Add{ destination, source, width() };
+            }
+            case Opcode::push:
+                return Push{ registerName() };
+            case Opcode::pop:
+                return Pop{ registerName() };
+            case Opcode::mov:
+            {
+                const auto destination = registerName();
+                const auto source = operand();
+                return Mov{ destination, source, width() };
+            }
+            case Opcode::sub:
+            {
+                const auto destination = registerName();
+                const auto source = operand();
+                return Sub{ destination, source, width() };
+            }
+            case Opcode::cmp:
+            {
+                const auto destination = registerName();
+                const auto source = operand();
+                return Cmp{ destination, source, width() };
+            }
+            case Opcode::pushf:
+                return Pushf{};
+            case Opcode::label:
+                return Label{ string() };
+            case Opcode::jmp:
+            {
+                auto label = string();
+                return Jmp{ std::move(label), m_reader.u64() };
+            }
+            case Opcode::jcc:
+            {
+                const auto code = conditionCode();
+                auto label = string();
+                return Jcc{ code, std::move(label), m_reader.u64() };
+            }
+            case Opcode::packed:
+                return packed();
+            }
+            fail(fmt::format("unknown opcode {}", static_cast<int>(opcode)));
+        }
+
+    private:
+        [[noreturn]] void fail(const std::string &message) const
+        {
+            throw std::runtime_error(fmt::format("Corrupt binary program '{}', instruction {} ('{}'): {}",
+                                                 m_sourceName, m_index, m_text, message));
+        }
+
+        RegisterName registerName(uint8_t value)
+        {
+            if(value >= generalPurposeRegisterCount)
+            {
+                fail(fmt::format("register {} out of range", static_cast<int>(value)));
+            }
+            return static_cast<RegisterName>(value);
+        }
+
+        RegisterName registerName()
+        {
+            return registerName(m_reader.u8());
+        }
+
+        std::string string()
+        {
+            return std::string{ lookup(m_strings, m_reader.u32()) };
+        }
+
+        ConditionCode conditionCode()
+        {
+            const auto value = m_reader.u8();
+            if(value > static_cast<uint8_t>(ConditionCode::np))
+            {
+                fail(fmt::format("condition code {} out of range", static_cast<int>(value)));
+            }
+            return static_cast<ConditionCode>(value);
+        }
+
+        Width width()
+        {
+            const auto value = m_reader.u8();
+            if(value > static_cast<uint8_t>(Width::highByte))
+            {
+                fail(fmt::format("width {} out of range", static_cast<int>(value)));
+            }
+            return static_cast<Width>(value);
+        }
+
+        AdditiveOperator additiveOperator()
+        {
+            const auto value = m_reader.u8();
+            if(value > static_cast<uint8_t>(AdditiveOperator::minus))
+            {
+                fail(fmt::format("additive operator {} out of range", static_cast<int>(value)));
+            }
+            return static_cast<AdditiveOperator>(value);
+        }
+
+        RegisterOrImmediateOrMemory operand()
+        {
+            const auto kind = static_cast<OperandKind>(m_reader.u8());
+            switch(kind)
+            {
+            case OperandKind::registerName:
+                return registerName();
+            case OperandKind::immediate:
+                return m_reader.u64();
+            case OperandKind::memory:
+                return memoryAddress();
+            case OperandKind::subRegister:
+            {
+                const auto name = registerName();
+                return SubRegister{ name, width() };
+            }
+            case OperandKind::vectorRegister:
+                break;
+            }
+            fail(fmt::format("unknown operand kind {}", static_cast<int>(kind)));
+        }
+
+        MemoryAddress memoryAddress()
+        {
+            MemoryAddress address;
+            address.base = registerName();
+            address.indexOperator = additiveOperator();
+            const auto index = m_reader.u8();
+            if(index != noIndex)
+            {
+                address.index = registerName(index);
+            }
+            address.scale = m_reader.u8();
+            address.displacementOperator = additiveOperator();
+            address.displacement = m_reader.u64();
+            return address;
+        }
+
+        bool boolean()
+        {
+            const auto value = m_reader.u8();
+            if(value > 1)
+            {
+                fail(fmt::format("boolean {} out of range", static_cast<int>(value)));
+            }
+            return value == 1;
+        }
+
+        VectorRegister vectorRegister()
+        {
+            const auto number = m_reader.u8();
+            if(number >= vectorRegisterCount)
+            {
+                fail(fmt::format("vector register {} out of range", static_cast<int>(number)));
+            }
+            return VectorRegister{ number, boolean() };
+        }
+
+        // The parser only makes packed instructions where the registers are the same size, and
+        // only the vex ones have ymm registers
+        Packed packed()
+        {
+            const auto operation = m_reader.u8();
+            if(operation > static_cast<uint8_t>(PackedOperation::mulps))
+            {
+                fail(fmt::format("packed operation {} out of range", static_cast<int>(operation)));
+            }
+            Packed result{ static_cast<PackedOperation>(operation) };
+            result.vex = boolean();
+            result.destination = vectorRegister();
+            result.first = vectorRegister();
+            const auto kind = static_cast<OperandKind>(m_reader.u8());
+            if(kind == OperandKind::vectorRegister)
+            {
+                const auto source = vectorRegister();
+                result.source = source;
+                if(source.wide != result.destination.wide)
+                {
+                    fail("the source and the destination are different sizes");
+                }
+            }
+            else if(kind == OperandKind::memory)
+            {
+                result.source = memoryAddress();
+            }
+            else
+            {
+                fail(fmt::format("unknown operand kind {}", static_cast<int>(kind)));
+            }
+            if(result.first.wide != result.destination.wide)
+            {
+                fail("the first operand and the destination are different sizes");
+            }
+            if(result.destination.wide && !result.vex)
+            {
+                fail("ymm registers need the vex form");
+            }
+            return result;
+        }
+
+        Reader &m_reader;
+        const std::vector<std::string_view> &m_strings;
+        std::string_view m_sourceName;
+        std::string_view m_text;
+        size_t m_index{ 0 };
+    };
+
+    Source deserialize(std::span<const uint8_t> data)
+    {
+        if(data.size() < headerSize || !std::equal(magic.begin(), magic.end(), data.begin()))
+        {
+            throw std::runtime_error("Not an Ostrich binary program");
+        }
+        Reader reader{ data };
+        reader.seek(magic.size());
+        const auto version = reader.u16();
+        if(version != formatVersion)
+        {
+            throw std::runtime_error(
+            fmt::format("Unsupported binary program version {}, expected {}", version, formatVersion));
+        }
+        reader.u16();
+        const auto instructionCount = reader.u32();
+        const auto stringCount = reader.u32();
+        const auto stringTableOffset = reader.u32();
+        const auto sourceNameIndex = reader.u32();
+        const auto programOffset = reader.position();
+
+        reader.seek(stringTableOffset);
+        const auto strings = readStrings(reader, stringCount);
+        const auto sourceName = lookup(strings, sourceNameIndex);
+
+        reader.seek(programOffset);
+        ProgramReader programReader{ reader, strings, sourceName };
+        reader.requireRecords(instructionCount, minimumInstructionSize, "instructions");
+        Source source;
+        source.reserve(instructionCount);
+        for(uint32_t i = 0; i < instructionCount; ++i)
+        {
+            source.push_back(programReader.instruction(i));
+        }
+        return source;
+    }
+
+    void save(const Source &source, const std::filesystem::path &path, const std::string &sourceName)
+    {
+        const auto data = serialize(source, sourceName.empty() ? path.filename().string() : sourceName);
+        std::ofstream file(path, std::ios::binary);
+        if(!file.is_open())
+        {
+            throw std::runtime_error(fmt::format("Failed to open '{}' for writing", path.string()));
+        }
+        file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        if(!file)
+        {
+            throw std::runtime_error(fmt::format("Failed to write '{}'", path.string()));
+        }
+    }
+
+    Source load(const std::filesystem::path &path)
+    {
+        const MappedFile file{ path };
+        return deserialize(file.data());
+    }
+
+    bool isBinary(const std::filesystem::path &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::array<char, magic.size()> header{};
+        file.read(header.data(), header.size());
+        return file.gcount() == static_cast<std::streamsize>(header.size()) &&
+               std::equal(magic.begin(), magic.end(), header.begin(),
+                          [](uint8_t m, char c) { return m == static_cast<uint8_t>(c); });
+    }
+} // namespace ostrich::binary
@@ -0,0 +1,184 @@
+module;
+
+#include <optional>
+#include <variant>
+#include <vector>
+
+module Ostrich;
+
+namespace ostrich
+{
+    namespace
+    {
+        std::optional<Operation> fuse(const Instruction &first, const Instruction &second)
+        {
+            if(const auto *push = std::get_if<Push>(&first))
+            {
+                // Pop rsp adds 8 to the value it pops, so it is left alone
+                const auto *pop = std::get_if<Pop>(&second);
+                if(pop && pop->registerName != RegisterName::rsp)
+                {
+                    return PushPop{ push->registerName, pop->registerName };
+                }
+            }
+            else if(const auto *mov = std::get_if<Mov>(&first))
+            {
+                const auto *value = std::get_if<uint64_t>(&mov->source);
+                const auto *add = std::get_if<Add>(&second);
+                const auto *added = add ? std::get_if<RegisterName>(&add->source) : nullptr;
+                const bool qwords = mov->width == Width::qword && add && add->width == Width::qword;
+                if(value && added && *added == mov->destination && qwords)
+                {
+                    return MovAdd{ mov->destination, *value, add->destination };
+                }
+            }
+            else if(const auto *dec = std::get_if<Dec>(&first))
+            {
+                const auto *jcc = std::get_if<Jcc>(&second);
+                if(jcc && dec->width == Width::qword)
+                {
+                    return DecJcc{ dec->registerName, jcc->conditionCode, jcc->target };
+                }
+            }
+            return std::nullopt;
+        }
+
+        std::vector<Operation> fuse(const Source &source, size_t first, size_t last)
+        {
+            std::vector<Operation> operations;
+            for(size_t i = first; i < last; ++i)
+            {
+                if(i + 1 < last)
+                {
+                    if(auto fused = fuse(source[i], source[i + 1]))
+                    {
+                        operations.push_back(*fused);
+                        ++i;
+                        continue;
+                    }
+                }
+                if(const auto handler = Cpu::handler(source[i]))
+                {
+                    operations.push_back(Handled{ &source[i], handler });
+                    continue;
+                }
+                operations.push_back(&source[i]);
+            }
+            return operations;
+        }
+    } // namespace
+
+    size_t BlockCache::Block::size() const
+    {
+        return last - first;
+    }
+
+    BlockCache::BlockCache(const BlockCache &other) : m_useJit{ other.m_useJit }
+    {
+    }
+
+    BlockCache &BlockCache::operator=(const BlockCache &other)
+    {
+        clear();
+        m_useJit = other.m_useJit;
+        return *this;
+    }
+
+    void BlockCache::prepare(const Source &source, const std::vector<bool> &breakBefore)
+    {
+        if(&source != m_source || source.size() != m_blocks.size() || breakBefore != m_breakBefore)
+        {
+            clear();
+            m_source = &source;
+            m_breakBefore = breakBefore;
+            m_blocks.resize(source.size());
+        }
+    }
+
+    void BlockCache::clear()
+    {
+        m_source = nullptr;
+        m_breakBefore.clear();
+        m_blocks.clear();
+        m_jit.clear();
+    }
+
+    BlockCache::Block &BlockCache::at(size_t first)
+    {
+        auto &block = m_blocks[first];
+        if(block)
+        {
+            return *block;
+        }
+        const auto &source = *m_source;
+        block = Block{ first, first };
+        // A block can start anywhere, since runs start wherever the last one stopped
+        do
+        {
+            const auto &instruction = source[block->last++];
+            if(const auto *jmp = std::get_if<Jmp>(&instruction))
+            {
+                block->target = jmp->target;
+                break;
+            }
+            if(const auto *jcc = std::get_if<Jcc>(&instruction))
+            {
+                block->target = jcc->target;
+                break;
+            }
+        } while(block->last < source.size() && !m_breakBefore[block->last] &&
+                !std::holds_alternative<Label>(source[block->last]));
+        block->operations = fuse(source, block->first, block->last);
+        return *block;
+    }
+
+    BlockCache::Block &BlockCache::successor(Block &block, size_t next)
+    {
+        if(next == block.last)
+        {
+            if(!block.fallthrough)
+            {
+                block.fallthrough = &at(next);
+            }
+            return *block.fallthrough;
+        }
+        if(next == block.target)
+        {
+            if(!block.taken)
+            {
+                block.taken = &at(next);
+            }
+            return *block.taken;
+        }
+        return at(next);
+    }
+
+    void BlockCache::executed(Block &block)
+    {
+        if(m_useJit && ++block.executions == jitThreshold)
+        {
+            block.compiled = m_jit.compile(*m_source, block.first, block.last);
+            if(m_jit.failed())
+            {
+                // The blocks are kept, since the run executing this one still points into them
+                m_useJit = false;
+                for(auto &other : m_blocks)
+                {
+                    if(other)
+                    {
+                        other->compiled = nullptr;
+                    }
+                }
+            }
+        }
+    }
+
+    void BlockCache::useJit(bool enabled)
+    {
+        if(!enabled)
+        {
+            clear();
+        }
+        m_useJit = enabled && Jit::supported();
+    }
+} // namespace ostrich
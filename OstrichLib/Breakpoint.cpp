@@ -0,0 +1,49 @@
+module;
+
+#include "Overloaded.h"
+
+#include <fmt/core.h>
+
+#include <string>
+#include <variant>
+
+module Ostrich;
+
+namespace ostrich
+{
+    std::string toString(ComparisonOperator comparisonOperator)
+    {
+        using enum ComparisonOperator;
+        switch(comparisonOperator)
+        {
+        case equal:
+            return "==";
+        case notEqual:
+            return "!=";
+        case less:
+            return "<";
+        case lessOrEqual:
+            return "<=";
+        case greater:
+            return ">";
+        case greaterOrEqual:
+            return ">=";
+        }
+        return "?";
+    }
+
+    std::string Condition::toString() const
+    {
+        return fmt::format("{} {} {}", ostrich::toString(lhs), ostrich::toString(comparisonOperator),
+                           ostrich::toString(rhs));
+    }
+
+    std::string toString(const Breakpoint &breakpoint)
+    {
+        return std::visit(overloaded{
+                          [](const size_t instruction) { return fmt::format("instruction {}", instruction); },
+                          [](const Condition &condition) { return condition.toString(); },
+                          },
+                          breakpoint);
+    }
+} // namespace ostrich
@@ -3,45 +3,178 @@ module;
 #include "Overloaded.h"
 
 #include <array>
+#include <bit>
 #include <stdexcept>
+#include <type_traits>
 #include <variant>
+#include <vector>
 module Ostrich;
 
 
 namespace ostrich
 {
-
-    Cpu::Cpu(Stack &stack, Source &source) : m_stack(&stack), m_source(&source)
+    namespace
     {
-        for(size_t i = 0; i < registerCount; ++i)
+        template <Width width>
+        constexpr uint64_t mask{ bitCount(width) == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << bitCount(width)) - 1 };
+
+        template <Width width>
+        constexpr unsigned shift{ width == Width::highByte ? 8 : 0 };
+
+        template <Width width>
+        uint64_t readPart(uint64_t value)
         {
-            m_registers[i] = Register{ static_cast<RegisterName>(i), 0 };
+            return value >> shift<width> & mask<width>;
+        }
+
+        // Only dword writes change the rest of the register, by zeroing it
+        template <Width width>
+        void writePart(uint64_t &destination, uint64_t value)
+        {
+            if constexpr(width == Width::qword || width == Width::dword)
+            {
+                destination = value & mask<width>;
+            }
+            else
+            {
+                destination = (destination & ~(mask<width> << shift<width>)) | (value & mask<width>) << shift<width>;
+            }
         }
+
+        // The flags of an operation on signBit + 1 bit operands, given the carry flag
+        uint64_t computeFlags(bool isAddition, bool carry, unsigned signBit, uint64_t lhs, uint64_t rhs,
+                              uint64_t result)
+        {
+            const bool overflow{ isAddition ? (((lhs ^ result) & (rhs ^ result)) >> signBit & 1) != 0
+                                            : (((lhs ^ rhs) & (lhs ^ result)) >> signBit & 1) != 0 };
+            uint64_t flags{ initialFlags };
+            flags |= carry ? carryFlag : 0;
+            flags |= std::popcount(result & 0xff) % 2 == 0 ? parityFlag : 0;
+            flags |= (lhs ^ rhs ^ result) & 0x10 ? auxiliaryCarryFlag : 0;
+            flags |= result == 0 ? zeroFlag : 0;
+            flags |= result >> signBit & 1 ? signFlag : 0;
+            flags |= overflow ? overflowFlag : 0;
+            return flags;
+        }
+    } // namespace
+
+    Cpu::Cpu(Stack &stack, Source &source, const std::vector<InstructionHandler> *handlers)
+    : m_stack(&stack), m_source(&source), m_handlers(handlers)
+    {
         registerValue(RegisterName::rsp) = stack.beginning();
     }
 
     Cpu::Cpu(Stack &stack, Source &source, size_t nextInstruction, std::array<Register, registerCount> registers)
-    : m_stack{ &stack }, m_source{ &source }, m_nextInstruction{ nextInstruction }, m_registers{ std::move(registers) }
+    : m_stack{ &stack }, m_source{ &source }
+    {
+        for(const auto &r : registers)
+        {
+            registerValue(r.registerName) = r.value;
+        }
+        registerValue(RegisterName::rip) = nextInstruction;
+    }
+
+    Cpu::Cpu(Stack &stack, Source &source, const std::vector<InstructionHandler> *handlers, const Cpu &other)
+    : Cpu{ other }
     {
+        m_stack = &stack;
+        m_source = &source;
+        m_handlers = handlers;
     }
 
     void Cpu::step()
     {
-        if(m_nextInstruction == m_source->size())
+        const auto next = nextInstruction();
+        if(next >= m_source->size())
         {
             return;
         }
-        execute((*m_source)[m_nextInstruction]);
-        m_nextInstruction++;
+        if(!m_handlers)
+        {
+            execute((*m_source)[next], next + 1);
+            return;
+        }
+        const auto &instruction = (*m_source)[next];
+        if(const auto handler = (*m_handlers)[next])
+        {
+            handler(*this, instruction);
+            registerValue(RegisterName::rip) = next + 1;
+            return;
+        }
+        executeWithoutHandler(instruction, next + 1);
     }
 
     void Cpu::execute(const Instruction &instruction)
+    {
+        execute(instruction, nextInstruction());
+    }
+
+    void Cpu::executeBlock(const std::vector<Operation> &operations, size_t first)
+    {
+        size_t index{ first };
+        for(const auto &operation : operations)
+        {
+            index = execute(operation, index);
+        }
+    }
+
+    uint64_t Cpu::executeCompiled(JitFunction function, uint64_t budget)
+    {
+        JitContext context{};
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            context.registers[i] = registerValue(static_cast<RegisterName>(i));
+        }
+        context.flagOperation = static_cast<uint64_t>(m_flagOperation);
+        context.flagLhs = m_flagLhs;
+        context.flagRhs = m_flagRhs;
+        context.flagResult = m_flagResult;
+        context.flags = m_flags;
+        context.entryCarry = carry() ? 1 : 0;
+        context.memory = m_stack->data();
+        context.memoryBeginning = m_stack->beginning();
+        context.memorySize = m_stack->content().size();
+        context.budget = budget;
+
+        function(&context);
+
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            registerValue(static_cast<RegisterName>(i)) = context.registers[i];
+        }
+        m_flagOperation = static_cast<FlagOperation>(context.flagOperation);
+        m_flagLhs = context.flagLhs;
+        m_flagRhs = context.flagRhs;
+        m_flagResult = context.flagResult;
+        m_flags = context.flags;
+        registerValue(RegisterName::rip) = context.nextInstruction;
+        if(context.fault)
+        {
+            // Throws the same exception as if the whole block had been interpreted
+            step();
+            return context.steps + 1;
+        }
+        return context.steps;
+    }
+
+    // If the instruction throws, the next instruction is still the one that threw
+    void Cpu::execute(const Instruction &instruction, size_t next)
+    {
+        if(const auto handler = Cpu::handler(instruction))
+        {
+            handler(*this, instruction);
+            registerValue(RegisterName::rip) = next;
+            return;
+        }
+        executeWithoutHandler(instruction, next);
+    }
+
+    void Cpu::executeWithoutHandler(const Instruction &instruction, size_t next)
     {
         std::visit(overloaded{
-                   [this](const Inc &inc) { registerValue(inc.registerName)++; },
-                   [this](const Dec &dec) { registerValue(dec.registerName)--; },
-                   [this](const Add &add) {
-                       registerValue(add.destination) += readValue(add.source);
+                   [this](const Pushf &) {
+                       m_stack->store(registerValue(RegisterName::rsp), flags());
+                       registerValue(RegisterName::rsp) -= 8;
                    },
                    [this](const Push &push) {
                        m_stack->store(registerValue(RegisterName::rsp), registerValue(push.registerName));
@@ -51,26 +184,374 @@ namespace ostrich
                        registerValue(pop.registerName) = m_stack->load(registerValue(RegisterName::rsp) + 8);
                        registerValue(RegisterName::rsp) += 8;
                    },
-                   [this](const Mov &mov) { registerValue(mov.destination) = readValue(mov.source); },
+                   [](const Label &) {},
+                   [&](const Jmp &jmp) { next = jmp.target; },
+                   [&](const Jcc &jcc) {
+                       if(evaluate(jcc.conditionCode))
+                       {
+                           next = jcc.target;
+                       }
+                   },
+                   // The others have handlers
+                   [](const auto &) {},
                    },
                    instruction);
+        registerValue(RegisterName::rip) = next;
+    }
+
+    // Only the first instruction of a superinstruction can throw, so the next instruction is
+    // still the one that threw here too
+    size_t Cpu::execute(const Operation &operation, size_t index)
+    {
+        return std::visit(overloaded{
+                          [&](const Instruction *instruction) {
+                              executeWithoutHandler(*instruction, index + 1);
+                              return index + 1;
+                          },
+                          [&](const Handled &handled) {
+                              handled.handler(*this, *handled.instruction);
+                              registerValue(RegisterName::rip) = index + 1;
+                              return index + 1;
+                          },
+                          [&](const PushPop &pushPop) {
+                              const auto value = registerValue(pushPop.source);
+                              m_stack->store(registerValue(RegisterName::rsp), value);
+                              registerValue(pushPop.destination) = value;
+                              registerValue(RegisterName::rip) = index + 2;
+                              return index + 2;
+                          },
+                          [&](const MovAdd &movAdd) {
+                              registerValue(movAdd.registerName) = movAdd.value;
+                              auto &value = registerValue(movAdd.destination);
+                              setFlags(FlagOperation::add, value, movAdd.value, value + movAdd.value);
+                              value += movAdd.value;
+                              registerValue(RegisterName::rip) = index + 2;
+                              return index + 2;
+                          },
+                          [&](const DecJcc &decJcc) {
+                              auto &value = registerValue(decJcc.registerName);
+                              setFlags(FlagOperation::dec, value, 1, value - 1);
+                              value--;
+                              // Counting down to zero is by far the most common use
+                              bool taken{};
+                              switch(decJcc.conditionCode)
+                              {
+                              case ConditionCode::e:
+                                  taken = value == 0;
+                                  break;
+                              case ConditionCode::ne:
+                                  taken = value != 0;
+                                  break;
+                              default:
+                                  taken = evaluate(decJcc.conditionCode);
+                                  break;
+                              }
+                              registerValue(RegisterName::rip) = taken ? decJcc.target : index + 2;
+                              return index + 2;
+                          },
+                          },
+                          operation);
+    }
+
+    InstructionHandler Cpu::handler(const Instruction &instruction)
+    {
+        return std::visit(
+        []<typename InstructionType>(const InstructionType &i) -> InstructionHandler {
+            if constexpr(std::is_same_v<InstructionType, Packed>)
+            {
+                return packedHandler(i);
+            }
+            else if constexpr(requires { i.width; })
+            {
+                switch(i.width)
+                {
+                case Width::qword:
+                    return handlerFor<InstructionType, Width::qword>(i);
+                case Width::dword:
+                    return handlerFor<InstructionType, Width::dword>(i);
+                case Width::word:
+                    return handlerFor<InstructionType, Width::word>(i);
+                case Width::byte:
+                    return handlerFor<InstructionType, Width::byte>(i);
+                case Width::highByte:
+                    return handlerFor<InstructionType, Width::highByte>(i);
+                }
+            }
+            return nullptr;
+        },
+        instruction);
+    }
+
+    std::vector<InstructionHandler> Cpu::handlers(const Source &source)
+    {
+        std::vector<InstructionHandler> handlers;
+        handlers.reserve(source.size());
+        for(const auto &instruction : source)
+        {
+            handlers.push_back(handler(instruction));
+        }
+        return handlers;
+    }
+
+    template <typename InstructionType, Width width>
+    InstructionHandler Cpu::handlerFor(const InstructionType &instruction)
+    {
+        if constexpr(requires { instruction.source; })
+        {
+            return std::visit([]<typename Form>(const Form &) -> InstructionHandler {
+                return &handle<InstructionType, width, Form>;
+            },
+                              instruction.source);
+        }
+        else
+        {
+            return &handle<InstructionType, width, void>;
+        }
+    }
+
+    // Qwords use the lazy flags, the others compute them right away
+    template <typename InstructionType, Width width, typename Form>
+    void Cpu::handle(Cpu &cpu, const Instruction &instruction)
+    {
+        const auto &i = *std::get_if<InstructionType>(&instruction);
+        const auto setFlags = [&cpu](FlagOperation operation, uint64_t lhs, uint64_t rhs, uint64_t result) {
+            if constexpr(width == Width::qword)
+            {
+                cpu.setFlags(operation, lhs, rhs, result);
+            }
+            else
+            {
+                cpu.setNarrowFlags<width>(operation, lhs, rhs, result);
+            }
+        };
+        if constexpr(std::is_same_v<InstructionType, Inc>)
+        {
+            auto &reg = cpu.registerValue(i.registerName);
+            const auto value = readPart<width>(reg);
+            setFlags(FlagOperation::inc, value, 1, value + 1);
+            writePart<width>(reg, value + 1);
+        }
+        else if constexpr(std::is_same_v<InstructionType, Dec>)
+        {
+            auto &reg = cpu.registerValue(i.registerName);
+            const auto value = readPart<width>(reg);
+            setFlags(FlagOperation::dec, value, 1, value - 1);
+            writePart<width>(reg, value - 1);
+        }
+        else if constexpr(std::is_same_v<InstructionType, Add>)
+        {
+            auto &reg = cpu.registerValue(i.destination);
+            const auto value = readPart<width>(reg);
+            const auto source = cpu.readSource<width, Form>(i.source);
+            setFlags(FlagOperation::add, value, source, value + source);
+            writePart<width>(reg, value + source);
+        }
+        else if constexpr(std::is_same_v<InstructionType, Sub>)
+        {
+            auto &reg = cpu.registerValue(i.destination);
+            const auto value = readPart<width>(reg);
+            const auto source = cpu.readSource<width, Form>(i.source);
+            setFlags(FlagOperation::sub, value, source, value - source);
+            writePart<width>(reg, value - source);
+        }
+        else if constexpr(std::is_same_v<InstructionType, Cmp>)
+        {
+            const auto value = readPart<width>(cpu.registerValue(i.destination));
+            const auto source = cpu.readSource<width, Form>(i.source);
+            setFlags(FlagOperation::sub, value, source, value - source);
+        }
+        else
+        {
+            static_assert(std::is_same_v<InstructionType, Mov>);
+            writePart<width>(cpu.registerValue(i.destination), cpu.readSource<width, Form>(i.source));
+        }
+    }
+
+    // Immediates and memory are truncated. A sub-register source has the same size as the
+    // destination, but can still be the other kind of byte.
+    template <Width width, typename Form>
+    uint64_t Cpu::readSource(const RegisterOrImmediateOrMemory &source) const
+    {
+        const auto &operand = *std::get_if<Form>(&source);
+        if constexpr(std::is_same_v<Form, RegisterName>)
+        {
+            return registerValue(operand) & mask<width>;
+        }
+        else if constexpr(std::is_same_v<Form, uint64_t>)
+        {
+            return operand & mask<width>;
+        }
+        else if constexpr(std::is_same_v<Form, MemoryAddress>)
+        {
+            return memoryValue(operand) & mask<width>;
+        }
+        else if constexpr(width == Width::byte || width == Width::highByte)
+        {
+            const auto value = registerValue(operand.registerName);
+            return operand.width == Width::highByte ? readPart<Width::highByte>(value) : readPart<Width::byte>(value);
+        }
+        else
+        {
+            return readPart<width>(registerValue(operand.registerName));
+        }
     }
 
     size_t Cpu::nextInstruction() const
     {
-        return m_nextInstruction;
+        return static_cast<size_t>(registerValue(RegisterName::rip));
     }
     const std::array<Register, registerCount> Cpu::registers() const
     {
-        return m_registers;
+        std::array<Register, registerCount> registers;
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            registers[i] = Register{ static_cast<RegisterName>(i), m_registers[i] };
+        }
+        return registers;
+    }
+
+    // Inc and dec leave the carry flag alone, so it is computed before they replace the operation
+    // that set it
+    void Cpu::setFlags(FlagOperation operation, uint64_t lhs, uint64_t rhs, uint64_t result)
+    {
+        if(operation == FlagOperation::inc || operation == FlagOperation::dec)
+        {
+            m_flags = carry() ? carryFlag : 0;
+        }
+        m_flagOperation = operation;
+        m_flagLhs = lhs;
+        m_flagRhs = rhs;
+        m_flagResult = result;
+    }
+
+    // The result is truncated here, but lhs and rhs have to be truncated already
+    template <Width width>
+    void Cpu::setNarrowFlags(FlagOperation operation, uint64_t lhs, uint64_t rhs, uint64_t result)
+    {
+        result &= mask<width>;
+        bool carryOut{};
+        switch(operation)
+        {
+        case FlagOperation::add:
+            carryOut = result < lhs;
+            break;
+        case FlagOperation::sub:
+            carryOut = lhs < rhs;
+            break;
+        default:
+            carryOut = carry();
+            break;
+        }
+        const bool isAddition{ operation == FlagOperation::add || operation == FlagOperation::inc };
+        m_flags = computeFlags(isAddition, carryOut, bitCount(width) - 1, lhs, rhs, result);
+        m_flagOperation = FlagOperation::none;
+    }
+
+    bool Cpu::carry() const
+    {
+        switch(m_flagOperation)
+        {
+        case FlagOperation::add:
+            return m_flagResult < m_flagLhs;
+        case FlagOperation::sub:
+            return m_flagLhs < m_flagRhs;
+        default:
+            return m_flags & carryFlag;
+        }
+    }
+
+    uint64_t Cpu::flags() const
+    {
+        if(m_flagOperation == FlagOperation::none)
+        {
+            return m_flags;
+        }
+        const bool isAddition{ m_flagOperation == FlagOperation::add || m_flagOperation == FlagOperation::inc };
+        return computeFlags(isAddition, carry(), 63, m_flagLhs, m_flagRhs, m_flagResult);
+    }
+
+    bool Cpu::evaluate(ConditionCode conditionCode) const
+    {
+        using enum ConditionCode;
+        // After sub and cmp, which is what usually comes before a jcc, most conditions are just a
+        // comparison of the operands
+        if(m_flagOperation == FlagOperation::sub)
+        {
+            const auto lhs = m_flagLhs;
+            const auto rhs = m_flagRhs;
+            switch(conditionCode)
+            {
+            case e:
+                return lhs == rhs;
+            case ne:
+                return lhs != rhs;
+            case b:
+                return lhs < rhs;
+            case ae:
+                return lhs >= rhs;
+            case be:
+                return lhs <= rhs;
+            case a:
+                return lhs > rhs;
+            case l:
+                return static_cast<int64_t>(lhs) < static_cast<int64_t>(rhs);
+            case ge:
+                return static_cast<int64_t>(lhs) >= static_cast<int64_t>(rhs);
+            case le:
+                return static_cast<int64_t>(lhs) <= static_cast<int64_t>(rhs);
+            case g:
+                return static_cast<int64_t>(lhs) > static_cast<int64_t>(rhs);
+            default:
+                break;
+            }
+        }
+        const auto f = flags();
+        const bool carry{ (f & carryFlag) != 0 };
+        const bool zero{ (f & zeroFlag) != 0 };
+        const bool sign{ (f & signFlag) != 0 };
+        const bool overflow{ (f & overflowFlag) != 0 };
+        const bool parity{ (f & parityFlag) != 0 };
+        switch(conditionCode)
+        {
+        case e:
+            return zero;
+        case ne:
+            return !zero;
+        case b:
+            return carry;
+        case ae:
+            return !carry;
+        case be:
+            return carry || zero;
+        case a:
+            return !carry && !zero;
+        case l:
+            return sign != overflow;
+        case ge:
+            return sign == overflow;
+        case le:
+            return zero || sign != overflow;
+        case g:
+            return !zero && sign == overflow;
+        case s:
+            return sign;
+        case ns:
+            return !sign;
+        case o:
+            return overflow;
+        case no:
+            return !overflow;
+        case p:
+            return parity;
+        case np:
+            return !parity;
+        }
+        return false;
     }
 
     const uint64_t &Cpu::registerValue(RegisterName r) const
     {
-        return std::find_if(m_registers.begin(), m_registers.end(),
-                            [&](const auto reg) { return reg.registerName == r; })
-        ->value;
-        throw std::runtime_error("No such register");
+        return m_registers[static_cast<size_t>(r)];
     }
 
     uint64_t &Cpu::registerValue(RegisterName r)
@@ -78,6 +559,25 @@ namespace ostrich
         return const_cast<uint64_t &>(const_cast<const Cpu &>(*this).registerValue(r));
     }
 
+    uint64_t Cpu::registerValue(SubRegister r) const
+    {
+        const auto value = registerValue(r.registerName);
+        switch(r.width)
+        {
+        case Width::qword:
+            return value;
+        case Width::dword:
+            return readPart<Width::dword>(value);
+        case Width::word:
+            return readPart<Width::word>(value);
+        case Width::byte:
+            return readPart<Width::byte>(value);
+        case Width::highByte:
+            return readPart<Width::highByte>(value);
+        }
+        return value;
+    }
+
     uint64_t Cpu::loadEffectiveAddress(const MemoryAddress &address) const
     {
         using enum AdditiveOperator;
@@ -111,12 +611,44 @@ namespace ostrich
         return m_stack->load(loadEffectiveAddress(address));
     }
 
-    uint64_t Cpu::readValue(RegisterOrImmediateOrMemory r)
+    bool Cpu::evaluate(const Condition &condition) const
+    {
+        using enum ComparisonOperator;
+        const auto readable = [this](const RegisterOrImmediateOrMemory &operand) {
+            const auto *address = std::get_if<MemoryAddress>(&operand);
+            return !address || m_stack->contains(loadEffectiveAddress(*address));
+        };
+        if(!readable(condition.lhs) || !readable(condition.rhs))
+        {
+            return false;
+        }
+        const auto lhs = readValue(condition.lhs);
+        const auto rhs = readValue(condition.rhs);
+        switch(condition.comparisonOperator)
+        {
+        case equal:
+            return lhs == rhs;
+        case notEqual:
+            return lhs != rhs;
+        case less:
+            return lhs < rhs;
+        case lessOrEqual:
+            return lhs <= rhs;
+        case greater:
+            return lhs > rhs;
+        case greaterOrEqual:
+            return lhs >= rhs;
+        }
+        return false;
+    }
+
+    uint64_t Cpu::readValue(RegisterOrImmediateOrMemory r) const
     {
         return std::visit(overloaded{
                           [this](const RegisterName name) { return registerValue(name); },
                           [this](const uint64_t value) { return value; },
                           [this](const MemoryAddress &address) { return memoryValue(address); },
+                          [this](const SubRegister subRegister) { return registerValue(subRegister); },
                           },
                           r);
     }
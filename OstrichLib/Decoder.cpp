@@ -0,0 +1,568 @@
+module;
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <optional>
+#include <set>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+module Ostrich;
+
+namespace ostrich::decoder
+{
+    namespace
+    {
+        using enum RegisterName;
+        using enum ConditionCode;
+
+        // In the order of the low nibble of jcc
+        constexpr std::array<ConditionCode, 16> conditionCodes{ o, no, b, ae, e, ne, be, a,
+                                                                s, ns, p, np, l, ge, le, g };
+
+        class Reader
+        {
+        public:
+            Reader(std::span<const uint8_t> code, uint64_t address) : m_code{ code }, m_address{ address }
+            {
+            }
+
+            uint8_t peek() const
+            {
+                need(1);
+                return m_code[m_position];
+            }
+
+            uint8_t u8()
+            {
+                need(1);
+                return m_code[m_position++];
+            }
+
+            int8_t i8()
+            {
+                return static_cast<int8_t>(u8());
+            }
+
+            int32_t i32()
+            {
+                return static_cast<int32_t>(integer(4));
+            }
+
+            uint64_t u64()
+            {
+                return integer(8);
+            }
+
+            size_t position() const
+            {
+                return m_position;
+            }
+
+            [[noreturn]] void unsupported(const std::string &what) const
+            {
+                throw std::runtime_error(fmt::format("{} at 0x{:x}", what, m_address));
+            }
+
+        private:
+            void need(size_t size) const
+            {
+                if(m_code.size() - m_position < size)
+                {
+                    unsupported("Truncated instruction");
+                }
+            }
+
+            uint64_t integer(size_t size)
+            {
+                need(size);
+                uint64_t value{ 0 };
+                for(size_t i = 0; i < size; ++i)
+                {
+                    value |= uint64_t{ m_code[m_position + i] } << i * 8;
+                }
+                m_position += size;
+                return value;
+            }
+
+            std::span<const uint8_t> m_code;
+            uint64_t m_address;
+            size_t m_position{ 0 };
+        };
+
+        struct Rex
+        {
+            bool w{ false };
+            bool r{ false };
+            bool x{ false };
+            bool b{ false };
+        };
+
+        struct ModRm
+        {
+            uint8_t mod;
+            // Including the extension from REX.R, or the opcode extension
+            uint8_t reg;
+            RegisterOrImmediateOrMemory rm;
+        };
+
+        class InstructionDecoder
+        {
+        public:
+            InstructionDecoder(std::span<const uint8_t> code, uint64_t address) : m_reader{ code, address }
+            {
+            }
+
+            Decoded decode(uint64_t address)
+            {
+                prefixes();
+                auto instruction = opcode(address);
+                return Decoded{ std::move(instruction), m_reader.position() };
+            }
+
+        private:
+            void prefixes()
+            {
+                for(;;)
+                {
+                    const auto byte = m_reader.peek();
+                    // cs, ds, es and ss overrides do nothing in 64 bit mode
+                    if(byte == 0x2e || byte == 0x3e || byte == 0x26 || byte == 0x36)
+                    {
+                        m_reader.u8();
+                        continue;
+                    }
+                    if(byte == 0x66 || byte == 0x67 || byte == 0xf0 || byte == 0xf2 || byte == 0xf3 ||
+                       byte == 0x64 || byte == 0x65)
+                    {
+                        m_reader.unsupported(fmt::format("Unsupported prefix 0x{:02x}", byte));
+                    }
+                    break;
+                }
+                // REX has to come right before the opcode
+                if((m_reader.peek() & 0xf0) == 0x40)
+                {
+                    const auto rex = m_reader.u8();
+                    m_rex = Rex{ (rex & 8) != 0, (rex & 4) != 0, (rex & 2) != 0, (rex & 1) != 0 };
+                }
+            }
+
+            Instruction opcode(uint64_t address)
+            {
+                const auto op = m_reader.u8();
+                if(op >= 0x50 && op <= 0x57)
+                {
+                    return Push{ registerName(op & 7, m_rex.b) };
+                }
+                if(op >= 0x58 && op <= 0x5f)
+                {
+                    return Pop{ registerName(op & 7, m_rex.b) };
+                }
+                if(op >= 0xb8 && op <= 0xbf)
+                {
+                    const auto destination = registerName(op & 7, m_rex.b);
+                    // Writing a 32 bit register clears the upper half, so this is a 64 bit mov too
+                    const uint64_t value{ m_rex.w ? m_reader.u64() : static_cast<uint32_t>(m_reader.i32()) };
+                    return Mov{ destination, value };
+                }
+                if(op >= 0x70 && op <= 0x7f)
+                {
+                    const auto displacement = m_reader.i8();
+                    return jcc(conditionCodes[op & 0xf], address, displacement);
+                }
+                switch(op)
+                {
+                case 0x9c:
+                    return Pushf{};
+                case 0x01:
+                    return registerDestination<Add>();
+                case 0x03:
+                    return registerSource<Add>();
+                case 0x29:
+                    return registerDestination<Sub>();
+                case 0x2b:
+                    return registerSource<Sub>();
+                case 0x39:
+                    return registerDestination<Cmp>();
+                case 0x3b:
+                    return registerSource<Cmp>();
+                case 0x89:
+                    return registerDestination<Mov>();
+                case 0x8b:
+                    return registerSource<Mov>();
+                case 0x05:
+                    return raxImmediate<Add>();
+                case 0x2d:
+                    return raxImmediate<Sub>();
+                case 0x3d:
+                    return raxImmediate<Cmp>();
+                case 0x81:
+                case 0x83:
+                    return immediateGroup(op == 0x83);
+                case 0xc7: {
+                    const auto modRm = this->modRm();
+                    if((modRm.reg & 7) != 0)
+                    {
+                        unsupportedOpcode(op);
+                    }
+                    return Mov{ registerOnly(modRm), signExtended(m_reader.i32()) };
+                }
+                case 0xff: {
+                    const auto modRm = this->modRm();
+                    if((modRm.reg & 7) == 0)
+                    {
+                        return Inc{ registerOnly(modRm) };
+                    }
+                    if((modRm.reg & 7) == 1)
+                    {
+                        return Dec{ registerOnly(modRm) };
+                    }
+                    unsupportedOpcode(op);
+                }
+                case 0xeb: {
+                    const auto displacement = m_reader.i8();
+                    return jmp(address, displacement);
+                }
+                case 0xe9: {
+                    const auto displacement = m_reader.i32();
+                    return jmp(address, displacement);
+                }
+                case 0x0f: {
+                    const auto op2 = m_reader.u8();
+                    if(op2 >= 0x80 && op2 <= 0x8f)
+                    {
+                        const auto displacement = m_reader.i32();
+                        return jcc(conditionCodes[op2 & 0xf], address, displacement);
+                    }
+                    m_reader.unsupported(fmt::format("Unsupported opcode 0x0f 0x{:02x}", op2));
+                }
+                default:
+                    unsupportedOpcode(op);
+                }
+            }
+
+            // op r/m64, r64
+            template <typename InstructionType>
+            Instruction registerDestination()
+            {
+                const auto modRm = this->modRm();
+                return InstructionType{ registerOnly(modRm), registerName(modRm.reg) };
+            }
+
+            // op r64, r/m64
+            template <typename InstructionType>
+            Instruction registerSource()
+            {
+                const auto modRm = this->modRm();
+                requireWide();
+                return InstructionType{ registerName(modRm.reg), modRm.rm };
+            }
+
+            // op rax, imm32
+            template <typename InstructionType>
+            Instruction raxImmediate()
+            {
+                requireWide();
+                return InstructionType{ rax, signExtended(m_reader.i32()) };
+            }
+
+            // add, sub or cmp r/m64, imm
+            Instruction immediateGroup(bool byteImmediate)
+            {
+                const auto modRm = this->modRm();
+                const auto destination = registerOnly(modRm);
+                const auto value = signExtended(byteImmediate ? m_reader.i8() : m_reader.i32());
+                switch(modRm.reg & 7)
+                {
+                case 0:
+                    return Add{ destination, value };
+                case 5:
+                    return Sub{ destination, value };
+                case 7:
+                    return Cmp{ destination, value };
+                default:
+                    m_reader.unsupported(fmt::format("Unsupported opcode 0x{:02x} /{}", byteImmediate ? 0x83 : 0x81,
+                                                     modRm.reg));
+                }
+            }
+
+            Instruction jmp(uint64_t address, int32_t displacement)
+            {
+                const auto target = address + m_reader.position() + signExtended(displacement);
+                return Jmp{ labelName(target), target };
+            }
+
+            Instruction jcc(ConditionCode conditionCode, uint64_t address, int32_t displacement)
+            {
+                const auto target = address + m_reader.position() + signExtended(displacement);
+                return Jcc{ conditionCode, labelName(target), target };
+            }
+
+            ModRm modRm()
+            {
+                const auto byte = m_reader.u8();
+                const uint8_t mod = byte >> 6;
+                const uint8_t reg = (byte >> 3 & 7) | (m_rex.r ? 8 : 0);
+                const uint8_t rm = byte & 7;
+                if(mod == 3)
+                {
+                    return ModRm{ mod, reg, registerName(rm, m_rex.b) };
+                }
+                return ModRm{ mod, reg, memory(mod, rm) };
+            }
+
+            MemoryAddress memory(uint8_t mod, uint8_t rm)
+            {
+                MemoryAddress address{ rax };
+                uint8_t base{ rm };
+                if(rm == 4)
+                {
+                    const auto sib = m_reader.u8();
+                    address.scale = static_cast<uint8_t>(1 << (sib >> 6));
+                    const uint8_t index = (sib >> 3 & 7) | (m_rex.x ? 8 : 0);
+                    // rsp can't be an index, so that encoding means no index
+                    if(index != 4)
+                    {
+                        address.index = registerName(index);
+                    }
+                    base = sib & 7;
+                    if(base == 5 && mod == 0)
+                    {
+                        m_reader.unsupported("Addresses without a base register are not supported");
+                    }
+                }
+                else if(rm == 5 && mod == 0)
+                {
+                    m_reader.unsupported("rip relative addresses are not supported");
+                }
+                address.base = registerName(base, m_rex.b);
+                const int32_t displacement{ mod == 1 ? m_reader.i8() : mod == 2 ? m_reader.i32() : 0 };
+                if(displacement < 0)
+                {
+                    address.displacementOperator = AdditiveOperator::minus;
+                    address.displacement = uint64_t{ 0 } - signExtended(displacement);
+                }
+                else
+                {
+                    address.displacement = static_cast<uint64_t>(displacement);
+                }
+                return address;
+            }
+
+            RegisterName registerOnly(const ModRm &modRm)
+            {
+                requireWide();
+                const auto *name = std::get_if<RegisterName>(&modRm.rm);
+                if(!name)
+                {
+                    m_reader.unsupported("Memory destinations are not supported");
+                }
+                return *name;
+            }
+
+            RegisterName registerName(uint8_t number, bool extended = false)
+            {
+                return registerWithNumber(static_cast<uint8_t>(number | (extended ? 8 : 0)));
+            }
+
+            void requireWide()
+            {
+                if(!m_rex.w)
+                {
+                    m_reader.unsupported("Only 64 bit operands are supported");
+                }
+            }
+
+            [[noreturn]] void unsupportedOpcode(uint8_t op)
+            {
+                m_reader.unsupported(fmt::format("Unsupported opcode 0x{:02x}", op));
+            }
+
+            static uint64_t signExtended(int32_t value)
+            {
+                return static_cast<uint64_t>(static_cast<int64_t>(value));
+            }
+
+            Reader m_reader;
+            Rex m_rex;
+        };
+    } // namespace
+
+    std::string labelName(uint64_t address)
+    {
+        return fmt::format("loc_{:x}", address);
+    }
+
+    Decoded decode(std::span<const uint8_t> code, uint64_t address)
+    {
+        return InstructionDecoder{ code, address }.decode(address);
+    }
+
+    Source decodeAll(std::span<const uint8_t> code, uint64_t address)
+    {
+        std::vector<std::pair<uint64_t, Instruction>> decoded;
+        std::set<uint64_t> targets;
+        for(size_t offset = 0; offset < code.size();)
+        {
+            auto [instruction, length] = decode(code.subspan(offset), address + offset);
+            if(const auto *jmp = std::get_if<Jmp>(&instruction))
+            {
+                targets.insert(jmp->target);
+            }
+            else if(const auto *jcc = std::get_if<Jcc>(&instruction))
+            {
+                targets.insert(jcc->target);
+            }
+            decoded.emplace_back(address + offset, std::move(instruction));
+            offset += length;
+        }
+
+        Source source;
+        for(auto &[instructionAddress, instruction] : decoded)
+        {
+            if(targets.erase(instructionAddress))
+            {
+                source.push_back(Label{ labelName(instructionAddress) });
+            }
+            source.push_back(std::move(instruction));
+        }
+        // Jumping to the end is fine, it ends the program
+        if(targets.erase(address + code.size()))
+        {
+            source.push_back(Label{ labelName(address + code.size()) });
+        }
+        if(!targets.empty())
+        {
+            throw std::runtime_error(fmt::format("Jump to 0x{:x}, which is not the start of an instruction",
+                                                 *targets.begin()));
+        }
+        parser::resolveLabels(source);
+        return source;
+    }
+
+    DecodeCache::DecodeCache(std::span<const uint8_t> code, uint64_t address) : m_code{ code }, m_address{ address }
+    {
+    }
+
+    const Decoded &DecodeCache::at(uint64_t address)
+    {
+        if(const auto found = m_decoded.find(address); found != m_decoded.end())
+        {
+            return found->second;
+        }
+        if(address < m_address || address - m_address >= m_code.size())
+        {
+            throw std::runtime_error(fmt::format("No code at 0x{:x}", address));
+        }
+        return m_decoded.emplace(address, decode(m_code.subspan(address - m_address), address)).first->second;
+    }
+
+    void DecodeCache::invalidate()
+    {
+        m_decoded.clear();
+    }
+
+    size_t DecodeCache::size() const
+    {
+        return m_decoded.size();
+    }
+
+    Source decodeReachable(std::span<const uint8_t> code, uint64_t address, uint64_t entry)
+    {
+        const auto end = address + code.size();
+        const auto isExit = [&](uint64_t at) {
+            if(at == end)
+            {
+                return true;
+            }
+            if(at < address || at > end)
+            {
+                return false;
+            }
+            const auto bytes = code.subspan(at - address);
+            return bytes[0] == 0xf4 || (bytes.size() > 1 && bytes[0] == 0x0f && bytes[1] == 0x05);
+        };
+
+        // Cache entries don't move, so the pointers stay valid
+        DecodeCache cache{ code, address };
+        std::map<uint64_t, const Decoded *> decoded;
+        std::set<uint64_t> exits;
+        std::set<uint64_t> targets;
+        std::vector<uint64_t> unvisited{ entry };
+        while(!unvisited.empty())
+        {
+            const auto at = unvisited.back();
+            unvisited.pop_back();
+            if(decoded.contains(at) || exits.contains(at))
+            {
+                continue;
+            }
+            if(isExit(at))
+            {
+                exits.insert(at);
+                continue;
+            }
+            const auto &instruction = cache.at(at);
+            decoded.emplace(at, &instruction);
+            if(const auto *jmp = std::get_if<Jmp>(&instruction.instruction))
+            {
+                targets.insert(jmp->target);
+                unvisited.push_back(jmp->target);
+                continue;
+            }
+            if(const auto *jcc = std::get_if<Jcc>(&instruction.instruction))
+            {
+                targets.insert(jcc->target);
+                unvisited.push_back(jcc->target);
+            }
+            unvisited.push_back(at + instruction.length);
+        }
+
+        // The instructions in the order of their addresses, and every exit as a label at the end
+        Source source;
+        if(!decoded.empty() && decoded.begin()->first != entry)
+        {
+            source.push_back(Jmp{ labelName(entry) });
+            targets.insert(entry);
+        }
+        std::set<uint64_t> exitLabels;
+        for(auto it = decoded.begin(); it != decoded.end(); ++it)
+        {
+            const auto [at, instruction] = *it;
+            const auto next = std::next(it);
+            if(next != decoded.end() && next->first < at + instruction->length)
+            {
+                throw std::runtime_error(fmt::format("Jump to 0x{:x}, which is not the start of an instruction",
+                                                     next->first));
+            }
+            if(targets.contains(at))
+            {
+                source.push_back(Label{ labelName(at) });
+            }
+            source.push_back(instruction->instruction);
+            // Falling through to an exit only ends the program if it is the last instruction
+            const auto fallthrough = at + instruction->length;
+            if(!std::holds_alternative<Jmp>(instruction->instruction) && exits.contains(fallthrough) &&
+               next != decoded.end())
+            {
+                source.push_back(Jmp{ labelName(fallthrough) });
+                exitLabels.insert(fallthrough);
+            }
+        }
+        for(const auto exit : exits)
+        {
+            if(targets.contains(exit) || exitLabels.contains(exit))
+            {
+                source.push_back(Label{ labelName(exit) });
+            }
+        }
+        parser::resolveLabels(source);
+        return source;
+    }
+} // namespace ostrich::decoder
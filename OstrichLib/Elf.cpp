@@ -0,0 +1,128 @@
+module;
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <vector>
+module Ostrich;
+
+// Only the fields that are used are read. See the System V ABI, "Object Files", and the x86-64
+// supplement for the layout.
+
+namespace ostrich::elf
+{
+    namespace
+    {
+        constexpr std::array<uint8_t, 4> magic{ 0x7f, 'E', 'L', 'F' };
+        constexpr size_t headerSize{ 64 };
+        constexpr size_t programHeaderSize{ 56 };
+
+        constexpr uint8_t elfClass64{ 2 };
+        constexpr uint8_t littleEndian{ 1 };
+        constexpr uint16_t typeExecutable{ 2 };
+        constexpr uint16_t typeSharedObject{ 3 };
+        constexpr uint16_t machineX86_64{ 62 };
+
+        constexpr uint32_t segmentLoad{ 1 };
+        constexpr uint32_t segmentInterpreter{ 3 };
+        constexpr uint32_t flagExecutable{ 1 };
+        constexpr uint32_t flagWritable{ 2 };
+
+        uint64_t read(std::span<const uint8_t> data, size_t offset, size_t size)
+        {
+            if(offset > data.size() || data.size() - offset < size)
+            {
+                throw std::runtime_error("Truncated ELF file");
+            }
+            uint64_t value{ 0 };
+            for(size_t i = 0; i < size; ++i)
+            {
+                value |= uint64_t{ data[offset + i] } << i * 8;
+            }
+            return value;
+        }
+    } // namespace
+
+    Executable::Executable(const std::filesystem::path &path) : m_file{ path }
+    {
+        const auto data = m_file.data();
+        if(data.size() < magic.size() || !std::equal(magic.begin(), magic.end(), data.begin()))
+        {
+            throw std::runtime_error(fmt::format("'{}' is not an ELF file", path.string()));
+        }
+        if(read(data, 4, 1) != elfClass64 || read(data, 5, 1) != littleEndian || read(data, 18, 2) != machineX86_64)
+        {
+            throw std::runtime_error("Only 64 bit x86-64 ELF files are supported");
+        }
+        const auto type = read(data, 16, 2);
+        if(type != typeExecutable && type != typeSharedObject)
+        {
+            throw std::runtime_error("Only ELF executables are supported");
+        }
+        m_entry = read(data, 24, 8);
+        const auto programHeaders = read(data, 32, 8);
+        const auto programHeaderCount = read(data, 56, 2);
+
+        for(size_t i = 0; i < programHeaderCount; ++i)
+        {
+            const auto header = programHeaders + i * programHeaderSize;
+            const auto segmentType = read(data, header, 4);
+            if(segmentType == segmentInterpreter)
+            {
+                throw std::runtime_error("Only statically linked executables are supported");
+            }
+            if(segmentType != segmentLoad)
+            {
+                continue;
+            }
+            const auto flags = read(data, header + 4, 4);
+            const auto offset = read(data, header + 8, 8);
+            const auto address = read(data, header + 16, 8);
+            const auto fileSize = read(data, header + 32, 8);
+            const auto memorySize = read(data, header + 40, 8);
+            if(offset > data.size() || data.size() - offset < fileSize || fileSize > memorySize)
+            {
+                throw std::runtime_error(fmt::format("Segment at 0x{:x} is outside of the file", address));
+            }
+            m_segments.push_back(Segment{ address, memorySize, (flags & flagWritable) != 0,
+                                          (flags & flagExecutable) != 0, data.subspan(offset, fileSize) });
+        }
+    }
+
+    uint64_t Executable::entry() const
+    {
+        return m_entry;
+    }
+
+    const std::vector<Segment> &Executable::segments() const
+    {
+        return m_segments;
+    }
+
+    Source Executable::decode() const
+    {
+        const auto segment = std::find_if(m_segments.begin(), m_segments.end(), [this](const Segment &segment) {
+            return segment.executable && m_entry >= segment.address && m_entry - segment.address < segment.data.size();
+        });
+        if(segment == m_segments.end())
+        {
+            throw std::runtime_error(fmt::format("No executable segment contains the entry point 0x{:x}", m_entry));
+        }
+        return decoder::decodeReachable(segment->data, segment->address, m_entry);
+    }
+
+    bool isElf(const std::filesystem::path &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::array<char, magic.size()> header{};
+        file.read(header.data(), header.size());
+        return file.gcount() == static_cast<std::streamsize>(header.size()) &&
+               std::equal(magic.begin(), magic.end(), header.begin(),
+                          [](uint8_t m, char c) { return m == static_cast<uint8_t>(c); });
+    }
+} // namespace ostrich::elf
@@ -0,0 +1,491 @@
+module;
+
+#include "Overloaded.h"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <variant>
+#include <vector>
+module Ostrich;
+
+namespace ostrich::encoder
+{
+    namespace
+    {
+        // rip has no number, but the parser doesn't let instructions use it
+        uint8_t number(RegisterName registerName)
+        {
+            return descriptor(registerName).number.value();
+        }
+
+        // How a register is encoded in a ModRM byte, or an opcode extension if neither flag is set.
+        // The low three bits of the number go in ModRM, SIB or the opcode, and the fourth in REX.
+        struct RegisterCode
+        {
+            uint8_t number;
+            // spl, bpl, sil and dil need a REX prefix, without which their numbers are ah to bh
+            bool needsRex{ false };
+            bool highByte{ false };
+        };
+
+        RegisterCode code(SubRegister subRegister)
+        {
+            const auto registerNumber = number(subRegister.registerName);
+            switch(subRegister.width)
+            {
+            case Width::byte:
+                return RegisterCode{ registerNumber, registerNumber >= 4 };
+            case Width::highByte:
+                return RegisterCode{ static_cast<uint8_t>(registerNumber + 4), false, true };
+            default:
+                return RegisterCode{ registerNumber };
+            }
+        }
+
+        RegisterCode code(RegisterName registerName, Width width)
+        {
+            return code(SubRegister{ registerName, width });
+        }
+
+        uint8_t conditionCodeNumber(ConditionCode conditionCode)
+        {
+            using enum ConditionCode;
+            constexpr ConditionCode numbered[]{ o, no, b, ae, e, ne, be, a, s, ns, p, np, l, ge, le, g };
+            for(uint8_t i = 0; i < 16; ++i)
+            {
+                if(numbered[i] == conditionCode)
+                {
+                    return i;
+                }
+            }
+            return 0;
+        }
+
+        bool fitsInt8(int64_t value)
+        {
+            return value >= std::numeric_limits<int8_t>::min() && value <= std::numeric_limits<int8_t>::max();
+        }
+
+        bool fitsInt32(int64_t value)
+        {
+            return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+        }
+
+        // The mandatory prefix, if any, and the opcode after 0f of the load form of each operation
+        struct PackedOpcode
+        {
+            std::optional<uint8_t> prefix;
+            uint8_t opcode;
+        };
+
+        PackedOpcode packedOpcode(PackedOperation operation)
+        {
+            using enum PackedOperation;
+            switch(operation)
+            {
+            case movdqa:
+                return { 0x66, 0x6f };
+            case movdqu:
+                return { 0xf3, 0x6f };
+            case paddd:
+                return { 0x66, 0xfe };
+            case paddq:
+                return { 0x66, 0xd4 };
+            case psubd:
+                return { 0x66, 0xfa };
+            case psubq:
+                return { 0x66, 0xfb };
+            case pand:
+                return { 0x66, 0xdb };
+            case por:
+                return { 0x66, 0xeb };
+            case pxor:
+                return { 0x66, 0xef };
+            case addps:
+                return { std::nullopt, 0x58 };
+            case subps:
+                return { std::nullopt, 0x5c };
+            case mulps:
+                return { std::nullopt, 0x59 };
+            }
+            throw std::logic_error("No such packed operation");
+        }
+
+        class Encoder
+        {
+        public:
+            explicit Encoder(const Source &source) : m_source{ source }
+            {
+            }
+
+            std::vector<uint8_t> encode()
+            {
+                for(const auto &instruction : m_source)
+                {
+                    m_offsets.push_back(m_code.size());
+                    std::visit([this](const auto &i) { encode(i); }, instruction);
+                }
+                m_offsets.push_back(m_code.size());
+                for(const auto &[rel32, target] : m_jumps)
+                {
+                    if(target >= m_offsets.size())
+                    {
+                        throw std::runtime_error(fmt::format("Jump to instruction {}, which doesn't exist", target));
+                    }
+                    const auto relative = static_cast<uint32_t>(static_cast<int32_t>(m_offsets[target] - (rel32 + 4)));
+                    for(size_t i = 0; i < 4; ++i)
+                    {
+                        m_code[rel32 + i] = static_cast<uint8_t>(relative >> i * 8);
+                    }
+                }
+                return std::move(m_code);
+            }
+
+        private:
+            void encode(const Inc &inc)
+            {
+                registers(inc.width, 0xff, RegisterCode{ 0 }, code(inc.registerName, inc.width));
+            }
+
+            void encode(const Dec &dec)
+            {
+                registers(dec.width, 0xff, RegisterCode{ 1 }, code(dec.registerName, dec.width));
+            }
+
+            void encode(const Add &add)
+            {
+                arithmetic("add", add, 0x01, 0x03, 0);
+            }
+
+            void encode(const Sub &sub)
+            {
+                arithmetic("sub", sub, 0x29, 0x2b, 5);
+            }
+
+            void encode(const Cmp &cmp)
+            {
+                arithmetic("cmp", cmp, 0x39, 0x3b, 7);
+            }
+
+            void encode(const Mov &mov)
+            {
+                const auto destination = code(mov.destination, mov.width);
+                std::visit(overloaded{
+                           [&](const RegisterName source) {
+                               registers(mov.width, 0x89, code(source, mov.width), destination);
+                           },
+                           [&](const SubRegister source) {
+                               registers(mov.width, 0x89, code(source), destination);
+                           },
+                           [&](const uint64_t value) { moveImmediate(mov.width, destination, value); },
+                           [&](const MemoryAddress &address) { memory(mov.width, 0x8b, destination, address); },
+                           },
+                           mov.source);
+            }
+
+            // The Cpu stores at rsp and then decrements it, and loads from rsp + 8 before
+            // incrementing it. Lea changes rsp without touching the flags, like the Cpu.
+            void encode(const Push &push)
+            {
+                memory(Width::qword, 0x89, code(push.registerName, Width::qword),
+                       MemoryAddress{ RegisterName::rsp });
+                moveStackPointer(-8);
+            }
+
+            void encode(const Pop &pop)
+            {
+                memory(Width::qword, 0x8b, code(pop.registerName, Width::qword),
+                       MemoryAddress{ RegisterName::rsp, AdditiveOperator::plus, std::nullopt, 1,
+                                      AdditiveOperator::plus, 8 });
+                moveStackPointer(8);
+            }
+
+            void encode(const Pushf &)
+            {
+                moveStackPointer(8);
+                bytes({ 0x9c });
+                moveStackPointer(-8);
+            }
+
+            void encode(const Label &)
+            {
+            }
+
+            void encode(const Jmp &jmp)
+            {
+                bytes({ 0xe9 });
+                jumpTo(jmp.target);
+            }
+
+            void encode(const Jcc &jcc)
+            {
+                bytes({ 0x0f, static_cast<uint8_t>(0x80 | conditionCodeNumber(jcc.conditionCode)) });
+                jumpTo(jcc.target);
+            }
+
+            void encode(const Packed &packed)
+            {
+                if(packed.destination.wide && !packed.vex)
+                {
+                    throw std::runtime_error(
+                    fmt::format("{} can't be encoded, ymm registers need the vex form", packed.toString()));
+                }
+                const auto [prefix, vectorOpcode] = packedOpcode(packed.operation);
+                const RegisterCode destination{ packed.destination.number };
+                std::visit(overloaded{
+                           [&](const VectorRegister source) {
+                               vectorPrefixes(packed, prefix, destination, RegisterCode{ source.number });
+                               bytes({ vectorOpcode, static_cast<uint8_t>(0xc0 | (destination.number & 7) << 3 |
+                                                                          (source.number & 7)) });
+                           },
+                           [&](const MemoryAddress &address) {
+                               addressing(destination, address, [&](RegisterCode base, RegisterCode index) {
+                                   vectorPrefixes(packed, prefix, destination, base, index);
+                                   bytes({ vectorOpcode });
+                               });
+                           },
+                           },
+                           packed.source);
+            }
+
+            // The opcodes are the ones for registers and memory sources. The ones for immediates
+            // take extension as the reg field.
+            template <typename InstructionType>
+            void arithmetic(std::string_view mnemonic, const InstructionType &instruction, uint8_t registerOpcode,
+                            uint8_t memoryOpcode, uint8_t extension)
+            {
+                const auto width = instruction.width;
+                const auto destination = code(instruction.destination, width);
+                std::visit(overloaded{
+                           [&](const RegisterName name) {
+                               registers(width, registerOpcode, code(name, width), destination);
+                           },
+                           [&](const SubRegister source) {
+                               registers(width, registerOpcode, code(source), destination);
+                           },
+                           [&](const uint64_t value) {
+                               // Sign extended to the width, and then to 64 bits
+                               const auto bits = bitCount(width);
+                               const auto shift = 64 - bits;
+                               const auto signedValue = static_cast<int64_t>(value << shift) >> shift;
+                               if(bits == 8)
+                               {
+                                   registers(width, 0x81, RegisterCode{ extension }, destination);
+                                   integer(value, 1);
+                               }
+                               else if(fitsInt8(signedValue))
+                               {
+                                   registers(width, 0x83, RegisterCode{ extension }, destination);
+                                   integer(value, 1);
+                               }
+                               else if(bits < 64 || fitsInt32(signedValue))
+                               {
+                                   registers(width, 0x81, RegisterCode{ extension }, destination);
+                                   integer(value, std::min(bits / 8, 4u));
+                               }
+                               else
+                               {
+                                   throw std::runtime_error(
+                                   fmt::format("{} {}, {} can't be encoded, the immediate is too big", mnemonic,
+                                               toString(instruction.destination), value));
+                               }
+                           },
+                           [&](const MemoryAddress &address) { memory(width, memoryOpcode, destination, address); },
+                           },
+                           instruction.source);
+            }
+
+            void moveImmediate(Width width, RegisterCode destination, uint64_t value)
+            {
+                if(width == Width::qword && fitsInt32(static_cast<int64_t>(value)))
+                {
+                    registers(width, 0xc7, RegisterCode{ 0 }, destination);
+                    integer(value, 4);
+                    return;
+                }
+                // mov r32, imm32 zero extends, so it also does for a qword that fits in 32 bits
+                const auto size = width == Width::qword && value <= std::numeric_limits<uint32_t>::max()
+                                  ? 4
+                                  : bitCount(width) / 8;
+                prefixes(size == 4 ? Width::dword : width, RegisterCode{ 0 }, destination);
+                bytes({ static_cast<uint8_t>((size == 1 ? 0xb0 : 0xb8) | (destination.number & 7)) });
+                integer(value, size);
+            }
+
+            void moveStackPointer(int8_t distance)
+            {
+                // lea rsp, [rsp + distance]
+                bytes({ 0x48, 0x8d, 0x64, 0x24, static_cast<uint8_t>(distance) });
+            }
+
+            // The prefixes for width sized operands. REX is needed for qwords, for r8 to r15, and
+            // for spl, bpl, sil and dil.
+            void prefixes(Width width, RegisterCode reg, RegisterCode rm, RegisterCode index = RegisterCode{ 0 })
+            {
+                const uint8_t rex = (width == Width::qword ? 8 : 0) | (reg.number & 8 ? 4 : 0) |
+                                    (index.number & 8 ? 2 : 0) | (rm.number & 8 ? 1 : 0);
+                const bool needsRex{ rex != 0 || reg.needsRex || rm.needsRex };
+                if((reg.highByte || rm.highByte) && needsRex)
+                {
+                    throw std::runtime_error(
+                    "ah, bh, ch and dh can't be encoded together with spl, bpl, sil, dil or r8 to r15");
+                }
+                if(width == Width::word)
+                {
+                    bytes({ 0x66 });
+                }
+                if(needsRex)
+                {
+                    bytes({ static_cast<uint8_t>(0x40 | rex) });
+                }
+            }
+
+            // Everything before the opcode of a packed instruction. The legacy form is the mandatory
+            // prefix, REX for xmm8 to xmm15 and the 0f escape. The vex form is a three byte VEX
+            // prefix, which also has the first operand, the size and the mandatory prefix.
+            void vectorPrefixes(const Packed &packed, std::optional<uint8_t> prefix, RegisterCode reg, RegisterCode rm,
+                                RegisterCode index = RegisterCode{ 0 })
+            {
+                if(!packed.vex)
+                {
+                    if(prefix)
+                    {
+                        bytes({ *prefix });
+                    }
+                    const uint8_t rex = (reg.number & 8 ? 4 : 0) | (index.number & 8 ? 2 : 0) | (rm.number & 8 ? 1 : 0);
+                    if(rex != 0)
+                    {
+                        bytes({ static_cast<uint8_t>(0x40 | rex) });
+                    }
+                    bytes({ 0x0f });
+                    return;
+                }
+                // R, X, B and vvvv are inverted, and the moves have no first operand so vvvv is 1111
+                const uint8_t inverted = (reg.number & 8 ? 0 : 0x80) | (index.number & 8 ? 0 : 0x40) |
+                                         (rm.number & 8 ? 0 : 0x20);
+                const uint8_t vvvv = hasFirstOperand(packed.operation) ? ~packed.first.number & 0xf : 0xf;
+                const uint8_t pp = prefix == 0x66 ? 1 : prefix == 0xf3 ? 2 : 0;
+                bytes({ 0xc4, static_cast<uint8_t>(inverted | 0x01),
+                        static_cast<uint8_t>(vvvv << 3 | (packed.destination.wide ? 4 : 0) | pp) });
+            }
+
+            // The byte version of each opcode used here is the one before it
+            void opcode(Width width, uint8_t wide)
+            {
+                bytes({ static_cast<uint8_t>(bitCount(width) == 8 ? wide - 1 : wide) });
+            }
+
+            void registers(Width width, uint8_t wide, RegisterCode reg, RegisterCode rm)
+            {
+                prefixes(width, reg, rm);
+                opcode(width, wide);
+                bytes({ static_cast<uint8_t>(0xc0 | (reg.number & 7) << 3 | (rm.number & 7)) });
+            }
+
+            void memory(Width width, uint8_t wide, RegisterCode reg, const MemoryAddress &address)
+            {
+                addressing(reg, address, [&](RegisterCode base, RegisterCode index) {
+                    prefixes(width, reg, base, index);
+                    opcode(width, wide);
+                });
+            }
+
+            // Emits ModRM, SIB and the displacement for reg and address. What comes before them
+            // depends on the instruction, so beforeModRm emits that, given the base and index for
+            // the prefixes.
+            template <typename BeforeModRm>
+            void addressing(RegisterCode reg, const MemoryAddress &address, BeforeModRm beforeModRm)
+            {
+                if(address.index && address.indexOperator == AdditiveOperator::minus)
+                {
+                    throw std::runtime_error(
+                    fmt::format("{} can't be encoded, x86-64 can't subtract an index", address.toString()));
+                }
+                if(address.index == RegisterName::rsp)
+                {
+                    throw std::runtime_error(
+                    fmt::format("{} can't be encoded, rsp can't be an index", address.toString()));
+                }
+                const auto scale = address.index ? address.scale : 1;
+                if(scale != 1 && scale != 2 && scale != 4 && scale != 8)
+                {
+                    throw std::runtime_error(
+                    fmt::format("{} can't be encoded, the scale must be 1, 2, 4 or 8", address.toString()));
+                }
+                const auto displacement = address.displacementOperator == AdditiveOperator::plus
+                                          ? static_cast<int64_t>(address.displacement)
+                                          : -static_cast<int64_t>(address.displacement);
+                if(!fitsInt32(displacement))
+                {
+                    throw std::runtime_error(
+                    fmt::format("{} can't be encoded, the displacement is too big", address.toString()));
+                }
+
+                const auto base = number(address.base);
+                const uint8_t index = address.index ? number(*address.index) : 4;
+                // Base rbp or r13 with no displacement is how rip relative is encoded, and rsp or
+                // r12 is how a SIB byte is
+                const uint8_t mod = displacement == 0 && (base & 7) != 5 ? 0 : fitsInt8(displacement) ? 1 : 2;
+                const bool sib{ address.index || (base & 7) == 4 };
+                beforeModRm(RegisterCode{ base }, RegisterCode{ index });
+                bytes({ static_cast<uint8_t>(mod << 6 | (reg.number & 7) << 3 | (sib ? 4 : base & 7)) });
+                if(sib)
+                {
+                    const uint8_t scaleBits = scale == 1 ? 0 : scale == 2 ? 1 : scale == 4 ? 2 : 3;
+                    bytes({ static_cast<uint8_t>(scaleBits << 6 | (index & 7) << 3 | (base & 7)) });
+                }
+                if(mod == 1)
+                {
+                    integer(static_cast<uint64_t>(displacement), 1);
+                }
+                else if(mod == 2)
+                {
+                    integer(static_cast<uint64_t>(displacement), 4);
+                }
+            }
+
+            void jumpTo(size_t target)
+            {
+                m_jumps.push_back({ m_code.size(), target });
+                integer(0, 4);
+            }
+
+            void bytes(std::initializer_list<uint8_t> values)
+            {
+                m_code.insert(m_code.end(), values);
+            }
+
+            void integer(uint64_t value, size_t size)
+            {
+                for(size_t i = 0; i < size; ++i)
+                {
+                    m_code.push_back(static_cast<uint8_t>(value >> i * 8));
+                }
+            }
+
+            struct Jump
+            {
+                size_t rel32;
+                size_t target;
+            };
+
+            const Source &m_source;
+            std::vector<uint8_t> m_code;
+            // The offset of each instruction, and of the end
+            std::vector<size_t> m_offsets;
+            std::vector<Jump> m_jumps;
+        };
+    } // namespace
+
+    std::vector<uint8_t> encode(const Source &source)
+    {
+        return Encoder{ source }.encode();
+    }
+} // namespace ostrich::encoder
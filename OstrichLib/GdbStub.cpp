@@ -0,0 +1,627 @@
+module;
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <variant>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+module Ostrich;
+
+
+namespace ostrich
+{
+    namespace
+    {
+#ifdef _WIN32
+        using NativeSocket = SOCKET;
+        const NativeSocket noSocket{ INVALID_SOCKET };
+
+        void closeSocket(NativeSocket socket)
+        {
+            closesocket(socket);
+        }
+
+        class SocketLibrary
+        {
+        public:
+            SocketLibrary()
+            {
+                WSADATA data;
+                if(WSAStartup(MAKEWORD(2, 2), &data) != 0)
+                {
+                    throw std::runtime_error("Failed to initialize Winsock");
+                }
+            }
+
+            ~SocketLibrary()
+            {
+                WSACleanup();
+            }
+        };
+#else
+        using NativeSocket = int;
+        const NativeSocket noSocket{ -1 };
+
+        void closeSocket(NativeSocket socket)
+        {
+            ::close(socket);
+        }
+
+        struct SocketLibrary
+        {
+        };
+#endif
+
+        class Socket
+        {
+        public:
+            explicit Socket(NativeSocket socket) : m_socket{ socket }
+            {
+            }
+            Socket(Socket &&other) noexcept : m_socket{ std::exchange(other.m_socket, noSocket) }
+            {
+            }
+            Socket(const Socket &) = delete;
+            Socket &operator=(const Socket &) = delete;
+
+            ~Socket()
+            {
+                if(m_socket != noSocket)
+                {
+                    closeSocket(m_socket);
+                }
+            }
+
+            NativeSocket native() const
+            {
+                return m_socket;
+            }
+
+            // Returns an empty string when the other end disconnects
+            std::string receive()
+            {
+                char buffer[4096];
+                const auto received = recv(m_socket, buffer, sizeof(buffer), 0);
+                return received > 0 ? std::string(buffer, static_cast<size_t>(received)) : std::string{};
+            }
+
+            void send(std::string_view data)
+            {
+                while(!data.empty())
+                {
+                    const auto sent = ::send(m_socket, data.data(), static_cast<int>(data.size()), 0);
+                    if(sent <= 0)
+                    {
+                        throw std::runtime_error("Failed to send to gdb");
+                    }
+                    data.remove_prefix(static_cast<size_t>(sent));
+                }
+            }
+
+            bool readable(std::chrono::milliseconds timeout)
+            {
+#ifdef _WIN32
+                WSAPOLLFD descriptor{ m_socket, POLLRDNORM, 0 };
+                return WSAPoll(&descriptor, 1, static_cast<int>(timeout.count())) > 0;
+#else
+                pollfd descriptor{ m_socket, POLLIN, 0 };
+                return poll(&descriptor, 1, static_cast<int>(timeout.count())) > 0;
+#endif
+            }
+
+        private:
+            NativeSocket m_socket;
+        };
+
+        Socket acceptOne(uint16_t port)
+        {
+            Socket listener{ socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) };
+            if(listener.native() == noSocket)
+            {
+                throw std::runtime_error("Failed to create socket");
+            }
+            const int yes{ 1 };
+            setsockopt(listener.native(), SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if(bind(listener.native(), reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+               listen(listener.native(), 1) != 0)
+            {
+                throw std::runtime_error(fmt::format("Failed to listen on port {}", port));
+            }
+            Socket connection{ accept(listener.native(), nullptr, nullptr) };
+            if(connection.native() == noSocket)
+            {
+                throw std::runtime_error("Failed to accept connection from gdb");
+            }
+            // Every packet is answered right away, so waiting to fill up segments only adds latency
+            setsockopt(connection.native(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&yes), sizeof(yes));
+            return connection;
+        }
+
+        constexpr char hexDigits[]{ "0123456789abcdef" };
+
+        // Register and memory contents are sent as little endian bytes
+        void appendHex(std::string &output, uint64_t value, size_t byteCount)
+        {
+            for(size_t i = 0; i < byteCount; ++i)
+            {
+                const auto byte = static_cast<uint8_t>(value >> i * 8);
+                output += hexDigits[byte >> 4];
+                output += hexDigits[byte & 0xf];
+            }
+        }
+
+        // Numbers in packets, like addresses and register numbers, are big endian
+        std::optional<uint64_t> parseHex(std::string_view text)
+        {
+            uint64_t value{ 0 };
+            const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+            if(text.empty() || error != std::errc{} || end != text.data() + text.size())
+            {
+                return std::nullopt;
+            }
+            return value;
+        }
+
+        std::optional<uint64_t> parseHexLittleEndian(std::string_view text)
+        {
+            if(text.empty() || text.size() > 16 || text.size() % 2 != 0)
+            {
+                return std::nullopt;
+            }
+            uint64_t value{ 0 };
+            for(size_t i = 0; i < text.size(); i += 2)
+            {
+                const auto byte = parseHex(text.substr(i, 2));
+                if(!byte)
+                {
+                    return std::nullopt;
+                }
+                value |= *byte << (i / 2) * 8;
+            }
+            return value;
+        }
+
+        // Splits "a,b" or "a:b" into its two parts
+        std::pair<std::string_view, std::string_view> splitAt(std::string_view text, char separator)
+        {
+            const auto position = std::min(text.find(separator), text.size());
+            return { text.substr(0, position), text.substr(std::min(position + 1, text.size())) };
+        }
+
+        bool isResume(std::string_view packet)
+        {
+            return packet.starts_with('c') || packet == "bc";
+        }
+
+        // gdb's x86-64 register numbers. The registers Ostrich has come first, in the same order.
+        static_assert(static_cast<size_t>(RegisterName::rip) == 16);
+        // Then eflags and the segment registers, which are 32 bits wide, the x87 registers, which
+        // are 80 bits, their 32 bit control registers, xmm0 to xmm15 and mxcsr. Ostrich doesn't
+        // have the segment and x87 registers, so they are zero.
+        constexpr size_t gdbEflags{ 17 };
+        constexpr size_t gdbSt0{ 24 };
+        constexpr size_t gdbXmm0{ 40 };
+        constexpr size_t gdbMxcsr{ gdbXmm0 + vectorRegisterCount };
+        constexpr size_t gdbRegisterCount{ gdbMxcsr + 1 };
+        // Round to nearest with all exceptions masked, which is what the packed instructions do
+        constexpr uint64_t defaultMxcsr{ 0x1f80 };
+
+        // In bytes
+        size_t gdbRegisterSize(size_t number)
+        {
+            if(number < gdbEflags)
+            {
+                return 8;
+            }
+            if(number >= gdbSt0 && number < gdbSt0 + 8)
+            {
+                return 10;
+            }
+            if(number >= gdbXmm0 && number < gdbMxcsr)
+            {
+                return 16;
+            }
+            return 4;
+        }
+        constexpr char interruptCharacter{ '\x03' };
+    } // namespace
+
+    GdbStub::GdbStub(Vm &vm) : m_vm{ vm }
+    {
+    }
+
+    uint8_t checksum(std::string_view payload)
+    {
+        uint8_t sum{ 0 };
+        for(const auto c : payload)
+        {
+            sum += static_cast<uint8_t>(c);
+        }
+        return sum;
+    }
+
+    std::string GdbStub::frame(std::string_view payload)
+    {
+        const auto sum = checksum(payload);
+        std::string framed;
+        framed.reserve(payload.size() + 4);
+        framed += '$';
+        framed += payload;
+        framed += '#';
+        framed += hexDigits[sum >> 4];
+        framed += hexDigits[sum & 0xf];
+        return framed;
+    }
+
+    void GdbStub::serve(uint16_t port)
+    {
+        [[maybe_unused]] SocketLibrary socketLibrary;
+        auto connection = acceptOne(port);
+        m_noAck = false;
+        m_done = false;
+        std::string input;
+        std::string lastReply;
+
+        // Runs on another thread, so that this one can look out for gdb interrupting
+        const auto resume = [&](std::string_view packet) {
+            m_interrupt = false;
+            auto reply = std::async(std::launch::async, [&]() { return handle(packet); });
+            while(reply.wait_for(std::chrono::milliseconds{ 0 }) != std::future_status::ready)
+            {
+                if(connection.readable(std::chrono::milliseconds{ 10 }))
+                {
+                    const auto received = connection.receive();
+                    if(received.empty() || received.find(interruptCharacter) != std::string::npos)
+                    {
+                        m_interrupt = true;
+                    }
+                    input += received;
+                }
+            }
+            return reply.get();
+        };
+
+        while(!m_done)
+        {
+            const auto received = connection.receive();
+            if(received.empty())
+            {
+                return;
+            }
+            input += received;
+            size_t position{ 0 };
+            while(position < input.size() && !m_done)
+            {
+                if(input[position] == '-')
+                {
+                    connection.send(lastReply);
+                }
+                if(input[position] != '$')
+                {
+                    // Acks, and interrupts that came after the run already stopped
+                    ++position;
+                    continue;
+                }
+                const auto end = input.find('#', position);
+                if(end == std::string::npos || end + 2 >= input.size())
+                {
+                    break;
+                }
+                const std::string packet = input.substr(position + 1, end - position - 1);
+                const auto expectedChecksum = parseHex(std::string_view{ input }.substr(end + 1, 2));
+                position = end + 3;
+                if(expectedChecksum != checksum(packet))
+                {
+                    if(!m_noAck)
+                    {
+                        connection.send("-");
+                    }
+                    continue;
+                }
+                if(!m_noAck)
+                {
+                    connection.send("+");
+                }
+                const auto reply = isResume(packet) ? resume(packet) : handle(packet);
+                if(packet.starts_with('k') || packet == "vKill")
+                {
+                    return;
+                }
+                lastReply = frame(reply);
+                connection.send(lastReply);
+            }
+            input.erase(0, position);
+        }
+    }
+
+    std::string GdbStub::handle(std::string_view packet)
+    {
+        if(packet.empty())
+        {
+            return "";
+        }
+        const auto arguments = packet.substr(1);
+        try
+        {
+            switch(packet[0])
+            {
+            case '?':
+                return "S05";
+            case 'g':
+                return readRegisters();
+            case 'G':
+                for(size_t i = 0; i < generalPurposeRegisterCount && (i + 1) * 16 <= arguments.size(); ++i)
+                {
+                    const auto value = parseHexLittleEndian(arguments.substr(i * 16, 16));
+                    if(!value || !writeRegister(i, *value))
+                    {
+                        return "E01";
+                    }
+                }
+                return "OK";
+            case 'p':
+            {
+                const auto number = parseHex(arguments);
+                return number ? readRegister(*number) : "E01";
+            }
+            case 'P':
+            {
+                const auto [number, value] = splitAt(arguments, '=');
+                const auto parsedNumber = parseHex(number);
+                const auto parsedValue = parseHexLittleEndian(value);
+                return parsedNumber && parsedValue && writeRegister(*parsedNumber, *parsedValue) ? "OK" : "E01";
+            }
+            case 'm':
+            {
+                const auto [address, length] = splitAt(arguments, ',');
+                const auto parsedAddress = parseHex(address);
+                const auto parsedLength = parseHex(length);
+                return parsedAddress && parsedLength ? readMemory(*parsedAddress, *parsedLength) : "E01";
+            }
+            case 's':
+                m_vm.step();
+                return "S05";
+            case 'c':
+                return m_vm.run(std::numeric_limits<size_t>::max(), &m_interrupt) == Vm::StopReason::interrupted
+                       ? "S02"
+                       : "S05";
+            case 'b':
+                try
+                {
+                    if(packet == "bs")
+                    {
+                        if(m_vm.historyDepth() == 0)
+                        {
+                            return "T05replaylog:begin;";
+                        }
+                        m_vm.stepBack();
+                        return "S05";
+                    }
+                    return packet == "bc" ? reverseContinue() : "";
+                }
+                catch(const std::runtime_error &)
+                {
+                    // Going back into a run that failed, which can't be replayed
+                    return "E01";
+                }
+            case 'Z':
+            case 'z':
+            {
+                const auto [type, rest] = splitAt(arguments, ',');
+                const auto address = parseHex(splitAt(rest, ',').first);
+                if(!address)
+                {
+                    return "E01";
+                }
+                if(type == "0" || type == "1")
+                {
+                    const Breakpoint breakpoint{ static_cast<size_t>(*address) };
+                    if(packet[0] == 'Z')
+                    {
+                        m_vm.addBreakpoint(breakpoint);
+                        return "OK";
+                    }
+                    const auto &breakpoints = m_vm.breakpoints();
+                    const auto found = std::find(breakpoints.begin(), breakpoints.end(), breakpoint);
+                    if(found != breakpoints.end())
+                    {
+                        m_vm.removeBreakpoint(static_cast<size_t>(found - breakpoints.begin()));
+                    }
+                    return "OK";
+                }
+                if(type == "2" || type == "3")
+                {
+                    const Watchpoint watchpoint{ *address, type == "2" ? WatchKind::write : WatchKind::read };
+                    if(packet[0] == 'Z')
+                    {
+                        m_vm.addWatchpoint(watchpoint);
+                        return "OK";
+                    }
+                    const auto &watchpoints = m_vm.watchpoints();
+                    const auto found = std::find_if(watchpoints.begin(), watchpoints.end(), [&](const Watchpoint &w) {
+                        return w.address == watchpoint.address && w.kind == watchpoint.kind;
+                    });
+                    if(found != watchpoints.end())
+                    {
+                        m_vm.removeWatchpoint(static_cast<size_t>(found - watchpoints.begin()));
+                    }
+                    return "OK";
+                }
+                return "";
+            }
+            case 'D':
+                m_done = true;
+                return "OK";
+            case 'k':
+                m_done = true;
+                return "";
+            case 'H':
+            case 'T':
+                return "OK";
+            case 'q':
+                if(packet.starts_with("qSupported"))
+                {
+                    return "PacketSize=4000;QStartNoAckMode+;ReverseStep+;ReverseContinue+";
+                }
+                if(packet == "qAttached")
+                {
+                    return "1";
+                }
+                if(packet == "qfThreadInfo")
+                {
+                    return "m1";
+                }
+                if(packet == "qsThreadInfo")
+                {
+                    return "l";
+                }
+                if(packet == "qC")
+                {
+                    return "QC1";
+                }
+                if(packet.starts_with("qSymbol"))
+                {
+                    return "OK";
+                }
+                return "";
+            case 'Q':
+                if(packet == "QStartNoAckMode")
+                {
+                    m_noAck = true;
+                    return "OK";
+                }
+                return "";
+            case 'v':
+                if(packet == "vKill")
+                {
+                    m_done = true;
+                    return "OK";
+                }
+                return "";
+            default:
+                return "";
+            }
+        }
+        catch(const std::exception &)
+        {
+            // Stack overflows and the like, reported as a segmentation fault
+            return "S0b";
+        }
+    }
+
+    std::string GdbStub::readRegisters() const
+    {
+        std::string reply;
+        reply.reserve(gdbRegisterCount * 2 * 16);
+        for(size_t i = 0; i < gdbRegisterCount; ++i)
+        {
+            reply += readRegister(i);
+        }
+        return reply;
+    }
+
+    // rip, the flags and the vector registers can only be read
+    std::string GdbStub::readRegister(size_t number) const
+    {
+        if(number >= gdbRegisterCount)
+        {
+            return "E01";
+        }
+        std::string reply;
+        if(number >= gdbXmm0 && number < gdbMxcsr)
+        {
+            // Only the xmm halves, gdb needs a target description to know about the rest of ymm
+            const auto &vector = m_vm.cpu().vectorValue(static_cast<uint8_t>(number - gdbXmm0));
+            appendHex(reply, vector.qwords[0], 8);
+            appendHex(reply, vector.qwords[1], 8);
+            return reply;
+        }
+        uint64_t value{ 0 };
+        if(number < registerCount)
+        {
+            value = m_vm.cpu().registerValue(static_cast<RegisterName>(number));
+        }
+        else if(number == gdbEflags)
+        {
+            value = m_vm.cpu().flags();
+        }
+        else if(number == gdbMxcsr)
+        {
+            value = defaultMxcsr;
+        }
+        const auto size = gdbRegisterSize(number);
+        appendHex(reply, value, std::min<size_t>(size, 8));
+        reply.append(2 * (size - std::min<size_t>(size, 8)), '0');
+        return reply;
+    }
+
+    // Only the general purpose registers can be written. Each write is a step in the history.
+    bool GdbStub::writeRegister(size_t number, uint64_t value)
+    {
+        if(number >= generalPurposeRegisterCount)
+        {
+            return false;
+        }
+        const auto registerName = static_cast<RegisterName>(number);
+        if(m_vm.cpu().registerValue(registerName) != value)
+        {
+            m_vm.execute(Mov{ registerName, value });
+        }
+        return true;
+    }
+
+    // Reads up to the first byte that isn't on the stack
+    std::string GdbStub::readMemory(uint64_t address, size_t length) const
+    {
+        const auto &content = m_vm.stack().content();
+        const auto highestAddress = m_vm.stack().beginning() + 7;
+        std::string reply;
+        for(uint64_t a = address; a - address < length && a <= highestAddress && highestAddress - a < content.size(); ++a)
+        {
+            appendHex(reply, content[highestAddress - a], 1);
+        }
+        return reply.empty() && length > 0 ? "E14" : reply;
+    }
+
+    std::string GdbStub::reverseContinue()
+    {
+        switch(m_vm.runBack(&m_interrupt))
+        {
+        case Vm::StopReason::breakpoint:
+            return "S05";
+        case Vm::StopReason::interrupted:
+            return "S02";
+        default:
+            return "T05replaylog:begin;";
+        }
+    }
+} // namespace ostrich
@@ -5,6 +5,7 @@ module;
 #include <fmt/core.h>
 
 #include <string>
+#include <string_view>
 #include <variant>
 
 module Ostrich;
@@ -16,29 +17,76 @@ namespace ostrich
         return fmt::format("0x{0:X}", value);
     }
 
+    namespace
+    {
+        std::string_view sizeKeyword(Width width)
+        {
+            switch(width)
+            {
+            case Width::qword:
+                return "qword";
+            case Width::dword:
+                return "dword";
+            case Width::word:
+                return "word";
+            case Width::byte:
+            case Width::highByte:
+                return "byte";
+            }
+            return "qword";
+        }
+
+        std::string operandToString(const RegisterOrImmediateOrMemory &r, Width width)
+        {
+            return std::visit(overloaded{
+                              [](const RegisterName name) { return ostrich::toString(name); },
+                              [](const uint64_t value) { return ostrich::toString(value); },
+                              [&](const MemoryAddress &value) {
+                                  return fmt::format("{} ptr [{}]", sizeKeyword(width), value.toString());
+                              },
+                              [](const SubRegister subRegister) { return ostrich::toString(subRegister); },
+                              },
+                              r);
+        }
+
+        std::string operandsToString(RegisterName destination, const RegisterOrImmediateOrMemory &source,
+                                     Width width)
+        {
+            return ostrich::toString(SubRegister{ destination, width }) + " " + operandToString(source, width);
+        }
+    } // namespace
+
     std::string toString(RegisterOrImmediateOrMemory r)
     {
-        return std::visit(overloaded{
-                          [](const RegisterName name) { return ostrich::toString(name); },
-                          [](const uint64_t value) { return ostrich::toString(value); },
-                          [](const MemoryAddress &value) { return fmt::format("qword ptr [{0}]",value.toString()); },
-                          },
-                          r);
+        return operandToString(r, Width::qword);
+    }
+
+    Width operandWidth(const Instruction &instruction)
+    {
+        return std::visit(
+        [](const auto &i) {
+            if constexpr(requires { i.width; })
+            {
+                return i.width;
+            }
+            return Width::qword;
+        },
+        instruction);
     }
 
     std::string Inc::toString() const
     {
-        return "inc  " + ostrich::toString(registerName);
+        return "inc  " + ostrich::toString(SubRegister{ registerName, width });
     }
 
     std::string Dec::toString() const
     {
-        return "dec  " + ostrich::toString(registerName);
+        return "dec  " + ostrich::toString(SubRegister{ registerName, width });
     }
 
     std::string Add::toString() const
     {
-        return "add  " + ostrich::toString(destination) + " " + ostrich::toString(source);
+        return "add  " + operandsToString(destination, source, width);
     }
 
     std::string Push::toString() const
@@ -53,7 +101,130 @@ namespace ostrich
 
     std::string Mov::toString() const
     {
-        return "mov  " + ostrich::toString(destination) + " " + ostrich::toString(source);
+        return "mov  " + operandsToString(destination, source, width);
+    }
+
+    std::string Sub::toString() const
+    {
+        return "sub  " + operandsToString(destination, source, width);
+    }
+
+    std::string Cmp::toString() const
+    {
+        return "cmp  " + operandsToString(destination, source, width);
+    }
+
+    std::string Pushf::toString() const
+    {
+        return "pushf";
+    }
+
+    std::string toString(ConditionCode conditionCode)
+    {
+        using enum ConditionCode;
+        switch(conditionCode)
+        {
+        case e:
+            return "e";
+        case ne:
+            return "ne";
+        case b:
+            return "b";
+        case ae:
+            return "ae";
+        case be:
+            return "be";
+        case a:
+            return "a";
+        case l:
+            return "l";
+        case ge:
+            return "ge";
+        case le:
+            return "le";
+        case g:
+            return "g";
+        case s:
+            return "s";
+        case ns:
+            return "ns";
+        case o:
+            return "o";
+        case no:
+            return "no";
+        case p:
+            return "p";
+        case np:
+            return "np";
+        }
+        return "?";
+    }
+
+    std::string Label::toString() const
+    {
+        return name + ":";
+    }
+
+    std::string Jmp::toString() const
+    {
+        return "jmp  " + label;
+    }
+
+    std::string Jcc::toString() const
+    {
+        return fmt::format("{:<5}{}", "j" + ostrich::toString(conditionCode), label);
+    }
+
+    std::string toString(PackedOperation operation)
+    {
+        using enum PackedOperation;
+        switch(operation)
+        {
+        case movdqa:
+            return "movdqa";
+        case movdqu:
+            return "movdqu";
+        case paddd:
+            return "paddd";
+        case paddq:
+            return "paddq";
+        case psubd:
+            return "psubd";
+        case psubq:
+            return "psubq";
+        case pand:
+            return "pand";
+        case por:
+            return "por";
+        case pxor:
+            return "pxor";
+        case addps:
+            return "addps";
+        case subps:
+            return "subps";
+        case mulps:
+            return "mulps";
+        }
+        return "?";
+    }
+
+    std::string Packed::toString() const
+    {
+        const auto sourceText = std::visit(overloaded{
+                                           [](const VectorRegister r) { return ostrich::toString(r); },
+                                           [&](const MemoryAddress &address) {
+                                               return fmt::format("{}mmword ptr [{}]", destination.wide ? 'y' : 'x',
+                                                                  address.toString());
+                                           },
+                                           },
+                                           source);
+        const auto mnemonic = (vex ? "v" : "") + ostrich::toString(operation);
+        if(vex && hasFirstOperand(operation))
+        {
+            return fmt::format("{:<4} {} {} {}", mnemonic, ostrich::toString(destination), ostrich::toString(first),
+                               sourceText);
+        }
+        return fmt::format("{:<4} {} {}", mnemonic, ostrich::toString(destination), sourceText);
     }
 
 } // namespace ostrich
@@ -0,0 +1,747 @@
+module;
+
+#include "Overloaded.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <optional>
+#include <variant>
+#include <vector>
+
+module Ostrich;
+
+namespace ostrich
+{
+    namespace
+    {
+        // Host registers. The context pointer is kept in rdx, and rax and rcx are scratch. All
+        // three are caller saved on both Windows and System V, so the code doesn't save anything.
+        constexpr uint8_t rax{ 0 };
+        constexpr uint8_t rcx{ 1 };
+        constexpr uint8_t rdx{ 2 };
+
+        constexpr int32_t registerOffset(RegisterName registerName)
+        {
+            return static_cast<int32_t>(offsetof(JitContext, registers) + 8 * static_cast<size_t>(registerName));
+        }
+
+        constexpr int32_t field(size_t offset)
+        {
+            return static_cast<int32_t>(offset);
+        }
+
+        // The condition codes of x86 jcc, in the low nibble of the opcode
+        uint8_t hostConditionCode(ConditionCode conditionCode)
+        {
+            using enum ConditionCode;
+            switch(conditionCode)
+            {
+            case o:
+                return 0x0;
+            case no:
+                return 0x1;
+            case b:
+                return 0x2;
+            case ae:
+                return 0x3;
+            case e:
+                return 0x4;
+            case ne:
+                return 0x5;
+            case be:
+                return 0x6;
+            case a:
+                return 0x7;
+            case s:
+                return 0x8;
+            case ns:
+                return 0x9;
+            case p:
+                return 0xa;
+            case np:
+                return 0xb;
+            case l:
+                return 0xc;
+            case ge:
+                return 0xd;
+            case le:
+                return 0xe;
+            case g:
+                return 0xf;
+            }
+            return 0x4;
+        }
+
+        // Only narrow instructions read sub-registers, unless they are made by hand
+        bool readsSubRegister(const Instruction &instruction)
+        {
+            return std::visit(
+            []<typename InstructionType>(const InstructionType &i) {
+                if constexpr(InstructionSourceDestination<InstructionType>)
+                {
+                    return std::holds_alternative<SubRegister>(i.source);
+                }
+                return false;
+            },
+            instruction);
+        }
+
+        // Emits the handful of 64 bit instructions the Jit needs. Memory operands are always
+        // [rdx + disp32], that is a field of the JitContext.
+        class Emitter
+        {
+        public:
+            const std::vector<uint8_t> &code() const
+            {
+                return m_code;
+            }
+
+            size_t position() const
+            {
+                return m_code.size();
+            }
+
+            // mov reg, [rdx + disp]
+            void load(uint8_t reg, int32_t disp)
+            {
+                withContext(0x8b, reg, disp);
+            }
+
+            // mov [rdx + disp], reg
+            void store(int32_t disp, uint8_t reg)
+            {
+                withContext(0x89, reg, disp);
+            }
+
+            // mov qword [rdx + disp], imm (sign extended)
+            void storeImmediate(int32_t disp, int32_t imm)
+            {
+                withContext(0xc7, 0, disp);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            // add reg, [rdx + disp]
+            void addFrom(uint8_t reg, int32_t disp)
+            {
+                withContext(0x03, reg, disp);
+            }
+
+            // cmp reg, [rdx + disp]
+            void compareWith(uint8_t reg, int32_t disp)
+            {
+                withContext(0x3b, reg, disp);
+            }
+
+            // add qword [rdx + disp], imm
+            void addToField(int32_t disp, int32_t imm)
+            {
+                withContext(0x81, 0, disp);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            // sub qword [rdx + disp], imm
+            void subtractFromField(int32_t disp, int32_t imm)
+            {
+                withContext(0x81, 5, disp);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            // mov reg, imm64
+            void moveImmediate(uint8_t reg, uint64_t imm)
+            {
+                bytes({ 0x48, static_cast<uint8_t>(0xb8 + reg) });
+                u64(imm);
+            }
+
+            // mov dst, src
+            void move(uint8_t dst, uint8_t src)
+            {
+                registers(0x89, src, dst);
+            }
+
+            // add dst, src
+            void add(uint8_t dst, uint8_t src)
+            {
+                registers(0x01, src, dst);
+            }
+
+            // sub dst, src
+            void subtract(uint8_t dst, uint8_t src)
+            {
+                registers(0x29, src, dst);
+            }
+
+            // add reg, imm
+            void addImmediate(uint8_t reg, int32_t imm)
+            {
+                registers(0x81, 0, reg);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            // sub reg, imm
+            void subtractImmediate(uint8_t reg, int32_t imm)
+            {
+                registers(0x81, 5, reg);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            // cmp reg, imm
+            void compareImmediate(uint8_t reg, int32_t imm)
+            {
+                registers(0x81, 7, reg);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            // imul reg, reg, imm
+            void multiplyImmediate(uint8_t reg, int32_t imm)
+            {
+                registers(0x69, reg, reg);
+                u32(static_cast<uint32_t>(imm));
+            }
+
+            void increment(uint8_t reg)
+            {
+                registers(0xff, 0, reg);
+            }
+
+            void decrement(uint8_t reg)
+            {
+                registers(0xff, 1, reg);
+            }
+
+            void byteSwap(uint8_t reg)
+            {
+                bytes({ 0x48, 0x0f, static_cast<uint8_t>(0xc8 + reg) });
+            }
+
+            // mov dst, [src]
+            void loadIndirect(uint8_t dst, uint8_t src)
+            {
+                bytes({ 0x48, 0x8b, static_cast<uint8_t>(dst << 3 | src) });
+            }
+
+            // mov [dst], src
+            void storeIndirect(uint8_t dst, uint8_t src)
+            {
+                bytes({ 0x48, 0x89, static_cast<uint8_t>(src << 3 | dst) });
+            }
+
+            // lea dst, [src + imm8]
+            void loadEffectiveAddress(uint8_t dst, uint8_t src, int8_t imm)
+            {
+                bytes({ 0x48, 0x8d, static_cast<uint8_t>(0x40 | dst << 3 | src), static_cast<uint8_t>(imm) });
+            }
+
+            // setb al, movzx eax, al
+            void carryToRax()
+            {
+                bytes({ 0x0f, 0x92, 0xc0, 0x48, 0x0f, 0xb6, 0xc0 });
+            }
+
+            // bt reg, 0, which sets the host carry flag to bit 0 of reg
+            void bitZeroToCarry(uint8_t reg)
+            {
+                bytes({ 0x48, 0x0f, 0xba, static_cast<uint8_t>(0xe0 | reg), 0x00 });
+            }
+
+            void ret()
+            {
+                m_code.push_back(0xc3);
+            }
+
+            // Returns where the rel32 is, for patching once the target is known
+            size_t jumpIf(uint8_t hostConditionCode)
+            {
+                bytes({ 0x0f, static_cast<uint8_t>(0x80 | hostConditionCode) });
+                u32(0);
+                return position() - 4;
+            }
+
+            size_t jump()
+            {
+                m_code.push_back(0xe9);
+                u32(0);
+                return position() - 4;
+            }
+
+            void patch(size_t rel32, size_t target)
+            {
+                const auto relative = static_cast<uint32_t>(static_cast<int32_t>(target - (rel32 + 4)));
+                std::memcpy(m_code.data() + rel32, &relative, 4);
+            }
+
+        private:
+            void bytes(std::initializer_list<uint8_t> values)
+            {
+                m_code.insert(m_code.end(), values);
+            }
+
+            void u32(uint32_t value)
+            {
+                for(size_t i = 0; i < 4; ++i)
+                {
+                    m_code.push_back(static_cast<uint8_t>(value >> i * 8));
+                }
+            }
+
+            void u64(uint64_t value)
+            {
+                u32(static_cast<uint32_t>(value));
+                u32(static_cast<uint32_t>(value >> 32));
+            }
+
+            void withContext(uint8_t opcode, uint8_t reg, int32_t disp)
+            {
+                bytes({ 0x48, opcode, static_cast<uint8_t>(0x80 | reg << 3 | rdx) });
+                u32(static_cast<uint32_t>(disp));
+            }
+
+            void registers(uint8_t opcode, uint8_t reg, uint8_t rm)
+            {
+                bytes({ 0x48, opcode, static_cast<uint8_t>(0xc0 | reg << 3 | rm) });
+            }
+
+            std::vector<uint8_t> m_code;
+        };
+
+        // Compiles one block. The flag operation of the last instruction that set the flags is
+        // tracked while compiling, so that carry and conditions can be computed without looking
+        // at what it was at run time. Before the first one, the carry flag is in entryCarry.
+        class BlockCompiler
+        {
+        public:
+            BlockCompiler(const Source &source, size_t first, size_t last)
+            : m_source{ source }, m_first{ first }, m_last{ last }
+            {
+            }
+
+            std::optional<std::vector<uint8_t>> compile()
+            {
+#ifdef _WIN32
+                m_emitter.move(rdx, rcx);
+#else
+                constexpr uint8_t rdi{ 7 };
+                m_emitter.move(rdx, rdi);
+#endif
+                m_start = m_emitter.position();
+                for(size_t i = m_first; i < m_last; ++i)
+                {
+                    if(!instruction(i))
+                    {
+                        return std::nullopt;
+                    }
+                }
+                const auto &lastInstruction = m_source[m_last - 1];
+                if(!std::holds_alternative<Jmp>(lastInstruction) && !std::holds_alternative<Jcc>(lastInstruction))
+                {
+                    exitTo(m_last);
+                }
+                faultStubs();
+                return m_emitter.code();
+            }
+
+        private:
+            bool instruction(size_t index)
+            {
+                // Narrow instructions are left to the interpreter
+                if(operandWidth(m_source[index]) != Width::qword || readsSubRegister(m_source[index]))
+                {
+                    return false;
+                }
+                return std::visit(
+                overloaded{
+                [&](const Inc &inc) { return incrementOrDecrement(inc.registerName, FlagOperation::inc); },
+                [&](const Dec &dec) { return incrementOrDecrement(dec.registerName, FlagOperation::dec); },
+                [&](const Add &add) { return arithmetic(add.destination, add.source, FlagOperation::add, true, index); },
+                [&](const Sub &sub) { return arithmetic(sub.destination, sub.source, FlagOperation::sub, true, index); },
+                [&](const Cmp &cmp) { return arithmetic(cmp.destination, cmp.source, FlagOperation::sub, false, index); },
+                [&](const Mov &mov) {
+                    operand(mov.source, index);
+                    m_emitter.store(registerOffset(mov.destination), rcx);
+                    return true;
+                },
+                [&](const Push &push) {
+                    m_emitter.load(rcx, registerOffset(RegisterName::rsp));
+                    hostAddress(index);
+                    m_emitter.load(rcx, registerOffset(push.registerName));
+                    m_emitter.byteSwap(rcx);
+                    m_emitter.storeIndirect(rax, rcx);
+                    m_emitter.subtractFromField(registerOffset(RegisterName::rsp), 8);
+                    return true;
+                },
+                [&](const Pop &pop) {
+                    m_emitter.load(rcx, registerOffset(RegisterName::rsp));
+                    m_emitter.addImmediate(rcx, 8);
+                    hostAddress(index);
+                    m_emitter.loadIndirect(rcx, rax);
+                    m_emitter.byteSwap(rcx);
+                    m_emitter.store(registerOffset(pop.registerName), rcx);
+                    m_emitter.addToField(registerOffset(RegisterName::rsp), 8);
+                    return true;
+                },
+                [](const Pushf &) { return false; },
+                [](const Packed &) { return false; },
+                [](const Label &) { return true; },
+                [&](const Jmp &jmp) {
+                    branch(jmp.target);
+                    return true;
+                },
+                [&](const Jcc &jcc) {
+                    if(!hostFlags())
+                    {
+                        return false;
+                    }
+                    const auto taken = m_emitter.jumpIf(hostConditionCode(jcc.conditionCode));
+                    exitTo(m_last);
+                    m_emitter.patch(taken, m_emitter.position());
+                    branch(jcc.target);
+                    return true;
+                },
+                },
+                m_source[index]);
+            }
+
+            bool incrementOrDecrement(RegisterName registerName, FlagOperation operation)
+            {
+                // Inc and dec keep the carry flag, which is only in flags after inc and dec
+                if(m_flagOperation != FlagOperation::inc && m_flagOperation != FlagOperation::dec)
+                {
+                    carryToRax();
+                    m_emitter.store(field(offsetof(JitContext, flags)), rax);
+                }
+                m_emitter.load(rax, registerOffset(registerName));
+                m_emitter.store(field(offsetof(JitContext, flagLhs)), rax);
+                m_emitter.storeImmediate(field(offsetof(JitContext, flagRhs)), 1);
+                if(operation == FlagOperation::inc)
+                {
+                    m_emitter.increment(rax);
+                }
+                else
+                {
+                    m_emitter.decrement(rax);
+                }
+                m_emitter.store(registerOffset(registerName), rax);
+                setFlagOperation(operation);
+                return true;
+            }
+
+            bool arithmetic(RegisterName destination, const RegisterOrImmediateOrMemory &source,
+                            FlagOperation operation, bool storeResult, size_t index)
+            {
+                operand(source, index);
+                m_emitter.load(rax, registerOffset(destination));
+                m_emitter.store(field(offsetof(JitContext, flagLhs)), rax);
+                m_emitter.store(field(offsetof(JitContext, flagRhs)), rcx);
+                if(operation == FlagOperation::add)
+                {
+                    m_emitter.add(rax, rcx);
+                }
+                else
+                {
+                    m_emitter.subtract(rax, rcx);
+                }
+                if(storeResult)
+                {
+                    m_emitter.store(registerOffset(destination), rax);
+                }
+                setFlagOperation(operation);
+                return true;
+            }
+
+            void setFlagOperation(FlagOperation operation)
+            {
+                m_emitter.store(field(offsetof(JitContext, flagResult)), rax);
+                m_emitter.storeImmediate(field(offsetof(JitContext, flagOperation)), static_cast<int32_t>(operation));
+                m_flagOperation = operation;
+            }
+
+            // rax = the carry flag, 0 or 1
+            void carryToRax()
+            {
+                switch(m_flagOperation)
+                {
+                case FlagOperation::add:
+                    m_emitter.load(rax, field(offsetof(JitContext, flagResult)));
+                    m_emitter.compareWith(rax, field(offsetof(JitContext, flagLhs)));
+                    m_emitter.carryToRax();
+                    break;
+                case FlagOperation::sub:
+                    m_emitter.load(rax, field(offsetof(JitContext, flagLhs)));
+                    m_emitter.compareWith(rax, field(offsetof(JitContext, flagRhs)));
+                    m_emitter.carryToRax();
+                    break;
+                case FlagOperation::inc:
+                case FlagOperation::dec:
+                    m_emitter.load(rax, field(offsetof(JitContext, flags)));
+                    break;
+                case FlagOperation::none:
+                    m_emitter.load(rax, field(offsetof(JitContext, entryCarry)));
+                    break;
+                }
+            }
+
+            // Redoes the last operation that set the flags on the host, which sets the host flags
+            // the same way. Only possible if it was in this block.
+            bool hostFlags()
+            {
+                switch(m_flagOperation)
+                {
+                case FlagOperation::add:
+                    m_emitter.load(rax, field(offsetof(JitContext, flagLhs)));
+                    m_emitter.addFrom(rax, field(offsetof(JitContext, flagRhs)));
+                    return true;
+                case FlagOperation::sub:
+                    m_emitter.load(rax, field(offsetof(JitContext, flagLhs)));
+                    m_emitter.compareWith(rax, field(offsetof(JitContext, flagRhs)));
+                    return true;
+                case FlagOperation::inc:
+                case FlagOperation::dec:
+                    m_emitter.load(rcx, field(offsetof(JitContext, flags)));
+                    m_emitter.bitZeroToCarry(rcx);
+                    m_emitter.load(rax, field(offsetof(JitContext, flagLhs)));
+                    if(m_flagOperation == FlagOperation::inc)
+                    {
+                        m_emitter.increment(rax);
+                    }
+                    else
+                    {
+                        m_emitter.decrement(rax);
+                    }
+                    return true;
+                case FlagOperation::none:
+                    return false;
+                }
+                return false;
+            }
+
+            // rcx = the value of the operand
+            void operand(const RegisterOrImmediateOrMemory &source, size_t index)
+            {
+                std::visit(overloaded{
+                           [&](const RegisterName name) { m_emitter.load(rcx, registerOffset(name)); },
+                           [&](const uint64_t value) { m_emitter.moveImmediate(rcx, value); },
+                           [&](const MemoryAddress &address) {
+                               effectiveAddress(address);
+                               hostAddress(index);
+                               m_emitter.loadIndirect(rcx, rax);
+                               m_emitter.byteSwap(rcx);
+                           },
+                           // Rejected before getting here
+                           [](const SubRegister) {},
+                           },
+                           source);
+            }
+
+            // rcx = base + index * scale +- displacement
+            void effectiveAddress(const MemoryAddress &address)
+            {
+                m_emitter.load(rcx, registerOffset(address.base));
+                if(address.index)
+                {
+                    m_emitter.load(rax, registerOffset(*address.index));
+                    m_emitter.multiplyImmediate(rax, address.scale);
+                    if(address.indexOperator == AdditiveOperator::plus)
+                    {
+                        m_emitter.add(rcx, rax);
+                    }
+                    else
+                    {
+                        m_emitter.subtract(rcx, rax);
+                    }
+                }
+                m_emitter.moveImmediate(rax, address.displacement);
+                if(address.displacementOperator == AdditiveOperator::plus)
+                {
+                    m_emitter.add(rcx, rax);
+                }
+                else
+                {
+                    m_emitter.subtract(rcx, rax);
+                }
+            }
+
+            // rax = where the qword at guest address rcx is in the host memory, or a fault if it
+            // isn't on the stack. The stack is stored highest address first, so the qword is big
+            // endian.
+            void hostAddress(size_t index)
+            {
+                m_emitter.load(rax, field(offsetof(JitContext, memoryBeginning)));
+                m_emitter.subtract(rax, rcx);
+                m_faults.push_back({ m_emitter.jumpIf(0x2), index });
+                m_emitter.loadEffectiveAddress(rcx, rax, 8);
+                m_emitter.compareWith(rcx, field(offsetof(JitContext, memorySize)));
+                m_faults.push_back({ m_emitter.jumpIf(0x7), index });
+                m_emitter.addFrom(rax, field(offsetof(JitContext, memory)));
+            }
+
+            void branch(size_t target)
+            {
+                if(target == m_first)
+                {
+                    loopBack();
+                }
+                else
+                {
+                    exitTo(target);
+                }
+            }
+
+            // Goes round again if there is budget for it. The next round starts with no flag
+            // operation known, so the carry flag is saved for it.
+            void loopBack()
+            {
+                const auto size = static_cast<int32_t>(m_last - m_first);
+                m_emitter.addToField(field(offsetof(JitContext, steps)), size);
+                carryToRax();
+                m_emitter.store(field(offsetof(JitContext, entryCarry)), rax);
+                m_emitter.load(rax, field(offsetof(JitContext, budget)));
+                m_emitter.subtractImmediate(rax, size);
+                m_emitter.store(field(offsetof(JitContext, budget)), rax);
+                m_emitter.compareImmediate(rax, size);
+                const auto outOfBudget = m_emitter.jumpIf(0x2);
+                m_emitter.patch(m_emitter.jump(), m_start);
+                m_emitter.patch(outOfBudget, m_emitter.position());
+                m_emitter.storeImmediate(field(offsetof(JitContext, nextInstruction)), static_cast<int32_t>(m_first));
+                m_emitter.ret();
+            }
+
+            void exitTo(size_t next)
+            {
+                m_emitter.addToField(field(offsetof(JitContext, steps)), static_cast<int32_t>(m_last - m_first));
+                m_emitter.storeImmediate(field(offsetof(JitContext, nextInstruction)), static_cast<int32_t>(next));
+                m_emitter.ret();
+            }
+
+            // Stops before the instruction that would fault, with the steps before it counted
+            void faultStubs()
+            {
+                for(const auto &[rel32, index] : m_faults)
+                {
+                    m_emitter.patch(rel32, m_emitter.position());
+                    m_emitter.addToField(field(offsetof(JitContext, steps)), static_cast<int32_t>(index - m_first));
+                    m_emitter.storeImmediate(field(offsetof(JitContext, nextInstruction)), static_cast<int32_t>(index));
+                    m_emitter.storeImmediate(field(offsetof(JitContext, fault)), 1);
+                    m_emitter.ret();
+                }
+            }
+
+            struct Fault
+            {
+                size_t rel32;
+                size_t index;
+            };
+
+            const Source &m_source;
+            size_t m_first;
+            size_t m_last;
+            Emitter m_emitter;
+            size_t m_start{ 0 };
+            FlagOperation m_flagOperation{ FlagOperation::none };
+            std::vector<Fault> m_faults;
+        };
+    } // namespace
+
+    Jit::~Jit()
+    {
+        if(!m_code)
+        {
+            return;
+        }
+#ifdef _WIN32
+        VirtualFree(m_code, 0, MEM_RELEASE);
+#else
+        munmap(m_code, capacity);
+#endif
+    }
+
+    bool Jit::supported()
+    {
+#if defined(_M_X64) || defined(__x86_64__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    JitFunction Jit::compile(const Source &source, size_t first, size_t last)
+    {
+        // Instruction indices are stored as 32 bit immediates
+        if(!supported() || m_failed || last > static_cast<size_t>(INT32_MAX))
+        {
+            return nullptr;
+        }
+        const auto code = BlockCompiler{ source, first, last }.compile();
+        if(!code || code->size() > capacity - m_used)
+        {
+            return nullptr;
+        }
+        if(!m_code)
+        {
+#ifdef _WIN32
+            m_code = static_cast<uint8_t *>(VirtualAlloc(nullptr, capacity, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+            void *memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            m_code = memory == MAP_FAILED ? nullptr : static_cast<uint8_t *>(memory);
+#endif
+            if(!m_code)
+            {
+                m_failed = true;
+                return nullptr;
+            }
+        }
+
+        // The code is never writable and executable at the same time. Hardened hosts may refuse
+        // to make it executable at all.
+#ifdef _WIN32
+        DWORD oldProtection;
+        if(!VirtualProtect(m_code, capacity, PAGE_READWRITE, &oldProtection))
+        {
+            m_failed = true;
+            return nullptr;
+        }
+        std::memcpy(m_code + m_used, code->data(), code->size());
+        if(!VirtualProtect(m_code, capacity, PAGE_EXECUTE_READ, &oldProtection))
+        {
+            m_failed = true;
+            return nullptr;
+        }
+        FlushInstructionCache(GetCurrentProcess(), m_code + m_used, code->size());
+#else
+        if(mprotect(m_code, capacity, PROT_READ | PROT_WRITE) != 0)
+        {
+            m_failed = true;
+            return nullptr;
+        }
+        std::memcpy(m_code + m_used, code->data(), code->size());
+        if(mprotect(m_code, capacity, PROT_READ | PROT_EXEC) != 0)
+        {
+            m_failed = true;
+            return nullptr;
+        }
+#endif
+        const auto function = reinterpret_cast<JitFunction>(m_code + m_used);
+        // Keeps the blocks 16 byte aligned
+        m_used += (code->size() + 15) & ~size_t{ 15 };
+        return function;
+    }
+
+    void Jit::clear()
+    {
+        m_used = 0;
+    }
+
+    bool Jit::failed() const
+    {
+        return m_failed;
+    }
+} // namespace ostrich
@@ -0,0 +1,116 @@
+module;
+
+#include <fmt/core.h>
+
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+module Ostrich;
+
+
+namespace ostrich
+{
+#ifdef _WIN32
+    MappedFile::MappedFile(const std::filesystem::path &path)
+    {
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(m_file == INVALID_HANDLE_VALUE)
+        {
+            m_file = nullptr;
+            throw std::runtime_error(fmt::format("Failed to open '{}'", path.string()));
+        }
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(m_file, &size))
+        {
+            CloseHandle(m_file);
+            throw std::runtime_error(fmt::format("Failed to get size of '{}'", path.string()));
+        }
+        m_size = static_cast<size_t>(size.QuadPart);
+        if(m_size == 0)
+        {
+            // Empty files can't be mapped
+            return;
+        }
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        m_data = m_mapping ? static_cast<const uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if(!m_data)
+        {
+            if(m_mapping)
+            {
+                CloseHandle(m_mapping);
+            }
+            CloseHandle(m_file);
+            throw std::runtime_error(fmt::format("Failed to map '{}'", path.string()));
+        }
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if(m_data)
+        {
+            UnmapViewOfFile(m_data);
+        }
+        if(m_mapping)
+        {
+            CloseHandle(m_mapping);
+        }
+        if(m_file)
+        {
+            CloseHandle(m_file);
+        }
+    }
+#else
+    MappedFile::MappedFile(const std::filesystem::path &path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+        {
+            throw std::runtime_error(fmt::format("Failed to open '{}'", path.string()));
+        }
+        struct stat status;
+        if(::fstat(fd, &status) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error(fmt::format("Failed to get size of '{}'", path.string()));
+        }
+        m_size = static_cast<size_t>(status.st_size);
+        if(m_size > 0)
+        {
+            void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error(fmt::format("Failed to map '{}'", path.string()));
+            }
+            m_data = static_cast<const uint8_t *>(data);
+        }
+        // The mapping stays valid after the descriptor is closed
+        ::close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if(m_data)
+        {
+            ::munmap(const_cast<uint8_t *>(m_data), m_size);
+        }
+    }
+#endif
+
+    std::span<const uint8_t> MappedFile::data() const
+    {
+        return { m_data, m_data ? m_size : 0 };
+    }
+} // namespace ostrich
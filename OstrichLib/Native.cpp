@@ -0,0 +1,386 @@
+module;
+
+#include <fmt/core.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define OSTRICH_NATIVE
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+module Ostrich;
+
+namespace ostrich::native
+{
+    namespace
+    {
+        // Where compare puts the stack, above the lowest addresses that can be mapped
+        constexpr uint64_t stackBase{ 0x100000000 };
+        constexpr uint64_t pageSize{ 0x1000 };
+        // Always set in user mode
+        constexpr uint64_t interruptFlag{ 1 << 9 };
+
+        // What the code works on in the child, at a fixed address after the stack
+        struct State
+        {
+            std::array<uint64_t, generalPurposeRegisterCount> registers;
+            uint64_t flags;
+            uint64_t hostStackPointer;
+            std::array<Vector, vectorRegisterCount> vectors;
+        };
+
+        uint64_t alignDown(uint64_t value)
+        {
+            return value & ~(pageSize - 1);
+        }
+
+        uint64_t alignUp(uint64_t value)
+        {
+            return alignDown(value + pageSize - 1);
+        }
+
+        class Code
+        {
+        public:
+            void bytes(std::initializer_list<uint8_t> values)
+            {
+                m_code.insert(m_code.end(), values);
+            }
+
+            void bytes(const std::vector<uint8_t> &values)
+            {
+                m_code.insert(m_code.end(), values.begin(), values.end());
+            }
+
+            void integer(uint64_t value, size_t size)
+            {
+                for(size_t i = 0; i < size; ++i)
+                {
+                    m_code.push_back(static_cast<uint8_t>(value >> i * 8));
+                }
+            }
+
+            // op reg, [base + disp32] or op [base + disp32], where base is one of the first eight
+            void withDisplacement(uint8_t opcode, uint8_t reg, uint8_t base, size_t displacement)
+            {
+                bytes({ static_cast<uint8_t>(reg & 8 ? 0x4c : 0x48), opcode,
+                        static_cast<uint8_t>(0x80 | (reg & 7) << 3 | base) });
+                if(base == 4)
+                {
+                    bytes({ 0x24 });
+                }
+                integer(displacement, 4);
+            }
+
+            // movdqu, or vmovdqu on the whole ymm register with avx, between a vector register and
+            // [base + disp32], where base is one of the first eight. 0x6f loads and 0x7f stores.
+            void vectorWithDisplacement(bool avx, uint8_t opcode, uint8_t reg, uint8_t base, size_t displacement)
+            {
+                if(avx)
+                {
+                    // VEX.256.F3.0F, with R inverted and no other operand
+                    bytes({ 0xc4, static_cast<uint8_t>((reg & 8 ? 0x00 : 0x80) | 0x61), 0x7e });
+                }
+                else
+                {
+                    bytes({ 0xf3 });
+                    if(reg & 8)
+                    {
+                        bytes({ 0x44 });
+                    }
+                    bytes({ 0x0f });
+                }
+                bytes({ opcode, static_cast<uint8_t>(0x80 | (reg & 7) << 3 | base) });
+                if(base == 4)
+                {
+                    bytes({ 0x24 });
+                }
+                integer(displacement, 4);
+            }
+
+            std::vector<uint8_t> release()
+            {
+                return std::move(m_code);
+            }
+
+        private:
+            std::vector<uint8_t> m_code;
+        };
+
+        size_t registerOffset(uint8_t number)
+        {
+            const auto index = static_cast<size_t>(registerWithNumber(number));
+            return offsetof(State, registers) + 8 * index;
+        }
+
+        size_t vectorOffset(uint8_t number)
+        {
+            return offsetof(State, vectors) + sizeof(Vector) * number;
+        }
+
+        // The code is called with the State in rdi. It saves the host's callee saved registers and
+        // stack pointer, switches to the guest registers and flags, and switches back at the end.
+        // Without avx, only the xmm registers are switched.
+        std::vector<uint8_t> wrap(const std::vector<uint8_t> &guest, uint64_t stateAddress, bool avx)
+        {
+            constexpr uint8_t rax{ 0 };
+            constexpr uint8_t rcx{ 1 };
+            constexpr uint8_t rsp{ 4 };
+            constexpr uint8_t rdi{ 7 };
+            Code code;
+            // push rbx, rbp, r12, r13, r14, r15
+            code.bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });
+            code.withDisplacement(0x89, rsp, rdi, offsetof(State, hostStackPointer));
+            // mov rax, [rdi + flags], push rax, popfq
+            code.withDisplacement(0x8b, rax, rdi, offsetof(State, flags));
+            code.bytes({ 0x50, 0x9d });
+            for(uint8_t reg = 0; reg < vectorRegisterCount; ++reg)
+            {
+                code.vectorWithDisplacement(avx, 0x6f, reg, rdi, vectorOffset(reg));
+            }
+            for(uint8_t reg = 0; reg < generalPurposeRegisterCount; ++reg)
+            {
+                if(reg != rdi)
+                {
+                    code.withDisplacement(0x8b, reg, rdi, registerOffset(reg));
+                }
+            }
+            code.withDisplacement(0x8b, rdi, rdi, registerOffset(rdi));
+
+            code.bytes(guest);
+
+            // Nothing here changes the flags before they are saved. mov [moffs64], rax first, since
+            // a register is needed for the State.
+            code.bytes({ 0x48, 0xa3 });
+            code.integer(stateAddress + registerOffset(rax), 8);
+            code.bytes({ 0x48, 0xb8 });
+            code.integer(stateAddress, 8);
+            for(uint8_t reg = 1; reg < generalPurposeRegisterCount; ++reg)
+            {
+                code.withDisplacement(0x89, reg, rax, registerOffset(reg));
+            }
+            for(uint8_t reg = 0; reg < vectorRegisterCount; ++reg)
+            {
+                code.vectorWithDisplacement(avx, 0x7f, reg, rax, vectorOffset(reg));
+            }
+            code.withDisplacement(0x8b, rsp, rax, offsetof(State, hostStackPointer));
+            // pushfq, pop rcx
+            code.bytes({ 0x9c, 0x59 });
+            code.withDisplacement(0x89, rcx, rax, offsetof(State, flags));
+            // pop r15, r14, r13, r12, rbp, rbx, ret
+            code.bytes({ 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3 });
+            return code.release();
+        }
+
+#ifdef OSTRICH_NATIVE
+        bool writeAll(int fd, const void *data, size_t size)
+        {
+            const auto *bytes = static_cast<const uint8_t *>(data);
+            while(size > 0)
+            {
+                const auto written = ::write(fd, bytes, size);
+                if(written <= 0)
+                {
+                    return false;
+                }
+                bytes += written;
+                size -= static_cast<size_t>(written);
+            }
+            return true;
+        }
+
+        bool readAll(int fd, void *data, size_t size)
+        {
+            auto *bytes = static_cast<uint8_t *>(data);
+            while(size > 0)
+            {
+                const auto got = ::read(fd, bytes, size);
+                if(got <= 0)
+                {
+                    return false;
+                }
+                bytes += got;
+                size -= static_cast<size_t>(got);
+            }
+            return true;
+        }
+
+        void *mapAt(uint64_t address, size_t size)
+        {
+#ifdef MAP_FIXED_NOREPLACE
+            constexpr int fixed{ MAP_FIXED_NOREPLACE };
+#else
+            constexpr int fixed{ MAP_FIXED };
+#endif
+            void *mapped = mmap(reinterpret_cast<void *>(address), size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | fixed, -1, 0);
+            return mapped == reinterpret_cast<void *>(address) ? mapped : nullptr;
+        }
+
+        // Ends with _exit, and never returns
+        [[noreturn]] void child(int fd, const std::vector<uint8_t> &code, uint64_t stackStart, uint64_t stackEnd,
+                                uint64_t stateAddress, uint64_t stackSize, uint64_t stackBeginning)
+        {
+            // Programs that loop forever are killed
+            alarm(1);
+            auto *state = static_cast<State *>(mapAt(stateAddress, pageSize));
+            void *stack = mapAt(alignDown(stackStart), alignUp(stackEnd) - alignDown(stackStart));
+            void *executable = mmap(nullptr, alignUp(code.size()), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(!state || !stack || executable == MAP_FAILED)
+            {
+                _exit(2);
+            }
+            std::memcpy(executable, code.data(), code.size());
+            if(mprotect(executable, alignUp(code.size()), PROT_READ | PROT_EXEC) != 0)
+            {
+                _exit(2);
+            }
+            state->registers = {};
+            state->vectors = {};
+            state->registers[static_cast<size_t>(RegisterName::rsp)] = stackBeginning;
+            state->flags = initialFlags | interruptFlag;
+
+            reinterpret_cast<void (*)(State *)>(executable)(state);
+
+            state->flags &= statusFlags;
+            const bool written = writeAll(fd, state->registers.data(), sizeof(state->registers)) &&
+                                 writeAll(fd, &state->flags, sizeof(state->flags)) &&
+                                 writeAll(fd, state->vectors.data(), sizeof(state->vectors)) &&
+                                 writeAll(fd, reinterpret_cast<const void *>(stackStart), stackSize);
+            _exit(written ? 0 : 2);
+        }
+#endif
+    } // namespace
+
+    bool supported()
+    {
+#ifdef OSTRICH_NATIVE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool supportsAvx2()
+    {
+#ifdef OSTRICH_NATIVE
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+
+    std::optional<Result> run(const Source &source, size_t stackSize, uint64_t stackBeginning)
+    {
+#ifdef OSTRICH_NATIVE
+        // The stack has the qword at stackBeginning at the top, and grows down
+        const uint64_t stackEnd{ stackBeginning + 8 };
+        const uint64_t stackStart{ stackEnd - stackSize };
+        const uint64_t stateAddress{ alignUp(stackEnd) + pageSize };
+        const auto code = wrap(encoder::encode(source), stateAddress, __builtin_cpu_supports("avx"));
+
+        int fds[2];
+        if(pipe(fds) != 0)
+        {
+            throw std::runtime_error("Failed to create a pipe");
+        }
+        const pid_t pid = fork();
+        if(pid < 0)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            throw std::runtime_error("Failed to start a child process");
+        }
+        if(pid == 0)
+        {
+            close(fds[0]);
+            child(fds[1], code, stackStart, stackEnd, stateAddress, stackSize, stackBeginning);
+        }
+        close(fds[1]);
+
+        Result result{};
+        std::vector<uint8_t> stack(stackSize);
+        const bool complete = readAll(fds[0], result.registers.data(), sizeof(result.registers)) &&
+                              readAll(fds[0], &result.flags, sizeof(result.flags)) &&
+                              readAll(fds[0], result.vectors.data(), sizeof(result.vectors)) &&
+                              readAll(fds[0], stack.data(), stack.size());
+        close(fds[0]);
+        int status{ 0 };
+        waitpid(pid, &status, 0);
+        if(!complete || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            return std::nullopt;
+        }
+        // The Stack keeps the highest address first
+        result.stack.assign(stack.rbegin(), stack.rend());
+        return result;
+#else
+        (void)source;
+        (void)stackSize;
+        (void)stackBeginning;
+        throw std::runtime_error("Running natively is only supported on x86-64 hosts other than Windows");
+#endif
+    }
+
+    std::optional<std::string> compare(const Source &source, size_t stackSize, bool useJit)
+    {
+        const uint64_t stackBeginning{ stackBase + stackSize - 8 };
+        Vm vm{ source, stackSize, stackBeginning };
+        vm.useJit(useJit);
+        vm.run();
+
+        const auto native = run(vm.source(), stackSize, stackBeginning);
+        if(!native)
+        {
+            return "The native code crashed or timed out";
+        }
+        for(size_t i = 0; i < generalPurposeRegisterCount; ++i)
+        {
+            const auto name = static_cast<RegisterName>(i);
+            if(vm.cpu().registerValue(name) != native->registers[i])
+            {
+                return fmt::format("{} is 0x{:x}, but 0x{:x} natively", toString(name), vm.cpu().registerValue(name),
+                                   native->registers[i]);
+            }
+        }
+        const auto hex = [](const Vector &vector) {
+            const auto &q = vector.qwords;
+            return fmt::format("0x{:016x}{:016x}{:016x}{:016x}", q[3], q[2], q[1], q[0]);
+        };
+        for(uint8_t i = 0; i < vectorRegisterCount; ++i)
+        {
+            if(vm.cpu().vectorValue(i) != native->vectors[i])
+            {
+                return fmt::format("ymm{} is {}, but {} natively", i, hex(vm.cpu().vectorValue(i)),
+                                   hex(native->vectors[i]));
+            }
+        }
+        const auto flags = vm.cpu().flags() & statusFlags;
+        if(flags != native->flags)
+        {
+            return fmt::format("The flags are 0x{:x}, but 0x{:x} natively", flags, native->flags);
+        }
+        const auto &stack = vm.stack().content();
+        const auto difference = std::mismatch(stack.begin(), stack.end(), native->stack.begin());
+        if(difference.first != stack.end())
+        {
+            const auto index = static_cast<uint64_t>(difference.first - stack.begin());
+            return fmt::format("The stack byte at 0x{:x} is 0x{:02x}, but 0x{:02x} natively",
+                               stackBeginning + 7 - index, *difference.first, *difference.second);
+        }
+        return std::nullopt;
+    }
+} // namespace ostrich::native
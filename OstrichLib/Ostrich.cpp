@@ -5,6 +5,7 @@ module;
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <variant>
 module Ostrich;
 
@@ -13,28 +14,7 @@ namespace ostrich
 {
     std::string toString(RegisterName registerName)
     {
-        switch(registerName)
-        {
-            using enum RegisterName;
-        case rax:
-            return "rax";
-        case rbx:
-            return "rbx";
-        case rcx:
-            return "rcx";
-        case rdx:
-            return "rdx";
-        case rsi:
-            return "rsi";
-        case rdi:
-            return "rdi";
-        case rbp:
-            return "rbp";
-        case rsp:
-            return "rsp";
-        }
-        static_assert(registerCount == 8, "Don't forget to update this!");
-        throw std::runtime_error("No such register");
+        return std::string{ descriptor(registerName).name };
     }
 
     std::ostream &operator<<(std::ostream &os, RegisterName registerName)
@@ -42,4 +22,78 @@ namespace ostrich
         os << toString(registerName);
         return os;
     }
+
+    std::string toString(SubRegister subRegister)
+    {
+        if(subRegister.width == Width::qword)
+        {
+            return toString(subRegister.registerName);
+        }
+        const auto name = descriptor(subRegister.registerName).parts[static_cast<size_t>(subRegister.width) - 1];
+        if(name.empty())
+        {
+            throw std::runtime_error(fmt::format("{} has no such part", toString(subRegister.registerName)));
+        }
+        return std::string{ name };
+    }
+
+    std::ostream &operator<<(std::ostream &os, SubRegister subRegister)
+    {
+        os << toString(subRegister);
+        return os;
+    }
+
+    std::optional<SubRegister> subRegisterFromString(std::string_view name)
+    {
+        for(const auto &d : registerDescriptors)
+        {
+            for(size_t i = 0; i < d.parts.size(); ++i)
+            {
+                if(!d.parts[i].empty() && d.parts[i] == name)
+                {
+                    return SubRegister{ d.registerName, static_cast<Width>(i + 1) };
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::optional<RegisterName> registerNameFromString(std::string_view name)
+    {
+        for(const auto &d : registerDescriptors)
+        {
+            if(d.name == name)
+            {
+                return d.registerName;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::string toString(VectorRegister vectorRegister)
+    {
+        return fmt::format("{}mm{}", vectorRegister.wide ? 'y' : 'x', vectorRegister.number);
+    }
+
+    std::ostream &operator<<(std::ostream &os, VectorRegister vectorRegister)
+    {
+        os << toString(vectorRegister);
+        return os;
+    }
+
+    std::optional<VectorRegister> vectorRegisterFromString(std::string_view name)
+    {
+        if(name.size() < 4 || (name[0] != 'x' && name[0] != 'y') || name.substr(1, 2) != "mm")
+        {
+            return std::nullopt;
+        }
+        for(uint8_t number = 0; number < vectorRegisterCount; ++number)
+        {
+            if(name.substr(3) == std::to_string(number))
+            {
+                return VectorRegister{ number, name[0] == 'y' };
+            }
+        }
+        return std::nullopt;
+    }
 } // namespace ostrich
\ No newline at end of file
@@ -3,10 +3,22 @@ module;
 #include <fmt/core.h>
 
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <deque>
 #include <filesystem>
+#include <istream>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <ostream>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 export module Ostrich;
@@ -14,8 +26,31 @@ export module Ostrich;
 namespace ostrich
 {
     // Registers
-    export enum class RegisterName { rax, rbx, rcx, rdx, rsi, rdi, rbp, rsp };
-    constexpr size_t registerCount{ 8 };
+    // rip is the index of the next instruction in the source, since the instructions aren't in
+    // memory. Instructions can't use it, only conditions can read it.
+    export enum class RegisterName
+    {
+        rax,
+        rbx,
+        rcx,
+        rdx,
+        rsi,
+        rdi,
+        rbp,
+        rsp,
+        r8,
+        r9,
+        r10,
+        r11,
+        r12,
+        r13,
+        r14,
+        r15,
+        rip
+    };
+    constexpr size_t registerCount{ 17 };
+    // The registers instructions can use, which are the ones before rip
+    constexpr size_t generalPurposeRegisterCount{ 16 };
     export std::string toString(RegisterName registerName);
     export std::ostream &operator<<(std::ostream &os, RegisterName registerName);
 
@@ -25,6 +60,126 @@ namespace ostrich
         uint64_t value;
     };
 
+    // How much of a register an operand is. Writing a dword zeroes the rest of the register, like
+    // on x86-64, while writing a word or a byte leaves it alone. highByte is ah, bh, ch and dh.
+    export enum class Width { qword, dword, word, byte, highByte };
+
+    constexpr unsigned bitCount(Width width)
+    {
+        switch(width)
+        {
+        case Width::qword:
+            return 64;
+        case Width::dword:
+            return 32;
+        case Width::word:
+            return 16;
+        case Width::byte:
+        case Width::highByte:
+            return 8;
+        }
+        return 64;
+    }
+
+    // A part of a register, like eax, ax, al or ah
+    export struct SubRegister
+    {
+        RegisterName registerName;
+        Width width;
+        bool operator==(const SubRegister &other) const = default;
+    };
+    export std::string toString(SubRegister subRegister);
+    export std::ostream &operator<<(std::ostream &os, SubRegister subRegister);
+    // nullopt if name isn't a sub-register, or if registerName doesn't have that part
+    std::optional<SubRegister> subRegisterFromString(std::string_view name);
+    std::optional<RegisterName> registerNameFromString(std::string_view name);
+
+    // Everything the parser, the printers, the encoder and the decoder need to know about a
+    // register. Adding a register is adding it here and to RegisterName.
+    struct RegisterDescriptor
+    {
+        RegisterName registerName;
+        std::string_view name;
+        // The names of the dword, word, byte and high byte, or empty if it doesn't have that part
+        std::array<std::string_view, 4> parts;
+        // What x86 numbers it in ModRM, SIB and REX, rip has no number
+        std::optional<uint8_t> number;
+    };
+
+    constexpr std::array<RegisterDescriptor, registerCount> registerDescriptors{ {
+    { RegisterName::rax, "rax", { "eax", "ax", "al", "ah" }, 0 },
+    { RegisterName::rbx, "rbx", { "ebx", "bx", "bl", "bh" }, 3 },
+    { RegisterName::rcx, "rcx", { "ecx", "cx", "cl", "ch" }, 1 },
+    { RegisterName::rdx, "rdx", { "edx", "dx", "dl", "dh" }, 2 },
+    { RegisterName::rsi, "rsi", { "esi", "si", "sil", "" }, 6 },
+    { RegisterName::rdi, "rdi", { "edi", "di", "dil", "" }, 7 },
+    { RegisterName::rbp, "rbp", { "ebp", "bp", "bpl", "" }, 5 },
+    { RegisterName::rsp, "rsp", { "esp", "sp", "spl", "" }, 4 },
+    { RegisterName::r8, "r8", { "r8d", "r8w", "r8b", "" }, 8 },
+    { RegisterName::r9, "r9", { "r9d", "r9w", "r9b", "" }, 9 },
+    { RegisterName::r10, "r10", { "r10d", "r10w", "r10b", "" }, 10 },
+    { RegisterName::r11, "r11", { "r11d", "r11w", "r11b", "" }, 11 },
+    { RegisterName::r12, "r12", { "r12d", "r12w", "r12b", "" }, 12 },
+    { RegisterName::r13, "r13", { "r13d", "r13w", "r13b", "" }, 13 },
+    { RegisterName::r14, "r14", { "r14d", "r14w", "r14b", "" }, 14 },
+    { RegisterName::r15, "r15", { "r15d", "r15w", "r15b", "" }, 15 },
+    { RegisterName::rip, "rip", {}, std::nullopt },
+    } };
+
+    constexpr bool inRegisterNameOrder()
+    {
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            if(static_cast<size_t>(registerDescriptors[i].registerName) != i)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(inRegisterNameOrder(), "registerDescriptors must be in RegisterName order");
+
+    constexpr const RegisterDescriptor &descriptor(RegisterName registerName)
+    {
+        return registerDescriptors[static_cast<size_t>(registerName)];
+    }
+
+    // The general purpose register with the given x86 number, 0 to 15
+    constexpr RegisterName registerWithNumber(uint8_t number)
+    {
+        for(const auto &d : registerDescriptors)
+        {
+            if(d.number == number)
+            {
+                return d.registerName;
+            }
+        }
+        throw std::logic_error("No register has that number");
+    }
+
+    // Vector registers
+    // xmm0 to xmm15 are the low halves of ymm0 to ymm15
+    constexpr size_t vectorRegisterCount{ 16 };
+
+    export struct VectorRegister
+    {
+        uint8_t number;
+        // ymm rather than xmm
+        bool wide{ false };
+        bool operator==(const VectorRegister &other) const = default;
+    };
+    export std::string toString(VectorRegister vectorRegister);
+    export std::ostream &operator<<(std::ostream &os, VectorRegister vectorRegister);
+    std::optional<VectorRegister> vectorRegisterFromString(std::string_view name);
+
+    // The value of a ymm register, with the lowest qword first like in memory. Aligned so the
+    // register file can be loaded and stored with aligned host instructions.
+    export struct alignas(32) Vector
+    {
+        std::array<uint64_t, 4> qwords{};
+        bool operator==(const Vector &other) const = default;
+    };
+
     // Memory address
     export enum class AdditiveOperator { plus, minus };
     export std::string toString(AdditiveOperator additiveOperator);
@@ -55,18 +210,28 @@ namespace ostrich
         return os;
     }
 
+    // The conditions of jcc, named by their suffix
+    export enum class ConditionCode { e, ne, b, ae, be, a, l, ge, le, g, s, ns, o, no, p, np };
+    export std::string toString(ConditionCode conditionCode);
+
     // Instructions
-    export using RegisterOrImmediateOrMemory = std::variant<RegisterName, uint64_t, MemoryAddress>;
+    // A SubRegister is only a source of instructions with a width other than qword, which is also
+    // the width memory sources are read with
+    export using RegisterOrImmediateOrMemory = std::variant<RegisterName, uint64_t, MemoryAddress, SubRegister>;
+    std::string toString(RegisterOrImmediateOrMemory r);
 
+    // Instructions with a width work on that part of their destination register
     export struct Inc
     {
         RegisterName registerName;
+        Width width{ Width::qword };
         std::string toString() const;
     };
 
     export struct Dec
     {
         RegisterName registerName;
+        Width width{ Width::qword };
         std::string toString() const;
     };
 
@@ -74,6 +239,7 @@ namespace ostrich
     {
         RegisterName destination;
         RegisterOrImmediateOrMemory source;
+        Width width{ Width::qword };
         std::string toString() const;
     };
 
@@ -93,11 +259,93 @@ namespace ostrich
     {
         RegisterName destination;
         RegisterOrImmediateOrMemory source;
+        Width width{ Width::qword };
         std::string toString() const;
     };
 
-    export using Instruction = std::variant<Inc, Dec, Add, Push, Pop, Mov>;
+    export struct Sub
+    {
+        RegisterName destination;
+        RegisterOrImmediateOrMemory source;
+        Width width{ Width::qword };
+        std::string toString() const;
+    };
+
+    // Sets the flags like sub, without storing the result
+    export struct Cmp
+    {
+        RegisterName destination;
+        RegisterOrImmediateOrMemory source;
+        Width width{ Width::qword };
+        std::string toString() const;
+    };
+
+    export struct Pushf
+    {
+        std::string toString() const;
+    };
+
+    // Marks the instruction after it as a jump target. Executing it does nothing.
+    export struct Label
+    {
+        std::string name;
+        std::string toString() const;
+        bool operator==(const Label &other) const = default;
+    };
+
+    // The target is the index of the label, filled in by parser::resolveLabels()
+    export struct Jmp
+    {
+        std::string label;
+        size_t target{ 0 };
+        std::string toString() const;
+        bool operator==(const Jmp &other) const = default;
+    };
+
+    export struct Jcc
+    {
+        ConditionCode conditionCode;
+        std::string label;
+        size_t target{ 0 };
+        std::string toString() const;
+        bool operator==(const Jcc &other) const = default;
+    };
+
+    export enum class PackedOperation { movdqa, movdqu, paddd, paddq, psubd, psubq, pand, por, pxor, addps, subps, mulps };
+    // The mnemonic of the legacy SSE form, the AVX form has a v in front
+    export std::string toString(PackedOperation operation);
+
+    // Whether the vex form has a first operand, which all but the moves do
+    export constexpr bool hasFirstOperand(PackedOperation operation)
+    {
+        return operation != PackedOperation::movdqa && operation != PackedOperation::movdqu;
+    }
+
+    // Memory is read as an xmmword or a ymmword, like the destination
+    export using VectorRegisterOrMemory = std::variant<VectorRegister, MemoryAddress>;
+
+    // Integer and float instructions on the lanes of xmm and ymm registers. They leave the flags
+    // alone. The legacy SSE form only works on xmm registers, and has the destination as its first
+    // operand. It leaves the upper half of the ymm register alone, and needs memory to be 16 byte
+    // aligned unless it is movdqu. The vex form is the AVX one, which has a separate first
+    // operand, zeroes the upper half when writing an xmm register, and only needs memory to be
+    // aligned for vmovdqa. Where there is no first operand, it is the destination.
+    export struct Packed
+    {
+        PackedOperation operation;
+        VectorRegister destination;
+        VectorRegister first;
+        VectorRegisterOrMemory source;
+        bool vex{ false };
+        std::string toString() const;
+        bool operator==(const Packed &other) const = default;
+    };
+
+    export using Instruction =
+    std::variant<Inc, Dec, Add, Push, Pop, Mov, Sub, Cmp, Pushf, Label, Jmp, Jcc, Packed>;
     export using Source = std::vector<Instruction>;
+    // The width of the instructions that have one, and qword for the others
+    Width operandWidth(const Instruction &instruction);
 
     export template <typename InstructionType>
     concept InstructionSingleRegister =
@@ -106,11 +354,26 @@ namespace ostrich
 
     export template <typename InstructionType>
     concept InstructionSourceDestination =
-    std::is_same_v<InstructionType, Mov> || std::is_same_v<InstructionType, Add>;
+    std::is_same_v<InstructionType, Mov> || std::is_same_v<InstructionType, Add> ||
+    std::is_same_v<InstructionType, Sub> || std::is_same_v<InstructionType, Cmp>;
+
+    export template <typename InstructionType>
+    concept InstructionNoOperands = std::is_same_v<InstructionType, Pushf>;
+
+    // Compared with their own operator==
+    export template <typename InstructionType>
+    concept InstructionControlFlow = std::is_same_v<InstructionType, Label> || std::is_same_v<InstructionType, Jmp> ||
+                                     std::is_same_v<InstructionType, Jcc>;
+
+    // Compared with its own operator==
+    export template <typename InstructionType>
+    concept InstructionPacked = std::is_same_v<InstructionType, Packed>;
 
     export template <typename InstructionType>
-    concept InstructionAny =
-    InstructionSingleRegister<InstructionType> || InstructionSourceDestination<InstructionType>;
+    concept InstructionAny = InstructionSingleRegister<InstructionType> ||
+                             InstructionSourceDestination<InstructionType> ||
+                             InstructionNoOperands<InstructionType> || InstructionControlFlow<InstructionType> ||
+                             InstructionPacked<InstructionType>;
 
     export template <InstructionAny LhsInstruction, InstructionAny RhsInstruction>
     bool operator==(const LhsInstruction &lhs, const RhsInstruction &rhs)
@@ -121,6 +384,11 @@ namespace ostrich
     export template <InstructionSingleRegister LhsInstruction, InstructionSingleRegister RhsInstruction>
     bool operator==(const LhsInstruction &lhs, const RhsInstruction &rhs)
     {
+        if constexpr(requires { lhs.width; rhs.width; })
+        {
+            return std::is_same_v<LhsInstruction, RhsInstruction> && lhs.registerName == rhs.registerName &&
+                   lhs.width == rhs.width;
+        }
         return std::is_same_v<LhsInstruction, RhsInstruction> && lhs.registerName == rhs.registerName;
     }
 
@@ -128,7 +396,13 @@ namespace ostrich
     bool operator==(const LhsInstruction &lhs, const RhsInstruction &rhs)
     {
         return std::is_same_v<LhsInstruction, RhsInstruction> && lhs.source == rhs.source &&
-               lhs.destination == rhs.destination;
+               lhs.destination == rhs.destination && lhs.width == rhs.width;
+    }
+
+    export template <InstructionNoOperands LhsInstruction, InstructionNoOperands RhsInstruction>
+    bool operator==(const LhsInstruction &lhs, const RhsInstruction &rhs)
+    {
+        return std::is_same_v<LhsInstruction, RhsInstruction>;
     }
 
     export template <InstructionAny I>
@@ -144,174 +418,1045 @@ namespace ostrich
         return os;
     }
 
+    // Watchpoints
+    export enum class WatchKind { read, write, change };
+    export std::string toString(WatchKind watchKind);
+
+    // Watches the qword at address
+    export struct Watchpoint
+    {
+        uint64_t address;
+        WatchKind kind;
+        std::string toString() const;
+    };
+
+    // The watchpoints of a Vm. The stack only calls into this when there are any, and most
+    // accesses are ruled out by a bitmap of which blocks of memory have a watchpoint.
+    class Watchpoints
+    {
+    public:
+        void add(Watchpoint watchpoint);
+        void remove(size_t number);
+        const std::vector<Watchpoint> &all() const;
+        bool empty() const;
+
+        void onLoad(uint64_t address);
+        // Bit i of changedBytes is set if the byte at address + i gets a new value
+        void onStore(uint64_t address, uint8_t changedBytes);
+        // Whether a watchpoint was hit since the last clearHit()
+        bool hit() const;
+        void clearHit();
+
+    private:
+        bool mightBeWatched(uint64_t address) const;
+        void updateBlocks();
+
+        static constexpr uint64_t blockBits{ 6 };
+        static constexpr size_t blockCount{ 1024 };
+        std::bitset<blockCount> m_blocks;
+        std::vector<Watchpoint> m_watchpoints;
+        bool m_hit{ false };
+    };
+
     // Stack
     export class Stack
     {
     public:
         Stack(uint64_t size, uint64_t beginning);
 
-        const std::vector<uint8_t> content() const;
+        const std::vector<uint8_t> &content() const;
         uint64_t beginning() const;
         void store(uint64_t address, uint64_t value);
         uint64_t load(uint64_t address) const;
+        // Whether a qword can be loaded from or stored to address
+        bool contains(uint64_t address) const;
+        // Loads and stores are reported to watchpoints, unless it is null. The Vm only sets them
+        // while it executes instructions.
+        void watch(Watchpoints *watchpoints);
+        // For compiled code, which does its own bounds checks and doesn't report to watchpoints
+        uint8_t *data();
 
     private:
         uint64_t m_size;
         uint64_t m_beginning;
         std::vector<uint8_t> m_content;
+        Watchpoints *m_watchpoints{ nullptr };
     };
 
+    // Breakpoints
+    export enum class ComparisonOperator { equal, notEqual, less, lessOrEqual, greater, greaterOrEqual };
+    export std::string toString(ComparisonOperator comparisonOperator);
+
+    // Like rax == 5 or [rsp + 8] > rbx. Values are compared unsigned.
+    export struct Condition
+    {
+        RegisterOrImmediateOrMemory lhs;
+        ComparisonOperator comparisonOperator;
+        RegisterOrImmediateOrMemory rhs;
+        std::string toString() const;
+    };
+
+    export bool operator==(const Condition &lhs, const Condition &rhs)
+    {
+        return lhs.lhs == rhs.lhs && lhs.comparisonOperator == rhs.comparisonOperator && lhs.rhs == rhs.rhs;
+    }
+
+    // Either the index of an instruction to stop before, or a condition to stop when it becomes true
+    export using Breakpoint = std::variant<size_t, Condition>;
+    export std::string toString(const Breakpoint &breakpoint);
+
+    // Flags
+    // Bits of rflags
+    export constexpr uint64_t carryFlag{ 1 << 0 };
+    export constexpr uint64_t parityFlag{ 1 << 2 };
+    export constexpr uint64_t auxiliaryCarryFlag{ 1 << 4 };
+    export constexpr uint64_t zeroFlag{ 1 << 6 };
+    export constexpr uint64_t signFlag{ 1 << 7 };
+    export constexpr uint64_t overflowFlag{ 1 << 11 };
+    // Bit 1 is always set
+    export constexpr uint64_t initialFlags{ 0x2 };
+
+    // The flags are only computed when they are read, from the operands of the last instruction
+    // that set them
+    enum class FlagOperation : uint64_t { none, add, sub, inc, dec };
+
+    // Superinstructions, which blocks use for pairs of instructions that are common enough to be
+    // worth one handler instead of two. Stepping still executes the instructions one at a time.
+    // push source, pop destination
+    struct PushPop
+    {
+        RegisterName source;
+        RegisterName destination;
+    };
+    // mov registerName, value, add destination, registerName
+    struct MovAdd
+    {
+        RegisterName registerName;
+        uint64_t value;
+        RegisterName destination;
+    };
+    // dec registerName, jcc target
+    struct DecJcc
+    {
+        RegisterName registerName;
+        ConditionCode conditionCode;
+        size_t target;
+    };
+    export class Cpu;
+    // Executes an instruction of one type, width and operand form. Cpu::handler() picks the one
+    // for an instruction.
+    using InstructionHandler = void (*)(Cpu &cpu, const Instruction &instruction);
+    struct Handled
+    {
+        const Instruction *instruction;
+        InstructionHandler handler;
+    };
+    // An instruction from the source, or a superinstruction replacing two of them. Instructions
+    // that have a handler are always Handled, so executing a block never looks at their width or
+    // at the form of their operands.
+    using Operation = std::variant<const Instruction *, PushPop, MovAdd, DecJcc, Handled>;
+
+    // What code compiled by the Jit works on. The Cpu copies its state in before running the code,
+    // and out again afterwards.
+    struct JitContext
+    {
+        std::array<uint64_t, registerCount> registers;
+        uint64_t flagOperation;
+        uint64_t flagLhs;
+        uint64_t flagRhs;
+        uint64_t flagResult;
+        uint64_t flags;
+        // The carry flag when the code was entered, or when it last looped back
+        uint64_t entryCarry;
+        uint8_t *memory;
+        uint64_t memoryBeginning;
+        uint64_t memorySize;
+        // The code loops while it has budget for another round, and counts the steps it executes
+        uint64_t budget;
+        uint64_t steps;
+        uint64_t nextInstruction;
+        // Set if the next instruction would throw, so the interpreter has to execute it
+        uint64_t fault;
+    };
+    using JitFunction = void (*)(JitContext *context);
+
     // Cpu
     export class Cpu
     {
     public:
-        Cpu(Stack &stack, Source &source);
+        // If handlers is set, step() uses the handler of the next instruction from it instead of
+        // picking one every time. It has to be rebuilt with handlers() whenever source changes.
+        Cpu(Stack &stack, Source &source, const std::vector<InstructionHandler> *handlers = nullptr);
         Cpu(Stack &stack, Source &source, size_t nextInstruction, std::array<Register, registerCount> registers);
+        // A copy of other running on a different stack, source and handlers, for copying states
+        Cpu(Stack &stack, Source &source, const std::vector<InstructionHandler> *handlers, const Cpu &other);
 
         void step();
+        // A jump goes to its target, other instructions leave the next instruction where it is
         void execute(const Instruction &instruction);
+        // Executes the operations of a block starting at first. Only the last one may be a jump.
+        void executeBlock(const std::vector<Operation> &operations, size_t first);
+        // For blocks to pick when they are built. Returns nullptr for instructions without a
+        // width or a source, like push and the jumps. The packed instructions all have one.
+        static InstructionHandler handler(const Instruction &instruction);
+        // The handler of each instruction of source
+        static std::vector<InstructionHandler> handlers(const Source &source);
+        // Runs a block compiled by the Jit with the given budget of steps, and returns how many
+        // steps it executed
+        uint64_t executeCompiled(JitFunction function, uint64_t budget);
         size_t nextInstruction() const;
         const std::array<Register, registerCount> registers() const;
+        uint64_t flags() const;
+        bool evaluate(ConditionCode conditionCode) const;
 
         const uint64_t &registerValue(RegisterName r) const;
+        uint64_t registerValue(SubRegister r) const;
         uint64_t memoryValue(const MemoryAddress &address) const;
         uint64_t loadEffectiveAddress(const MemoryAddress &address) const;
+        // The whole ymm register, of which the xmm register is the low half
+        const Vector &vectorValue(uint8_t number) const;
+        // False if the condition reads memory outside the stack
+        bool evaluate(const Condition &condition) const;
 
     private:
+        // Executes instruction and then continues at next, or at the target of a taken jump
+        void execute(const Instruction &instruction, size_t next);
+        // Like execute(), for instructions without a handler
+        void executeWithoutHandler(const Instruction &instruction, size_t next);
+        // Executes the operation at index, and returns the index of the one after it
+        size_t execute(const Operation &operation, size_t index);
         uint64_t &registerValue(RegisterName r);
-        uint64_t readValue(RegisterOrImmediateOrMemory r);
+        uint64_t readValue(RegisterOrImmediateOrMemory r) const;
+
+        // Form is the alternative of RegisterOrImmediateOrMemory the source is, or void for inc
+        // and dec
+        template <typename InstructionType, Width width, typename Form>
+        static void handle(Cpu &cpu, const Instruction &instruction);
+        template <typename InstructionType, Width width>
+        static InstructionHandler handlerFor(const InstructionType &instruction);
+        template <Width width, typename Form>
+        uint64_t readSource(const RegisterOrImmediateOrMemory &source) const;
+        // The packed instructions are picked by operation, encoding, size and operand form instead.
+        // Defined in Packed.cpp, together with the host vector code.
+        template <PackedOperation operation, bool vex, bool wide, typename Form>
+        static void handlePacked(Cpu &cpu, const Instruction &instruction);
+        static InstructionHandler packedHandler(const Packed &packed);
+        template <PackedOperation operation>
+        static InstructionHandler packedHandlerFor(const Packed &packed);
+        // Throws if address isn't aligned to alignment bytes, which is 1 for unaligned reads
+        Vector loadVector(const MemoryAddress &address, bool wide, uint64_t alignment) const;
+
+        void setFlags(FlagOperation operation, uint64_t lhs, uint64_t rhs, uint64_t result);
+        // Narrow instructions compute their flags right away, since the lazy flags are 64 bit
+        template <Width width>
+        void setNarrowFlags(FlagOperation operation, uint64_t lhs, uint64_t rhs, uint64_t result);
+        bool carry() const;
 
         Stack *m_stack;
         Source *m_source;
-        size_t m_nextInstruction{ 0 };
-        std::array<Register, registerCount> m_registers;
+        const std::vector<InstructionHandler> *m_handlers{ nullptr };
+        // Indexed by RegisterName, with the next instruction in rip. Sub-registers are read and
+        // written in place by the handlers, so every access is a plain index.
+        std::array<uint64_t, registerCount> m_registers{};
+        // Indexed by number. Vector is 32 byte aligned, so every register is too.
+        std::array<Vector, vectorRegisterCount> m_vectorRegisters{};
+        FlagOperation m_flagOperation{ FlagOperation::none };
+        uint64_t m_flagLhs{ 0 };
+        uint64_t m_flagRhs{ 0 };
+        uint64_t m_flagResult{ 0 };
+        // The flags when the operation is none, and the carry flag that inc and dec keep
+        uint64_t m_flags{ initialFlags };
+    };
+
+    // Translates basic blocks to x86-64 code that works directly on a JitContext, for hosts that
+    // are x86-64 themselves. A block that jumps back to its own start loops in the compiled code.
+    class Jit
+    {
+    public:
+        Jit() = default;
+        Jit(const Jit &) = delete;
+        Jit &operator=(const Jit &) = delete;
+        ~Jit();
+
+        static bool supported();
+        // Returns nullptr if the block has an instruction the Jit doesn't translate, or if there
+        // is no more room for code
+        JitFunction compile(const Source &source, size_t first, size_t last);
+        // Invalidates all the code compiled so far
+        void clear();
+        // If the host refuses to give us executable memory, nothing is compiled from then on, and
+        // the code compiled so far may no longer be executable
+        bool failed() const;
+
+    private:
+        static constexpr size_t capacity{ 1 << 20 };
+        uint8_t *m_code{ nullptr };
+        size_t m_used{ 0 };
+        bool m_failed{ false };
+    };
+
+    // The basic blocks of a source, built when first run and chained to the blocks that follow
+    // them, so that a run can execute a whole block at a time. Blocks end after a jump and before
+    // a label or an instruction with a breakpoint.
+    class BlockCache
+    {
+    public:
+        struct Block
+        {
+            size_t first;
+            // One past the last instruction
+            size_t last;
+            // The target of the jump at the end, if there is one
+            std::optional<size_t> target;
+            // The instructions, with common pairs fused
+            std::vector<Operation> operations;
+            Block *fallthrough{ nullptr };
+            Block *taken{ nullptr };
+            // Compiled once it has been executed jitThreshold times
+            size_t executions{ 0 };
+            JitFunction compiled{ nullptr };
+
+            size_t size() const;
+        };
+        static constexpr size_t jitThreshold{ 32 };
+
+        BlockCache() = default;
+        // Copies start out empty, since the blocks point to each other
+        BlockCache(const BlockCache &);
+        BlockCache &operator=(const BlockCache &);
+
+        // Keeps the blocks if they were built for the same source and breakpoints
+        void prepare(const Source &source, const std::vector<bool> &breakBefore);
+        // For when the source has been changed in place
+        void clear();
+        Block &at(size_t first);
+        // The block starting at next, which is where the program went after block
+        Block &successor(Block &block, size_t next);
+        // Counts an execution of block, and compiles it when it gets hot
+        void executed(Block &block);
+        void useJit(bool enabled);
+
+    private:
+        bool m_useJit{ Jit::supported() };
+        Jit m_jit;
+        const Source *m_source{ nullptr };
+        std::vector<bool> m_breakBefore;
+        std::vector<std::optional<Block>> m_blocks;
     };
 
+    // Parser
+    export namespace parser
+    {
+        export enum class ErrorCode {
+            emptyLine,
+            unknownInstruction,
+            expectedWord,
+            expectedRegister,
+            unknownRegister,
+            expectedQwordRegister,
+            instructionPointerOperand,
+            expectedVectorRegister,
+            expectedXmmRegister,
+            expectedInteger,
+            integerOutOfRange,
+            invalidImmediate,
+            immediateOutOfRange,
+            immediateTooWide,
+            expectedAdditiveOperator,
+            expectedOperand,
+            operandSizeMismatch,
+            expectedToken,
+            expectedComparisonOperator,
+            undefinedLabel,
+            duplicateLabel,
+            trailingInput
+        };
+
+        export struct Error
+        {
+            ErrorCode code;
+            // The remaining input where the error was found
+            std::string_view where;
+            // What was found or expected, depending on the code
+            std::string_view subject{};
+            // Set if the error was found while parsing the operands of an instruction
+            std::optional<std::string_view> operands{ std::nullopt };
+
+            // Only formatted on demand, errors are cheap until then
+            std::string message() const;
+        };
+
+        // Either a value or an Error, like std::expected
+        export template <typename T>
+        class [[nodiscard]] Result
+        {
+        public:
+            Result(T value) : m_value{ std::move(value) }
+            {
+            }
+
+            Result(Error error) : m_value{ std::move(error) }
+            {
+            }
+
+            bool has_value() const
+            {
+                return std::holds_alternative<T>(m_value);
+            }
+
+            explicit operator bool() const
+            {
+                return has_value();
+            }
+
+            const T &operator*() const
+            {
+                return std::get<T>(m_value);
+            }
+
+            const T *operator->() const
+            {
+                return &std::get<T>(m_value);
+            }
+
+            const Error &error() const
+            {
+                return std::get<Error>(m_value);
+            }
+
+        private:
+            std::variant<T, Error> m_value;
+        };
+
+        // The parsed value and the remaining input
+        export template <typename T>
+        using Parsed = Result<std::tuple<T, std::string_view>>;
+
+        // These never throw
+        export Parsed<RegisterName> tryParseRegister(const std::string_view &str);
+        export Parsed<MemoryAddress> tryParseMemoryAddress(const std::string_view &memoryAddress);
+        export Parsed<RegisterOrImmediateOrMemory> tryParseRegisterOrImmediateOrMemory(const std::string_view &str);
+        export Result<Instruction> tryParseInstruction(const std::string_view &sourceLine);
+        export Result<Condition> tryParseCondition(const std::string_view &condition);
+
+        // These throw std::runtime_error with Error::message()
+        export Instruction parseInstruction(const std::string_view &sourceLine);
+        export Condition parseCondition(const std::string_view &condition);
+        export std::tuple<MemoryAddress, std::string_view> parseMemoryAddress(const std::string_view &memoryAddress);
+        export Source parse(const std::string_view &sourceText);
+        export Source parse(const std::filesystem::path &sourcePath);
+        // Sets the target of every jump to the index of its label. Throws std::runtime_error if a
+        // label is missing or defined twice. parse() and Vm do this, so it is only needed for
+        // sources made some other way.
+        export void resolveLabels(Source &source);
+        // For a jump to a label in source, like one typed at the prompt
+        export Instruction resolveLabels(Instruction instruction, const Source &source);
+
+        export struct Diagnostic
+        {
+            // Both 1-based
+            size_t line;
+            size_t column;
+            ErrorCode code;
+            std::string message;
+        };
+
+        export struct ParseResult
+        {
+            // Lines with errors are left out
+            Source source;
+            std::vector<Diagnostic> diagnostics;
+        };
+
+        // Parses every line even if some of them fail, collecting a diagnostic for each failure.
+        // Doesn't throw on parse errors.
+        export ParseResult parseAll(const std::string_view &sourceText);
+        export ParseResult parseAll(const std::filesystem::path &sourcePath);
+
+        // Keeps the line hashes of the last parsed text, so that a new version of the text can be
+        // parsed by only parsing the lines that changed.
+        export class IncrementalParser
+        {
+        public:
+            // Updates source, which must be the result of the previous update, to reflect
+            // sourceText. Returns the index of the first instruction that changed, or nullopt if
+            // nothing did. If parsing fails, source is left untouched.
+            std::optional<size_t> update(const std::string_view &sourceText, Source &source);
+            std::optional<size_t> update(const std::filesystem::path &sourcePath, Source &source);
+
+        private:
+            std::vector<size_t> m_lineHashes;
+        };
+
+        // split_view is not implemented yet, so I stole https://www.bfilipek.com/2018/07/string-view-perf-followup.html
+        std::vector<std::string_view> split(const std::string_view &sourceLine, const char delimiter);
+    } // namespace parser
+
     // Vm
+    // How far a run has come
+    export struct Progress
+    {
+        uint64_t steps;
+        size_t nextInstruction;
+        std::array<uint64_t, registerCount> registers;
+    };
+
+    // Passes Progress from the thread doing a run to a thread showing it, without either of them
+    // ever waiting for the other. This is a seqlock: the sequence number is odd while publishing,
+    // and readers retry if it was odd or changed while they were reading.
+    export class ProgressChannel
+    {
+    public:
+        // Only one thread may publish
+        void publish(const Progress &progress);
+        Progress read() const;
+
+    private:
+        static constexpr size_t wordCount{ 2 + registerCount };
+        std::atomic<uint64_t> m_sequence{ 0 };
+        std::array<std::atomic<uint64_t>, wordCount> m_words{};
+    };
+
+    export struct Statistics
+    {
+        // Including instructions executed with execute()
+        uint64_t instructionsExecuted;
+        // Over the last Vm::statisticsWindow
+        double stepsPerSecond;
+        size_t historyStates;
+        // Memory used by the history, including the shared source
+        size_t historyBytes;
+        std::chrono::nanoseconds lastParseTime;
+    };
+
     export class Vm
     {
     public:
-        Vm(Source source, size_t stackSize);
+        // The stack starts at stackBeginning and grows down
+        Vm(Source source, size_t stackSize, uint64_t stackBeginning = stackTop);
+        // Copies get their own source, since reloading a file changes it in place
+        Vm(const Vm &other);
+        Vm(Vm &&other) = default;
+        Vm &operator=(const Vm &other);
+        Vm &operator=(Vm &&other) = default;
 
         void load(Source source);
+        // Reloading the same .asm file only parses the lines that changed, and keeps the history
+        // up to the first state that is about to execute a changed instruction or to start a run.
+        // Binary programs and ELF executables are loaded from scratch.
+        void load(const std::filesystem::path &sourcePath);
         void step();
         void execute(const Instruction &instruction);
         void restorePreviousState();
+        // Goes back one instruction, where restorePreviousState() goes back over a whole run. Going
+        // back into a run replays it from the state it started at. Throws if the run failed, since
+        // then it can't be replayed.
+        void stepBack();
+
+        enum class StopReason { breakpoint, watchpoint, end, stepLimit, interrupted };
+        // Executes instructions until a breakpoint is hit, the program ends, maxSteps instructions
+        // have been executed or interrupt is set. A breakpoint on the first instruction is passed,
+        // so run can continue from where it last stopped. Only the state before the run is saved,
+        // so one restorePreviousState() undoes the whole run. If progress is set, it is updated
+        // every progressInterval steps and when the run stops.
+        StopReason run(size_t maxSteps = std::numeric_limits<size_t>::max(),
+                       const std::atomic<bool> *interrupt = nullptr, ProgressChannel *progress = nullptr);
+        // Steps back until the next instruction has an instruction breakpoint, the start of the
+        // history or interrupt is set. Throws like stepBack().
+        StopReason runBack(const std::atomic<bool> *interrupt = nullptr);
+        static constexpr size_t progressInterval{ 4096 };
+        void addBreakpoint(Breakpoint breakpoint);
+        void removeBreakpoint(size_t number);
+        const std::vector<Breakpoint> &breakpoints() const;
+        // Watchpoints stop run() after the instruction that hit them
+        void addWatchpoint(Watchpoint watchpoint);
+        void removeWatchpoint(size_t number);
+        const std::vector<Watchpoint> &watchpoints() const;
+        // Runs compile hot blocks to native code when the host supports it, unless this is turned
+        // off. If the host refuses executable memory, runs go on in the interpreter. Stepping
+        // always uses the interpreter.
+        void useJit(bool enabled);
+
+        Statistics statistics() const;
+        // The number of states that can be restored
+        size_t historyDepth() const;
+        static constexpr std::chrono::seconds statisticsWindow{ 5 };
+
         const Cpu &cpu() const;
         const Stack &stack() const;
         const Source &source() const;
+        // The .asm file the source was parsed from, empty if it wasn't
+        const std::filesystem::path &sourcePath() const;
 
         // TODO make this private and members private and declare swap a friend. Blocked by msvc issue:
         // https://developercommunity.visualstudio.com/content/problem/1191747/friends-declared-in-nested-classes-dont-work-with.html
         class State
         {
         public:
-            State(Source source, size_t stackSize);
+            State(Source source, size_t stackSize, uint64_t stackBeginning);
             State(const State &other);
+            // A copy of other that uses source and handlers instead
+            State(const State &other, std::shared_ptr<Source> source,
+                  std::shared_ptr<std::vector<InstructionHandler>> handlers);
             State &operator=(State other) noexcept;
 
             Stack m_stack;
-            Source m_source;
-            Cpu m_cpu{ m_stack, m_source };
+            // Shared by all states in the history of one Vm, only that Vm modifies it
+            std::shared_ptr<Source> m_source;
+            // The handlers of m_source, shared and updated the same way
+            std::shared_ptr<std::vector<InstructionHandler>> m_handlers;
+            Cpu m_cpu{ m_stack, *m_source, m_handlers.get() };
+            // Reached by run() rather than by a single instruction, so the previous state may have
+            // executed any of the instructions to get here
+            bool m_afterRun{ false };
+            // The number of instructions the run executed, unknown if it threw
+            std::optional<size_t> m_runSteps;
         };
 
     private:
         State &state();
         const State &state() const;
         void saveState();
+        void countInstructions(uint64_t count);
+        size_t runSteps() const;
+        // Saves a state that is steps instructions on from the current one, as if run() got there
+        void replay(size_t steps);
+        void truncateHistory(size_t firstChangedInstruction);
 
         static constexpr uint64_t stackTop{ 0xffff };
         std::vector<State> m_states;
+        std::filesystem::path m_sourcePath;
+        parser::IncrementalParser m_parser;
+        std::vector<Breakpoint> m_breakpoints;
+        Watchpoints m_watchpoints;
+        BlockCache m_blockCache;
+
+        struct Sample
+        {
+            std::chrono::steady_clock::time_point time;
+            uint64_t instructionsExecuted;
+        };
+        static constexpr std::chrono::milliseconds sampleInterval{ 100 };
+        uint64_t m_instructionsExecuted{ 0 };
+        // Spanning at least statisticsWindow, for the steps per second, about sampleInterval apart
+        std::deque<Sample> m_samples;
+        std::chrono::nanoseconds m_lastParseTime{ 0 };
     };
 
     void swap(Vm::State &lhs, Vm::State &rhs) noexcept;
 
     // UI
+    // A frame of characters, drawn by only sending the terminal the cells that changed since the
+    // previous frame
+    export class Screen
+    {
+    public:
+        Screen(size_t width, size_t height);
+
+        void clear();
+        // Text that doesn't fit is cut off
+        void write(size_t row, size_t column, std::string_view text);
+        // Returns what to send to the terminal to turn the previous frame into this one
+        std::string present();
+        // Makes the next present() redraw everything, for when something else has written to the
+        // terminal
+        void invalidate();
+
+    private:
+        size_t m_width;
+        size_t m_height;
+        std::vector<char> m_current;
+        std::vector<char> m_previous;
+        bool m_valid{ false };
+    };
+
+    // A window onto the stack with one qword per row, highest address first. Only the visible
+    // rows are formatted, so drawing doesn't get slower with a bigger stack.
+    export class StackView
+    {
+    public:
+        explicit StackView(size_t height);
+
+        // In follow mode the window scrolls to keep the stack pointer visible
+        std::vector<std::string> render(const Stack &stack, uint64_t stackPointer);
+        void pageUp();
+        void pageDown();
+        void follow();
+        bool following() const;
+
+    private:
+        size_t m_height;
+        size_t m_firstRow{ 0 };
+        bool m_following{ true };
+    };
+
+    // A window onto the source with the next instruction in the middle. The disassembly of each
+    // line is cached, and only redone if the instruction on that line changed.
+    export class SourceView
+    {
+    public:
+        explicit SourceView(size_t height);
+
+        std::vector<std::string> render(const Source &source, size_t nextInstruction);
+
+    private:
+        struct Line
+        {
+            Instruction instruction;
+            std::string text;
+        };
+
+        const std::string &disassembly(const Source &source, size_t index);
+
+        size_t m_height;
+        std::vector<std::optional<Line>> m_lines;
+    };
+
     export class UI
     {
     public:
         UI(size_t widht, size_t height, Vm &vm);
-        void render() const;
+        void render();
         void mainLoop();
 
     private:
-        void render_register(const std::string &name, uint64_t value, char *buf) const;
+        void render_register(const std::string &name, uint64_t value, size_t row);
+        void render_progress(const Progress &progress, double stepsPerSecond);
+        void render_statistics(size_t row);
+        void run(size_t maxSteps);
 
         size_t m_width;
         size_t m_height;
         Vm &m_vm;
+        Screen m_screen;
+        SourceView m_sourceView;
+        StackView m_stackView;
+        // Shown in front of the prompt until the next command
+        std::string m_status;
     };
 
-    // Parser
-    export namespace parser
+    // Everything about the current state of a Vm, for tools outside of Ostrich
+    export struct StateDump
     {
-        export Instruction parseInstruction(const std::string_view &sourceLine);
-        export std::tuple<MemoryAddress, std::string_view> parseMemoryAddress(const std::string_view &memoryAddress);
-        export Source parse(const std::string_view &sourceText);
-        export Source parse(const std::filesystem::path &sourcePath);
-        // split_view is not implemented yet, so I stole https://www.bfilipek.com/2018/07/string-view-perf-followup.html
-        std::vector<std::string_view> split(const std::string_view &sourceLine, const char delimiter);
-    } // namespace parser
+        size_t nextInstruction;
+        size_t historyDepth;
+        // Indexed by RegisterName
+        std::array<uint64_t, registerCount> registers;
+        uint64_t flags;
+        // Indexed by number
+        std::array<Vector, vectorRegisterCount> vectors;
+        // The lowest address of the stack, and its content from there and up
+        uint64_t memoryAddress;
+        std::vector<uint8_t> memory;
+
+        static StateDump of(const Vm &vm);
+        // One line, with the vector registers and the memory as hex strings of their bytes
+        std::string toJson() const;
+        // Little endian: magic "OSTRDUMP", u32 version, u32 register count, u32 vector register
+        // count, u64 nextInstruction, u64 historyDepth, u64 per register, u64 flags, 4 u64 per
+        // vector register, u64 memoryAddress, u64 memory size, memory
+        std::vector<uint8_t> toBinary() const;
+        static StateDump fromBinary(std::span<const uint8_t> data);
+        // JSON if the extension is .json, binary otherwise
+        void save(const std::filesystem::path &path) const;
+
+        bool operator==(const StateDump &other) const = default;
+    };
+
+    // Parts of StateDump::toJson(), without the surrounding braces
+    std::string cpuJson(const StateDump &dump);
+    std::string memoryJson(const StateDump &dump);
+
+    // Runs debugger commands without rendering anything, for scripts and test farms. Output is
+    // JSON, one object per line. Use next rather than step for long runs, since every step is
+    // saved in the history.
+    export class Batch
+    {
+    public:
+        Batch(Vm &vm, std::ostream &output);
+
+        // Returns false if the command was quit. Throws on errors.
+        bool execute(const std::string_view &command);
+        // Runs commands until the end of input or quit. Empty lines and lines starting with # are
+        // skipped.
+        void run(std::istream &input);
+
+    private:
+        Vm &m_vm;
+        std::ostream &m_output;
+    };
+
+    // Lets gdb debug the program in a Vm over the gdb remote serial protocol. Code addresses are
+    // instruction indexes, so rip is the next instruction. Registers are in the order gdb uses for
+    // x86-64, connect with "set architecture i386:x86-64" and "target remote localhost:<port>".
+    // Reverse stepping and continuing go back through the Vm history, replaying runs to go back
+    // into them.
+    export class GdbStub
+    {
+    public:
+        explicit GdbStub(Vm &vm);
+
+        // Waits for gdb to connect to localhost:port, and serves it until it detaches, kills or
+        // disconnects
+        void serve(uint16_t port);
+        // Takes the payload of a packet and returns the payload of the reply
+        std::string handle(std::string_view packet);
+        // Adds the $ and checksum
+        static std::string frame(std::string_view payload);
+
+    private:
+        std::string readRegisters() const;
+        std::string readRegister(size_t number) const;
+        bool writeRegister(size_t number, uint64_t value);
+        std::string readMemory(uint64_t address, size_t length) const;
+        std::string reverseContinue();
+
+        Vm &m_vm;
+        std::atomic<bool> m_interrupt{ false };
+        bool m_noAck{ false };
+        bool m_done{ false };
+    };
+
+    // Binary program format
+    export namespace binary
+    {
+        export constexpr uint16_t formatVersion{ 2 };
+        export std::vector<uint8_t> serialize(const Source &source, const std::string &sourceName = "");
+        export Source deserialize(std::span<const uint8_t> data);
+        // sourceName is what errors in the saved program refer to, the name of path if empty
+        export void save(const Source &source, const std::filesystem::path &path, const std::string &sourceName = "");
+        export Source load(const std::filesystem::path &path);
+        export bool isBinary(const std::filesystem::path &path);
+    } // namespace binary
+
+    // x86-64 machine code
+    // Decodes the part of x86-64 that Ostrich has instructions for, which is 64 bit operations on
+    // the registers it has, plus mov of a 32 bit immediate since that zero extends. Anything else
+    // throws std::runtime_error.
+    export namespace decoder
+    {
+        export struct Decoded
+        {
+            Instruction instruction;
+            // In bytes
+            size_t length;
+        };
+
+        // The name of the label decoded jumps to address go to
+        export std::string labelName(uint64_t address);
+        // Decodes the instruction at the start of code, which is at address. Jumps get the
+        // address they go to as their target.
+        export Decoded decode(std::span<const uint8_t> code, uint64_t address);
+        // Decodes all of code, with a label before every instruction that is jumped to, and the
+        // jumps resolved to those labels
+        export Source decodeAll(std::span<const uint8_t> code, uint64_t address);
+
+        // Decodes each instruction of code once, the first time the instruction at its address
+        // is asked for
+        export class DecodeCache
+        {
+        public:
+            DecodeCache(std::span<const uint8_t> code, uint64_t address);
+            const Decoded &at(uint64_t address);
+            // For when the code has changed
+            void invalidate();
+            // The number of decoded instructions
+            size_t size() const;
+
+        private:
+            std::span<const uint8_t> m_code;
+            uint64_t m_address;
+            std::unordered_map<uint64_t, Decoded> m_decoded;
+        };
+
+        // Like decodeAll, but only decodes what can be reached from entry by following jumps,
+        // so padding and data between functions is skipped. The source starts at entry. Ostrich
+        // has no kernel, so a syscall or hlt ends the program, like reaching the end of code does.
+        export Source decodeReachable(std::span<const uint8_t> code, uint64_t address, uint64_t entry);
+    } // namespace decoder
+
+    export namespace encoder
+    {
+        // Encodes source as x86-64 code that does what the Cpu does, to run natively. Labels take
+        // no space, and jumps to the end of the source go to the end of the code. Push and pop
+        // become a mov and a lea, since the Cpu stores at rsp before decrementing it. Throws
+        // std::runtime_error for what x86-64 can't encode, like add with a 64 bit immediate or
+        // subtracting an index.
+        export std::vector<uint8_t> encode(const Source &source);
+    } // namespace encoder
+
+    // Memory mapped file, read only
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::filesystem::path &path);
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        ~MappedFile();
+
+        std::span<const uint8_t> data() const;
+
+    private:
+        const uint8_t *m_data{ nullptr };
+        size_t m_size{ 0 };
+#ifdef _WIN32
+        void *m_file{ nullptr };
+        void *m_mapping{ nullptr };
+#endif
+    };
+
+    // ELF executables
+    // Reads statically linked x86-64 executables. The file is memory mapped and the segments are
+    // views into the mapping, so opening a big executable costs no more than opening a small one.
+    export namespace elf
+    {
+        export struct Segment
+        {
+            uint64_t address;
+            // The rest of the segment after data is zero filled, like .bss
+            uint64_t memorySize;
+            bool writable;
+            bool executable;
+            std::span<const uint8_t> data;
+        };
+
+        export class Executable
+        {
+        public:
+            explicit Executable(const std::filesystem::path &path);
+
+            uint64_t entry() const;
+            // The loadable segments
+            const std::vector<Segment> &segments() const;
+            // Decodes the code in the segment with the entry point that can be reached from the
+            // entry point, so the program starts at the first instruction
+            Source decode() const;
+
+        private:
+            MappedFile m_file;
+            uint64_t m_entry{ 0 };
+            std::vector<Segment> m_segments;
+        };
+
+        export bool isElf(const std::filesystem::path &path);
+    } // namespace elf
+
+    // Running programs natively, to check the Cpu against the real thing
+    export namespace native
+    {
+        export constexpr uint64_t statusFlags{ carryFlag | parityFlag | auxiliaryCarryFlag | zeroFlag | signFlag |
+                                               overflowFlag };
+
+        export struct Result
+        {
+            // In RegisterName order, without rip
+            std::array<uint64_t, generalPurposeRegisterCount> registers;
+            // Only the statusFlags, since the Cpu doesn't have the others
+            uint64_t flags;
+            // Indexed by number. Only the xmm halves are run natively on hosts without avx.
+            std::array<Vector, vectorRegisterCount> vectors;
+            // Laid out like Stack::content
+            std::vector<uint8_t> stack;
+        };
+
+        // Running natively needs an x86-64 host, and isn't implemented for Windows
+        export bool supported();
+        // Whether the host can run the vex forms on ymm registers, which needs avx2 for the
+        // integer ones
+        export bool supportsAvx2();
+        // Encodes source and runs it in a child process, with the registers, vector registers and
+        // stack zeroed except rsp, which is stackBeginning. The stack is mapped at the same addresses as a
+        // Stack of stackSize bytes starting at stackBeginning. Returns nullopt if the code crashed
+        // or ran for more than a second.
+        export std::optional<Result> run(const Source &source, size_t stackSize, uint64_t stackBeginning);
+        // Runs source to the end in a Vm and natively, and describes the first difference in the
+        // registers, vector registers, status flags or stack. Throws if the Vm throws. Pushf is never the same,
+        // since the Cpu doesn't have the interrupt flag.
+        export std::optional<std::string> compare(const Source &source, size_t stackSize, bool useJit = true);
+    } // namespace native
 
     // Tokenizer
+    // Token values are views into the tokenized input, so the input must outlive the tokens
     export namespace tokenizer
     {
         export struct Word
         {
             static constexpr const char *tokenName = "Word";
-            std::string value;
+            std::string_view value;
         };
 
         export struct Number
         {
             static constexpr const char *tokenName = "Number";
-            std::string value;
+            std::string_view value;
         };
 
         export struct Comma
         {
             static constexpr const char *tokenName = "Comma";
-            std::string value{ "," };
+            std::string_view value{ "," };
         };
 
         export struct ArithmeticOperator
         {
             static constexpr const char *tokenName = "ArithmeticOperator";
-            std::string value;
+            std::string_view value;
         };
 
         export struct LeftBracket
         {
             static constexpr const char *tokenName = "LeftBracket";
-            std::string value{ "[" };
+            std::string_view value{ "[" };
         };
 
         export struct RightBracket
         {
             static constexpr const char *tokenName = "RightBracket";
-            std::string value{ "]" };
+            std::string_view value{ "]" };
         };
 
         export struct LeftParenthesis
         {
             static constexpr const char *tokenName = "LeftParenthesis";
-            std::string value{ "(" };
+            std::string_view value{ "(" };
         };
 
         export struct RightParenthesis
         {
             static constexpr const char *tokenName = "RightParenthesis";
-            std::string value{ ")" };
+            std::string_view value{ ")" };
+        };
+
+        export struct Colon
+        {
+            static constexpr const char *tokenName = "Colon";
+            std::string_view value{ ":" };
+        };
+
+        // ==, !=, <, <=, > or >=
+        export struct ComparisonOperator
+        {
+            static constexpr const char *tokenName = "ComparisonOperator";
+            std::string_view value;
         };
 
-        export using Token =
-        std::variant<Word, Number, Comma, ArithmeticOperator, LeftBracket, RightBracket, LeftParenthesis, RightParenthesis>;
+        // A character that doesn't start any other token
+        export struct Unknown
+        {
+            static constexpr const char *tokenName = "Unknown";
+            std::string_view value;
+        };
+
+        export using Token = std::variant<Word, Number, Comma, ArithmeticOperator, LeftBracket, RightBracket,
+                                          LeftParenthesis, RightParenthesis, Colon, ComparisonOperator, Unknown>;
 
         export template <typename T>
         concept TokenAny = std::is_same_v<T, Word> || std::is_same_v<T, Number> ||
                            std::is_same_v<T, Comma> || std::is_same_v<T, ArithmeticOperator> ||
                            std::is_same_v<T, LeftBracket> || std::is_same_v<T, RightBracket> ||
-                           std::is_same_v<T, LeftParenthesis> || std::is_same_v<T, RightParenthesis>;
+                           std::is_same_v<T, LeftParenthesis> || std::is_same_v<T, RightParenthesis> ||
+                           std::is_same_v<T, Colon> || std::is_same_v<T, ComparisonOperator> ||
+                           std::is_same_v<T, Unknown>;
 
         export template <TokenAny T>
         std::ostream &operator<<(std::ostream &os, const T &w)
@@ -326,6 +1471,20 @@ namespace ostrich
             return std::is_same_v<LhsToken, RhsToken> && lhs.value == rhs.value;
         }
 
+        export std::string_view value(const Token &token);
+
+        // Produces one token at a time, without allocating
+        export class Lexer
+        {
+        public:
+            explicit Lexer(std::string_view input);
+            // Returns nullopt at the end of the input
+            std::optional<Token> next();
+
+        private:
+            std::string_view m_input;
+        };
+
         export std::vector<Token> tokenize(std::string_view input);
     } // namespace tokenizer
 } // namespace ostrich
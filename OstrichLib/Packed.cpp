@@ -0,0 +1,297 @@
+module;
+
+#include <fmt/core.h>
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <variant>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define OSTRICH_SSE2
+#include <emmintrin.h>
+#endif
+module Ostrich;
+
+namespace ostrich
+{
+    namespace
+    {
+        // A ymm register is worked on a 128 bit half at a time. On x86-64 a half is a host SSE2
+        // register, so a guest instruction is one host instruction for xmm and two for ymm. Other
+        // hosts do it a lane at a time.
+#ifdef OSTRICH_SSE2
+        using Half = __m128i;
+
+        // qwords must be 16 byte aligned
+        Half loadHalf(const uint64_t *qwords)
+        {
+            return _mm_load_si128(reinterpret_cast<const __m128i *>(qwords));
+        }
+
+        void storeHalf(uint64_t *qwords, Half value)
+        {
+            _mm_store_si128(reinterpret_cast<__m128i *>(qwords), value);
+        }
+
+        template <PackedOperation operation>
+        Half apply(Half lhs, Half rhs)
+        {
+            using enum PackedOperation;
+            const auto floats = [](Half value) { return _mm_castsi128_ps(value); };
+            if constexpr(operation == movdqa || operation == movdqu)
+            {
+                return rhs;
+            }
+            else if constexpr(operation == paddd)
+            {
+                return _mm_add_epi32(lhs, rhs);
+            }
+            else if constexpr(operation == paddq)
+            {
+                return _mm_add_epi64(lhs, rhs);
+            }
+            else if constexpr(operation == psubd)
+            {
+                return _mm_sub_epi32(lhs, rhs);
+            }
+            else if constexpr(operation == psubq)
+            {
+                return _mm_sub_epi64(lhs, rhs);
+            }
+            else if constexpr(operation == pand)
+            {
+                return _mm_and_si128(lhs, rhs);
+            }
+            else if constexpr(operation == por)
+            {
+                return _mm_or_si128(lhs, rhs);
+            }
+            else if constexpr(operation == pxor)
+            {
+                return _mm_xor_si128(lhs, rhs);
+            }
+            else if constexpr(operation == addps)
+            {
+                return _mm_castps_si128(_mm_add_ps(floats(lhs), floats(rhs)));
+            }
+            else if constexpr(operation == subps)
+            {
+                return _mm_castps_si128(_mm_sub_ps(floats(lhs), floats(rhs)));
+            }
+            else
+            {
+                static_assert(operation == mulps);
+                return _mm_castps_si128(_mm_mul_ps(floats(lhs), floats(rhs)));
+            }
+        }
+#else
+        using Half = std::array<uint64_t, 2>;
+
+        Half loadHalf(const uint64_t *qwords)
+        {
+            return { qwords[0], qwords[1] };
+        }
+
+        void storeHalf(uint64_t *qwords, Half value)
+        {
+            qwords[0] = value[0];
+            qwords[1] = value[1];
+        }
+
+        template <typename Operation>
+        Half qwords(Half lhs, Half rhs, Operation operation)
+        {
+            return { operation(lhs[0], rhs[0]), operation(lhs[1], rhs[1]) };
+        }
+
+        template <typename Operation>
+        Half dwords(Half lhs, Half rhs, Operation operation)
+        {
+            Half result{};
+            for(size_t i = 0; i < 4; ++i)
+            {
+                const auto shift = i % 2 * 32;
+                const auto lane = operation(static_cast<uint32_t>(lhs[i / 2] >> shift),
+                                            static_cast<uint32_t>(rhs[i / 2] >> shift));
+                result[i / 2] |= uint64_t{ static_cast<uint32_t>(lane) } << shift;
+            }
+            return result;
+        }
+
+        template <typename Operation>
+        Half floats(Half lhs, Half rhs, Operation operation)
+        {
+            return dwords(lhs, rhs, [&](uint32_t l, uint32_t r) {
+                return std::bit_cast<uint32_t>(operation(std::bit_cast<float>(l), std::bit_cast<float>(r)));
+            });
+        }
+
+        template <PackedOperation operation>
+        Half apply(Half lhs, Half rhs)
+        {
+            using enum PackedOperation;
+            if constexpr(operation == movdqa || operation == movdqu)
+            {
+                return rhs;
+            }
+            else if constexpr(operation == paddd)
+            {
+                return dwords(lhs, rhs, [](uint32_t l, uint32_t r) { return l + r; });
+            }
+            else if constexpr(operation == paddq)
+            {
+                return qwords(lhs, rhs, [](uint64_t l, uint64_t r) { return l + r; });
+            }
+            else if constexpr(operation == psubd)
+            {
+                return dwords(lhs, rhs, [](uint32_t l, uint32_t r) { return l - r; });
+            }
+            else if constexpr(operation == psubq)
+            {
+                return qwords(lhs, rhs, [](uint64_t l, uint64_t r) { return l - r; });
+            }
+            else if constexpr(operation == pand)
+            {
+                return qwords(lhs, rhs, [](uint64_t l, uint64_t r) { return l & r; });
+            }
+            else if constexpr(operation == por)
+            {
+                return qwords(lhs, rhs, [](uint64_t l, uint64_t r) { return l | r; });
+            }
+            else if constexpr(operation == pxor)
+            {
+                return qwords(lhs, rhs, [](uint64_t l, uint64_t r) { return l ^ r; });
+            }
+            else if constexpr(operation == addps)
+            {
+                return floats(lhs, rhs, [](float l, float r) { return l + r; });
+            }
+            else if constexpr(operation == subps)
+            {
+                return floats(lhs, rhs, [](float l, float r) { return l - r; });
+            }
+            else
+            {
+                static_assert(operation == mulps);
+                return floats(lhs, rhs, [](float l, float r) { return l * r; });
+            }
+        }
+#endif
+
+        // The legacy SSE forms fault on memory that isn't 16 byte aligned, except movdqu. Of the
+        // vex forms only vmovdqa does, on memory that isn't aligned to its size.
+        template <PackedOperation operation, bool vex, bool wide>
+        constexpr uint64_t alignment{ operation == PackedOperation::movdqa ? (wide ? 32 : 16)
+                                      : vex || operation == PackedOperation::movdqu ? 1
+                                                                                    : 16 };
+    } // namespace
+
+    template <PackedOperation operation, bool vex, bool wide, typename Form>
+    void Cpu::handlePacked(Cpu &cpu, const Instruction &instruction)
+    {
+        const auto &packed = *std::get_if<Packed>(&instruction);
+        Vector loaded;
+        const Vector *source{ &loaded };
+        if constexpr(std::is_same_v<Form, MemoryAddress>)
+        {
+            loaded = cpu.loadVector(*std::get_if<MemoryAddress>(&packed.source), wide,
+                                    alignment<operation, vex, wide>);
+        }
+        else
+        {
+            source = &cpu.m_vectorRegisters[std::get_if<VectorRegister>(&packed.source)->number];
+        }
+        const auto &first = cpu.m_vectorRegisters[packed.first.number].qwords;
+        auto &destination = cpu.m_vectorRegisters[packed.destination.number].qwords;
+        storeHalf(destination.data(), apply<operation>(loadHalf(first.data()), loadHalf(source->qwords.data())));
+        if constexpr(wide)
+        {
+            storeHalf(destination.data() + 2,
+                      apply<operation>(loadHalf(first.data() + 2), loadHalf(source->qwords.data() + 2)));
+        }
+        else if constexpr(vex)
+        {
+            destination[2] = 0;
+            destination[3] = 0;
+        }
+    }
+
+    // The legacy forms can't have ymm registers, so they always work on xmm
+    template <PackedOperation operation>
+    InstructionHandler Cpu::packedHandlerFor(const Packed &packed)
+    {
+        const auto withEncoding = [&packed]<bool vex, bool wide>() {
+            return std::visit([]<typename Form>(const Form &) -> InstructionHandler {
+                return &handlePacked<operation, vex, wide, Form>;
+            },
+                              packed.source);
+        };
+        if(!packed.vex)
+        {
+            return withEncoding.template operator()<false, false>();
+        }
+        if(packed.destination.wide)
+        {
+            return withEncoding.template operator()<true, true>();
+        }
+        return withEncoding.template operator()<true, false>();
+    }
+
+    InstructionHandler Cpu::packedHandler(const Packed &packed)
+    {
+        using enum PackedOperation;
+        switch(packed.operation)
+        {
+        case movdqa:
+            return packedHandlerFor<movdqa>(packed);
+        case movdqu:
+            return packedHandlerFor<movdqu>(packed);
+        case paddd:
+            return packedHandlerFor<paddd>(packed);
+        case paddq:
+            return packedHandlerFor<paddq>(packed);
+        case psubd:
+            return packedHandlerFor<psubd>(packed);
+        case psubq:
+            return packedHandlerFor<psubq>(packed);
+        case pand:
+            return packedHandlerFor<pand>(packed);
+        case por:
+            return packedHandlerFor<por>(packed);
+        case pxor:
+            return packedHandlerFor<pxor>(packed);
+        case addps:
+            return packedHandlerFor<addps>(packed);
+        case subps:
+            return packedHandlerFor<subps>(packed);
+        case mulps:
+            return packedHandlerFor<mulps>(packed);
+        }
+        return nullptr;
+    }
+
+    Vector Cpu::loadVector(const MemoryAddress &address, bool wide, uint64_t alignment) const
+    {
+        const auto effectiveAddress = loadEffectiveAddress(address);
+        if(effectiveAddress % alignment != 0)
+        {
+            throw std::runtime_error(
+            fmt::format("{} is 0x{:x}, which isn't {} byte aligned", address.toString(), effectiveAddress,
+                        alignment));
+        }
+        Vector vector;
+        for(size_t i = 0; i < (wide ? 4 : 2); ++i)
+        {
+            vector.qwords[i] = m_stack->load(effectiveAddress + 8 * i);
+        }
+        return vector;
+    }
+
+    const Vector &Cpu::vectorValue(uint8_t number) const
+    {
+        return m_vectorRegisters[number];
+    }
+} // namespace ostrich
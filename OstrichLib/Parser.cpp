@@ -3,12 +3,20 @@ module;
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <fstream>
+#include <functional>
+#include <iterator>
 #include <limits>
+#include <optional>
 #include <ranges>
+#include <sstream>
 #include <stdexcept>
 #include <string_view>
+#include <system_error>
 #include <tuple>
+#include <unordered_map>
 #include <variant>
 module Ostrich;
 
@@ -38,280 +46,994 @@ namespace ostrich::parser
         return output;
     }
 
-    std::string_view skipSpace(const std::string_view &str)
+    std::string Error::message() const
     {
-        if(str.empty())
+        using enum ErrorCode;
+        const auto description = [this]() -> std::string {
+            switch(code)
+            {
+            case emptyLine:
+                return "Failed to parse empty source line";
+            case unknownInstruction:
+                return fmt::format("Failed to parse '{}', instruction '{}' not recognized", where, subject);
+            case expectedWord:
+                return fmt::format("Failed to parse word from '{}'", where);
+            case expectedRegister:
+                return fmt::format("Expected a register name, found '{}'", where);
+            case unknownRegister:
+                return fmt::format("Unknown register name '{}'", subject);
+            case expectedQwordRegister:
+                return fmt::format("Expected a 64 bit register, found '{}'", subject);
+            case instructionPointerOperand:
+                return fmt::format("'{}' can only be read by conditions", subject);
+            case expectedVectorRegister:
+                return fmt::format("Expected an xmm or ymm register, found '{}'", where);
+            case expectedXmmRegister:
+                return fmt::format("Expected an xmm register, found '{}'. ymm registers need the v form.", subject);
+            case expectedInteger:
+                return fmt::format("Failed to parse integer from '{}': Expected a number", where);
+            case integerOutOfRange:
+                return fmt::format("Failed to parse integer from '{}': Expected a number <= {}, but got {}",
+                                   where, std::numeric_limits<uint8_t>::max(), subject);
+            case invalidImmediate:
+                return fmt::format("Failed to parse immediate value from '{}'", subject);
+            case immediateOutOfRange:
+                return fmt::format("Immediate value '{}' does not fit in 64 bits", subject);
+            case immediateTooWide:
+                return fmt::format("Immediate value '{}' does not fit in the destination", subject);
+            case expectedAdditiveOperator:
+                return fmt::format("Failed to parse additive operator, found '{}'", where);
+            case expectedOperand:
+                return "Expected a register name, an immediate or a memory address, got empty string";
+            case operandSizeMismatch:
+                return fmt::format("The size of '{}' doesn't match the destination", subject);
+            case expectedToken:
+                return fmt::format("Expected '{}', found '{}'", subject, where);
+            case expectedComparisonOperator:
+                return fmt::format("Expected one of == != < <= > >=, found '{}'", where);
+            case undefinedLabel:
+                return fmt::format("Undefined label '{}'", subject);
+            case duplicateLabel:
+                return fmt::format("Label '{}' is defined more than once", subject);
+            case trailingInput:
+                return fmt::format("Trailing output '{}' in '{}'", where, subject);
+            }
+            return "Unknown parse error";
+        }();
+        return operands ? fmt::format("Failed to parse operands from '{}': {}", *operands, description) : description;
+    }
+
+    template <typename T>
+    T valueOrThrow(const Result<T> &result)
+    {
+        if(!result)
+        {
+            throw std::runtime_error{ result.error().message() };
+        }
+        return *result;
+    }
+
+    using namespace tokenizer;
+
+    // The tokens of a single line with one token of lookahead. Keeps track of where in the line
+    // the tokens are, for error reporting and for returning the remaining input.
+    class TokenStream
+    {
+    public:
+        explicit TokenStream(const std::string_view &input) : m_input{ input }, m_lexer{ input }
+        {
+            m_next = m_lexer.next();
+        }
+
+        template <TokenAny T>
+        const T *peek() const
+        {
+            return m_next ? std::get_if<T>(&*m_next) : nullptr;
+        }
+
+        bool peekOperator(char op) const
+        {
+            const auto *arithmeticOperator = peek<ArithmeticOperator>();
+            return arithmeticOperator && arithmeticOperator->value[0] == op;
+        }
+
+        std::string_view peekValue() const
+        {
+            return m_next ? value(*m_next) : std::string_view{};
+        }
+
+        bool atEnd() const
+        {
+            return !m_next;
+        }
+
+        void take()
+        {
+            m_consumed = offset(value(*m_next)) + value(*m_next).size();
+            m_next = m_lexer.next();
+        }
+
+        // The input from the next token on
+        std::string_view here() const
+        {
+            return m_input.substr(m_next ? offset(value(*m_next)) : m_input.size());
+        }
+
+        // The input after the last token taken, including any leading whitespace
+        std::string_view rest() const
+        {
+            return m_input.substr(m_consumed);
+        }
+
+        std::string_view input() const
+        {
+            return m_input;
+        }
+
+    private:
+        size_t offset(const std::string_view &tokenValue) const
+        {
+            return static_cast<size_t>(tokenValue.data() - m_input.data());
+        }
+
+        std::string_view m_input;
+        Lexer m_lexer;
+        std::optional<Token> m_next;
+        size_t m_consumed{ 0 };
+    };
+
+    Result<uint64_t> parseNumber(const std::string_view &number, const std::string_view &where)
+    {
+        const auto isHex = number.starts_with("0x");
+        const auto digits = isHex ? number.substr(2) : number;
+        uint64_t result{ 0 };
+        const auto [end, error] =
+        std::from_chars(digits.data(), digits.data() + digits.size(), result, isHex ? 16 : 10);
+        if(error == std::errc::result_out_of_range)
+        {
+            return Error{ ErrorCode::immediateOutOfRange, where, number };
+        }
+        if(error != std::errc{} || end != digits.data() + digits.size())
         {
-            return str;
+            return Error{ ErrorCode::invalidImmediate, where, number };
         }
-        const auto firstNonSpace = str.find_first_not_of(' ');
-        return firstNonSpace == std::string_view::npos ? str.substr(str.size()) : str.substr(firstNonSpace);
+        return result;
     }
 
-    std::string_view peekOrThrow(const std::string_view &str, size_t pos, size_t count = std::string_view::npos)
+    Result<uint8_t> parseUint8t(TokenStream &tokens)
     {
-        const auto minLength = pos + (count == std::string_view::npos ? 0 : count);
-        if(minLength >= str.size())
+        const auto *number = tokens.peek<Number>();
+        if(!number)
         {
-            throw std::runtime_error{
-                fmt::format("Unexpected end of input, tried to parse {} characters from '{}'", minLength, str)
-            };
+            return Error{ ErrorCode::expectedInteger, tokens.here() };
         }
-        return str.substr(pos, count);
+        const auto value = parseNumber(number->value, tokens.here());
+        if(!value)
+        {
+            return value.error().code == ErrorCode::immediateOutOfRange ?
+                   Error{ ErrorCode::integerOutOfRange, tokens.here(), number->value } :
+                   Error{ ErrorCode::expectedInteger, tokens.here() };
+        }
+        if(*value > std::numeric_limits<uint8_t>::max())
+        {
+            return Error{ ErrorCode::integerOutOfRange, tokens.here(), number->value };
+        }
+        tokens.take();
+        return static_cast<uint8_t>(*value);
     }
 
-    std::string_view consumeOrThrow(const std::string_view &str, const std::string_view &expected)
+    Result<uint64_t> parseImmediateValue(TokenStream &tokens)
     {
-        if(!str.starts_with(expected))
+        const auto *number = tokens.peek<Number>();
+        if(!number)
+        {
+            return Error{ ErrorCode::invalidImmediate, tokens.here(), tokens.here() };
+        }
+        const auto value = parseNumber(number->value, tokens.here());
+        if(value)
         {
-            throw std::runtime_error{ fmt::format("Expected '{}', found '{}'", expected, str) };
+            tokens.take();
         }
-        return str.substr(expected.size());
+        return value;
     }
 
-    std::tuple<uint8_t, std::string_view> parseUint8t(const std::string_view &str)
+    Result<RegisterName> stringToRegisterName(const std::string_view &reg)
     {
-        std::size_t pos;
-        try
+        if(const auto registerName = registerNameFromString(reg))
         {
-            int i = std::stoi(std::string{ str }, &pos);
-            if(i > std::numeric_limits<uint8_t>::max())
+            if(*registerName == RegisterName::rip)
             {
-                throw std::runtime_error{ fmt::format("Expected a number <= {}, but got {}",
-                                                      std::numeric_limits<uint8_t>::max(), i) };
+                return Error{ ErrorCode::instructionPointerOperand, reg, reg };
             }
-            return { static_cast<uint8_t>(i), str.substr(pos) };
+            return *registerName;
+        }
+        if(subRegisterFromString(reg))
+        {
+            return Error{ ErrorCode::expectedQwordRegister, reg, reg };
         }
-        catch(const std::exception &e)
+        return Error{ ErrorCode::unknownRegister, reg, reg };
+    }
+
+    Result<RegisterName> parseRegister(TokenStream &tokens)
+    {
+        const auto *word = tokens.peek<Word>();
+        if(!word || word->value.size() < 2)
         {
-            throw std::runtime_error{ fmt::format("Failed to parse integer from '{}': {}", str, e.what()) };
+            return Error{ ErrorCode::expectedRegister, tokens.here() };
         }
+        const auto registerName = stringToRegisterName(word->value);
+        if(registerName)
+        {
+            tokens.take();
+        }
+        return registerName;
     }
 
-    bool isNotWordCharacter(char c)
+    // A whole register has the width qword
+    Result<SubRegister> parseSubRegister(TokenStream &tokens)
     {
-        return !std::isalnum(c) && c != '_';
+        if(const auto *word = tokens.peek<Word>())
+        {
+            if(const auto subRegister = subRegisterFromString(word->value))
+            {
+                tokens.take();
+                return *subRegister;
+            }
+        }
+        const auto registerName = parseRegister(tokens);
+        if(!registerName)
+        {
+            return registerName.error();
+        }
+        return SubRegister{ *registerName, Width::qword };
     }
 
-    std::tuple<std::string_view, std::string_view> parseWord(const std::string_view &str)
+    Result<AdditiveOperator> parseAdditiveOperator(TokenStream &tokens)
     {
-        if(str.empty())
+        if(tokens.peekOperator('+'))
+        {
+            tokens.take();
+            return AdditiveOperator::plus;
+        }
+        if(tokens.peekOperator('-'))
+        {
+            tokens.take();
+            return AdditiveOperator::minus;
+        }
+        return Error{ ErrorCode::expectedAdditiveOperator, tokens.here() };
+    }
+
+    template <TokenAny T>
+    std::optional<Error> expect(TokenStream &tokens, const std::string_view &expected)
+    {
+        if(!tokens.peek<T>())
+        {
+            return Error{ ErrorCode::expectedToken, tokens.here(), expected };
+        }
+        tokens.take();
+        return std::nullopt;
+    }
+
+    std::optional<Error> expectWord(TokenStream &tokens, const std::string_view &expected)
+    {
+        const auto *word = tokens.peek<Word>();
+        if(!word || word->value != expected)
+        {
+            return Error{ ErrorCode::expectedToken, tokens.here(), expected };
+        }
+        tokens.take();
+        return std::nullopt;
+    }
+
+    // base [+- index | +- (index * scale)] [+- displacement]
+    Result<MemoryAddress> parseMemoryAddress(TokenStream &tokens)
+    {
+        MemoryAddress memAddress;
+        // Base
+        const auto base = parseRegister(tokens);
+        if(!base)
+        {
+            return base.error();
+        }
+        memAddress.base = *base;
+        // Index
+        // If we have +/- and then either a register or a parenthesized expression
+        const auto hasAdditiveOperator = tokens.peekOperator('+') || tokens.peekOperator('-');
+        if(hasAdditiveOperator)
         {
-            throw std::runtime_error(fmt::format("Failed to parse word from '{}'", str));
+            TokenStream lookahead{ tokens };
+            lookahead.take();
+            if(lookahead.peek<Word>() || lookahead.peek<LeftParenthesis>())
+            {
+                memAddress.indexOperator = *parseAdditiveOperator(tokens);
+                const auto hasScale = tokens.peek<LeftParenthesis>() != nullptr;
+                if(hasScale)
+                {
+                    tokens.take();
+                }
+                const auto index = parseRegister(tokens);
+                if(!index)
+                {
+                    return index.error();
+                }
+                memAddress.index = *index;
+                if(hasScale)
+                {
+                    if(!tokens.peekOperator('*'))
+                    {
+                        return Error{ ErrorCode::expectedToken, tokens.here(), "*" };
+                    }
+                    tokens.take();
+                    const auto scale = parseUint8t(tokens);
+                    if(!scale)
+                    {
+                        return scale.error();
+                    }
+                    memAddress.scale = *scale;
+                    if(const auto error = expect<RightParenthesis>(tokens, ")"))
+                    {
+                        return *error;
+                    }
+                }
+            }
         }
-        const auto wordEnd =
-        std::distance(str.cbegin(), std::find_if(str.cbegin(), str.cend(), isNotWordCharacter));
-        return { str.substr(0, wordEnd), str.substr(wordEnd) };
+        // Displacement
+        if(tokens.peekOperator('+') || tokens.peekOperator('-'))
+        {
+            memAddress.displacementOperator = *parseAdditiveOperator(tokens);
+            const auto displacement = parseUint8t(tokens);
+            if(!displacement)
+            {
+                return displacement.error();
+            }
+            memAddress.displacement = *displacement;
+        }
+        return memAddress;
     }
 
-    RegisterName stringToRegisterName(const std::string_view &reg)
+    std::optional<Width> sizeKeyword(std::string_view word)
     {
-        using enum RegisterName;
-        if(reg == "rax")
+        if(word == "qword")
         {
-            return rax;
+            return Width::qword;
         }
-        if(reg == "rbx")
+        if(word == "dword")
         {
-            return rbx;
+            return Width::dword;
         }
-        if(reg == "rcx")
+        if(word == "word")
         {
-            return rcx;
+            return Width::word;
         }
-        if(reg == "rdx")
+        if(word == "byte")
         {
-            return rdx;
+            return Width::byte;
         }
-        if(reg == "rsi")
+        return std::nullopt;
+    }
+
+    // An operand, and its width unless it is an immediate
+    struct Operand
+    {
+        RegisterOrImmediateOrMemory value;
+        std::optional<Width> width;
+    };
+
+    // register | sub-register | immediate | (q|d)word ptr [memory address] | (word|byte) ptr [memory address]
+    Result<Operand> parseOperand(TokenStream &tokens)
+    {
+        if(tokens.atEnd())
         {
-            return rsi;
+            return Error{ ErrorCode::expectedOperand, tokens.here() };
         }
-        if(reg == "rdi")
+        if(tokens.peek<Number>())
         {
-            return rdi;
+            const auto immediate = parseImmediateValue(tokens);
+            if(!immediate)
+            {
+                return immediate.error();
+            }
+            return Operand{ *immediate, std::nullopt };
         }
-        if(reg == "rbp")
+        const auto *word = tokens.peek<Word>();
+        const auto width = word ? sizeKeyword(word->value) : std::nullopt;
+        if(width)
         {
-            return rbp;
+            tokens.take();
+            if(const auto error = expectWord(tokens, "ptr"))
+            {
+                return *error;
+            }
+            if(const auto error = expect<LeftBracket>(tokens, "["))
+            {
+                return *error;
+            }
+            const auto memAddress = parseMemoryAddress(tokens);
+            if(!memAddress)
+            {
+                return memAddress.error();
+            }
+            if(const auto error = expect<RightBracket>(tokens, "]"))
+            {
+                return *error;
+            }
+            return Operand{ *memAddress, *width };
         }
-        if(reg == "rsp")
+        const auto reg = parseSubRegister(tokens);
+        if(!reg)
         {
-            return rsp;
+            return reg.error();
         }
-        static_assert(registerCount == 8, "Don't forget to update this!");
-        throw std::runtime_error(fmt::format("Unknown register name '{}'", reg));
+        if(reg->width == Width::qword)
+        {
+            return Operand{ reg->registerName, Width::qword };
+        }
+        return Operand{ *reg, reg->width };
     }
 
-    std::tuple<uint64_t, std::string_view> parseImmediateValue(const std::string_view &str)
+    // xmm0 to xmm15 | ymm0 to ymm15
+    Result<VectorRegister> parseVectorRegister(TokenStream &tokens)
     {
-        const auto [value, rest] = parseWord(str);
-        const auto result = value.starts_with("0x") ? std::stoull(std::string(value), 0, 16) :
-                                                      std::stoull(std::string(value));
-        return { result, rest };
+        const auto *word = tokens.peek<Word>();
+        const auto vectorRegister = word ? vectorRegisterFromString(word->value) : std::nullopt;
+        if(!vectorRegister)
+        {
+            return Error{ ErrorCode::expectedVectorRegister, tokens.here() };
+        }
+        tokens.take();
+        return *vectorRegister;
     }
 
-    std::tuple<RegisterName, std::string_view> parseRegister(const std::string_view &str)
+    // An operand of a packed instruction, and whether it is a ymm one
+    struct VectorOperand
     {
-        if(str.size() < 3)
+        VectorRegisterOrMemory value;
+        bool wide;
+    };
+
+    // vector register | (xmm|ymm)word ptr [memory address]
+    Result<VectorOperand> parseVectorOperand(TokenStream &tokens)
+    {
+        const auto *word = tokens.peek<Word>();
+        if(word && (word->value == "xmmword" || word->value == "ymmword"))
         {
-            throw std::runtime_error{ fmt::format("Expected a register name, found '{}'", str) };
+            const bool wide{ word->value == "ymmword" };
+            tokens.take();
+            if(const auto error = expectWord(tokens, "ptr"))
+            {
+                return *error;
+            }
+            if(const auto error = expect<LeftBracket>(tokens, "["))
+            {
+                return *error;
+            }
+            const auto memAddress = parseMemoryAddress(tokens);
+            if(!memAddress)
+            {
+                return memAddress.error();
+            }
+            if(const auto error = expect<RightBracket>(tokens, "]"))
+            {
+                return *error;
+            }
+            return VectorOperand{ *memAddress, wide };
         }
-        const auto [reg, rest] = parseWord(str);
-        return { stringToRegisterName(reg), rest };
+        const auto vectorRegister = parseVectorRegister(tokens);
+        if(!vectorRegister)
+        {
+            return vectorRegister.error();
+        }
+        return VectorOperand{ *vectorRegister, vectorRegister->wide };
     }
 
-    std::tuple<AdditiveOperator, std::string_view> parseAdditiveOperator(const std::string_view &str)
+    // register | sub-register | immediate | qword ptr [memory address]
+    Result<RegisterOrImmediateOrMemory> parseRegisterOrImmediateOrMemory(TokenStream &tokens)
     {
-        if(str[0] == '+')
+        const auto here = tokens.here();
+        const auto operand = parseOperand(tokens);
+        if(!operand)
+        {
+            return operand.error();
+        }
+        // Without an instruction to give it a width, memory is always read a qword at a time
+        if(std::holds_alternative<MemoryAddress>(operand->value) && operand->width != Width::qword)
         {
-            return { AdditiveOperator::plus, str.substr(1) };
+            return Error{ ErrorCode::expectedToken, here, "qword" };
         }
-        if(str[0] == '-')
+        return operand->value;
+    }
+
+    template <typename T>
+    Parsed<T> withRest(const Result<T> &result, const TokenStream &tokens)
+    {
+        if(!result)
         {
-            return { AdditiveOperator::minus, str.substr(1) };
+            return result.error();
         }
-        throw std::runtime_error{ fmt::format("Failed to parse additive operator, found '{}'", str) };
+        return std::tuple{ *result, tokens.rest() };
+    }
+
+    Parsed<RegisterName> tryParseRegister(const std::string_view &str)
+    {
+        TokenStream tokens{ str };
+        const auto result = parseRegister(tokens);
+        return withRest(result, tokens);
+    }
+
+    Parsed<MemoryAddress> tryParseMemoryAddress(const std::string_view &memoryAddress)
+    {
+        TokenStream tokens{ memoryAddress };
+        const auto result = parseMemoryAddress(tokens);
+        return withRest(result, tokens);
     }
 
     std::tuple<MemoryAddress, std::string_view> parseMemoryAddress(const std::string_view &memoryAddress)
     {
-        MemoryAddress memAddress;
-        std::string_view input;
-        // Base
-        std::tie(memAddress.base, input) = parseRegister(memoryAddress);
-        // Index
-        // If we have +/- and then either a register or a parenthesized expression
-        if(input.size() >= 2 && (input[0] == '+' || input[0] == '-') &&
-           (input[1] == '(' || std::isalpha(input[1])))
+        return valueOrThrow(tryParseMemoryAddress(memoryAddress));
+    }
+
+    Parsed<RegisterOrImmediateOrMemory> tryParseRegisterOrImmediateOrMemory(const std::string_view &str)
+    {
+        TokenStream tokens{ str };
+        const auto result = parseRegisterOrImmediateOrMemory(tokens);
+        return withRest(result, tokens);
+    }
+
+    Error operandError(const std::string_view &operands, Error error)
+    {
+        error.operands = operands;
+        return error;
+    }
+
+    // Push and pop only take whole registers
+    template <InstructionSingleRegister InstructionType>
+    Result<Instruction> parseInstructionWithSingleRegister(TokenStream &tokens)
+    {
+        const auto operands = tokens.here();
+        if constexpr(requires { InstructionType{}.width; })
         {
-            std::tie(memAddress.indexOperator, input) = parseAdditiveOperator(input);
-            const auto hasScale = input[0] == '(';
-            if(hasScale)
+            const auto reg = parseSubRegister(tokens);
+            if(!reg)
             {
-                input = input.substr(1);
+                return operandError(operands, reg.error());
             }
-            std::tie(memAddress.index, input) = parseRegister(input);
-            if(hasScale)
+            return Instruction{ InstructionType{ reg->registerName, reg->width } };
+        }
+        else
+        {
+            const auto reg = parseRegister(tokens);
+            if(!reg)
             {
-                input = consumeOrThrow(input, "*");
-                std::tie(memAddress.scale, input) = parseUint8t(input);
-                input = consumeOrThrow(input, ")");
+                return operandError(operands, reg.error());
             }
+            return Instruction{ InstructionType{ *reg } };
         }
-        // Displacement
-        if(!input.empty() && (input[0] == '+' || input[0] == '-'))
+    }
+
+    // Whether value is a width sized number, either unsigned or sign extended to 64 bits
+    bool fits(uint64_t value, Width width)
+    {
+        const auto bits = bitCount(width);
+        if(bits == 64)
         {
-            std::tie(memAddress.displacementOperator, input) = parseAdditiveOperator(input);
-            std::tie(memAddress.displacement, input) = parseUint8t(input);
+            return true;
         }
-        return { memAddress, input };
+        const uint64_t largest{ (uint64_t{ 1 } << bits) - 1 };
+        const uint64_t smallestNegative{ ~uint64_t{ 0 } << (bits - 1) };
+        return value <= largest || value >= smallestNegative;
     }
 
-    std::tuple<RegisterOrImmediateOrMemory, std::string_view>
-    parseRegisterOrImmediateOrMemory(const std::string_view &str)
+    // destination[,] source
+    template <InstructionSourceDestination InstructionType>
+    Result<Instruction> parseInstructionWithSourceAndDestination(TokenStream &tokens)
     {
-        if(str.empty())
+        const auto operands = tokens.here();
+        const auto destination = parseSubRegister(tokens);
+        if(!destination)
         {
-            throw std::runtime_error(
-            "Exepected a register name, an immediate or a memory address, got empty string");
+            return operandError(operands, destination.error());
         }
-        if(std::isdigit(str[0]))
+        if(tokens.peek<Comma>())
         {
-            const auto [immediate, rest] = parseImmediateValue(str);
-            return { RegisterOrImmediateOrMemory{ immediate }, rest };
+            tokens.take();
         }
-        else if(str.starts_with("qword"))
+        const auto here = tokens.here();
+        const auto source = parseOperand(tokens);
+        if(!source)
         {
-            const auto memAddressBegin = consumeOrThrow(str, "qword ptr [");
-            const auto [memAddress, rest] = parseMemoryAddress(memAddressBegin);
-            return { memAddress, consumeOrThrow("]", rest) };
+            return operandError(operands, source.error());
         }
-        else
+        const auto sourceText = here.substr(0, here.size() - tokens.rest().size());
+        if(source->width)
         {
-            const auto [reg, rest] = parseRegister(str);
-            return { RegisterOrImmediateOrMemory{ reg }, rest };
+            // ah and al can be mixed, since both are bytes
+            if(bitCount(*source->width) != bitCount(destination->width))
+            {
+                return operandError(operands, Error{ ErrorCode::operandSizeMismatch, here, sourceText });
+            }
         }
+        else if(!fits(std::get<uint64_t>(source->value), destination->width))
+        {
+            return operandError(operands, Error{ ErrorCode::immediateTooWide, here, sourceText });
+        }
+        return Instruction{ InstructionType{ destination->registerName, source->value, destination->width } };
     }
 
-    template <InstructionSingleRegister InstructionType>
-    std::tuple<InstructionType, std::string_view>
-    parseInstructionWithSingleRegister(const std::string_view &operands)
+    template <InstructionNoOperands InstructionType>
+    Result<Instruction> parseInstructionWithNoOperands(TokenStream &)
+    {
+        return Instruction{ InstructionType{} };
+    }
+
+    // The mnemonics of the legacy SSE forms, and of the vex forms with a v in front
+    std::optional<std::tuple<PackedOperation, bool>> parsePackedMnemonic(std::string_view mnemonic)
+    {
+        using enum PackedOperation;
+        const bool vex{ mnemonic.starts_with('v') };
+        const auto name = vex ? mnemonic.substr(1) : mnemonic;
+        for(const auto operation : { movdqa, movdqu, paddd, paddq, psubd, psubq, pand, por, pxor, addps, subps, mulps })
+        {
+            if(name == toString(operation))
+            {
+                return std::tuple{ operation, vex };
+            }
+        }
+        return std::nullopt;
+    }
+
+    // destination[,] source for the legacy forms and the vex moves, destination[,] first[,] source
+    // for the other vex forms. All the operands are the same size, and only vex has ymm.
+    Result<Instruction> parsePacked(TokenStream &tokens, PackedOperation operation, bool vex)
     {
-        try
+        const auto operands = tokens.here();
+        const auto destinationText = tokens.peekValue();
+        const auto destination = parseVectorRegister(tokens);
+        if(!destination)
+        {
+            return operandError(operands, destination.error());
+        }
+        if(destination->wide && !vex)
+        {
+            return operandError(operands, Error{ ErrorCode::expectedXmmRegister, operands, destinationText });
+        }
+        if(tokens.peek<Comma>())
+        {
+            tokens.take();
+        }
+        auto first = *destination;
+        if(vex && hasFirstOperand(operation))
         {
-            const auto [reg, rest] = parseRegister(operands);
-            return { InstructionType{ reg }, rest };
+            const auto here = tokens.here();
+            const auto firstText = tokens.peekValue();
+            const auto parsedFirst = parseVectorRegister(tokens);
+            if(!parsedFirst)
+            {
+                return operandError(operands, parsedFirst.error());
+            }
+            if(parsedFirst->wide != destination->wide)
+            {
+                return operandError(operands, Error{ ErrorCode::operandSizeMismatch, here, firstText });
+            }
+            first = *parsedFirst;
+            if(tokens.peek<Comma>())
+            {
+                tokens.take();
+            }
         }
-        catch(const std::runtime_error &)
+        const auto here = tokens.here();
+        const auto source = parseVectorOperand(tokens);
+        if(!source)
         {
-            throw std::runtime_error{ fmt::format("Failed to parse operands from '{}'", operands) };
+            return operandError(operands, source.error());
         }
+        if(source->wide != destination->wide)
+        {
+            const auto sourceText = here.substr(0, here.size() - tokens.rest().size());
+            return operandError(operands, Error{ ErrorCode::operandSizeMismatch, here, sourceText });
+        }
+        return Instruction{ Packed{ operation, *destination, first, source->value, vex } };
     }
 
+    Result<std::string_view> parseLabelName(TokenStream &tokens)
+    {
+        const auto *word = tokens.peek<Word>();
+        if(!word)
+        {
+            return Error{ ErrorCode::expectedWord, tokens.here() };
+        }
+        const auto name = word->value;
+        tokens.take();
+        return name;
+    }
 
-    template <InstructionSourceDestination InstructionType>
-    std::tuple<InstructionType, std::string_view>
-    parseInstructionWithSourceAndDestination(const std::string_view &operands)
+    // Conditional jumps are j followed by a condition code, or one of the aliases jz and jnz
+    std::optional<ConditionCode> parseJccMnemonic(std::string_view mnemonic)
     {
-        try
+        using enum ConditionCode;
+        if(mnemonic == "jz")
+        {
+            return e;
+        }
+        if(mnemonic == "jnz")
         {
-            const auto [destination, sourceStr] = parseRegister(operands);
-            const auto [source, rest] = parseRegisterOrImmediateOrMemory(skipSpace(sourceStr));
-            return { InstructionType{ destination, source }, rest };
+            return ne;
         }
-        catch(const std::runtime_error &)
+        if(!mnemonic.starts_with('j'))
         {
-            throw std::runtime_error{ fmt::format("Failed to parse operands from '{}'", operands) };
+            return std::nullopt;
         }
+        for(const auto conditionCode : { e, ne, b, ae, be, a, l, ge, le, g, s, ns, o, no, p, np })
+        {
+            if(mnemonic.substr(1) == toString(conditionCode))
+            {
+                return conditionCode;
+            }
+        }
+        return std::nullopt;
     }
 
-    std::tuple<Instruction, std::string_view> parseInstructionInternal(const std::string_view &sourceLine)
+    // jmp label or jcc label
+    Result<Instruction> parseJump(TokenStream &tokens, std::optional<ConditionCode> conditionCode)
     {
-        if(skipSpace(sourceLine).empty())
+        const auto operands = tokens.here();
+        const auto label = parseLabelName(tokens);
+        if(!label)
         {
-            throw std::runtime_error("Failed to parse empty source line");
+            return operandError(operands, label.error());
+        }
+        if(conditionCode)
+        {
+            return Instruction{ Jcc{ *conditionCode, std::string{ *label } } };
+        }
+        return Instruction{ Jmp{ std::string{ *label } } };
+    }
+
+    Result<Instruction> parseInstruction(TokenStream &tokens)
+    {
+        if(tokens.atEnd())
+        {
+            return Error{ ErrorCode::emptyLine, tokens.input() };
+        }
+        const bool startsWithWord{ tokens.peek<Word>() != nullptr };
+        const auto instruction = tokens.peekValue();
+        tokens.take();
+        if(startsWithWord && tokens.peek<Colon>())
+        {
+            tokens.take();
+            return Instruction{ Label{ std::string{ instruction } } };
         }
-        // TODO be more forgiving about leading spaces, multiple spaces between operators/operands etc, and test this
-        const auto [instruction, rest] = parseWord(sourceLine);
-        const auto operands = skipSpace(rest);
         if(instruction == "inc")
         {
-            return parseInstructionWithSingleRegister<Inc>(operands);
+            return parseInstructionWithSingleRegister<Inc>(tokens);
         }
         if(instruction == "dec")
         {
-            return parseInstructionWithSingleRegister<Dec>(operands);
+            return parseInstructionWithSingleRegister<Dec>(tokens);
         }
         if(instruction == "push")
         {
-            return parseInstructionWithSingleRegister<Push>(operands);
+            return parseInstructionWithSingleRegister<Push>(tokens);
         }
         if(instruction == "pop")
         {
-            return parseInstructionWithSingleRegister<Pop>(operands);
+            return parseInstructionWithSingleRegister<Pop>(tokens);
         }
         if(instruction == "add")
         {
-            return parseInstructionWithSourceAndDestination<Add>(operands);
+            return parseInstructionWithSourceAndDestination<Add>(tokens);
         }
         if(instruction == "mov")
         {
-            return parseInstructionWithSourceAndDestination<Mov>(operands);
+            return parseInstructionWithSourceAndDestination<Mov>(tokens);
+        }
+        if(instruction == "sub")
+        {
+            return parseInstructionWithSourceAndDestination<Sub>(tokens);
+        }
+        if(instruction == "cmp")
+        {
+            return parseInstructionWithSourceAndDestination<Cmp>(tokens);
+        }
+        if(instruction == "pushf")
+        {
+            return parseInstructionWithNoOperands<Pushf>(tokens);
+        }
+        if(instruction == "jmp")
+        {
+            return parseJump(tokens, std::nullopt);
+        }
+        if(const auto conditionCode = parseJccMnemonic(instruction))
+        {
+            return parseJump(tokens, conditionCode);
+        }
+        if(const auto packed = parsePackedMnemonic(instruction))
+        {
+            const auto [operation, vex] = *packed;
+            return parsePacked(tokens, operation, vex);
         }
         else
         {
-            throw std::runtime_error(
-            fmt::format("Failed to parse '{}', instruction '{}' not recognized", sourceLine, instruction));
+            return Error{ ErrorCode::unknownInstruction, tokens.input(), instruction };
         }
     };
 
+    Result<Instruction> tryParseInstruction(const std::string_view &sourceLine)
+    {
+        TokenStream tokens{ sourceLine };
+        const auto instruction = parseInstruction(tokens);
+        if(instruction && !tokens.atEnd())
+        {
+            return Error{ ErrorCode::trailingInput, tokens.rest(), sourceLine };
+        }
+        return instruction;
+    }
+
     Instruction parseInstruction(const std::string_view &sourceLine)
     {
-        const auto [instruction, rest] = parseInstructionInternal(sourceLine);
-        if(!rest.empty())
+        return valueOrThrow(tryParseInstruction(sourceLine));
+    }
+
+    // Conditions are typed at the prompt, so memory operands don't need the qword ptr. They are
+    // also the only place rip can be used.
+    Result<RegisterOrImmediateOrMemory> parseConditionOperand(TokenStream &tokens)
+    {
+        if(const auto *word = tokens.peek<Word>(); word && word->value == toString(RegisterName::rip))
+        {
+            tokens.take();
+            return RegisterOrImmediateOrMemory{ RegisterName::rip };
+        }
+        if(!tokens.peek<LeftBracket>())
+        {
+            return parseRegisterOrImmediateOrMemory(tokens);
+        }
+        tokens.take();
+        const auto memAddress = parseMemoryAddress(tokens);
+        if(!memAddress)
+        {
+            return memAddress.error();
+        }
+        if(const auto error = expect<RightBracket>(tokens, "]"))
+        {
+            return *error;
+        }
+        return RegisterOrImmediateOrMemory{ *memAddress };
+    }
+
+    Result<ostrich::ComparisonOperator> parseComparisonOperator(TokenStream &tokens)
+    {
+        using enum ostrich::ComparisonOperator;
+        const auto *comparisonOperator = tokens.peek<tokenizer::ComparisonOperator>();
+        if(!comparisonOperator)
+        {
+            return Error{ ErrorCode::expectedComparisonOperator, tokens.here() };
+        }
+        const auto op = comparisonOperator->value;
+        tokens.take();
+        if(op == "==")
+        {
+            return equal;
+        }
+        if(op == "!=")
+        {
+            return notEqual;
+        }
+        if(op == "<")
+        {
+            return less;
+        }
+        if(op == "<=")
+        {
+            return lessOrEqual;
+        }
+        if(op == ">")
+        {
+            return greater;
+        }
+        return greaterOrEqual;
+    }
+
+    Result<Condition> tryParseCondition(const std::string_view &condition)
+    {
+        TokenStream tokens{ condition };
+        const auto lhs = parseConditionOperand(tokens);
+        if(!lhs)
         {
-            throw std::runtime_error{ fmt::format("Trailing output '{}' in '{}'", rest, sourceLine) };
+            return lhs.error();
+        }
+        const auto comparisonOperator = parseComparisonOperator(tokens);
+        if(!comparisonOperator)
+        {
+            return comparisonOperator.error();
+        }
+        const auto rhs = parseConditionOperand(tokens);
+        if(!rhs)
+        {
+            return rhs.error();
+        }
+        if(!tokens.atEnd())
+        {
+            return Error{ ErrorCode::trailingInput, tokens.rest(), condition };
+        }
+        return Condition{ *lhs, *comparisonOperator, *rhs };
+    }
+
+    Condition parseCondition(const std::string_view &condition)
+    {
+        return valueOrThrow(tryParseCondition(condition));
+    }
+
+    using Labels = std::unordered_map<std::string_view, size_t>;
+
+    // The errors are for the instruction at the index, and view into the names in source
+    std::vector<std::tuple<size_t, Error>> findLabels(const Source &source, Labels &labels)
+    {
+        std::vector<std::tuple<size_t, Error>> errors;
+        for(size_t i = 0; i < source.size(); ++i)
+        {
+            if(const auto *label = std::get_if<Label>(&source[i]))
+            {
+                if(!labels.emplace(label->name, i).second)
+                {
+                    errors.emplace_back(i, Error{ ErrorCode::duplicateLabel, label->name, label->name });
+                }
+            }
+        }
+        return errors;
+    }
+
+    std::optional<Error> resolveLabel(Instruction &instruction, const Labels &labels)
+    {
+        const auto resolve = [&](auto &jump) -> std::optional<Error> {
+            const auto label = labels.find(jump.label);
+            if(label == labels.end())
+            {
+                return Error{ ErrorCode::undefinedLabel, jump.label, jump.label };
+            }
+            jump.target = label->second;
+            return std::nullopt;
+        };
+        if(auto *jmp = std::get_if<Jmp>(&instruction))
+        {
+            return resolve(*jmp);
+        }
+        if(auto *jcc = std::get_if<Jcc>(&instruction))
+        {
+            return resolve(*jcc);
+        }
+        return std::nullopt;
+    }
+
+    // Resolves what it can, and returns the rest as errors
+    std::vector<std::tuple<size_t, Error>> tryResolveLabels(Source &source)
+    {
+        Labels labels;
+        auto errors = findLabels(source, labels);
+        for(size_t i = 0; i < source.size(); ++i)
+        {
+            if(const auto error = resolveLabel(source[i], labels))
+            {
+                errors.emplace_back(i, *error);
+            }
+        }
+        return errors;
+    }
+
+    void resolveLabels(Source &source)
+    {
+        const auto errors = tryResolveLabels(source);
+        if(!errors.empty())
+        {
+            throw std::runtime_error{ std::get<Error>(errors.front()).message() };
+        }
+    }
+
+    Instruction resolveLabels(Instruction instruction, const Source &source)
+    {
+        Labels labels;
+        findLabels(source, labels);
+        if(const auto error = resolveLabel(instruction, labels))
+        {
+            throw std::runtime_error{ error->message() };
         }
         return instruction;
     }
@@ -324,6 +1046,7 @@ namespace ostrich::parser
         {
             source.push_back(parseInstruction(line));
         }
+        resolveLabels(source);
         return source;
     }
 
@@ -342,6 +1065,114 @@ namespace ostrich::parser
         {
             source.push_back(parseInstruction(line));
         }
+        resolveLabels(source);
         return source;
     }
+
+    Diagnostic makeDiagnostic(size_t line, const std::string_view &sourceLine, const Error &error)
+    {
+        const auto where = error.where.data();
+        const auto inLine = where >= sourceLine.data() && where <= sourceLine.data() + sourceLine.size();
+        return Diagnostic{ line, inLine ? static_cast<size_t>(where - sourceLine.data()) + 1 : 1, error.code,
+                           error.message() };
+    }
+
+    ParseResult parseAll(const std::string_view &sourceText)
+    {
+        ParseResult result;
+        // The line of each instruction in result.source
+        std::vector<std::tuple<size_t, std::string_view>> lines;
+        size_t lineNumber{ 0 };
+        std::string_view rest{ sourceText };
+        while(!rest.empty())
+        {
+            ++lineNumber;
+            const auto lineEnd = std::min(rest.find('\n'), rest.size());
+            const auto line = rest.substr(0, lineEnd);
+            rest.remove_prefix(std::min(lineEnd + 1, rest.size()));
+            if(TokenStream{ line }.atEnd())
+            {
+                continue;
+            }
+            const auto instruction = tryParseInstruction(line);
+            if(instruction)
+            {
+                result.source.push_back(*instruction);
+                lines.emplace_back(lineNumber, line);
+            }
+            else
+            {
+                result.diagnostics.push_back(makeDiagnostic(lineNumber, line, instruction.error()));
+            }
+        }
+        for(const auto &[index, error] : tryResolveLabels(result.source))
+        {
+            const auto [labelLineNumber, line] = lines[index];
+            result.diagnostics.push_back(makeDiagnostic(labelLineNumber, line, error));
+        }
+        std::stable_sort(result.diagnostics.begin(), result.diagnostics.end(),
+                         [](const Diagnostic &lhs, const Diagnostic &rhs) { return lhs.line < rhs.line; });
+        return result;
+    }
+
+    ParseResult parseAll(const std::filesystem::path &sourcePath)
+    {
+        std::ifstream file(sourcePath.string());
+        if(!file.is_open())
+        {
+            throw std::runtime_error(fmt::format("Failed to open '{}'", sourcePath.string()));
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+        return parseAll(std::string_view{ text.str() });
+    }
+
+    std::optional<size_t> IncrementalParser::update(const std::string_view &sourceText, Source &source)
+    {
+        const auto lines = split(sourceText, '\n');
+        std::vector<size_t> lineHashes;
+        lineHashes.reserve(lines.size());
+        std::transform(lines.begin(), lines.end(), std::back_inserter(lineHashes), std::hash<std::string_view>{});
+
+        const auto [firstChangedOld, firstChangedNew] = std::mismatch(
+        m_lineHashes.begin(), m_lineHashes.end(), lineHashes.begin(), lineHashes.end());
+        const auto prefix = static_cast<size_t>(std::distance(m_lineHashes.begin(), firstChangedOld));
+        if(prefix == m_lineHashes.size() && prefix == lineHashes.size())
+        {
+            return std::nullopt;
+        }
+        const auto maxSuffix = std::min(m_lineHashes.size(), lineHashes.size()) - prefix;
+        const auto [lastChangedOld, lastChangedNew] =
+        std::mismatch(m_lineHashes.rbegin(), m_lineHashes.rbegin() + maxSuffix, lineHashes.rbegin());
+        const auto suffix = static_cast<size_t>(std::distance(m_lineHashes.rbegin(), lastChangedOld));
+
+        Source updated;
+        updated.reserve(lines.size());
+        updated.insert(updated.end(), source.begin(), source.begin() + prefix);
+        for(size_t i = prefix; i < lines.size() - suffix; ++i)
+        {
+            updated.push_back(parseInstruction(lines[i]));
+        }
+        updated.insert(updated.end(), source.end() - suffix, source.end());
+        resolveLabels(updated);
+
+        // Moving a label changes the target of jumps to it, even on lines that didn't change
+        const auto firstChanged = static_cast<size_t>(std::distance(
+        source.begin(), std::mismatch(source.begin(), source.begin() + prefix, updated.begin()).first));
+        source = std::move(updated);
+        m_lineHashes = std::move(lineHashes);
+        return firstChanged;
+    }
+
+    std::optional<size_t> IncrementalParser::update(const std::filesystem::path &sourcePath, Source &source)
+    {
+        std::ifstream file(sourcePath.string());
+        if(!file.is_open())
+        {
+            throw std::runtime_error(fmt::format("Failed to open '{}'", sourcePath.string()));
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+        return update(std::string_view{ text.str() }, source);
+    }
 } // namespace ostrich
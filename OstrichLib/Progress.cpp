@@ -0,0 +1,46 @@
+module;
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+module Ostrich;
+
+namespace ostrich
+{
+    void ProgressChannel::publish(const Progress &progress)
+    {
+        const auto sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        // Keeps the words below from being written before the sequence number is odd
+        std::atomic_thread_fence(std::memory_order_release);
+        m_words[0].store(progress.steps, std::memory_order_relaxed);
+        m_words[1].store(progress.nextInstruction, std::memory_order_relaxed);
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            m_words[2 + i].store(progress.registers[i], std::memory_order_relaxed);
+        }
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    Progress ProgressChannel::read() const
+    {
+        Progress progress{};
+        while(true)
+        {
+            const auto before = m_sequence.load(std::memory_order_acquire);
+            progress.steps = m_words[0].load(std::memory_order_relaxed);
+            progress.nextInstruction = static_cast<size_t>(m_words[1].load(std::memory_order_relaxed));
+            for(size_t i = 0; i < registerCount; ++i)
+            {
+                progress.registers[i] = m_words[2 + i].load(std::memory_order_relaxed);
+            }
+            // Keeps the sequence number below from being read before the words
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(before % 2 == 0 && m_sequence.load(std::memory_order_relaxed) == before)
+            {
+                return progress;
+            }
+        }
+    }
+} // namespace ostrich
@@ -0,0 +1,88 @@
+module;
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+module Ostrich;
+
+
+namespace ostrich
+{
+    // Moving the cursor costs about as much as writing this many unchanged characters
+    constexpr size_t maxUnchangedGap{ 6 };
+
+    Screen::Screen(size_t width, size_t height)
+    : m_width{ width }, m_height{ height }, m_current(width * height, ' '), m_previous(width * height, ' ')
+    {
+    }
+
+    void Screen::clear()
+    {
+        std::fill(m_current.begin(), m_current.end(), ' ');
+    }
+
+    void Screen::write(size_t row, size_t column, std::string_view text)
+    {
+        if(row >= m_height || column >= m_width)
+        {
+            return;
+        }
+        const auto length = std::min(text.size(), m_width - column);
+        std::copy_n(text.begin(), length, m_current.begin() + row * m_width + column);
+    }
+
+    std::string Screen::present()
+    {
+        std::string output;
+        if(!m_valid)
+        {
+            output += "\x1b[2J";
+            for(size_t row = 0; row < m_height; ++row)
+            {
+                output += fmt::format("\x1b[{};1H", row + 1);
+                output.append(&m_current[row * m_width], m_width);
+            }
+        }
+        else
+        {
+            for(size_t row = 0; row < m_height; ++row)
+            {
+                const auto rowStart = row * m_width;
+                size_t column{ 0 };
+                while(column < m_width)
+                {
+                    if(m_current[rowStart + column] == m_previous[rowStart + column])
+                    {
+                        ++column;
+                        continue;
+                    }
+                    // Extend the run across short stretches of unchanged cells, which are cheaper
+                    // to rewrite than to skip
+                    const auto runStart = column;
+                    auto runEnd = column + 1;
+                    for(auto next = runEnd; next < m_width && next - runEnd <= maxUnchangedGap; ++next)
+                    {
+                        if(m_current[rowStart + next] != m_previous[rowStart + next])
+                        {
+                            runEnd = next + 1;
+                        }
+                    }
+                    output += fmt::format("\x1b[{};{}H", row + 1, runStart + 1);
+                    output.append(&m_current[rowStart + runStart], runEnd - runStart);
+                    column = runEnd;
+                }
+            }
+        }
+        m_previous = m_current;
+        m_valid = true;
+        return output;
+    }
+
+    void Screen::invalidate()
+    {
+        m_valid = false;
+    }
+} // namespace ostrich
@@ -0,0 +1,44 @@
+module;
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+module Ostrich;
+
+
+namespace ostrich
+{
+    SourceView::SourceView(size_t height) : m_height{ height }
+    {
+    }
+
+    std::vector<std::string> SourceView::render(const Source &source, size_t nextInstruction)
+    {
+        // Lines past the end of a shorter source would never be looked at again
+        m_lines.resize(source.size());
+
+        const size_t lastFirstRow{ source.size() > m_height ? source.size() - m_height : 0 };
+        const size_t firstRow{ std::min(nextInstruction - std::min(nextInstruction, m_height / 2), lastFirstRow) };
+        const size_t lastRow{ std::min(firstRow + m_height, source.size()) };
+
+        std::vector<std::string> lines;
+        for(size_t i = firstRow; i < lastRow; ++i)
+        {
+            lines.push_back((i == nextInstruction ? ">" : " ") + disassembly(source, i));
+        }
+        return lines;
+    }
+
+    const std::string &SourceView::disassembly(const Source &source, size_t index)
+    {
+        auto &line = m_lines[index];
+        if(!line || !(line->instruction == source[index]))
+        {
+            line = Line{ source[index], std::visit([](const auto &i) { return i.toString(); }, source[index]) };
+        }
+        return line->text;
+    }
+} // namespace ostrich
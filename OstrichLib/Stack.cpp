@@ -19,7 +19,7 @@ namespace ostrich
         }
     }
 
-    const std::vector<uint8_t> Stack::content() const
+    const std::vector<uint8_t> &Stack::content() const
     {
         return m_content;
     }
@@ -40,6 +40,18 @@ namespace ostrich
         {
             throw std::runtime_error("Stack overflow! (No, not that website)");
         }
+        if(m_watchpoints)
+        {
+            uint8_t changedBytes{ 0 };
+            for(uint64_t i = 0; i < 8; ++i)
+            {
+                if(m_content.at(lsb_index - i) != static_cast<uint8_t>(value >> i * 8))
+                {
+                    changedBytes |= 1 << i;
+                }
+            }
+            m_watchpoints->onStore(address, changedBytes);
+        }
         for(uint64_t i = 0; i < 8; ++i)
         {
             const uint8_t byte{ static_cast<uint8_t>(value >> i * 8) };
@@ -48,6 +60,21 @@ namespace ostrich
         }
     }
 
+    bool Stack::contains(uint64_t address) const
+    {
+        return address <= m_beginning && m_beginning - address + 8 <= m_content.size();
+    }
+
+    void Stack::watch(Watchpoints *watchpoints)
+    {
+        m_watchpoints = watchpoints;
+    }
+
+    uint8_t *Stack::data()
+    {
+        return m_content.data();
+    }
+
     uint64_t Stack::load(uint64_t address) const
     {
         if(address > m_beginning)
@@ -58,6 +85,10 @@ namespace ostrich
         {
             throw std::runtime_error("Stack overflow! (No, not that website)");
         }
+        if(m_watchpoints)
+        {
+            m_watchpoints->onLoad(address);
+        }
         uint64_t result{ 0 };
         for(uint64_t i = 0; i < 8; ++i)
         {
@@ -0,0 +1,72 @@
+module;
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+module Ostrich;
+
+
+namespace ostrich
+{
+    StackView::StackView(size_t height) : m_height{ height }
+    {
+    }
+
+    // Row n shows the qword at beginning - 8n, so the top row is the first thing pushed
+    std::vector<std::string> StackView::render(const Stack &stack, uint64_t stackPointer)
+    {
+        const size_t rowCount{ stack.content().size() / 8 };
+        if(m_following)
+        {
+            const size_t stackPointerRow{
+                stackPointer >= stack.beginning() ? 0 : (stack.beginning() - stackPointer + 7) / 8
+            };
+            if(stackPointerRow < m_firstRow)
+            {
+                m_firstRow = stackPointerRow;
+            }
+            else if(stackPointerRow >= m_firstRow + m_height)
+            {
+                m_firstRow = stackPointerRow - m_height + 1;
+            }
+        }
+        m_firstRow = std::min(m_firstRow, rowCount > m_height ? rowCount - m_height : 0);
+
+        std::vector<std::string> lines;
+        const size_t lastRow{ std::min(m_firstRow + m_height, rowCount) };
+        for(size_t row = m_firstRow; row < lastRow; ++row)
+        {
+            const uint64_t address{ stack.beginning() - row * 8 };
+            const bool pointsHere{ stackPointer >= address && stackPointer < address + 8 };
+            lines.push_back(fmt::format("{0}{1:04X}: {2:016X}", pointsHere ? '>' : ' ', address, stack.load(address)));
+        }
+        return lines;
+    }
+
+    void StackView::pageUp()
+    {
+        m_following = false;
+        m_firstRow -= std::min(m_firstRow, m_height);
+    }
+
+    // Clamped to the end of the stack on the next render
+    void StackView::pageDown()
+    {
+        m_following = false;
+        m_firstRow += m_height;
+    }
+
+    void StackView::follow()
+    {
+        m_following = true;
+    }
+
+    bool StackView::following() const
+    {
+        return m_following;
+    }
+} // namespace ostrich
@@ -0,0 +1,205 @@
+module;
+
+#include <fmt/core.h>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+module Ostrich;
+
+namespace ostrich
+{
+    constexpr std::array<uint8_t, 8> dumpMagic{ 'O', 'S', 'T', 'R', 'D', 'U', 'M', 'P' };
+    constexpr uint32_t dumpVersion{ 3 };
+
+    // The stack content is stored from the highest address down, the dump goes from the lowest
+    // address up, like a hex dump
+    StateDump StateDump::of(const Vm &vm)
+    {
+        StateDump dump{ vm.cpu().nextInstruction(), vm.historyDepth() };
+        for(const auto &r : vm.cpu().registers())
+        {
+            dump.registers[static_cast<size_t>(r.registerName)] = r.value;
+        }
+        dump.flags = vm.cpu().flags();
+        for(size_t i = 0; i < vectorRegisterCount; ++i)
+        {
+            dump.vectors[i] = vm.cpu().vectorValue(static_cast<uint8_t>(i));
+        }
+        const auto &content = vm.stack().content();
+        dump.memoryAddress = vm.stack().beginning() + 8 - content.size();
+        dump.memory.assign(content.rbegin(), content.rend());
+        return dump;
+    }
+
+    void appendHexByte(std::string &hex, uint8_t byte)
+    {
+        static constexpr char digits[]{ "0123456789abcdef" };
+        hex += digits[byte >> 4];
+        hex += digits[byte & 0xf];
+    }
+
+    std::string cpuJson(const StateDump &dump)
+    {
+        std::string json = fmt::format("\"nextInstruction\":{},\"registers\":{{", dump.nextInstruction);
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            json += fmt::format("{}\"{}\":{}", i == 0 ? "" : ",", toString(static_cast<RegisterName>(i)),
+                                dump.registers[i]);
+        }
+        json += fmt::format("}},\"flags\":{},\"vectors\":{{", dump.flags);
+        for(size_t i = 0; i < vectorRegisterCount; ++i)
+        {
+            std::string bytes;
+            for(const auto qword : dump.vectors[i].qwords)
+            {
+                for(size_t j = 0; j < 8; ++j)
+                {
+                    appendHexByte(bytes, static_cast<uint8_t>(qword >> j * 8));
+                }
+            }
+            json += fmt::format("{}\"{}\":\"{}\"", i == 0 ? "" : ",",
+                                toString(VectorRegister{ static_cast<uint8_t>(i), true }), bytes);
+        }
+        return json + "}";
+    }
+
+    std::string memoryJson(const StateDump &dump)
+    {
+        std::string bytes;
+        bytes.reserve(dump.memory.size() * 2);
+        for(const auto byte : dump.memory)
+        {
+            appendHexByte(bytes, byte);
+        }
+        return fmt::format("\"memory\":{{\"address\":{},\"bytes\":\"{}\"}}", dump.memoryAddress, bytes);
+    }
+
+    std::string StateDump::toJson() const
+    {
+        return fmt::format("{{{},\"historyDepth\":{},{}}}", cpuJson(*this), historyDepth, memoryJson(*this));
+    }
+
+    void appendU64(std::vector<uint8_t> &data, uint64_t value, size_t byteCount = 8)
+    {
+        for(size_t i = 0; i < byteCount; ++i)
+        {
+            data.push_back(static_cast<uint8_t>(value >> i * 8));
+        }
+    }
+
+    std::vector<uint8_t> StateDump::toBinary() const
+    {
+        std::vector<uint8_t> data(dumpMagic.begin(), dumpMagic.end());
+        data.reserve(8 + 4 + 4 + 4 + 8 * (5 + registerCount + 4 * vectorRegisterCount) + memory.size());
+        appendU64(data, dumpVersion, 4);
+        appendU64(data, registerCount, 4);
+        appendU64(data, vectorRegisterCount, 4);
+        appendU64(data, nextInstruction);
+        appendU64(data, historyDepth);
+        for(const auto value : registers)
+        {
+            appendU64(data, value);
+        }
+        appendU64(data, flags);
+        for(const auto &vector : vectors)
+        {
+            for(const auto qword : vector.qwords)
+            {
+                appendU64(data, qword);
+            }
+        }
+        appendU64(data, memoryAddress);
+        appendU64(data, memory.size());
+        data.insert(data.end(), memory.begin(), memory.end());
+        return data;
+    }
+
+    uint64_t readU64(std::span<const uint8_t> data, size_t &position, size_t byteCount = 8)
+    {
+        if(byteCount > data.size() - position)
+        {
+            throw std::runtime_error(fmt::format("Truncated state dump, tried to read {} bytes at offset {} of {}",
+                                                 byteCount, position, data.size()));
+        }
+        uint64_t result{ 0 };
+        for(size_t i = 0; i < byteCount; ++i)
+        {
+            result |= static_cast<uint64_t>(data[position + i]) << i * 8;
+        }
+        position += byteCount;
+        return result;
+    }
+
+    StateDump StateDump::fromBinary(std::span<const uint8_t> data)
+    {
+        if(data.size() < dumpMagic.size() || !std::equal(dumpMagic.begin(), dumpMagic.end(), data.begin()))
+        {
+            throw std::runtime_error("Not an Ostrich state dump");
+        }
+        size_t position{ dumpMagic.size() };
+        const auto version = readU64(data, position, 4);
+        if(version != dumpVersion)
+        {
+            throw std::runtime_error(fmt::format("Unsupported state dump version {}, expected {}", version, dumpVersion));
+        }
+        const auto dumpedRegisterCount = readU64(data, position, 4);
+        if(dumpedRegisterCount != registerCount)
+        {
+            throw std::runtime_error(
+            fmt::format("State dump has {} registers, expected {}", dumpedRegisterCount, registerCount));
+        }
+        const auto dumpedVectorRegisterCount = readU64(data, position, 4);
+        if(dumpedVectorRegisterCount != vectorRegisterCount)
+        {
+            throw std::runtime_error(fmt::format("State dump has {} vector registers, expected {}",
+                                                 dumpedVectorRegisterCount, vectorRegisterCount));
+        }
+        StateDump dump{ readU64(data, position), readU64(data, position) };
+        for(auto &value : dump.registers)
+        {
+            value = readU64(data, position);
+        }
+        dump.flags = readU64(data, position);
+        for(auto &vector : dump.vectors)
+        {
+            for(auto &qword : vector.qwords)
+            {
+                qword = readU64(data, position);
+            }
+        }
+        dump.memoryAddress = readU64(data, position);
+        const auto memorySize = readU64(data, position);
+        if(memorySize != data.size() - position)
+        {
+            throw std::runtime_error(fmt::format("State dump has {} bytes of memory, expected {}",
+                                                 data.size() - position, memorySize));
+        }
+        dump.memory.assign(data.begin() + position, data.end());
+        return dump;
+    }
+
+    void StateDump::save(const std::filesystem::path &path) const
+    {
+        std::ofstream file(path, std::ios::binary);
+        if(!file.is_open())
+        {
+            throw std::runtime_error(fmt::format("Failed to open '{}'", path.string()));
+        }
+        if(path.extension() == ".json")
+        {
+            file << toJson() << "\n";
+        }
+        else
+        {
+            const auto data = toBinary();
+            file.write(reinterpret_cast<const char *>(data.data()), data.size());
+        }
+    }
+} // namespace ostrich
@@ -2,6 +2,7 @@ module;
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <cctype>
 #include <optional>
 #include <ostream>
 #include <string>
@@ -18,6 +19,13 @@ namespace ostrich::tokenizer
         input.remove_prefix(std::distance(input.cbegin(), firstNonSpace));
     }
 
+    std::string_view take(std::string_view &input, size_t count)
+    {
+        const auto taken = input.substr(0, count);
+        input.remove_prefix(count);
+        return taken;
+    }
+
     std::optional<Token> tryTokenizeSingleCharacter(std::string_view &input)
     {
         if(input.empty())
@@ -28,102 +36,108 @@ namespace ostrich::tokenizer
         switch(input[0])
         {
         case ',':
-            input.remove_prefix(1);
-            return Comma{};
+            return Comma{ take(input, 1) };
         case '+':
-            input.remove_prefix(1);
-            return ArithmeticOperator{ "+" };
         case '-':
-            input.remove_prefix(1);
-            return ArithmeticOperator{ "-" };
         case '*':
-            input.remove_prefix(1);
-            return ArithmeticOperator{ "*" };
+            return ArithmeticOperator{ take(input, 1) };
         case '[':
-            input.remove_prefix(1);
-            return LeftBracket{};
+            return LeftBracket{ take(input, 1) };
         case ']':
-            input.remove_prefix(1);
-            return RightBracket{};
+            return RightBracket{ take(input, 1) };
         case '(':
-            input.remove_prefix(1);
-            return LeftParenthesis{};
+            return LeftParenthesis{ take(input, 1) };
         case ')':
-            input.remove_prefix(1);
-            return RightParenthesis{};
+            return RightParenthesis{ take(input, 1) };
+        case ':':
+            return Colon{ take(input, 1) };
         default:
             return std::nullopt;
         }
     }
 
-    bool isNumberCharacter(char c)
+    std::optional<ComparisonOperator> tryTokenizeComparisonOperator(std::string_view &input)
     {
-        return isdigit(c) || c == 'x';
+        if(input.starts_with("==") || input.starts_with("!=") || input.starts_with("<=") || input.starts_with(">="))
+        {
+            return ComparisonOperator{ take(input, 2) };
+        }
+        if(input.starts_with("<") || input.starts_with(">"))
+        {
+            return ComparisonOperator{ take(input, 1) };
+        }
+        return std::nullopt;
     }
 
     bool isWordCharacter(char c)
     {
-        return isalnum(c) || (c == '_');
+        return std::isalnum(static_cast<unsigned char>(c)) || (c == '_');
     }
 
+    // Numbers start with a digit, but can contain letters like in 0xff. The parser checks that
+    // they are well formed.
     std::optional<Number> tryTokenizeNumber(std::string_view &input)
     {
-        if(!input.empty() && input[0] == 'x') // Otherwise "x123" would be treated as a number
+        if(input.empty() || !std::isdigit(static_cast<unsigned char>(input[0])))
         {
             return std::nullopt;
         }
-        const auto end = std::find_if_not(input.cbegin(), input.cend(), isNumberCharacter);
+        const auto end = std::find_if_not(input.cbegin(), input.cend(), isWordCharacter);
+        return Number{ take(input, std::distance(input.cbegin(), end)) };
+    }
+
+    std::optional<Word> tryTokenizeWord(std::string_view &input)
+    {
+        const auto end = std::find_if_not(input.cbegin(), input.cend(), isWordCharacter);
         if(end == input.cbegin())
         {
             return std::nullopt;
         }
-        const Number word{ std::string{ input.cbegin(), end } };
-        input.remove_prefix(std::distance(input.cbegin(), end));
-        return word;
+        return Word{ take(input, std::distance(input.cbegin(), end)) };
     }
 
-    std::optional<Word> tryTokenizeWord(std::string_view &input)
+    std::string_view value(const Token &token)
     {
-        const auto end = std::find_if_not(input.cbegin(), input.cend(), isWordCharacter);
-        if(end == input.cbegin())
+        return std::visit([](const auto &t) { return t.value; }, token);
+    }
+
+    Lexer::Lexer(std::string_view input) : m_input{ input }
+    {
+    }
+
+    std::optional<Token> Lexer::next()
+    {
+        skipSpace(m_input);
+        if(m_input.empty())
         {
             return std::nullopt;
         }
-        const Word word{ std::string{ input.cbegin(), end } };
-        input.remove_prefix(std::distance(input.cbegin(), end));
-        return word;
+        if(auto token = tryTokenizeSingleCharacter(m_input))
+        {
+            return token;
+        }
+        if(auto token = tryTokenizeComparisonOperator(m_input))
+        {
+            return token;
+        }
+        if(auto token = tryTokenizeNumber(m_input))
+        {
+            return token;
+        }
+        if(auto token = tryTokenizeWord(m_input))
+        {
+            return token;
+        }
+        return Unknown{ take(m_input, 1) };
     }
 
     std::vector<Token> tokenize(std::string_view input)
     {
         std::vector<Token> result;
-        while(!input.empty())
+        Lexer lexer{ input };
+        while(const auto token = lexer.next())
         {
-            skipSpace(input);
-            {
-                const auto &token = tryTokenizeSingleCharacter(input);
-                if(token)
-                {
-                    result.push_back(*token);
-                    continue;
-                }
-            }
-            {
-                const auto &token = tryTokenizeNumber(input);
-                if(token)
-                {
-                    result.push_back(*token);
-                    continue;
-                }
-            }
-            {
-                const auto &token = tryTokenizeWord(input);
-                if(token)
-                {
-                    result.push_back(*token);
-                    continue;
-                }
-            }
+            result.push_back(*token);
         }
         return result;
     }
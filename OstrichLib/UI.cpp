@@ -2,65 +2,220 @@ module;
 
 #include <fmt/core.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <ranges>
 #include <string>
+#include <thread>
 #include <variant>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
 module Ostrich;
 
 
 namespace ostrich
 {
+    namespace
+    {
+        std::atomic<bool> interrupted{ false };
+
+        void onInterrupt(int)
+        {
+            interrupted = true;
+        }
+
+        // Ctrl-C stops a run instead of killing the debugger, but only while running
+        class InterruptHandler
+        {
+        public:
+            InterruptHandler() : m_previous{ std::signal(SIGINT, onInterrupt) }
+            {
+                interrupted = false;
+            }
+
+            ~InterruptHandler()
+            {
+                std::signal(SIGINT, m_previous);
+            }
+
+        private:
+            void (*m_previous)(int);
+        };
+
+        // Calls tick on its own thread every interval until destroyed
+        class Ticker
+        {
+        public:
+            Ticker(std::chrono::milliseconds interval, std::function<void()> tick)
+            : m_thread{ [this, interval, tick]() {
+                  std::unique_lock lock{ m_mutex };
+                  while(!m_stopping.wait_for(lock, interval, [this]() { return m_stopped; }))
+                  {
+                      // Not holding the lock while ticking, so the destructor never waits for it
+                      lock.unlock();
+                      tick();
+                      lock.lock();
+                  }
+              } }
+            {
+            }
+
+            ~Ticker()
+            {
+                {
+                    std::lock_guard lock{ m_mutex };
+                    m_stopped = true;
+                }
+                m_stopping.notify_one();
+                m_thread.join();
+            }
 
-    UI::UI(size_t width, size_t height, Vm &vm) : m_width(width), m_height(height), m_vm(vm)
+        private:
+            std::mutex m_mutex;
+            std::condition_variable m_stopping;
+            bool m_stopped{ false };
+            // Last, so it starts after the members it uses are constructed
+            std::thread m_thread;
+        };
+
+        constexpr std::chrono::milliseconds frameInterval{ 100 };
+    } // namespace
+
+    UI::UI(size_t width, size_t height, Vm &vm)
+    : m_width(width), m_height(height), m_vm(vm), m_screen(width, height - 1), m_sourceView(height - 2),
+      m_stackView(height - 2)
     {
+#ifdef _WIN32
+        // Needed for the escape sequences used to only redraw what changed
+        const auto console = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode{ 0 };
+        if(GetConsoleMode(console, &mode))
+        {
+            SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+        }
+#endif
     }
 
-    void UI::render_register(const std::string &name, uint64_t value, char *buf) const
+    void UI::render_register(const std::string &name, uint64_t value, size_t row)
     {
-        const auto s = fmt::format("{0}: {1:016X}", name, value);
-        std::copy(s.c_str(), s.c_str() + s.size(), &(buf[0]) + static_cast<int>(m_width * 0.4));
+        m_screen.write(row, static_cast<size_t>(m_width * 0.4), fmt::format("{0}: {1:016X}", name, value));
     }
 
-    void UI::render() const
+    void UI::render()
     {
-        std::vector<char> buffer_owner((m_width * (m_height - 1)) + 1, ' ');
-        buffer_owner.at(m_width * (m_height - 1)) = '\0';
-        char *buf = buffer_owner.data();
+        m_screen.clear();
 
         // Source
-        for(size_t i = 0; i < m_vm.source().size(); ++i)
+        const auto source = m_sourceView.render(m_vm.source(), m_vm.cpu().nextInstruction());
+        for(size_t row = 0; row < source.size(); ++row)
         {
-            const auto &instruction = m_vm.source()[i];
-            // TODO these two lines are a mess, should be a function
-            const auto s = std::visit([](const auto &i) { return i.toString(); }, instruction);
-            const auto s2 = (i == m_vm.cpu().nextInstruction() ? ">" : " ") + s;
-            std::copy(s2.c_str(), s2.c_str() + s2.size(), &(buf[m_width * i + 5]));
+            m_screen.write(row, 5, source[row]);
         }
 
         // Registers
-        for(size_t i = 0; i < m_vm.cpu().registers().size(); ++i)
+        const auto registers = m_vm.cpu().registers();
+        for(size_t i = 0; i < registers.size(); ++i)
         {
-            const auto &reg = m_vm.cpu().registers()[i];
-            render_register(toString(reg.registerName), reg.value, buf + m_width * i);
+            render_register(toString(registers[i].registerName), registers[i].value, i);
         }
+        render_register("rflags", m_vm.cpu().flags(), registers.size());
 
         // Stack
-        const auto &stack = m_vm.stack().content();
-        const size_t maxHeight{ m_height - 1 };
-        for(size_t i = 0; i < stack.size(); ++i)
+        const auto stack = m_stackView.render(m_vm.stack(), m_vm.cpu().registerValue(RegisterName::rsp));
+        for(size_t row = 0; row < stack.size(); ++row)
         {
-            const auto stackPointer{
-                m_vm.stack().beginning() - i == m_vm.cpu().registerValue(RegisterName::rsp) ? '>' : ' '
-            };
-            const auto s =
-            fmt::format("{0}{1:04X}: {2:02X}", stackPointer, m_vm.stack().beginning() - i, stack[i]);
-            const size_t row{ i % maxHeight };
-            const size_t col{ i / maxHeight };
-            std::copy(s.c_str(), s.c_str() + s.size(), &(buf[m_width * row + m_width - 26 + col * 12]));
+            m_screen.write(row, m_width - 26, stack[row]);
+        }
+        render_statistics(m_height - 2);
+        std::cout << m_screen.present();
+        std::cout << fmt::format("\x1b[{};1H\x1b[K", m_height) << m_status << "(ostrich) " << std::flush;
+    }
+
+    std::string withUnit(double value, const char *const units[4], double step)
+    {
+        size_t unit{ 0 };
+        while(value >= step && unit < 3)
+        {
+            value /= step;
+            ++unit;
+        }
+        return unit == 0 ? fmt::format("{:.0f}{}", value, units[unit]) : fmt::format("{:.1f}{}", value, units[unit]);
+    }
+
+    void UI::render_statistics(size_t row)
+    {
+        static const char *const count[]{ "", "k", "M", "G" };
+        static const char *const bytes[]{ " B", " KiB", " MiB", " GiB" };
+        const auto statistics = m_vm.statistics();
+        const std::chrono::duration<double, std::milli> parseTime{ statistics.lastParseTime };
+        m_screen.write(row, 0,
+                       fmt::format("Instructions: {} | {} steps/s | History: {} states, {} | Parse: {:.1f} ms",
+                                   statistics.instructionsExecuted, withUnit(statistics.stepsPerSecond, count, 1000),
+                                   statistics.historyStates, withUnit(static_cast<double>(statistics.historyBytes), bytes, 1024),
+                                   parseTime.count()));
+    }
+
+    // Called from the render thread while running, so only looks at progress and not the Vm
+    void UI::render_progress(const Progress &progress, double stepsPerSecond)
+    {
+        for(size_t i = 0; i < registerCount; ++i)
+        {
+            render_register(toString(static_cast<RegisterName>(i)), progress.registers[i], i);
+        }
+        std::cout << m_screen.present();
+        std::cout << fmt::format("\x1b[{};1H\x1b[KRunning: {} steps, {:.0f} steps/s, next instruction {} "
+                                 "(Ctrl-C to stop)",
+                                 m_height, progress.steps, stepsPerSecond, progress.nextInstruction)
+                  << std::flush;
+    }
+
+    // The run happens on this thread, while a render thread shows its progress. The two only
+    // share the progress channel, so the run never waits for the terminal.
+    void UI::run(size_t maxSteps)
+    {
+        ProgressChannel progress;
+        Vm::StopReason stopReason;
+        {
+            auto previous = progress.read();
+            auto previousTime = std::chrono::steady_clock::now();
+            Ticker renderer{ frameInterval, [&]() {
+                                const auto current = progress.read();
+                                const auto now = std::chrono::steady_clock::now();
+                                const std::chrono::duration<double> elapsed{ now - previousTime };
+                                render_progress(current, (current.steps - previous.steps) / elapsed.count());
+                                previous = current;
+                                previousTime = now;
+                            } };
+            InterruptHandler interruptHandler;
+            stopReason = m_vm.run(maxSteps, &interrupted, &progress);
+        }
+        switch(stopReason)
+        {
+        case Vm::StopReason::breakpoint:
+            m_status = "Breakpoint hit. ";
+            break;
+        case Vm::StopReason::watchpoint:
+            m_status = "Watchpoint hit. ";
+            break;
+        case Vm::StopReason::end:
+            m_status = "End of program. ";
+            break;
+        case Vm::StopReason::stepLimit:
+            break;
+        case Vm::StopReason::interrupted:
+            m_status = "Interrupted. ";
+            break;
         }
-        std::cout << buf;
-        std::cout << "(ostrich) ";
     }
 
     void UI::mainLoop()
@@ -71,6 +226,7 @@ namespace ostrich
             std::string command;
             render();
             std::getline(std::cin, command);
+            m_status.clear();
             try
             {
                 if(command.empty())
@@ -89,13 +245,83 @@ namespace ostrich
                 {
                     m_vm.step();
                 }
+                else if(command == "c" || command == "continue")
+                {
+                    run(std::numeric_limits<size_t>::max());
+                }
+                else if(command == "n" || command.starts_with("n ") || command.starts_with("next"))
+                {
+                    const auto count = parser::split(command, ' ');
+                    run(count.size() > 1 ? std::stoull(std::string{ count[1] }) : 1);
+                }
+                else if(command == "br" || command == "break")
+                {
+                    for(size_t i = 0; i < m_vm.breakpoints().size(); ++i)
+                    {
+                        std::cout << fmt::format("{}: {}\n", i, toString(m_vm.breakpoints()[i]));
+                    }
+                    std::cout << "\n(press any key)";
+                    std::cin.get();
+                    m_screen.invalidate();
+                }
+                else if(command.starts_with("br ") || command.starts_with("break "))
+                {
+                    const auto where = command.substr(command.find(' ') + 1);
+                    if(where.find_first_not_of("0123456789") == std::string::npos)
+                    {
+                        m_vm.addBreakpoint(Breakpoint{ static_cast<size_t>(std::stoull(where)) });
+                    }
+                    else
+                    {
+                        m_vm.addBreakpoint(parser::parseCondition(where));
+                    }
+                }
+                else if(command.starts_with("del ") || command.starts_with("delete "))
+                {
+                    m_vm.removeBreakpoint(std::stoull(command.substr(command.find(' ') + 1)));
+                }
+                else if(command == "wa" || command == "watch")
+                {
+                    for(size_t i = 0; i < m_vm.watchpoints().size(); ++i)
+                    {
+                        std::cout << fmt::format("{}: {}\n", i, m_vm.watchpoints()[i].toString());
+                    }
+                    std::cout << "\n(press any key)";
+                    std::cin.get();
+                    m_screen.invalidate();
+                }
+                else if(command.starts_with("wa ") || command.starts_with("watch "))
+                {
+                    const auto arguments = parser::split(command, ' ');
+                    if(arguments.size() != 3 || (arguments[1] != "read" && arguments[1] != "write" && arguments[1] != "change"))
+                    {
+                        throw std::runtime_error(fmt::format("Syntax error: '{}'", command));
+                    }
+                    const auto kind = arguments[1] == "read"    ? WatchKind::read
+                                      : arguments[1] == "write" ? WatchKind::write
+                                                                : WatchKind::change;
+                    m_vm.addWatchpoint(Watchpoint{ std::stoull(std::string{ arguments[2] }, nullptr, 0), kind });
+                }
+                else if(command.starts_with("unwa ") || command.starts_with("unwatch "))
+                {
+                    m_vm.removeWatchpoint(std::stoull(command.substr(command.find(' ') + 1)));
+                }
                 else if(command == "q" || command == "quit")
                 {
                     return;
                 }
                 else if(command.starts_with("l ") || command.starts_with("load"))
                 {
-                    m_vm.load(parser::parse(std::filesystem::path(parser::split(command, ' ')[1])));
+                    m_vm.load(std::filesystem::path(parser::split(command, ' ')[1]));
+                }
+                else if(command.starts_with("w ") || command.starts_with("write"))
+                {
+                    binary::save(m_vm.source(), std::filesystem::path(parser::split(command, ' ')[1]),
+                                 m_vm.sourcePath().string());
+                }
+                else if(command.starts_with("du ") || command.starts_with("dump "))
+                {
+                    StateDump::of(m_vm).save(std::filesystem::path(parser::split(command, ' ')[1]));
                 }
                 else if(command.starts_with("'"))
                 {
@@ -105,16 +331,45 @@ namespace ostrich
                 {
                     m_vm.restorePreviousState();
                 }
+                else if(command == "pu" || command == "pageup")
+                {
+                    m_stackView.pageUp();
+                }
+                else if(command == "pd" || command == "pagedown")
+                {
+                    m_stackView.pageDown();
+                }
+                else if(command == "f" || command == "follow")
+                {
+                    m_stackView.follow();
+                }
                 else if(command == "h" || command == "help" || command == "?")
                 {
                     std::cout << "s / step              Step one instruction forward\n"
-                              << "b / back              Step one instruction back\n"
-                              << "l / load <filename>   Load new source from <filename>\n"
+                              << "b / back              Step one instruction back, or undo a whole run\n"
+                              << "n / next <count>      Run <count> instructions, stopping at breakpoints\n"
+                              << "c / continue          Run until a breakpoint or the end, Ctrl-C stops\n"
+                              << "br / break <where>    Break before instruction number <where>, or when\n"
+                              << "                      a condition like rax == 5 or [rsp + 8] > rbx becomes true\n"
+                              << "br / break            List breakpoints\n"
+                              << "del / delete <n>      Delete breakpoint number <n>\n"
+                              << "wa / watch <kind> <a> Stop when the qword at address <a> is read, written\n"
+                              << "                      or changed, for <kind> read, write or change\n"
+                              << "wa / watch            List watchpoints\n"
+                              << "unwa / unwatch <n>    Delete watchpoint number <n>\n"
+                              << "l / load <filename>   Load new source from <filename> (.asm or binary)\n"
+                              << "w / write <filename>  Write the loaded program to <filename> in binary form\n"
+                              << "pu / pageup           Scroll the stack view up a page\n"
+                              << "pd / pagedown         Scroll the stack view down a page\n"
+                              << "f / follow            Make the stack view follow rsp again\n"
+                              << "du / dump <filename>  Dump registers and memory to <filename>, as JSON if it\n"
+                              << "                      ends with .json and in binary form otherwise\n"
                               << "'<instruction>        Interpret and execute <instruction>\n"
                               << "h / help              Print this help\n"
                               << "q / quit              Quit\n\n"
                               << "(press any key)";
                     std::cin.get();
+                    m_screen.invalidate();
                 }
                 else
                 {
@@ -127,6 +382,7 @@ namespace ostrich
                 std::cout << e.what() << std::endl;
                 previousCommand = "";
                 std::cin.get();
+                m_screen.invalidate();
             }
         }
     }
@@ -1,35 +1,142 @@
 module;
 
+#include "Overloaded.h"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iterator>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <utility>
 #include <variant>
+#include <vector>
 
 module Ostrich;
 
 
 namespace ostrich
 {
-    Vm::Vm(Source source, size_t stackSize) : m_states{ Vm::State{ source, stackSize } }
+    namespace
+    {
+        // Reports the loads and stores of a stack to the watchpoints while instructions execute.
+        // The stack doesn't keep the pointer afterwards, since the Vm and the states in its
+        // history may be copied or moved.
+        class WatchScope
+        {
+        public:
+            WatchScope(Stack &stack, Watchpoints &watchpoints) : m_stack{ stack }
+            {
+                m_stack.watch(watchpoints.empty() ? nullptr : &watchpoints);
+            }
+            WatchScope(const WatchScope &) = delete;
+            WatchScope &operator=(const WatchScope &) = delete;
+            ~WatchScope()
+            {
+                m_stack.watch(nullptr);
+            }
+
+        private:
+            Stack &m_stack;
+        };
+    } // namespace
+
+    Vm::Vm(Source source, size_t stackSize, uint64_t stackBeginning)
+    {
+        parser::resolveLabels(source);
+        m_states.emplace_back(std::move(source), stackSize, stackBeginning);
+    }
+
+    Vm::Vm(const Vm &other)
+    : m_sourcePath{ other.m_sourcePath }, m_parser{ other.m_parser }, m_breakpoints{ other.m_breakpoints },
+      m_watchpoints{ other.m_watchpoints }, m_blockCache{ other.m_blockCache },
+      m_instructionsExecuted{ other.m_instructionsExecuted }, m_samples{ other.m_samples },
+      m_lastParseTime{ other.m_lastParseTime }
+    {
+        const auto source = std::make_shared<Source>(other.source());
+        const auto handlers = std::make_shared<std::vector<InstructionHandler>>(*other.state().m_handlers);
+        m_states.reserve(other.m_states.size());
+        for(const auto &state : other.m_states)
+        {
+            m_states.emplace_back(state, source, handlers);
+        }
+    }
+
+    Vm &Vm::operator=(const Vm &other)
     {
+        return *this = Vm{ other };
     }
 
     void Vm::load(Source source)
     {
+        parser::resolveLabels(source);
         auto stackSize = state().m_stack.content().size();
+        auto stackBeginning = state().m_stack.beginning();
         m_states.clear();
-        m_states.emplace_back(source, stackSize);
+        m_states.emplace_back(std::move(source), stackSize, stackBeginning);
+        m_sourcePath.clear();
+        m_blockCache.clear();
+    }
+
+    void Vm::load(const std::filesystem::path &sourcePath)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if(binary::isBinary(sourcePath))
+        {
+            load(binary::load(sourcePath));
+        }
+        else if(elf::isElf(sourcePath))
+        {
+            const elf::Executable executable{ sourcePath };
+            // Only the stack is memory, so the program would run without its data
+            for(const auto &segment : executable.segments())
+            {
+                if(segment.writable && segment.memorySize > 0)
+                {
+                    throw std::runtime_error(
+                        fmt::format("Writable segments are not supported, there is one at 0x{:x}", segment.address));
+                }
+            }
+            load(executable.decode());
+        }
+        else if(sourcePath != m_sourcePath)
+        {
+            parser::IncrementalParser parser;
+            Source source;
+            parser.update(sourcePath, source);
+            load(std::move(source));
+            m_parser = std::move(parser);
+            m_sourcePath = sourcePath;
+        }
+        else if(const auto firstChangedInstruction = m_parser.update(sourcePath, *state().m_source))
+        {
+            *state().m_handlers = Cpu::handlers(*state().m_source);
+            m_blockCache.clear();
+            truncateHistory(*firstChangedInstruction);
+        }
+        m_lastParseTime = std::chrono::steady_clock::now() - start;
     }
 
     void Vm::step()
     {
         saveState();
+        const WatchScope watchScope{ state().m_stack, m_watchpoints };
+        const auto nextInstruction = state().m_cpu.nextInstruction();
         state().m_cpu.step();
+        countInstructions(state().m_cpu.nextInstruction() == nextInstruction ? 0 : 1);
     }
 
     void Vm::execute(const Instruction &instruction)
     {
+        const auto resolved = parser::resolveLabels(instruction, source());
         saveState();
-        state().m_cpu.execute(instruction);
+        const WatchScope watchScope{ state().m_stack, m_watchpoints };
+        state().m_cpu.execute(resolved);
+        countInstructions(1);
     }
 
     void Vm::restorePreviousState()
@@ -40,6 +147,288 @@ namespace ostrich
         }
     }
 
+    void Vm::stepBack()
+    {
+        // Runs that stopped before executing anything don't count
+        while(m_states.size() > 1 && state().m_runSteps == 0)
+        {
+            m_states.pop_back();
+        }
+        if(m_states.size() == 1)
+        {
+            return;
+        }
+        if(!state().m_afterRun)
+        {
+            m_states.pop_back();
+            return;
+        }
+        const auto steps = runSteps();
+        m_states.pop_back();
+        replay(steps - 1);
+    }
+
+    Vm::StopReason Vm::runBack(const std::atomic<bool> *interrupt)
+    {
+        const auto atBreakpoint = [&]() {
+            const Breakpoint here{ state().m_cpu.nextInstruction() };
+            return std::find(m_breakpoints.begin(), m_breakpoints.end(), here) != m_breakpoints.end();
+        };
+        while(m_states.size() > 1)
+        {
+            if(interrupt && interrupt->load(std::memory_order_relaxed))
+            {
+                return StopReason::interrupted;
+            }
+            if(state().m_runSteps == 0)
+            {
+                m_states.pop_back();
+                continue;
+            }
+            if(state().m_afterRun)
+            {
+                // Replays the run to find the last time it was at a breakpoint, other than where it
+                // ended
+                const auto steps = runSteps();
+                m_states.pop_back();
+                saveState();
+                size_t lastBreakpoint{ 0 };
+                for(size_t i = 1; i < steps; ++i)
+                {
+                    state().m_cpu.step();
+                    if(atBreakpoint())
+                    {
+                        lastBreakpoint = i;
+                    }
+                }
+                m_states.pop_back();
+                if(lastBreakpoint > 0)
+                {
+                    replay(lastBreakpoint);
+                    return StopReason::breakpoint;
+                }
+            }
+            else
+            {
+                m_states.pop_back();
+            }
+            if(atBreakpoint())
+            {
+                return StopReason::breakpoint;
+            }
+        }
+        return StopReason::end;
+    }
+
+    Vm::StopReason Vm::run(size_t maxSteps, const std::atomic<bool> *interrupt, ProgressChannel *progress)
+    {
+        const auto &source = *state().m_source;
+        if(state().m_cpu.nextInstruction() >= source.size())
+        {
+            return StopReason::end;
+        }
+        if(maxSteps == 0)
+        {
+            return StopReason::stepLimit;
+        }
+
+        // Flattened so the loop doesn't have to look through the breakpoints for every instruction
+        std::vector<bool> breakBefore(source.size());
+        std::vector<Condition> conditions;
+        for(const auto &breakpoint : m_breakpoints)
+        {
+            std::visit(overloaded{
+                       [&](const size_t instruction) {
+                           if(instruction < breakBefore.size())
+                           {
+                               breakBefore[instruction] = true;
+                           }
+                       },
+                       [&](const Condition &condition) { conditions.push_back(condition); },
+                       },
+                       breakpoint);
+        }
+
+        saveState();
+        const WatchScope watchScope{ state().m_stack, m_watchpoints };
+        state().m_afterRun = true;
+        auto &cpu = state().m_cpu;
+        Watchpoints *watchpoints{ m_watchpoints.empty() ? nullptr : &m_watchpoints };
+        // Conditions that are already true when starting don't stop the run until they have been
+        // false in between
+        std::vector<bool> wasTrue;
+        std::transform(conditions.begin(), conditions.end(), std::back_inserter(wasTrue),
+                       [&](const Condition &condition) { return cpu.evaluate(condition); });
+
+        size_t steps{ 0 };
+        size_t nextPublish{ 0 };
+        const auto publish = [&]() {
+            Progress current{ steps, cpu.nextInstruction() };
+            const auto registers = cpu.registers();
+            std::transform(registers.begin(), registers.end(), current.registers.begin(),
+                           [](const Register &r) { return r.value; });
+            progress->publish(current);
+            nextPublish = steps + progressInterval;
+        };
+        // A sample from the start, so the steps per second covers the whole run
+        countInstructions(0);
+        const auto stop = [&](StopReason reason) {
+            state().m_runSteps = steps;
+            countInstructions(steps);
+            if(progress)
+            {
+                publish();
+            }
+            return reason;
+        };
+
+        // Without conditions and watchpoints, there is nothing to check in the middle of a block
+        const bool runBlocks{ conditions.empty() && !watchpoints };
+        if(runBlocks)
+        {
+            m_blockCache.prepare(source, breakBefore);
+        }
+        BlockCache::Block *block{ nullptr };
+        for(;;)
+        {
+            if(cpu.nextInstruction() >= source.size())
+            {
+                return stop(StopReason::end);
+            }
+            if(steps == maxSteps)
+            {
+                return stop(StopReason::stepLimit);
+            }
+            if(steps > 0 && breakBefore[cpu.nextInstruction()])
+            {
+                return stop(StopReason::breakpoint);
+            }
+            if(interrupt && interrupt->load(std::memory_order_relaxed))
+            {
+                return stop(StopReason::interrupted);
+            }
+            if(progress && steps >= nextPublish)
+            {
+                publish();
+            }
+            if(runBlocks)
+            {
+                block = block ? &m_blockCache.successor(*block, cpu.nextInstruction())
+                              : &m_blockCache.at(cpu.nextInstruction());
+                // Close to the step limit, the rest is done one step at a time
+                if(block->size() <= maxSteps - steps)
+                {
+                    if(block->compiled)
+                    {
+                        // Compiled loops only come back here when out of budget, so the budget
+                        // is what decides how often progress and interrupts are checked. The
+                        // first instruction's breakpoint stops them after one round.
+                        const auto budget = breakBefore[block->first]
+                                            ? block->size()
+                                            : std::max(block->size(), std::min(maxSteps - steps, progressInterval));
+                        steps += cpu.executeCompiled(block->compiled, budget);
+                    }
+                    else
+                    {
+                        cpu.executeBlock(block->operations, block->first);
+                        steps += block->size();
+                        m_blockCache.executed(*block);
+                    }
+                    continue;
+                }
+                block = nullptr;
+            }
+            if(watchpoints)
+            {
+                // Evaluating conditions loads from memory too
+                watchpoints->clearHit();
+            }
+            cpu.step();
+            ++steps;
+            if(watchpoints && watchpoints->hit())
+            {
+                return stop(StopReason::watchpoint);
+            }
+            bool conditionHit{ false };
+            for(size_t i = 0; i < conditions.size(); ++i)
+            {
+                const bool isTrue{ cpu.evaluate(conditions[i]) };
+                conditionHit = conditionHit || (isTrue && !wasTrue[i]);
+                wasTrue[i] = isTrue;
+            }
+            if(conditionHit)
+            {
+                return stop(StopReason::breakpoint);
+            }
+        }
+    }
+
+    void Vm::addBreakpoint(Breakpoint breakpoint)
+    {
+        m_breakpoints.push_back(std::move(breakpoint));
+    }
+
+    void Vm::removeBreakpoint(size_t number)
+    {
+        if(number >= m_breakpoints.size())
+        {
+            throw std::runtime_error(fmt::format("No breakpoint number {}", number));
+        }
+        m_breakpoints.erase(m_breakpoints.begin() + number);
+    }
+
+    const std::vector<Breakpoint> &Vm::breakpoints() const
+    {
+        return m_breakpoints;
+    }
+
+    void Vm::addWatchpoint(Watchpoint watchpoint)
+    {
+        m_watchpoints.add(watchpoint);
+    }
+
+    void Vm::removeWatchpoint(size_t number)
+    {
+        m_watchpoints.remove(number);
+    }
+
+    const std::vector<Watchpoint> &Vm::watchpoints() const
+    {
+        return m_watchpoints.all();
+    }
+
+    void Vm::useJit(bool enabled)
+    {
+        m_blockCache.useJit(enabled);
+    }
+
+    Statistics Vm::statistics() const
+    {
+        size_t historyBytes{ m_states.capacity() * sizeof(State) };
+        for(const auto &state : m_states)
+        {
+            historyBytes += state.m_stack.content().capacity();
+        }
+        historyBytes += source().capacity() * sizeof(Instruction);
+
+        double stepsPerSecond{ 0 };
+        if(m_samples.size() > 1)
+        {
+            const std::chrono::duration<double> elapsed{ m_samples.back().time - m_samples.front().time };
+            if(elapsed.count() > 0)
+            {
+                stepsPerSecond =
+                (m_samples.back().instructionsExecuted - m_samples.front().instructionsExecuted) / elapsed.count();
+            }
+        }
+        return Statistics{ m_instructionsExecuted, stepsPerSecond, m_states.size(), historyBytes, m_lastParseTime };
+    }
+
+    size_t Vm::historyDepth() const
+    {
+        return m_states.size() - 1;
+    }
+
     const Cpu &Vm::cpu() const
     {
         return state().m_cpu;
@@ -52,8 +441,12 @@ namespace ostrich
 
     const Source &Vm::source() const
     {
+        return *state().m_source;
+    }
 
-        return state().m_source;
+    const std::filesystem::path &Vm::sourcePath() const
+    {
+        return m_sourcePath;
     }
 
     Vm::State &Vm::state()
@@ -69,18 +462,88 @@ namespace ostrich
     void Vm::saveState()
     {
         m_states.push_back(state());
+        state().m_afterRun = false;
+        state().m_runSteps.reset();
+    }
+
+    void Vm::countInstructions(uint64_t count)
+    {
+        m_instructionsExecuted += count;
+        const auto now = std::chrono::steady_clock::now();
+        // The last sample follows the count until sampleInterval after the one before it, so
+        // stepping one instruction at a time doesn't add a sample for every instruction
+        if(m_samples.size() > 1 && now - m_samples[m_samples.size() - 2].time < sampleInterval)
+        {
+            m_samples.back() = Sample{ now, m_instructionsExecuted };
+        }
+        else
+        {
+            m_samples.push_back(Sample{ now, m_instructionsExecuted });
+        }
+        // Keeps one sample from before the window, so that the window is covered even if there
+        // were no samples for a while
+        while(m_samples.size() > 2 && now - m_samples[1].time > statisticsWindow)
+        {
+            m_samples.pop_front();
+        }
+    }
+
+    size_t Vm::runSteps() const
+    {
+        if(!state().m_runSteps)
+        {
+            throw std::runtime_error("Can't go back into a run that failed, since it can't be replayed");
+        }
+        return *state().m_runSteps;
+    }
+
+    void Vm::replay(size_t steps)
+    {
+        if(steps == 0)
+        {
+            return;
+        }
+        saveState();
+        for(size_t i = 0; i < steps; ++i)
+        {
+            state().m_cpu.step();
+        }
+        state().m_afterRun = true;
+        state().m_runSteps = steps;
+    }
+
+    void Vm::truncateHistory(size_t firstChangedInstruction)
+    {
+        // Stepping from one state to the next executes at most the instruction the first state
+        // points to, so every state up to and including the first one pointing at a changed
+        // instruction has only seen unchanged instructions. A run may have executed anything, so
+        // the history also stops at the state it started from.
+        for(size_t i = 0; i + 1 < m_states.size(); ++i)
+        {
+            if(m_states[i].m_cpu.nextInstruction() >= firstChangedInstruction || m_states[i + 1].m_afterRun)
+            {
+                m_states.erase(m_states.begin() + i + 1, m_states.end());
+                return;
+            }
+        }
     }
 
     // State
-    Vm::State::State(Source source, size_t stackSize)
-    : m_stack{ stackSize, stackTop }, m_source{ std::move(source) }
+    Vm::State::State(Source source, size_t stackSize, uint64_t stackBeginning)
+    : m_stack{ stackSize, stackBeginning }, m_source{ std::make_shared<Source>(std::move(source)) },
+      m_handlers{ std::make_shared<std::vector<InstructionHandler>>(Cpu::handlers(*m_source)) }
+    {
+    }
+
+    Vm::State::State(const Vm::State &other) : State{ other, other.m_source, other.m_handlers }
     {
     }
 
-    Vm::State::State(const Vm::State &other)
-    : m_stack{ other.m_stack }, m_source{ other.m_source }, m_cpu{ m_stack, m_source,
-                                                                   other.m_cpu.nextInstruction(),
-                                                                   other.m_cpu.registers() }
+    Vm::State::State(const Vm::State &other, std::shared_ptr<Source> source,
+                     std::shared_ptr<std::vector<InstructionHandler>> handlers)
+    : m_stack{ other.m_stack }, m_source{ std::move(source) }, m_handlers{ std::move(handlers) },
+      m_cpu{ m_stack, *m_source, m_handlers.get(), other.m_cpu }, m_afterRun{ other.m_afterRun },
+      m_runSteps{ other.m_runSteps }
     {
     }
 
@@ -88,7 +551,10 @@ namespace ostrich
     {
         std::swap(lhs.m_stack, rhs.m_stack);
         std::swap(lhs.m_source, rhs.m_source);
+        std::swap(lhs.m_handlers, rhs.m_handlers);
         std::swap(lhs.m_cpu, rhs.m_cpu);
+        std::swap(lhs.m_afterRun, rhs.m_afterRun);
+        std::swap(lhs.m_runSteps, rhs.m_runSteps);
     }
 
     Vm::State &Vm::State::operator=(Vm::State other) noexcept
@@ -0,0 +1,129 @@
+module;
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+module Ostrich;
+
+namespace ostrich
+{
+    std::string toString(WatchKind watchKind)
+    {
+        using enum WatchKind;
+        switch(watchKind)
+        {
+        case read:
+            return "read";
+        case write:
+            return "write";
+        case change:
+            return "change";
+        }
+        return "?";
+    }
+
+    std::string Watchpoint::toString() const
+    {
+        return fmt::format("{} 0x{:X}", ostrich::toString(kind), address);
+    }
+
+    void Watchpoints::add(Watchpoint watchpoint)
+    {
+        m_watchpoints.push_back(watchpoint);
+        updateBlocks();
+    }
+
+    void Watchpoints::remove(size_t number)
+    {
+        if(number >= m_watchpoints.size())
+        {
+            throw std::runtime_error(fmt::format("No watchpoint number {}", number));
+        }
+        m_watchpoints.erase(m_watchpoints.begin() + number);
+        updateBlocks();
+    }
+
+    const std::vector<Watchpoint> &Watchpoints::all() const
+    {
+        return m_watchpoints;
+    }
+
+    bool Watchpoints::empty() const
+    {
+        return m_watchpoints.empty();
+    }
+
+    // The qwords at a and b overlap if they are less than 8 bytes apart. Written so it also works
+    // when they wrap around.
+    bool overlaps(uint64_t a, uint64_t b)
+    {
+        return a - b + 7 < 15;
+    }
+
+    void Watchpoints::onLoad(uint64_t address)
+    {
+        if(!mightBeWatched(address))
+        {
+            return;
+        }
+        m_hit = m_hit || std::any_of(m_watchpoints.begin(), m_watchpoints.end(), [=](const Watchpoint &w) {
+                    return w.kind == WatchKind::read && overlaps(w.address, address);
+                });
+    }
+
+    void Watchpoints::onStore(uint64_t address, uint8_t changedBytes)
+    {
+        if(!mightBeWatched(address))
+        {
+            return;
+        }
+        m_hit = m_hit || std::any_of(m_watchpoints.begin(), m_watchpoints.end(), [=](const Watchpoint &w) {
+                    if(w.kind == WatchKind::write)
+                    {
+                        return overlaps(w.address, address);
+                    }
+                    if(w.kind == WatchKind::change)
+                    {
+                        for(uint64_t i = 0; i < 8; ++i)
+                        {
+                            if((changedBytes >> i & 1) && address + i - w.address < 8)
+                            {
+                                return true;
+                            }
+                        }
+                    }
+                    return false;
+                });
+    }
+
+    bool Watchpoints::hit() const
+    {
+        return m_hit;
+    }
+
+    void Watchpoints::clearHit()
+    {
+        m_hit = false;
+    }
+
+    // An access covers at most two blocks, since blocks are bigger than a qword
+    bool Watchpoints::mightBeWatched(uint64_t address) const
+    {
+        return m_blocks[(address >> blockBits) % blockCount] || m_blocks[((address + 7) >> blockBits) % blockCount];
+    }
+
+    void Watchpoints::updateBlocks()
+    {
+        m_blocks.reset();
+        for(const auto &watchpoint : m_watchpoints)
+        {
+            m_blocks.set((watchpoint.address >> blockBits) % blockCount);
+            m_blocks.set(((watchpoint.address + 7) >> blockBits) % blockCount);
+        }
+    }
+} // namespace ostrich
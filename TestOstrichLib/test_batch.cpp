@@ -0,0 +1,76 @@
+#include "catch.hpp"
+
+#include <sstream>
+#include <string>
+
+import Ostrich;
+
+using Catch::Matchers::Contains;
+using Catch::Matchers::Equals;
+using Catch::Matchers::StartsWith;
+using namespace ostrich;
+using enum RegisterName;
+
+TEST_CASE("Batch runs a script")
+{
+    Vm vm{ Source{ Mov{ rax, 3 }, Inc{ rax }, Push{ rax } }, 16 };
+    std::ostringstream output;
+    Batch batch{ vm, output };
+    std::istringstream script{ "# A comment\n"
+                               "\n"
+                               "step 2\n"
+                               "registers\n"
+                               "'add rbx, 0x10\n"
+                               "back\n"
+                               "q\n"
+                               "step\n" };
+    batch.run(script);
+    CHECK(vm.cpu().nextInstruction() == 2);
+    CHECK(vm.cpu().registerValue(rax) == 4);
+    CHECK(vm.cpu().registerValue(rbx) == 0);
+    CHECK_THAT(output.str(), StartsWith("{\"nextInstruction\":2,\"registers\":{\"rax\":4,\"rbx\":0,"));
+}
+
+TEST_CASE("Batch steps and runs no further than the end")
+{
+    Vm vm{ Source{ Mov{ rax, 3 }, Inc{ rax }, Push{ rax } }, 16 };
+    std::ostringstream output;
+    Batch batch{ vm, output };
+    SECTION("Stepping")
+    {
+        batch.execute("step 1000000");
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.historyDepth() == 3);
+    }
+    SECTION("Running")
+    {
+        batch.execute("next 2");
+        CHECK(vm.cpu().nextInstruction() == 2);
+        batch.execute("n 1000000");
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.cpu().registerValue(rax) == 4);
+        CHECK(vm.historyDepth() == 2);
+    }
+}
+
+TEST_CASE("Batch dumps memory from the lowest address")
+{
+    Vm vm{ Source{ Mov{ rax, 0x1122 }, Push{ rax } }, 16 };
+    std::ostringstream output;
+    Batch batch{ vm, output };
+    batch.execute("step 2");
+    batch.execute("memory");
+    const auto address = vm.stack().beginning() - 8;
+    CHECK_THAT(output.str(), Equals("{\"memory\":{\"address\":" + std::to_string(address) +
+                                    ",\"bytes\":\"00000000000000002211000000000000\"}}\n"));
+}
+
+TEST_CASE("Batch errors refer to the script line")
+{
+    Vm vm{ Source{}, 16 };
+    std::ostringstream output;
+    Batch batch{ vm, output };
+    std::istringstream script{ "step 0\nfrobnicate\n" };
+    CHECK_THROWS_WITH(batch.run(script), Equals("Line 2: Syntax error: 'frobnicate'"));
+    CHECK_THROWS_WITH(batch.execute("step x"), Contains("Expected a count"));
+}
@@ -0,0 +1,154 @@
+#include "catch.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <variant>
+
+import Ostrich;
+
+using Catch::Matchers::Contains;
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using enum RegisterName;
+
+namespace
+{
+    Source allInstructions()
+    {
+        using enum AdditiveOperator;
+        return Source{ Inc{ rax },
+                       Dec{ rbx },
+                       Push{ rcx },
+                       Pop{ rdx },
+                       Add{ rsi, rdi },
+                       Add{ rbp, 0xfedcba9876543210 },
+                       Mov{ rsp, MemoryAddress{ rax, minus, rbx, 4, minus, 8 } },
+                       Mov{ rax, MemoryAddress{ rbx } },
+                       Sub{ rcx, 7 },
+                       Cmp{ rdx, MemoryAddress{ rsp } },
+                       Inc{ rsi, Width::dword },
+                       Dec{ rdi, Width::byte },
+                       Add{ rax, SubRegister{ rbx, Width::highByte }, Width::byte },
+                       Mov{ rcx, MemoryAddress{ rsp }, Width::word },
+                       Sub{ rdx, 0xff, Width::highByte },
+                       Push{ r15 },
+                       Mov{ r8, MemoryAddress{ r9, plus, r10, 2, minus, 16 }, Width::word },
+                       Pushf{},
+                       Label{ "loop" },
+                       Jmp{ "loop", 18 },
+                       Jcc{ ConditionCode::ge, "loop", 18 },
+                       Packed{ PackedOperation::paddq, VectorRegister{ 3 }, VectorRegister{ 3 }, VectorRegister{ 12 } },
+                       Packed{ PackedOperation::addps, VectorRegister{ 15, true }, VectorRegister{ 0, true },
+                               MemoryAddress{ r12, plus, rax, 8, minus, 32 }, true } };
+    }
+} // namespace
+
+TEST_CASE("Binary round trip")
+{
+    CHECK_THAT(binary::deserialize(binary::serialize(allInstructions())), Equals(allInstructions()));
+    CHECK(binary::deserialize(binary::serialize(Source{})).empty());
+}
+
+TEST_CASE("Binary rejects foreign or unsupported data")
+{
+    CHECK_THROWS_WITH(binary::deserialize(std::vector<uint8_t>{}), Equals("Not an Ostrich binary program"));
+
+    auto data = binary::serialize(allInstructions());
+    data[8] = binary::formatVersion + 1;
+    CHECK_THROWS_WITH(binary::deserialize(data), Contains("Unsupported binary program version"));
+}
+
+TEST_CASE("Binary rejects counts that don't fit in the data")
+{
+    const auto data = binary::serialize(Source{ Inc{ rax } }, "test.asm");
+    SECTION("Instructions")
+    {
+        auto corrupt = data;
+        // The instruction count, after the magic, the version and the reserved u16
+        corrupt[12] = 0xff;
+        corrupt[13] = 0xff;
+        corrupt[14] = 0xff;
+        corrupt[15] = 0xff;
+        CHECK_THROWS_WITH(binary::deserialize(corrupt), Contains("4294967295 instructions don't fit"));
+    }
+    SECTION("Strings")
+    {
+        auto corrupt = data;
+        corrupt[16] = 0xff;
+        corrupt[17] = 0xff;
+        corrupt[18] = 0xff;
+        corrupt[19] = 0xff;
+        CHECK_THROWS_WITH(binary::deserialize(corrupt), Contains("4294967295 strings don't fit"));
+    }
+}
+
+TEST_CASE("Binary errors refer to the original instruction")
+{
+    const auto data = binary::serialize(Source{ Inc{ rax } }, "test.asm");
+    SECTION("Truncated")
+    {
+        const std::vector<uint8_t> truncated(data.begin(), data.begin() + 30);
+        CHECK_THROWS_WITH(binary::deserialize(truncated), Contains("offset"));
+    }
+    SECTION("Bad register")
+    {
+        auto corrupt = data;
+        corrupt[28 + 5] = 0x42;
+        CHECK_THROWS_WITH(binary::deserialize(corrupt),
+                          Equals("Corrupt binary program 'test.asm', instruction 0 ('inc  rax'): register 66 "
+                                 "out of range"));
+    }
+    SECTION("ymm registers without vex")
+    {
+        const VectorRegister ymm1{ 1, true };
+        auto corrupt = binary::serialize(
+        Source{ Packed{ PackedOperation::pxor, ymm1, ymm1, ymm1, true } }, "test.asm");
+        // The vex flag, after the opcode, the text and the operation
+        corrupt[28 + 6] = 0;
+        CHECK_THROWS_WITH(binary::deserialize(corrupt), Contains("ymm registers need the vex form"));
+    }
+}
+
+TEST_CASE("Save and load binary file")
+{
+    const auto asmPath = std::filesystem::temp_directory_path() / "ostrich_test_binary.asm";
+    const auto binaryPath = std::filesystem::temp_directory_path() / "ostrich_test_binary.ob";
+    std::ofstream{ asmPath } << "mov rax 0x12\npush rax";
+
+    binary::save(allInstructions(), binaryPath);
+    CHECK(binary::isBinary(binaryPath));
+    CHECK_FALSE(binary::isBinary(asmPath));
+    CHECK_THAT(binary::load(binaryPath), Equals(allInstructions()));
+
+    Vm vm{ Source{}, 64 };
+    vm.load(binaryPath);
+    CHECK_THAT(vm.source(), Equals(allInstructions()));
+    CHECK(vm.sourcePath().empty());
+    vm.load(asmPath);
+    CHECK_THAT(vm.source(), Equals(Source{ Mov{ rax, 0x12 }, Push{ rax } }));
+    CHECK(vm.sourcePath() == asmPath);
+
+    std::filesystem::remove(asmPath);
+    std::filesystem::remove(binaryPath);
+}
+
+TEST_CASE("Saved binaries name the source they came from")
+{
+    const auto path = std::filesystem::temp_directory_path() / "ostrich_test_name.ob";
+    const auto contains = [&](const std::string &name) {
+        std::ifstream file{ path, std::ios::binary };
+        const std::string data{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+        return data.find(name) != std::string::npos;
+    };
+
+    binary::save(Source{ Inc{ rax } }, path, "program.asm");
+    CHECK(contains("program.asm"));
+    CHECK_FALSE(contains("ostrich_test_name.ob"));
+    binary::save(Source{ Inc{ rax } }, path);
+    CHECK(contains("ostrich_test_name.ob"));
+
+    std::filesystem::remove(path);
+}
@@ -1,6 +1,13 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include "catch.hpp"
 
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
 #include <optional>
+#include <utility>
 #include <variant>
 
 import Ostrich;
@@ -69,6 +76,157 @@ TEST_CASE("mov")
     }
 }
 
+TEST_CASE("sub")
+{
+    Vm vm{ Source{}, 64 };
+    vm.execute(Mov{ rax, 10 });
+    vm.execute(Mov{ rbx, 4 });
+    vm.execute(Sub{ rax, rbx });
+    CHECK(vm.cpu().registerValue(rax) == 6);
+    vm.execute(Sub{ rax, 7 });
+    CHECK(vm.cpu().registerValue(rax) == 0xffffffffffffffff);
+}
+
+TEST_CASE("cmp")
+{
+    Vm vm{ Source{}, 64 };
+    vm.execute(Mov{ rax, 10 });
+    vm.execute(Cmp{ rax, 10 });
+    CHECK(vm.cpu().registerValue(rax) == 10);
+    CHECK(vm.cpu().flags() & zeroFlag);
+}
+
+TEST_CASE("flags")
+{
+    Vm vm{ Source{}, 64 };
+    CHECK(vm.cpu().flags() == initialFlags);
+
+    SECTION("add")
+    {
+        vm.execute(Mov{ rax, 0x7fffffffffffffff });
+        vm.execute(Add{ rax, 1 });
+        CHECK(vm.cpu().flags() == (initialFlags | parityFlag | auxiliaryCarryFlag | signFlag | overflowFlag));
+        vm.execute(Add{ rax, 0x8000000000000000 });
+        CHECK(vm.cpu().flags() == (initialFlags | carryFlag | parityFlag | zeroFlag | overflowFlag));
+    }
+
+    SECTION("sub")
+    {
+        vm.execute(Mov{ rax, 3 });
+        vm.execute(Sub{ rax, 3 });
+        CHECK(vm.cpu().flags() == (initialFlags | parityFlag | zeroFlag));
+        vm.execute(Sub{ rax, 1 });
+        CHECK(vm.cpu().flags() == (initialFlags | carryFlag | parityFlag | auxiliaryCarryFlag | signFlag));
+        vm.execute(Mov{ rax, 0x8000000000000000 });
+        vm.execute(Sub{ rax, 1 });
+        CHECK(vm.cpu().flags() == (initialFlags | parityFlag | auxiliaryCarryFlag | overflowFlag));
+    }
+
+    SECTION("inc and dec keep the carry flag")
+    {
+        vm.execute(Mov{ rax, 0 });
+        vm.execute(Sub{ rax, 1 });
+        vm.execute(Inc{ rax });
+        CHECK(vm.cpu().flags() == (initialFlags | carryFlag | parityFlag | auxiliaryCarryFlag | zeroFlag));
+        vm.execute(Dec{ rax });
+        vm.execute(Dec{ rax });
+        CHECK(vm.cpu().flags() & carryFlag);
+        vm.execute(Add{ rax, 1 });
+        vm.execute(Inc{ rax });
+        CHECK((vm.cpu().flags() & carryFlag) == 0);
+    }
+
+    SECTION("mov and push leave the flags alone")
+    {
+        vm.execute(Cmp{ rax, 0 });
+        vm.execute(Mov{ rax, 5 });
+        vm.execute(Push{ rax });
+        CHECK(vm.cpu().flags() & zeroFlag);
+    }
+
+    SECTION("flags are part of the history")
+    {
+        vm.execute(Cmp{ rax, 0 });
+        vm.execute(Cmp{ rax, 1 });
+        vm.restorePreviousState();
+        CHECK(vm.cpu().flags() & zeroFlag);
+    }
+}
+
+TEST_CASE("condition codes")
+{
+    using enum ConditionCode;
+    Vm vm{ Source{}, 64 };
+    const auto check = [&](uint64_t lhs, uint64_t rhs, std::initializer_list<ConditionCode> expected) {
+        vm.execute(Mov{ rax, lhs });
+        vm.execute(Cmp{ rax, rhs });
+        for(const auto conditionCode : { e, ne, b, ae, be, a, l, ge, le, g })
+        {
+            const bool isExpected{ std::find(expected.begin(), expected.end(), conditionCode) != expected.end() };
+            CHECK(vm.cpu().evaluate(conditionCode) == isExpected);
+        }
+        // The same conditions from the flags, after an instruction that keeps them
+        const auto flags = vm.cpu().flags();
+        vm.execute(Inc{ rbx });
+        vm.execute(Dec{ rbx });
+        CHECK((vm.cpu().flags() & carryFlag) == (flags & carryFlag));
+    };
+    check(3, 3, { e, ae, be, ge, le });
+    check(2, 3, { ne, b, be, l, le });
+    check(3, 2, { ne, ae, a, ge, g });
+    check(0xffffffffffffffff, 1, { ne, ae, a, l, le });
+    check(1, 0xffffffffffffffff, { ne, b, be, ge, g });
+
+    SECTION("from flags")
+    {
+        vm.execute(Mov{ rax, 0x7fffffffffffffff });
+        vm.execute(Add{ rax, 1 });
+        CHECK(vm.cpu().evaluate(s));
+        CHECK(vm.cpu().evaluate(o));
+        CHECK(vm.cpu().evaluate(ge));
+        CHECK(vm.cpu().evaluate(ne));
+        CHECK(vm.cpu().evaluate(p));
+        CHECK_FALSE(vm.cpu().evaluate(b));
+        vm.execute(Inc{ rax });
+        CHECK(vm.cpu().evaluate(np));
+        CHECK(vm.cpu().evaluate(no));
+        CHECK(vm.cpu().evaluate(l));
+    }
+}
+
+TEST_CASE("pushf")
+{
+    Vm vm{ Source{}, 64 };
+    vm.execute(Cmp{ rax, 1 });
+    vm.execute(Pushf{});
+    CHECK(vm.stack().load(vm.stack().beginning()) == vm.cpu().flags());
+    CHECK(vm.cpu().registerValue(rsp) == vm.stack().beginning() - 8);
+}
+
+TEST_CASE("jumps")
+{
+    using enum ConditionCode;
+    Vm vm{ Source{ Mov{ rax, 3 }, Label{ "loop" }, Dec{ rax }, Cmp{ rax, 0 }, Jcc{ ne, "loop" }, Jmp{ "end" },
+                   Inc{ rbx }, Label{ "end" } },
+           64 };
+    while(vm.cpu().nextInstruction() < vm.source().size())
+    {
+        vm.step();
+    }
+    CHECK(vm.cpu().registerValue(rax) == 0);
+    CHECK(vm.cpu().registerValue(rbx) == 0);
+
+    SECTION("a jump executed at the prompt goes to the label")
+    {
+        vm.execute(Jmp{ "loop" });
+        CHECK(vm.cpu().nextInstruction() == 1);
+        vm.execute(Jcc{ e, "end" });
+        CHECK(vm.cpu().nextInstruction() == 7);
+        vm.execute(Jcc{ ne, "loop" });
+        CHECK(vm.cpu().nextInstruction() == 7);
+    }
+}
+
 TEST_CASE("push/pop")
 {
     Vm vm{ Source{}, 64 };
@@ -100,3 +258,295 @@ TEST_CASE("loadEffectiveAddress")
     // Base and index and displacement
     CHECK(vm.cpu().loadEffectiveAddress(MemoryAddress{ rax, plus, rbx, 2, minus, 2 }) == 38);
 }
+
+TEST_CASE("evaluate")
+{
+    using enum ComparisonOperator;
+    Vm vm{ Source{}, 64 };
+    vm.execute(Mov{ rax, 3 });
+    vm.execute(Push{ rax });
+    const auto top = MemoryAddress{ rsp, AdditiveOperator::plus, std::nullopt, 1, AdditiveOperator::plus, 8 };
+
+    CHECK(vm.cpu().evaluate(Condition{ rax, equal, 3 }));
+    CHECK_FALSE(vm.cpu().evaluate(Condition{ rax, notEqual, 3 }));
+    CHECK(vm.cpu().evaluate(Condition{ rbx, less, rax }));
+    CHECK(vm.cpu().evaluate(Condition{ top, lessOrEqual, rax }));
+    CHECK_FALSE(vm.cpu().evaluate(Condition{ top, greater, rax }));
+    CHECK(vm.cpu().evaluate(Condition{ 0xffffffffffffffff, greaterOrEqual, rax }));
+
+    // Memory outside the stack never matches
+    CHECK_FALSE(vm.cpu().evaluate(Condition{ MemoryAddress{ rbx }, equal, 0 }));
+}
+
+TEST_CASE("sub-registers")
+{
+    using enum Width;
+    Vm vm{ Source{}, 64 };
+    vm.execute(Mov{ rax, 0x1122334455667788 });
+
+    SECTION("reading")
+    {
+        CHECK(vm.cpu().registerValue(SubRegister{ rax, dword }) == 0x55667788);
+        CHECK(vm.cpu().registerValue(SubRegister{ rax, word }) == 0x7788);
+        CHECK(vm.cpu().registerValue(SubRegister{ rax, byte }) == 0x88);
+        CHECK(vm.cpu().registerValue(SubRegister{ rax, highByte }) == 0x77);
+    }
+
+    SECTION("writing a dword clears the upper half")
+    {
+        vm.execute(Mov{ rax, uint64_t{ 0xffffffff }, dword });
+        CHECK(vm.cpu().registerValue(rax) == 0xffffffff);
+        vm.execute(Inc{ rax, dword });
+        CHECK(vm.cpu().registerValue(rax) == 0);
+    }
+
+    SECTION("writing a word or a byte keeps the rest")
+    {
+        vm.execute(Mov{ rax, 0xabcd, word });
+        CHECK(vm.cpu().registerValue(rax) == 0x112233445566abcd);
+        vm.execute(Mov{ rax, 0x12, highByte });
+        CHECK(vm.cpu().registerValue(rax) == 0x11223344556612cd);
+        vm.execute(Mov{ rbx, SubRegister{ rax, highByte }, byte });
+        CHECK(vm.cpu().registerValue(rbx) == 0x12);
+        vm.execute(Add{ rax, SubRegister{ rax, byte }, highByte });
+        CHECK(vm.cpu().registerValue(rax) == 0x112233445566dfcd);
+    }
+
+    SECTION("flags follow the width")
+    {
+        vm.execute(Mov{ rax, 0xff, byte });
+        vm.execute(Add{ rax, 1, byte });
+        CHECK(vm.cpu().registerValue(rax) == 0x1122334455667700);
+        CHECK(vm.cpu().flags() == (initialFlags | carryFlag | parityFlag | auxiliaryCarryFlag | zeroFlag));
+        vm.execute(Mov{ rax, 0x7fff, word });
+        vm.execute(Inc{ rax, word });
+        CHECK(vm.cpu().flags() == (initialFlags | carryFlag | parityFlag | auxiliaryCarryFlag | signFlag |
+                                   overflowFlag));
+        vm.execute(Cmp{ rax, uint64_t{ 0x80000000 }, dword });
+        CHECK(vm.cpu().flags() == (initialFlags | carryFlag | parityFlag | signFlag | overflowFlag));
+    }
+
+    SECTION("narrow instructions run in blocks too")
+    {
+        using enum ConditionCode;
+        Vm loop{ Source{ Mov{ rcx, 0xffffffffffff0003 }, Label{ "loop" }, Add{ rax, 0x100, word }, Dec{ rcx, word },
+                         Jcc{ ne, "loop" } },
+                 64 };
+        loop.run();
+        CHECK(loop.cpu().registerValue(rax) == 0x300);
+        CHECK(loop.cpu().registerValue(rcx) == 0xffffffffffff0000);
+    }
+}
+
+TEST_CASE("extended registers")
+{
+    using enum ConditionCode;
+    Vm vm{ Source{ Mov{ r8, 3 }, Label{ "loop" }, Add{ r15, r8 }, Push{ r15 }, Pop{ r9 }, Dec{ r8, Width::dword },
+                   Jcc{ ne, "loop" } },
+           64 };
+    CHECK(vm.cpu().registerValue(RegisterName::rip) == 0);
+    vm.step();
+    CHECK(vm.cpu().registerValue(RegisterName::rip) == 1);
+    CHECK(vm.cpu().evaluate(Condition{ RegisterName::rip, ComparisonOperator::equal, 1 }));
+    vm.run();
+    CHECK(vm.cpu().registerValue(r15) == 6);
+    CHECK(vm.cpu().registerValue(r9) == 6);
+    CHECK(vm.cpu().registerValue(RegisterName::rip) == vm.cpu().nextInstruction());
+    CHECK(vm.cpu().registers().back().registerName == RegisterName::rip);
+}
+
+namespace
+{
+    // Pushes the qwords so that the first one is at rsp + 8, which makes them a vector there
+    void pushVector(Vm &vm, std::initializer_list<uint64_t> qwords)
+    {
+        for(auto qword = std::rbegin(qwords); qword != std::rend(qwords); ++qword)
+        {
+            vm.execute(Mov{ rax, *qword });
+            vm.execute(Push{ rax });
+        }
+    }
+} // namespace
+
+TEST_CASE("packed instructions")
+{
+    using enum PackedOperation;
+    using enum AdditiveOperator;
+    const VectorRegister xmm0{ 0 };
+    const VectorRegister xmm1{ 1 };
+    const VectorRegister xmm9{ 9 };
+    const VectorRegister ymm0{ 0, true };
+    const VectorRegister ymm1{ 1, true };
+    const VectorRegister ymm9{ 9, true };
+    const auto vectorAt = [](uint64_t displacement) {
+        return MemoryAddress{ rsp, plus, std::nullopt, 1, plus, displacement };
+    };
+    // With four qwords pushed, rsp + 8 is 32 byte aligned
+    Vm vm{ Source{}, 256, 0x1018 };
+    pushVector(vm, { 0xffffffff00000001, 0x7fffffffffffffff, 0x1111111111111111, 0x2222222222222222 });
+    vm.execute(Packed{ movdqa, ymm0, ymm0, vectorAt(8), true });
+    pushVector(vm, { 0x0000000100000001, 0x0000000000000001, 0x3333333333333333, 0x4444444444444444 });
+    vm.execute(Packed{ movdqu, ymm1, ymm1, vectorAt(8), true });
+
+    SECTION("loading")
+    {
+        CHECK(vm.cpu().vectorValue(0) ==
+              Vector{ { 0xffffffff00000001, 0x7fffffffffffffff, 0x1111111111111111, 0x2222222222222222 } });
+        CHECK(vm.cpu().vectorValue(1) ==
+              Vector{ { 0x0000000100000001, 0x0000000000000001, 0x3333333333333333, 0x4444444444444444 } });
+        vm.execute(Packed{ movdqu, xmm9, xmm9, vectorAt(16) });
+        CHECK(vm.cpu().vectorValue(9) == Vector{ { 0x0000000000000001, 0x3333333333333333, 0, 0 } });
+    }
+
+    SECTION("integer lanes wrap around on their own")
+    {
+        vm.execute(Packed{ movdqa, xmm9, xmm9, xmm0 });
+        vm.execute(Packed{ paddd, xmm9, xmm9, xmm1 });
+        CHECK(vm.cpu().vectorValue(9) == Vector{ { 0x0000000000000002, 0x7fffffff00000000, 0, 0 } });
+        vm.execute(Packed{ paddq, xmm9, xmm9, xmm1 });
+        CHECK(vm.cpu().vectorValue(9) == Vector{ { 0x0000000100000003, 0x7fffffff00000001, 0, 0 } });
+        vm.execute(Packed{ psubq, xmm9, xmm9, xmm0 });
+        CHECK(vm.cpu().vectorValue(9) == Vector{ { 0x0000000200000002, 0xffffffff00000002, 0, 0 } });
+        vm.execute(Packed{ psubd, xmm9, xmm9, xmm0 });
+        CHECK(vm.cpu().vectorValue(9) == Vector{ { 0x0000000300000001, 0x8000000000000003, 0, 0 } });
+    }
+
+    SECTION("logic")
+    {
+        vm.execute(Packed{ pand, ymm9, ymm0, ymm1, true });
+        CHECK(vm.cpu().vectorValue(9) ==
+              Vector{ { 0x0000000100000001, 0x0000000000000001, 0x1111111111111111, 0x0000000000000000 } });
+        vm.execute(Packed{ por, ymm9, ymm0, ymm1, true });
+        CHECK(vm.cpu().vectorValue(9) ==
+              Vector{ { 0xffffffff00000001, 0x7fffffffffffffff, 0x3333333333333333, 0x6666666666666666 } });
+        vm.execute(Packed{ pxor, xmm0, xmm0, xmm0 });
+        CHECK(vm.cpu().vectorValue(0) == Vector{ { 0, 0, 0x1111111111111111, 0x2222222222222222 } });
+    }
+
+    SECTION("floats")
+    {
+        const auto floats = [](float a, float b, float c, float d) {
+            return Vector{ { uint64_t{ std::bit_cast<uint32_t>(b) } << 32 | std::bit_cast<uint32_t>(a),
+                             uint64_t{ std::bit_cast<uint32_t>(d) } << 32 | std::bit_cast<uint32_t>(c), 0, 0 } };
+        };
+        const auto lhs = floats(1.5f, -2.0f, 0.25f, 3.0f);
+        const auto rhs = floats(2.25f, 0.5f, 0.25f, -1.0f);
+        pushVector(vm, { lhs.qwords[0], lhs.qwords[1] });
+        vm.execute(Packed{ movdqa, xmm0, xmm0, vectorAt(8), true });
+        pushVector(vm, { rhs.qwords[0], rhs.qwords[1] });
+        vm.execute(Packed{ movdqu, xmm1, xmm1, vectorAt(8), true });
+        vm.execute(Packed{ movdqa, xmm9, xmm9, xmm0 });
+        vm.execute(Packed{ addps, xmm9, xmm9, xmm1 });
+        CHECK(vm.cpu().vectorValue(9) == floats(3.75f, -1.5f, 0.5f, 2.0f));
+        vm.execute(Packed{ subps, xmm9, xmm0, xmm1, true });
+        CHECK(vm.cpu().vectorValue(9) == floats(-0.75f, -2.5f, 0.0f, 4.0f));
+        vm.execute(Packed{ mulps, xmm9, xmm0, xmm1, true });
+        CHECK(vm.cpu().vectorValue(9) == floats(3.375f, -1.0f, 0.0625f, -3.0f));
+    }
+
+    SECTION("legacy forms keep the upper half, vex forms zero it")
+    {
+        vm.execute(Packed{ paddq, xmm0, xmm0, xmm1 });
+        CHECK(vm.cpu().vectorValue(0).qwords[2] == 0x1111111111111111);
+        CHECK(vm.cpu().vectorValue(0).qwords[3] == 0x2222222222222222);
+        vm.execute(Packed{ paddq, xmm0, xmm0, xmm1, true });
+        CHECK(vm.cpu().vectorValue(0).qwords[2] == 0);
+        CHECK(vm.cpu().vectorValue(0).qwords[3] == 0);
+    }
+
+    SECTION("alignment")
+    {
+        CHECK_THROWS_WITH(vm.execute(Packed{ movdqa, xmm9, xmm9, vectorAt(16) }),
+                          "rsp+(nullopt*1)+16 is 0xfe8, which isn't 16 byte aligned");
+        CHECK_THROWS_WITH(vm.execute(Packed{ paddd, xmm9, xmm9, vectorAt(16) }),
+                          "rsp+(nullopt*1)+16 is 0xfe8, which isn't 16 byte aligned");
+        CHECK_THROWS_WITH(vm.execute(Packed{ movdqa, ymm9, ymm9, vectorAt(24), true }),
+                          "rsp+(nullopt*1)+24 is 0xff0, which isn't 32 byte aligned");
+        vm.execute(Packed{ movdqu, xmm9, xmm9, vectorAt(16) });
+        vm.execute(Packed{ paddd, ymm9, ymm9, vectorAt(16), true });
+        vm.execute(Packed{ movdqa, xmm9, xmm9, vectorAt(24), true });
+        CHECK(vm.cpu().vectorValue(9) == Vector{ { 0x3333333333333333, 0x4444444444444444, 0, 0 } });
+    }
+
+    SECTION("flags are left alone")
+    {
+        vm.execute(Cmp{ rax, 1 });
+        const auto flags = vm.cpu().flags();
+        vm.execute(Packed{ psubq, ymm0, ymm0, ymm0, true });
+        CHECK(vm.cpu().flags() == flags);
+    }
+
+    SECTION("packed instructions run in blocks too")
+    {
+        using enum ConditionCode;
+        Vm loop{ Source{ Mov{ rax, 5 }, Push{ rax }, Push{ rax }, Packed{ movdqu, xmm1, xmm1, vectorAt(8) },
+                         Mov{ rcx, 3 }, Label{ "loop" }, Packed{ paddq, ymm0, ymm0, ymm1, true },
+                         Packed{ paddd, xmm1, xmm1, xmm1 }, Dec{ rcx }, Jcc{ ne, "loop" } },
+                 64 };
+        loop.run();
+        CHECK(loop.cpu().vectorValue(0) == Vector{ { 35, 35, 0, 0 } });
+        CHECK(loop.cpu().vectorValue(1) == Vector{ { 40, 40, 0, 0 } });
+    }
+}
+
+TEST_CASE("Register width benchmarks", "[!benchmark]")
+{
+    using enum ConditionCode;
+    constexpr uint64_t n{ 1000000 };
+    const Source qwords{ Mov{ rax, n }, Mov{ rbx, 0 }, Label{ "loop" }, Add{ rbx, rax }, Sub{ rcx, rbx },
+                         Mov{ rdx, rcx }, Dec{ rax }, Cmp{ rax, 0 }, Jcc{ ne, "loop" } };
+    using enum Width;
+    const Source dwords{ Mov{ rax, n, dword },
+                         Mov{ rbx, 0, dword },
+                         Label{ "loop" },
+                         Add{ rbx, SubRegister{ rax, dword }, dword },
+                         Sub{ rcx, SubRegister{ rbx, dword }, dword },
+                         Mov{ rdx, SubRegister{ rcx, dword }, dword },
+                         Dec{ rax, dword },
+                         Cmp{ rax, 0, dword },
+                         Jcc{ ne, "loop" } };
+
+    // The baseline, picking the handler on every step
+    BENCHMARK("64 bit loop, stepped without handlers")
+    {
+        Stack stack{ 64, 0xffff };
+        Source source{ qwords };
+        parser::resolveLabels(source);
+        Cpu cpu{ stack, source };
+        while(cpu.nextInstruction() < source.size())
+        {
+            cpu.step();
+        }
+        return std::as_const(cpu).registerValue(rbx);
+    };
+
+    BENCHMARK("64 bit loop, stepped")
+    {
+        Stack stack{ 64, 0xffff };
+        Source source{ qwords };
+        parser::resolveLabels(source);
+        const auto handlers = Cpu::handlers(source);
+        Cpu cpu{ stack, source, &handlers };
+        while(cpu.nextInstruction() < source.size())
+        {
+            cpu.step();
+        }
+        return std::as_const(cpu).registerValue(rbx);
+    };
+
+    BENCHMARK("64 bit loop, run")
+    {
+        Vm vm{ qwords, 64 };
+        vm.useJit(false);
+        vm.run();
+        return vm.cpu().registerValue(rbx);
+    };
+
+    BENCHMARK("32 bit loop, run")
+    {
+        Vm vm{ dwords, 64 };
+        vm.useJit(false);
+        vm.run();
+        return vm.cpu().registerValue(rbx);
+    };
+}
@@ -0,0 +1,241 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Contains;
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using namespace ostrich::decoder;
+using enum RegisterName;
+using enum AdditiveOperator;
+
+namespace
+{
+    struct TestVector
+    {
+        std::vector<uint8_t> bytes;
+        Instruction instruction;
+    };
+
+    // Checked against objdump -D -b binary -mi386:x86-64 -M intel
+    const std::vector<TestVector> testVectors{
+        { { 0x50 }, Push{ rax } },                                          // push rax
+        { { 0x53 }, Push{ rbx } },                                          // push rbx
+        { { 0x5e }, Pop{ rsi } },                                           // pop rsi
+        { { 0x5d }, Pop{ rbp } },                                           // pop rbp
+        { { 0x9c }, Pushf{} },                                              // pushf
+        { { 0x48, 0xff, 0xc0 }, Inc{ rax } },                               // inc rax
+        { { 0x48, 0xff, 0xcf }, Dec{ rdi } },                               // dec rdi
+        { { 0x48, 0x01, 0xd8 }, Add{ rax, rbx } },                          // add rax,rbx
+        { { 0x48, 0x03, 0x0c, 0x24 }, Add{ rcx, MemoryAddress{ rsp } } },   // add rcx,QWORD PTR [rsp]
+        { { 0x48, 0x03, 0x55, 0x08 },                                       // add rdx,QWORD PTR [rbp+0x8]
+          Add{ rdx, MemoryAddress{ rbp, plus, std::nullopt, 1, plus, 8 } } },
+        { { 0x48, 0x03, 0x74, 0x98, 0xf0 },                                 // add rsi,QWORD PTR [rax+rbx*4-0x10]
+          Add{ rsi, MemoryAddress{ rax, plus, rbx, 4, minus, 0x10 } } },
+        { { 0x48, 0x03, 0x84, 0xcc, 0x00, 0x10, 0x00, 0x00 },               // add rax,QWORD PTR [rsp+rcx*8+0x1000]
+          Add{ rax, MemoryAddress{ rsp, plus, rcx, 8, plus, 0x1000 } } },
+        { { 0x48, 0x29, 0xcb }, Sub{ rbx, rcx } },                          // sub rbx,rcx
+        { { 0x48, 0x83, 0xec, 0x08 }, Sub{ rsp, 8 } },                      // sub rsp,0x8
+        { { 0x48, 0x2d, 0x45, 0x23, 0x01, 0x00 }, Sub{ rax, 0x12345 } },    // sub rax,0x12345
+        { { 0x48, 0x83, 0xf8, 0xff }, Cmp{ rax, 0xffffffffffffffff } },     // cmp rax,0xffffffffffffffff
+        { { 0x48, 0x3b, 0x97, 0x00, 0x00, 0x00, 0x80 },                     // cmp rdx,QWORD PTR [rdi-0x80000000]
+          Cmp{ rdx, MemoryAddress{ rdi, plus, std::nullopt, 1, minus, 0x80000000 } } },
+        { { 0x48, 0x3d, 0x00, 0x00, 0x00, 0x80 }, Cmp{ rax, 0xffffffff80000000 } }, // cmp rax,0xffffffff80000000
+        { { 0x48, 0x89, 0xd8 }, Mov{ rax, rbx } },                          // mov rax,rbx
+        { { 0x2e, 0x48, 0x8b, 0xc3 }, Mov{ rax, rbx } },                    // cs mov rax,rbx
+        { { 0x48, 0x8b, 0x4d, 0xf8 },                                       // mov rcx,QWORD PTR [rbp-0x8]
+          Mov{ rcx, MemoryAddress{ rbp, plus, std::nullopt, 1, minus, 8 } } },
+        { { 0x48, 0xba, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 },   // movabs rdx,0x1122334455667788
+          Mov{ rdx, 0x1122334455667788 } },
+        { { 0xb8, 0xff, 0xff, 0xff, 0xff }, Mov{ rax, uint64_t{ 0xffffffff } } }, // mov eax,0xffffffff
+        { { 0x48, 0xc7, 0xc3, 0xfe, 0xff, 0xff, 0xff }, Mov{ rbx, 0xfffffffffffffffe } }, // mov rbx,0xff..fe
+        { { 0x48, 0x83, 0xc0, 0x7f }, Add{ rax, 0x7f } },                   // add rax,0x7f
+        { { 0x41, 0x50 }, Push{ r8 } },                                     // push r8
+        { { 0x41, 0x5f }, Pop{ r15 } },                                     // pop r15
+        { { 0x49, 0xff, 0xc4 }, Inc{ r12 } },                               // inc r12
+        { { 0x4d, 0x01, 0xc8 }, Add{ r8, r9 } },                            // add r8,r9
+        { { 0x4f, 0x03, 0x54, 0xe5, 0x08 },                                 // add r10,QWORD PTR [r13+r12*8+0x8]
+          Add{ r10, MemoryAddress{ r13, plus, r12, 8, plus, 8 } } },
+        { { 0x49, 0xbb, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 },   // movabs r11,0x1122334455667788
+          Mov{ r11, 0x1122334455667788 } },
+        { { 0x4c, 0x8b, 0x3c, 0x24 }, Mov{ r15, MemoryAddress{ rsp } } },   // mov r15,QWORD PTR [rsp]
+    };
+} // namespace
+
+TEST_CASE("Decode instructions")
+{
+    for(const auto &[bytes, instruction] : testVectors)
+    {
+        const auto decoded = decode(bytes, 0x401000);
+        CHECK(decoded.instruction == instruction);
+        CHECK(decoded.length == bytes.size());
+    }
+}
+
+TEST_CASE("Decode jumps")
+{
+    using enum ConditionCode;
+    // 0x1000 dec rcx, jne 0x1000, jmp 0x1014, je 0x1000, jl 0x110f, jmp 0x1004
+    const std::vector<uint8_t> code{ 0x48, 0xff, 0xc9, 0x75, 0xfb, 0xeb, 0x0d, 0x74, 0xf7, 0x0f,
+                                     0x8c, 0x00, 0x01, 0x00, 0x00, 0xe9, 0xf0, 0xff, 0xff, 0xff };
+    const std::span<const uint8_t> span{ code };
+    CHECK(decode(span.subspan(3), 0x1003).instruction == Instruction{ Jcc{ ne, "loc_1000", 0x1000 } });
+    CHECK(decode(span.subspan(5), 0x1005).instruction == Instruction{ Jmp{ "loc_1014", 0x1014 } });
+    CHECK(decode(span.subspan(7), 0x1007).instruction == Instruction{ Jcc{ e, "loc_1000", 0x1000 } });
+    const auto jl = decode(span.subspan(9), 0x1009);
+    CHECK(jl.instruction == Instruction{ Jcc{ l, "loc_110f", 0x110f } });
+    CHECK(jl.length == 6);
+    CHECK(decode(span.subspan(15), 0x100f).instruction == Instruction{ Jmp{ "loc_1004", 0x1004 } });
+}
+
+TEST_CASE("Decode a whole program")
+{
+    using enum ConditionCode;
+    // mov ecx,0x3 / add rax,rcx / dec rcx / jne 0x401005 / push rax
+    const std::vector<uint8_t> code{ 0xb9, 0x03, 0x00, 0x00, 0x00, 0x48, 0x01, 0xc8,
+                                     0x48, 0xff, 0xc9, 0x75, 0xf8, 0x50 };
+    const auto source = decodeAll(code, 0x401000);
+    CHECK_THAT(source, Equals(Source{ Mov{ rcx, 3 }, Label{ "loc_401005" }, Add{ rax, rcx }, Dec{ rcx },
+                                      Jcc{ ne, "loc_401005", 1 }, Push{ rax } }));
+
+    Vm vm{ source, 64 };
+    CHECK(vm.run() == Vm::StopReason::end);
+    CHECK(vm.cpu().registerValue(rax) == 6);
+
+    SECTION("Jumping into the middle of an instruction")
+    {
+        const std::vector<uint8_t> bad{ 0x48, 0xff, 0xc9, 0x75, 0xfc };
+        CHECK_THROWS_WITH(decodeAll(bad, 0), Contains("not the start of an instruction"));
+    }
+}
+
+TEST_CASE("Decoding unsupported instructions")
+{
+    const auto error = [](std::vector<uint8_t> bytes) {
+        try
+        {
+            decode(bytes, 0x10);
+        }
+        catch(const std::runtime_error &e)
+        {
+            return std::string{ e.what() };
+        }
+        return std::string{};
+    };
+    CHECK_THAT(error({ 0x48 }), Equals("Truncated instruction at 0x10"));
+    CHECK_THAT(error({ 0x48, 0x83, 0xc0 }), Equals("Truncated instruction at 0x10"));
+    CHECK_THAT(error({ 0x66, 0x50 }), Equals("Unsupported prefix 0x66 at 0x10"));
+    CHECK_THAT(error({ 0x90 }), Equals("Unsupported opcode 0x90 at 0x10"));
+    CHECK_THAT(error({ 0x0f, 0x05 }), Equals("Unsupported opcode 0x0f 0x05 at 0x10"));
+    CHECK_THAT(error({ 0x48, 0x83, 0xe0, 0x01 }), Equals("Unsupported opcode 0x83 /4 at 0x10"));
+    CHECK_THAT(error({ 0x01, 0xd8 }), Equals("Only 64 bit operands are supported at 0x10"));
+    CHECK_THAT(error({ 0x48, 0x01, 0x18 }), Equals("Memory destinations are not supported at 0x10"));
+    CHECK_THAT(error({ 0x48, 0x8b, 0x05, 0, 0, 0, 0 }), Equals("rip relative addresses are not supported at 0x10"));
+}
+
+TEST_CASE("Decode cache")
+{
+    const std::vector<uint8_t> code{ 0x48, 0xff, 0xc0, 0x50, 0x5b };
+    DecodeCache cache{ code, 0x2000 };
+    CHECK(cache.at(0x2003).instruction == Instruction{ Push{ rax } });
+    const auto &first = cache.at(0x2000);
+    CHECK(first.instruction == Instruction{ Inc{ rax } });
+    CHECK(first.length == 3);
+    CHECK(&cache.at(0x2000) == &first);
+    CHECK(cache.size() == 2);
+    CHECK_THROWS_WITH(cache.at(0x2005), Equals("No code at 0x2005"));
+    CHECK_THROWS_WITH(cache.at(0x1fff), Equals("No code at 0x1fff"));
+    cache.invalidate();
+    CHECK(cache.size() == 0);
+}
+
+TEST_CASE("Decode the reachable code")
+{
+    using enum ConditionCode;
+
+    SECTION("Data, padding and syscall are skipped")
+    {
+        // mov ecx,0x3 / jmp 0x1009 / (data) / dec rcx / jne 0x1009 / syscall / nop / nop
+        const std::vector<uint8_t> code{ 0xb9, 0x03, 0x00, 0x00, 0x00, 0xeb, 0x02, 0xff, 0xff,
+                                         0x48, 0xff, 0xc9, 0x75, 0xfb, 0x0f, 0x05, 0x90, 0x90 };
+        const auto source = decodeReachable(code, 0x1000, 0x1000);
+        CHECK_THAT(source, Equals(Source{ Mov{ rcx, 3 }, Jmp{ "loc_1009", 2 }, Label{ "loc_1009" }, Dec{ rcx },
+                                          Jcc{ ne, "loc_1009", 2 } }));
+        Vm vm{ source, 64 };
+        CHECK(vm.run() == Vm::StopReason::end);
+        CHECK(vm.cpu().registerValue(rcx) == 0);
+    }
+    SECTION("Exits in the middle of the code")
+    {
+        // jne 0x5 / push rax / syscall / pop rbx / hlt
+        const std::vector<uint8_t> code{ 0x75, 0x03, 0x50, 0x0f, 0x05, 0x5b, 0xf4 };
+        CHECK_THAT(decodeReachable(code, 0, 0),
+                   Equals(Source{ Jcc{ ne, "loc_5", 3 }, Push{ rax }, Jmp{ "loc_3", 5 }, Label{ "loc_5" }, Pop{ rbx },
+                                  Label{ "loc_3" } }));
+    }
+    SECTION("Starting after the start of the code")
+    {
+        const std::vector<uint8_t> code{ 0x90, 0x50 };
+        CHECK_THAT(decodeReachable(code, 0x10, 0x11), Equals(Source{ Push{ rax } }));
+    }
+    SECTION("Code before the entry point")
+    {
+        // push rax / syscall / pop rbx / jmp 0x0, with the entry point at pop rbx
+        const std::vector<uint8_t> code{ 0x50, 0x0f, 0x05, 0x5b, 0xeb, 0xfa };
+        CHECK_THAT(decodeReachable(code, 0, 3),
+                   Equals(Source{ Jmp{ "loc_3", 4 }, Label{ "loc_0" }, Push{ rax }, Jmp{ "loc_1", 7 },
+                                  Label{ "loc_3" }, Pop{ rbx }, Jmp{ "loc_0", 1 }, Label{ "loc_1" } }));
+    }
+    SECTION("Jumping out of the code")
+    {
+        const std::vector<uint8_t> code{ 0xeb, 0x10 };
+        CHECK_THROWS_WITH(decodeReachable(code, 0, 0), Equals("No code at 0x12"));
+    }
+    SECTION("Jumping into the middle of an instruction")
+    {
+        // mov eax,0x50505050 / jmp 0x1
+        const std::vector<uint8_t> code{ 0xb8, 0x50, 0x50, 0x50, 0x50, 0xeb, 0xfa };
+        CHECK_THROWS_WITH(decodeReachable(code, 0, 0), Contains("not the start of an instruction"));
+    }
+}
+
+TEST_CASE("Decoder benchmarks", "[!benchmark]")
+{
+    std::vector<uint8_t> code;
+    for(size_t i = 0; i < 1000; ++i)
+    {
+        const auto &bytes = testVectors[i % testVectors.size()].bytes;
+        code.insert(code.end(), bytes.begin(), bytes.end());
+    }
+
+    BENCHMARK("decode")
+    {
+        size_t instructions{ 0 };
+        for(size_t offset = 0; offset < code.size(); ++instructions)
+        {
+            offset += decode(std::span<const uint8_t>{ code }.subspan(offset), offset).length;
+        }
+        return instructions;
+    };
+
+    DecodeCache cache{ code, 0 };
+    BENCHMARK("cached")
+    {
+        size_t instructions{ 0 };
+        for(size_t offset = 0; offset < code.size(); ++instructions)
+        {
+            offset += cache.at(offset).length;
+        }
+        return instructions;
+    };
+}
+
@@ -0,0 +1,170 @@
+#include "catch.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Contains;
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using enum RegisterName;
+
+namespace
+{
+    void put(std::vector<uint8_t> &data, size_t offset, uint64_t value, size_t size)
+    {
+        for(size_t i = 0; i < size; ++i)
+        {
+            data[offset + i] = static_cast<uint8_t>(value >> i * 8);
+        }
+    }
+
+    // An executable with the code in one read and execute segment, and a writable segment with
+    // 8 bytes in the file and 24 in memory
+    std::vector<uint8_t> executable(const std::vector<uint8_t> &code)
+    {
+        constexpr uint64_t base{ 0x400000 };
+        constexpr size_t codeOffset{ 64 + 2 * 56 };
+        std::vector<uint8_t> data(codeOffset);
+        data.insert(data.end(), code.begin(), code.end());
+        const size_t dataOffset{ data.size() };
+        data.insert(data.end(), 8, 0x2a);
+
+        data[0] = 0x7f;
+        data[1] = 'E';
+        data[2] = 'L';
+        data[3] = 'F';
+        data[4] = 2; // 64 bit
+        data[5] = 1; // Little endian
+        data[6] = 1; // Version
+        put(data, 16, 2, 2); // Executable
+        put(data, 18, 62, 2); // x86-64
+        put(data, 20, 1, 4); // Version
+        put(data, 24, base + codeOffset, 8); // Entry
+        put(data, 32, 64, 8); // Program headers
+        put(data, 52, 64, 2); // Header size
+        put(data, 54, 56, 2); // Program header size
+        put(data, 56, 2, 2); // Program header count
+
+        const auto segment = [&](size_t header, uint32_t flags, size_t offset, size_t fileSize, size_t memorySize) {
+            put(data, header, 1, 4); // Load
+            put(data, header + 4, flags, 4);
+            put(data, header + 8, offset, 8);
+            put(data, header + 16, base + offset, 8);
+            put(data, header + 24, base + offset, 8);
+            put(data, header + 32, fileSize, 8);
+            put(data, header + 40, memorySize, 8);
+            put(data, header + 48, 0x1000, 8);
+        };
+        segment(64, 5, codeOffset, code.size(), code.size());
+        segment(64 + 56, 6, dataOffset, 8, 24);
+        return data;
+    }
+
+    std::filesystem::path write(const std::string &name, const std::vector<uint8_t> &data)
+    {
+        const auto path = std::filesystem::temp_directory_path() / name;
+        std::ofstream file{ path, std::ios::binary };
+        file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        return path;
+    }
+} // namespace
+
+TEST_CASE("Load an ELF executable")
+{
+    // mov ecx,0x3 / add rax,rcx / dec rcx / jne -8 / push rax / syscall / nop / nop
+    const std::vector<uint8_t> code{ 0xb9, 0x03, 0x00, 0x00, 0x00, 0x48, 0x01, 0xc8, 0x48,
+                                     0xff, 0xc9, 0x75, 0xf8, 0x50, 0x0f, 0x05, 0x90, 0x90 };
+    auto data = executable(code);
+    const auto path = write("ostrich_test.elf", data);
+    REQUIRE(elf::isElf(path));
+    CHECK_FALSE(binary::isBinary(path));
+
+    SECTION("Segments")
+    {
+        const elf::Executable executable{ path };
+        CHECK(executable.entry() == 0x4000b0);
+        REQUIRE(executable.segments().size() == 2);
+        const auto &text = executable.segments()[0];
+        CHECK(text.address == 0x4000b0);
+        CHECK(text.executable);
+        CHECK_FALSE(text.writable);
+        CHECK(std::vector<uint8_t>(text.data.begin(), text.data.end()) == code);
+        const auto &data = executable.segments()[1];
+        CHECK(data.address == 0x4000b0 + code.size());
+        CHECK(data.writable);
+        CHECK(data.memorySize == 24);
+        CHECK(data.data.size() == 8);
+        CHECK(data.data[0] == 0x2a);
+    }
+
+    SECTION("Run it")
+    {
+        // Without the writable segment
+        put(data, 64 + 56 + 32, 0, 8);
+        put(data, 64 + 56 + 40, 0, 8);
+        const auto withoutData = write("ostrich_test_nodata.elf", data);
+        Vm vm{ Source{}, 64 };
+        vm.load(withoutData);
+        CHECK(vm.source().size() == 6);
+        CHECK(vm.run() == Vm::StopReason::end);
+        CHECK(vm.cpu().registerValue(rax) == 6);
+        std::filesystem::remove(withoutData);
+    }
+
+    SECTION("Writable segments")
+    {
+        Vm vm{ Source{ Push{ rax } }, 64 };
+        CHECK_THROWS_WITH(vm.load(path), Equals("Writable segments are not supported, there is one at 0x4000c2"));
+        CHECK(vm.source().size() == 1);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Reject unsupported ELF files")
+{
+    const std::vector<uint8_t> code{ 0x50 };
+    auto data = executable(code);
+
+    SECTION("Not ELF")
+    {
+        const auto path = write("ostrich_test_not.elf", std::vector<uint8_t>{ 'O', 'S', 'T' });
+        CHECK_FALSE(elf::isElf(path));
+        CHECK_THROWS_WITH(elf::Executable{ path }, Contains("is not an ELF file"));
+        std::filesystem::remove(path);
+    }
+    SECTION("32 bit")
+    {
+        data[4] = 1;
+        const auto path = write("ostrich_test_32.elf", data);
+        CHECK_THROWS_WITH(elf::Executable{ path }, Equals("Only 64 bit x86-64 ELF files are supported"));
+        std::filesystem::remove(path);
+    }
+    SECTION("Dynamically linked")
+    {
+        put(data, 64, 3, 4);
+        const auto path = write("ostrich_test_dynamic.elf", data);
+        CHECK_THROWS_WITH(elf::Executable{ path }, Equals("Only statically linked executables are supported"));
+        std::filesystem::remove(path);
+    }
+    SECTION("Segment past the end of the file")
+    {
+        put(data, 64 + 32, 0x1000, 8);
+        put(data, 64 + 40, 0x1000, 8);
+        const auto path = write("ostrich_test_short.elf", data);
+        CHECK_THROWS_WITH(elf::Executable{ path }, Equals("Segment at 0x4000b0 is outside of the file"));
+        std::filesystem::remove(path);
+    }
+    SECTION("Entry point outside the code")
+    {
+        put(data, 24, 0x500000, 8);
+        const auto path = write("ostrich_test_entry.elf", data);
+        CHECK_THROWS_WITH(elf::Executable{ path }.decode(),
+                          Equals("No executable segment contains the entry point 0x500000"));
+        std::filesystem::remove(path);
+    }
+}
@@ -0,0 +1,138 @@
+#include "catch.hpp"
+
+#include <string>
+
+import Ostrich;
+
+using Catch::Matchers::Equals;
+using Catch::Matchers::StartsWith;
+using namespace ostrich;
+using enum RegisterName;
+
+TEST_CASE("gdb packet framing")
+{
+    CHECK(GdbStub::frame("OK") == "$OK#9a");
+    CHECK(GdbStub::frame("") == "$#00");
+}
+
+TEST_CASE("gdb reads and writes registers")
+{
+    Vm vm{ Source{ Mov{ rax, 0x1122 }, Inc{ rbx } }, 16 };
+    GdbStub stub{ vm };
+    vm.step();
+
+    const auto registers = stub.handle("g");
+    CHECK(registers.size() == 2 * (17 * 8 + 4 + 6 * 4 + 8 * 10 + 8 * 4 + 16 * 16 + 4));
+    CHECK_THAT(registers, StartsWith("2211000000000000"));
+    CHECK(registers.substr(7 * 16, 16) == "ffff000000000000");
+    CHECK(registers.substr(16 * 16, 16) == "0100000000000000");
+    CHECK(registers.substr(17 * 16, 8) == "02000000");
+    CHECK(stub.handle("p10") == "0100000000000000");
+    CHECK(stub.handle("p18") == std::string(20, '0'));
+    CHECK(stub.handle("p38") == "801f0000");
+    CHECK(stub.handle("p39") == "E01");
+
+    vm.execute(Push{ rax });
+    vm.execute(Packed{ PackedOperation::movdqu, VectorRegister{ 2 }, VectorRegister{ 2 }, MemoryAddress{ rsp } });
+    CHECK(stub.handle("p2a") == "00000000000000002211000000000000");
+    CHECK(stub.handle("g").substr(2 * (17 * 8 + 4 + 6 * 4 + 8 * 10 + 8 * 4 + 2 * 16), 32) ==
+          "00000000000000002211000000000000");
+    CHECK(stub.handle("P2a=0100000000000000") == "E01");
+
+    CHECK(stub.handle("P1=0500000000000000") == "OK");
+    CHECK(vm.cpu().registerValue(rbx) == 5);
+    CHECK(stub.handle("P8=0500000000000000") == "OK");
+    CHECK(vm.cpu().registerValue(r8) == 5);
+    CHECK(stub.handle("P10=0500000000000000") == "E01");
+    CHECK(stub.handle("G" + registers) == "OK");
+    CHECK(vm.cpu().registerValue(rbx) == 0);
+    CHECK(vm.cpu().registerValue(r8) == 0);
+}
+
+TEST_CASE("gdb reads memory")
+{
+    Vm vm{ Source{ Mov{ rax, 0x1122 }, Push{ rax } }, 16 };
+    GdbStub stub{ vm };
+    stub.handle("s");
+    stub.handle("s");
+    CHECK(stub.handle("mffff,2") == "2211");
+    CHECK(stub.handle("m10005,8") == "0000");
+    CHECK(stub.handle("m20000,8") == "E14");
+}
+
+TEST_CASE("gdb steps, continues and goes back")
+{
+    Vm vm{ Source{ Inc{ rax }, Inc{ rax }, Inc{ rax }, Inc{ rax } }, 16 };
+    GdbStub stub{ vm };
+    CHECK(stub.handle("?") == "S05");
+    CHECK(stub.handle("bs") == "T05replaylog:begin;");
+    CHECK(stub.handle("s") == "S05");
+    CHECK(stub.handle("Z0,3,1") == "OK");
+    CHECK(stub.handle("c") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 3);
+    CHECK(stub.handle("bs") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 2);
+    CHECK(stub.handle("Z0,0,1") == "OK");
+    CHECK(stub.handle("bc") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 0);
+    CHECK(stub.handle("bc") == "T05replaylog:begin;");
+    CHECK(stub.handle("z0,3,1") == "OK");
+    CHECK(vm.breakpoints().size() == 1);
+}
+
+TEST_CASE("gdb goes back into runs one instruction at a time")
+{
+    using enum ConditionCode;
+    Vm vm{ Source{ Mov{ rcx, 3 }, Label{ "loop" }, Inc{ rax }, Dec{ rcx }, Jcc{ ne, "loop" }, Push{ rax } }, 16 };
+    GdbStub stub{ vm };
+    CHECK(stub.handle("c") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 6);
+    CHECK(stub.handle("bs") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 5);
+    CHECK(vm.cpu().registerValue(rax) == 3);
+
+    // Stops at the breakpoints hit during the run, latest first
+    CHECK(stub.handle("Z0,2,1") == "OK");
+    CHECK(stub.handle("bc") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 2);
+    CHECK(vm.cpu().registerValue(rax) == 2);
+    CHECK(stub.handle("bc") == "S05");
+    CHECK(vm.cpu().registerValue(rax) == 1);
+    CHECK(stub.handle("bs") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 1);
+    CHECK(stub.handle("bc") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 2);
+    CHECK(vm.cpu().registerValue(rax) == 0);
+    CHECK(stub.handle("bc") == "T05replaylog:begin;");
+    CHECK(vm.cpu().nextInstruction() == 0);
+}
+
+TEST_CASE("gdb can't go back into a run that failed")
+{
+    Vm vm{ Source{ Push{ rax }, Push{ rax }, Push{ rax } }, 16 };
+    GdbStub stub{ vm };
+    CHECK(stub.handle("c") == "S0b");
+    CHECK(stub.handle("bs") == "E01");
+    CHECK(stub.handle("bc") == "E01");
+}
+
+TEST_CASE("gdb watchpoints")
+{
+    Vm vm{ Source{ Inc{ rax }, Push{ rax }, Inc{ rax } }, 16 };
+    GdbStub stub{ vm };
+    CHECK(stub.handle("Z2,ffff,8") == "OK");
+    CHECK(stub.handle("c") == "S05");
+    CHECK(vm.cpu().nextInstruction() == 2);
+    CHECK(stub.handle("z2,ffff,8") == "OK");
+    CHECK(vm.watchpoints().empty());
+}
+
+TEST_CASE("gdb queries")
+{
+    Vm vm{ Source{}, 16 };
+    GdbStub stub{ vm };
+    CHECK_THAT(stub.handle("qSupported:multiprocess+;swbreak+"), Equals("PacketSize=4000;QStartNoAckMode+;ReverseStep+;ReverseContinue+"));
+    CHECK(stub.handle("qAttached") == "1");
+    CHECK(stub.handle("vMustReplyEmpty").empty());
+    CHECK(stub.handle("D") == "OK");
+}
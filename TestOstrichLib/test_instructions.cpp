@@ -65,6 +65,42 @@ TEST_CASE("toString")
     using enum AdditiveOperator;
     CHECK("mov  rsi qword ptr [rax+(rbx*2)-4]" ==
           Mov{ rsi, MemoryAddress{ rax, plus, rbx, 2, minus, 4 } }.toString());
+
+    using enum Width;
+    CHECK("inc  eax" == Inc{ rax, dword }.toString());
+    CHECK("dec  sil" == Dec{ rsi, byte }.toString());
+    CHECK("add  ah bl" == Add{ rax, SubRegister{ rbx, byte }, highByte }.toString());
+    CHECK("mov  cx word ptr [rsp-(rbx*4)+8]" == Mov{ rcx, MemoryAddress{ rsp, minus, rbx, 4, plus, 8 }, word }.toString());
+    CHECK("cmp  edx 0x10" == Cmp{ rdx, 0x10, dword }.toString());
+    CHECK("push r8" == Push{ r8 }.toString());
+    CHECK("add  r9d r15d" == Add{ r9, SubRegister{ r15, dword }, dword }.toString());
+    CHECK("mov  r10b byte ptr [r11+(r12*8)+0]" ==
+          Mov{ r10, MemoryAddress{ r11, plus, r12, 8, plus, 0 }, byte }.toString());
+
+    using enum PackedOperation;
+    const VectorRegister xmm0{ 0 };
+    const VectorRegister xmm9{ 9 };
+    const VectorRegister ymm1{ 1, true };
+    const VectorRegister ymm15{ 15, true };
+    CHECK("paddq xmm0 xmm9" == Packed{ paddq, xmm0, xmm0, xmm9 }.toString());
+    CHECK("por  xmm9 xmmword ptr [rsp+(rax*1)+16]" ==
+          Packed{ por, xmm9, xmm9, MemoryAddress{ rsp, plus, rax, 1, plus, 16 } }.toString());
+    CHECK("vaddps ymm1 ymm15 ymm1" == Packed{ addps, ymm1, ymm15, ymm1, true }.toString());
+    CHECK("vmovdqa ymm15 ymmword ptr [rbp+(rbx*1)-32]" ==
+          Packed{ movdqa, ymm15, ymm15, MemoryAddress{ rbp, plus, rbx, 1, minus, 32 }, true }.toString());
+}
+
+TEST_CASE("Packed instruction equality")
+{
+    using enum PackedOperation;
+    const VectorRegister xmm0{ 0 };
+    const VectorRegister xmm1{ 1 };
+    CHECK(Packed{ pxor, xmm0, xmm0, xmm1 } == Packed{ pxor, xmm0, xmm0, xmm1 });
+    CHECK(Packed{ pxor, xmm0, xmm0, xmm1 } != Packed{ por, xmm0, xmm0, xmm1 });
+    CHECK(Packed{ pxor, xmm0, xmm0, xmm1 } != Packed{ pxor, xmm0, xmm0, xmm1, true });
+    CHECK(Instruction{ Packed{ pxor, xmm0, xmm0, xmm1 } } != Instruction{ Mov{ rax, rbx } });
+    CHECK("xmm0" == toString(xmm0));
+    CHECK("ymm12" == toString(VectorRegister{ 12, true }));
 }
 
 TEST_CASE("Memory address equality")
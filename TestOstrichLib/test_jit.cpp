@@ -0,0 +1,191 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch.hpp"
+
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+import Ostrich;
+
+using namespace ostrich;
+using enum RegisterName;
+using enum ConditionCode;
+using enum AdditiveOperator;
+
+namespace
+{
+    // A Vm with the Jit and one without, to compare after doing the same to both
+    struct Pair
+    {
+        Pair(const Source &source, size_t stackSize = 64) : jit{ source, stackSize }, interpreter{ source, stackSize }
+        {
+            jit.useJit(true);
+            interpreter.useJit(false);
+        }
+
+        Vm::StopReason run(size_t maxSteps = std::numeric_limits<size_t>::max())
+        {
+            const auto reason = jit.run(maxSteps);
+            CHECK(interpreter.run(maxSteps) == reason);
+            return reason;
+        }
+
+        void check() const
+        {
+            CHECK(jit.cpu().nextInstruction() == interpreter.cpu().nextInstruction());
+            for(const auto &r : interpreter.cpu().registers())
+            {
+                CHECK(jit.cpu().registerValue(r.registerName) == r.value);
+            }
+            CHECK(jit.cpu().flags() == interpreter.cpu().flags());
+            CHECK(jit.stack().content() == interpreter.stack().content());
+            CHECK(jit.statistics().instructionsExecuted == interpreter.statistics().instructionsExecuted);
+        }
+
+        Vm jit;
+        Vm interpreter;
+    };
+
+    // Sums 1..n into rbx, with the loop in a single block
+    Source countdown(uint64_t n)
+    {
+        return Source{ Mov{ rax, n }, Mov{ rbx, 0 }, Label{ "loop" }, Add{ rbx, rax }, Dec{ rax },
+                       Cmp{ rax, 0 }, Jcc{ ne, "loop" }, Push{ rbx } };
+    }
+} // namespace
+
+TEST_CASE("The Jit gives the same results as the interpreter")
+{
+    SECTION("a counting loop")
+    {
+        Pair pair{ countdown(1000) };
+        CHECK(pair.run() == Vm::StopReason::end);
+        pair.check();
+        CHECK(pair.jit.cpu().registerValue(rbx) == 500500);
+    }
+
+    SECTION("loops ending on every kind of flag operation")
+    {
+        for(const auto conditionCode : { e, ne, b, ae, be, a, l, ge, le, g, s, ns, o, no, p, np })
+        {
+            for(const auto &flagSetter : std::vector<Instruction>{ Add{ rax, rcx }, Sub{ rax, rcx }, Cmp{ rax, rcx },
+                                                                   Inc{ rax }, Dec{ rax } })
+            {
+                const Source source{ Mov{ rax, 0x7ffffffffffffff0 }, Mov{ rcx, 3 }, Label{ "loop" }, Inc{ rbx },
+                                     flagSetter, Sub{ rdx, 1 }, Dec{ rsi }, Add{ rax, 5 }, flagSetter,
+                                     Jcc{ conditionCode, "loop" }, Pushf{} };
+                Pair pair{ source };
+                pair.run(10000);
+                pair.check();
+            }
+        }
+    }
+
+    SECTION("the carry flag survives inc and dec across rounds")
+    {
+        const Source source{ Mov{ rax, 100 }, Label{ "loop" }, Add{ rbx, 0xffffffffffffffff }, Inc{ rcx },
+                             Dec{ rax }, Jcc{ ne, "loop" }, Pushf{} };
+        Pair pair{ source };
+        pair.run();
+        pair.check();
+    }
+
+    SECTION("memory operands and the stack")
+    {
+        const Source source{ Mov{ rax, 50 }, Label{ "loop" }, Push{ rax }, Push{ rax },
+                             Add{ rbx, MemoryAddress{ rsp, plus, std::nullopt, 1, plus, 8 } },
+                             Mov{ rdi, 1 },
+                             Mov{ rcx, MemoryAddress{ rsp, plus, rdi, 8, plus, 0 } },
+                             Sub{ rcx, MemoryAddress{ rsp, minus, rdi, 8, plus, 24 } },
+                             Pop{ rdx }, Pop{ rdx }, Dec{ rax }, Jcc{ ne, "loop" } };
+        Pair pair{ source };
+        CHECK(pair.run() == Vm::StopReason::end);
+        pair.check();
+        CHECK(pair.jit.cpu().registerValue(rbx) == 1275);
+    }
+
+    SECTION("jumps between blocks")
+    {
+        const Source source{ Mov{ rax, 200 }, Label{ "top" }, Dec{ rax }, Cmp{ rax, 100 }, Jcc{ a, "big" },
+                             Inc{ rcx }, Jmp{ "next" }, Label{ "big" }, Inc{ rbx }, Label{ "next" },
+                             Cmp{ rax, 0 }, Jcc{ ne, "top" } };
+        Pair pair{ source };
+        CHECK(pair.run() == Vm::StopReason::end);
+        pair.check();
+        CHECK(pair.jit.cpu().registerValue(rbx) == 99);
+        CHECK(pair.jit.cpu().registerValue(rcx) == 101);
+    }
+}
+
+TEST_CASE("Compiled loops stop like interpreted ones")
+{
+    SECTION("at the step limit")
+    {
+        Pair pair{ countdown(100000) };
+        for(const size_t steps : { 1, 7, 200, 4096, 5000, 12345, 3 })
+        {
+            CHECK(pair.run(steps) == Vm::StopReason::stepLimit);
+            pair.check();
+        }
+        CHECK(pair.run() == Vm::StopReason::end);
+        pair.check();
+    }
+
+    SECTION("at a breakpoint at the start of the loop")
+    {
+        Pair pair{ countdown(1000) };
+        pair.jit.addBreakpoint(Breakpoint{ size_t{ 2 } });
+        pair.interpreter.addBreakpoint(Breakpoint{ size_t{ 2 } });
+        for(size_t i = 0; i < 100; ++i)
+        {
+            CHECK(pair.run() == Vm::StopReason::breakpoint);
+        }
+        pair.check();
+        CHECK(pair.jit.cpu().nextInstruction() == 2);
+    }
+
+    SECTION("when the stack overflows")
+    {
+        const Source source{ Label{ "loop" }, Inc{ rax }, Push{ rax }, Jmp{ "loop" } };
+        Pair pair{ source, 8 * 100 };
+        CHECK_THROWS_AS(pair.jit.run(), std::runtime_error);
+        CHECK_THROWS_AS(pair.interpreter.run(), std::runtime_error);
+        CHECK(pair.jit.cpu().nextInstruction() == 2);
+        CHECK(pair.jit.cpu().nextInstruction() == pair.interpreter.cpu().nextInstruction());
+        CHECK(pair.jit.cpu().registerValue(rax) == 101);
+        CHECK(pair.jit.cpu().registerValue(rax) == pair.interpreter.cpu().registerValue(rax));
+        CHECK(pair.jit.stack().content() == pair.interpreter.stack().content());
+    }
+}
+
+TEST_CASE("Stepping back after a compiled run")
+{
+    Pair pair{ countdown(1000) };
+    pair.run();
+    pair.jit.restorePreviousState();
+    CHECK(pair.jit.cpu().nextInstruction() == 0);
+    pair.jit.step();
+    CHECK(pair.jit.cpu().registerValue(rax) == 1000);
+}
+
+TEST_CASE("Jit benchmarks", "[!benchmark]")
+{
+    BENCHMARK("Interpreted loop")
+    {
+        Vm vm{ countdown(1000000), 64 };
+        vm.useJit(false);
+        vm.run();
+        return vm.cpu().registerValue(rbx);
+    };
+
+    BENCHMARK("Compiled loop")
+    {
+        Vm vm{ countdown(1000000), 64 };
+        vm.useJit(true);
+        vm.run();
+        return vm.cpu().registerValue(rbx);
+    };
+}
@@ -0,0 +1,419 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Contains;
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using enum RegisterName;
+using enum AdditiveOperator;
+
+namespace
+{
+    std::string toText(const Source &source)
+    {
+        std::ostringstream text;
+        for(const auto &instruction : source)
+        {
+            text << instruction << "\n";
+        }
+        return text.str();
+    }
+
+    // Random programs that always end, since they only jump forwards. The stack operands stay
+    // close to rsp, but can still fall off the stack, in which case the Vm throws.
+    class ProgramGenerator
+    {
+    public:
+        explicit ProgramGenerator(uint64_t seed) : m_random{ seed }
+        {
+        }
+
+        Source generate(size_t length)
+        {
+            using enum ConditionCode;
+            Source source;
+            size_t labels{ 0 };
+            for(size_t i = 0; i < length; ++i)
+            {
+                switch(pick(12))
+                {
+                case 0:
+                    source.push_back(Inc{ destination() });
+                    break;
+                case 1:
+                    source.push_back(Dec{ destination() });
+                    break;
+                case 2:
+                    source.push_back(Add{ destination(), operand() });
+                    break;
+                case 3:
+                    source.push_back(Sub{ destination(), operand() });
+                    break;
+                case 4:
+                    source.push_back(Cmp{ destination(), operand() });
+                    break;
+                case 5:
+                case 6:
+                    source.push_back(Mov{ destination(), operand(true) });
+                    break;
+                case 7:
+                    source.push_back(Push{ anyRegister() });
+                    break;
+                case 8:
+                    source.push_back(Pop{ destination() });
+                    break;
+                case 9: {
+                    constexpr ConditionCode conditionCodes[]{ o, no, b, ae, e, ne, be, a,
+                                                              s, ns, p, np, l, ge, le, g };
+                    source.push_back(Jcc{ conditionCodes[pick(16)], "l" + std::to_string(labels), 0 });
+                    m_pending.push_back(labels++);
+                    break;
+                }
+                case 10:
+                    source.push_back(Jmp{ "l" + std::to_string(labels), 0 });
+                    m_pending.push_back(labels++);
+                    break;
+                case 11:
+                    if(!m_pending.empty())
+                    {
+                        source.push_back(Label{ "l" + std::to_string(m_pending.back()) });
+                        m_pending.pop_back();
+                    }
+                    break;
+                }
+            }
+            for(const auto label : m_pending)
+            {
+                source.push_back(Label{ "l" + std::to_string(label) });
+            }
+            m_pending.clear();
+            return source;
+        }
+
+    private:
+        size_t pick(size_t count)
+        {
+            return std::uniform_int_distribution<size_t>{ 0, count - 1 }(m_random);
+        }
+
+        RegisterName anyRegister()
+        {
+            return static_cast<RegisterName>(pick(generalPurposeRegisterCount));
+        }
+
+        // rsp is only changed by push and pop
+        RegisterName destination()
+        {
+            const auto number = pick(generalPurposeRegisterCount - 1);
+            return static_cast<RegisterName>(number < 7 ? number : number + 1);
+        }
+
+        uint64_t immediate(bool wide)
+        {
+            constexpr uint64_t interesting[]{ 0,          1,          2,          0x7f,       0x80,
+                                              0xffffffffffffffff,     0x7fffffff, 0xffffffff80000000,
+                                              0x10,       0xf,        0x8000000000000000 };
+            const auto value = pick(2) ? interesting[pick(std::size(interesting))] : m_random();
+            // Only mov takes a 64 bit immediate, the others take a sign extended 32 bit one
+            return wide ? value : static_cast<uint64_t>(static_cast<int32_t>(value));
+        }
+
+        RegisterOrImmediateOrMemory operand(bool wide = false)
+        {
+            switch(pick(3))
+            {
+            case 0:
+                return anyRegister();
+            case 1:
+                return immediate(wide);
+            default: {
+                const auto distance = pick(6);
+                return MemoryAddress{ rsp, plus, std::nullopt, 1, distance < 3 ? plus : minus, 8 * (distance % 3) };
+            }
+            }
+        }
+
+        std::mt19937_64 m_random;
+        std::vector<size_t> m_pending;
+    };
+} // namespace
+
+TEST_CASE("Encode instructions")
+{
+    // The decoder gives back what was encoded, except for push and pop
+    const Source source{ Inc{ rax },
+                         Dec{ rdi },
+                         Add{ rax, rbx },
+                         Add{ rsp, 8 },
+                         Sub{ rsi, 0x12345 },
+                         Cmp{ rdx, 0xffffffffffffffff },
+                         Add{ rcx, MemoryAddress{ rsp } },
+                         Add{ rdx, MemoryAddress{ rbp } },
+                         Sub{ rsi, MemoryAddress{ rax, plus, rbx, 4, minus, 0x10 } },
+                         Cmp{ rax, MemoryAddress{ rsp, plus, rcx, 8, plus, 0x1000 } },
+                         Mov{ rax, rbx },
+                         Mov{ rcx, MemoryAddress{ rbp, plus, std::nullopt, 1, minus, 8 } },
+                         Mov{ rdx, 0x1122334455667788 },
+                         Mov{ rax, uint64_t{ 0xffffffff } },
+                         Mov{ rbx, 0xfffffffffffffffe },
+                         Inc{ r8 },
+                         Add{ r15, rdi },
+                         Sub{ rsi, r9 },
+                         Cmp{ r12, 0x7f },
+                         Mov{ r11, MemoryAddress{ r12, plus, r13, 2, minus, 8 } },
+                         Mov{ r13, MemoryAddress{ r13 } },
+                         Mov{ r10, 0x1122334455667788 } };
+    const auto code = encoder::encode(source);
+    size_t offset{ 0 };
+    for(const auto &instruction : source)
+    {
+        const auto decoded = decoder::decode(std::span<const uint8_t>{ code }.subspan(offset), offset);
+        CHECK(decoded.instruction == instruction);
+        offset += decoded.length;
+    }
+    CHECK(offset == code.size());
+
+    SECTION("Jumps")
+    {
+        using enum ConditionCode;
+        const Source loop{ Label{ "top" }, Dec{ rax }, Jcc{ ne, "top", 0 }, Jmp{ "end", 4 }, Label{ "end" } };
+        CHECK(encoder::encode(loop) == std::vector<uint8_t>{ 0x48, 0xff, 0xc8, 0x0f, 0x85, 0xf7, 0xff, 0xff, 0xff,
+                                                             0xe9, 0x00, 0x00, 0x00, 0x00 });
+    }
+
+    SECTION("Packed instructions")
+    {
+        using enum PackedOperation;
+        const VectorRegister xmm0{ 0 };
+        const VectorRegister xmm12{ 12 };
+        const VectorRegister ymm2{ 2, true };
+        const VectorRegister ymm3{ 3, true };
+        const VectorRegister ymm9{ 9, true };
+        CHECK(encoder::encode(Source{ Packed{ paddq, xmm0, xmm0, xmm12 } }) ==
+              std::vector<uint8_t>{ 0x66, 0x41, 0x0f, 0xd4, 0xc4 });
+        CHECK(encoder::encode(Source{ Packed{ mulps, xmm12, xmm12, MemoryAddress{ rsp, plus, rax, 2, plus, 16 } } }) ==
+              std::vector<uint8_t>{ 0x44, 0x0f, 0x59, 0x64, 0x44, 0x10 });
+        CHECK(encoder::encode(Source{ Packed{ movdqu, xmm12, xmm12, MemoryAddress{ r13 } } }) ==
+              std::vector<uint8_t>{ 0xf3, 0x45, 0x0f, 0x6f, 0x65, 0x00 });
+        CHECK(encoder::encode(Source{ Packed{ paddd, ymm3, ymm2, MemoryAddress{ r8, plus, rcx, 4, minus, 32 }, true } }) ==
+              std::vector<uint8_t>{ 0xc4, 0xc1, 0x6d, 0xfe, 0x5c, 0x88, 0xe0 });
+        CHECK(encoder::encode(Source{ Packed{ movdqa, ymm9, ymm9, ymm2, true } }) ==
+              std::vector<uint8_t>{ 0xc4, 0x61, 0x7d, 0x6f, 0xca });
+        CHECK(encoder::encode(Source{ Packed{ subps, xmm0, xmm12, xmm0, true } }) ==
+              std::vector<uint8_t>{ 0xc4, 0xe1, 0x18, 0x5c, 0xc0 });
+    }
+
+    SECTION("Push and pop move rsp with lea")
+    {
+        CHECK(encoder::encode(Source{ Push{ rax }, Pop{ rbx } }) ==
+              std::vector<uint8_t>{ 0x48, 0x89, 0x04, 0x24, 0x48, 0x8d, 0x64, 0x24, 0xf8, 0x48, 0x8b, 0x5c, 0x24,
+                                    0x08, 0x48, 0x8d, 0x64, 0x24, 0x08 });
+    }
+}
+
+TEST_CASE("Encoding what x86-64 can't encode")
+{
+    CHECK_THROWS_WITH(encoder::encode(Source{ Add{ rax, 0x100000000 } }),
+                      Equals("add rax, 4294967296 can't be encoded, the immediate is too big"));
+    CHECK_THROWS_WITH(encoder::encode(Source{ Mov{ rax, SubRegister{ rsi, Width::byte }, Width::highByte } }),
+                      Equals("ah, bh, ch and dh can't be encoded together with spl, bpl, sil, dil or r8 to r15"));
+    CHECK_THROWS_WITH(encoder::encode(Source{ Mov{ rax, MemoryAddress{ rax, minus, rbx, 1, plus, 0 } } }),
+                      Contains("can't subtract an index"));
+    CHECK_THROWS_WITH(encoder::encode(Source{ Mov{ rax, MemoryAddress{ rax, plus, rbx, 3, plus, 0 } } }),
+                      Contains("the scale must be 1, 2, 4 or 8"));
+    CHECK_THROWS_WITH(encoder::encode(Source{ Mov{ rax, MemoryAddress{ rax, plus, std::nullopt, 1, plus,
+                                                                       0x80000000 } } }),
+                      Contains("the displacement is too big"));
+    const VectorRegister ymm1{ 1, true };
+    CHECK_THROWS_WITH(encoder::encode(Source{ Packed{ PackedOperation::pxor, ymm1, ymm1, ymm1 } }),
+                      Equals("pxor ymm1 ymm1 can't be encoded, ymm registers need the vex form"));
+}
+
+TEST_CASE("The Cpu does what the hardware does")
+{
+    if(!native::supported())
+    {
+        return;
+    }
+
+    SECTION("Flags at the edges")
+    {
+        using enum ConditionCode;
+        for(const uint64_t value : { uint64_t{ 0 }, uint64_t{ 1 }, uint64_t{ 0xf }, uint64_t{ 0x7fffffffffffffff },
+                                     uint64_t{ 0x8000000000000000 }, uint64_t{ 0xffffffffffffffff } })
+        {
+            for(const uint64_t other : { uint64_t{ 0 }, uint64_t{ 1 }, uint64_t{ 0xffffffffffffffff } })
+            {
+                for(const auto &instruction : std::vector<Instruction>{ Add{ rax, rbx }, Sub{ rax, rbx },
+                                                                        Cmp{ rax, rbx }, Inc{ rax }, Dec{ rax } })
+                {
+                    const Source source{ Mov{ rax, value }, Mov{ rbx, other }, Add{ rcx, rbx }, instruction };
+                    INFO(toText(source));
+                    CHECK(native::compare(source, 64) == std::nullopt);
+                }
+            }
+        }
+    }
+
+    SECTION("Sub-registers")
+    {
+        using enum Width;
+        for(const auto width : { dword, word, byte, highByte })
+        {
+            for(const auto &instruction : std::vector<Instruction>{
+                Add{ rax, SubRegister{ rbx, width == highByte ? byte : width }, width }, Sub{ rax, 1, width },
+                Cmp{ rax, 0x7f, width }, Inc{ rax, width }, Dec{ rax, width }, Mov{ rax, 0x80, width },
+                Mov{ rdx, SubRegister{ rax, width }, width == highByte ? byte : width },
+                Add{ rdi, MemoryAddress{ rsp, plus, std::nullopt, 1, plus, 8 }, width == highByte ? byte : width } })
+            {
+                const Source source{ Mov{ rax, 0x80007fff807f7fff }, Mov{ rbx, 0xffffffffffffffff }, Push{ rax },
+                                     Push{ rbx }, Mov{ rsi, rbx }, Mov{ rdi, rbx }, instruction };
+                INFO(toText(source));
+                CHECK(native::compare(source, 64) == std::nullopt);
+            }
+        }
+    }
+
+    SECTION("Extended registers")
+    {
+        using enum Width;
+        for(const auto &instruction : std::vector<Instruction>{
+            Add{ r8, r15 }, Sub{ r9, 0x80 }, Inc{ r12, dword }, Mov{ r10, SubRegister{ r11, word }, word },
+            Mov{ r13, SubRegister{ rsi, byte }, byte }, Cmp{ r14, MemoryAddress{ rsp, plus, r12, 8, plus, 0 } },
+            Add{ r15, MemoryAddress{ r13, plus, std::nullopt, 1, minus, 8 } } })
+        {
+            const Source source{ Mov{ r8, 0x7fffffffffffffff }, Mov{ r11, 0x1122334455667788 }, Mov{ r12, 0 },
+                                 Mov{ r13, rsp }, Push{ r8 }, Push{ r11 }, Mov{ rsi, 0x80 }, instruction };
+            INFO(toText(source));
+            CHECK(native::compare(source, 64) == std::nullopt);
+        }
+    }
+
+    SECTION("Packed instructions")
+    {
+        using enum PackedOperation;
+        const bool avx2{ native::supportsAvx2() };
+        const VectorRegister xmm1{ 1 };
+        const VectorRegister xmm9{ 9 };
+        const VectorRegister ymm1{ 1, true };
+        const VectorRegister ymm2{ 2, true };
+        const VectorRegister ymm9{ 9, true };
+        const auto vectorAt = [](uint64_t displacement) {
+            return MemoryAddress{ rsp, plus, std::nullopt, 1, plus, displacement };
+        };
+        // Integers that carry and floats that are negative, infinite and NaN, in ymm1 at rsp + 8 and
+        // in ymm9 at rsp + 40, which are both 32 byte aligned
+        const std::vector<uint64_t> vectors{ 0x3f800000c0200000, 0x7fffffffffffffff, 0x80000001ffffffff,
+                                             0x4049000000000001, 0xbf000000ff800000, 0x0000000100000001,
+                                             0x40400000c0000000, 0xfffffffffffffffe };
+        Source setup;
+        for(auto value = vectors.rbegin(); value != vectors.rend(); ++value)
+        {
+            setup.push_back(Mov{ rax, *value });
+            setup.push_back(Push{ rax });
+        }
+        setup.push_back(Packed{ movdqu, avx2 ? ymm1 : xmm1, avx2 ? ymm1 : xmm1, vectorAt(8), avx2 });
+        setup.push_back(Packed{ movdqu, avx2 ? ymm9 : xmm9, avx2 ? ymm9 : xmm9, vectorAt(40), avx2 });
+        for(const auto operation : { movdqa, movdqu, paddd, paddq, psubd, psubq, pand, por, pxor, addps, subps, mulps })
+        {
+            std::vector<Instruction> instructions{ Packed{ operation, xmm1, xmm1, xmm9 },
+                                                   Packed{ operation, xmm9, xmm9, vectorAt(8) } };
+            if(avx2)
+            {
+                // Only vmovdqa needs aligned memory
+                const auto unaligned = vectorAt(operation == movdqa ? 8 : 16);
+                instructions.push_back(Packed{ operation, ymm2, hasFirstOperand(operation) ? ymm1 : ymm2, ymm9, true });
+                instructions.push_back(
+                Packed{ operation, ymm9, hasFirstOperand(operation) ? ymm1 : ymm9, unaligned, true });
+                instructions.push_back(Packed{ operation, xmm1, hasFirstOperand(operation) ? xmm9 : xmm1, unaligned, true });
+            }
+            for(const auto &instruction : instructions)
+            {
+                auto source = setup;
+                source.push_back(instruction);
+                INFO(toText(source));
+                CHECK(native::compare(source, 128) == std::nullopt);
+            }
+        }
+    }
+
+    SECTION("The stack")
+    {
+        const Source source{ Mov{ rax, 0x1122334455667788 }, Push{ rax }, Inc{ rax }, Push{ rax },
+                             Mov{ rbx, MemoryAddress{ rsp, plus, std::nullopt, 1, plus, 16 } }, Pop{ rcx },
+                             Push{ rsp }, Pop{ rsp } };
+        CHECK(native::compare(source, 64) == std::nullopt);
+    }
+
+    SECTION("A difference is reported")
+    {
+        // The Cpu doesn't have the interrupt flag
+        CHECK_THAT(native::compare(Source{ Pushf{} }, 64).value_or(""), Contains("The stack byte"));
+    }
+
+    SECTION("Random programs")
+    {
+        ProgramGenerator generator{ 42 };
+        size_t compared{ 0 };
+        for(size_t i = 0; i < 500; ++i)
+        {
+            const auto source = generator.generate(40);
+            INFO(toText(source));
+            std::optional<std::string> difference;
+            try
+            {
+                difference = native::compare(source, 256, i % 2 == 0);
+            }
+            catch(const std::runtime_error &)
+            {
+                // Fell off the stack
+                continue;
+            }
+            CHECK(difference == std::nullopt);
+            ++compared;
+        }
+        CHECK(compared > 100);
+    }
+}
+
+TEST_CASE("Differential testing benchmarks", "[!benchmark]")
+{
+    if(!native::supported())
+    {
+        return;
+    }
+    ProgramGenerator generator{ 7 };
+    std::vector<Source> programs;
+    for(size_t i = 0; i < 100; ++i)
+    {
+        programs.push_back(generator.generate(40));
+    }
+
+    BENCHMARK("100 random programs")
+    {
+        size_t differences{ 0 };
+        for(const auto &program : programs)
+        {
+            try
+            {
+                differences += native::compare(program, 256) ? 1 : 0;
+            }
+            catch(const std::runtime_error &)
+            {
+            }
+        }
+        return differences;
+    };
+}
@@ -1,9 +1,11 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include "catch.hpp"
 #include <fmt/core.h>
 
 #include <iostream>
 #include <optional>
 #include <ostream>
+#include <string>
 #include <variant>
 
 import Ostrich;
@@ -60,12 +62,140 @@ TEST_CASE("Mov")
                       Contains("Trailing output ' rcx' in 'mov rax rbx rcx'"));
 }
 
+TEST_CASE("Sub and cmp")
+{
+    checkInstruction(Sub{ .destination = rax, .source = rbx }, parseInstruction("sub rax rbx"));
+    checkInstruction(Sub{ .destination = rax, .source = 42 }, parseInstruction("sub rax, 42"));
+    checkInstruction(Cmp{ .destination = rcx, .source = 0x10 }, parseInstruction("cmp rcx 0x10"));
+    checkInstruction(Cmp{ .destination = rcx, .source = MemoryAddress{ rsp } }, parseInstruction("cmp rcx qword ptr [rsp]"));
+
+    CHECK_THROWS_WITH(parseInstruction("cmp rax"), Contains("Expected a register name, an immediate or a memory address"));
+}
+
+TEST_CASE("Sub-registers")
+{
+    using enum Width;
+    checkInstruction(Inc{ rax, dword }, parseInstruction("inc eax"));
+    checkInstruction(Dec{ rsi, byte }, parseInstruction("dec sil"));
+    checkInstruction(Mov{ rax, SubRegister{ rbx, dword }, dword }, parseInstruction("mov eax ebx"));
+    checkInstruction(Add{ rcx, 0xffff, word }, parseInstruction("add cx, 0xffff"));
+    checkInstruction(Sub{ rax, SubRegister{ rdx, byte }, highByte }, parseInstruction("sub ah dl"));
+    checkInstruction(Cmp{ rbx, 0xffffffffffffff80, byte }, parseInstruction("cmp bl 0xffffffffffffff80"));
+    using enum AdditiveOperator;
+    checkInstruction(Mov{ rdi, MemoryAddress{ rsp, plus, std::nullopt, 1, plus, 8 }, dword },
+                     parseInstruction("mov edi dword ptr [rsp+8]"));
+
+    CHECK_THROWS_WITH(parseInstruction("push eax"), Contains("Expected a 64 bit register, found 'eax'"));
+    CHECK_THROWS_WITH(parseInstruction("mov eax rbx"), Contains("The size of 'rbx' doesn't match the destination"));
+    CHECK_THROWS_WITH(parseInstruction("mov al word ptr [rsp]"),
+                      Contains("The size of 'word ptr [rsp]' doesn't match the destination"));
+    CHECK_THROWS_WITH(parseInstruction("mov al 0x100"), Contains("Immediate value '0x100' does not fit"));
+    CHECK_THROWS_WITH(parseInstruction("mov rax [rsp]"), Contains("Expected a register name"));
+}
+
+TEST_CASE("Extended registers")
+{
+    using enum Width;
+    checkInstruction(Push{ r8 }, parseInstruction("push r8"));
+    checkInstruction(Inc{ r15, dword }, parseInstruction("inc r15d"));
+    checkInstruction(Add{ r9, SubRegister{ r10, word }, word }, parseInstruction("add r9w r10w"));
+    checkInstruction(Mov{ rax, SubRegister{ r12, byte }, byte }, parseInstruction("mov al r12b"));
+    using enum AdditiveOperator;
+    checkInstruction(Cmp{ r11, MemoryAddress{ r13, plus, r14, 8, minus, 16 } },
+                     parseInstruction("cmp r11 qword ptr [r13+(r14*8)-16]"));
+
+    CHECK_THROWS_WITH(parseInstruction("mov rax rip"), Contains("'rip' can only be read by conditions"));
+    CHECK_THROWS_WITH(parseInstruction("inc rip"), Contains("'rip' can only be read by conditions"));
+    CHECK_THROWS_WITH(parseInstruction("mov rax qword ptr [rip+8]"),
+                      Contains("'rip' can only be read by conditions"));
+}
+
+TEST_CASE("Packed instructions")
+{
+    using enum PackedOperation;
+    const VectorRegister xmm0{ 0 };
+    const VectorRegister xmm1{ 1 };
+    const VectorRegister xmm12{ 12 };
+    const VectorRegister ymm2{ 2, true };
+    const VectorRegister ymm3{ 3, true };
+    const VectorRegister ymm15{ 15, true };
+    checkInstruction(Packed{ paddq, xmm0, xmm0, xmm12 }, parseInstruction("paddq xmm0, xmm12"));
+    checkInstruction(Packed{ mulps, xmm12, xmm12, xmm1 }, parseInstruction("mulps xmm12 xmm1"));
+    checkInstruction(Packed{ pxor, xmm1, xmm0, xmm12, true }, parseInstruction("vpxor xmm1, xmm0, xmm12"));
+    checkInstruction(Packed{ subps, ymm15, ymm2, ymm3, true }, parseInstruction("vsubps ymm15 ymm2 ymm3"));
+    checkInstruction(Packed{ movdqu, ymm2, ymm2, ymm15, true }, parseInstruction("vmovdqu ymm2, ymm15"));
+    using enum AdditiveOperator;
+    checkInstruction(Packed{ movdqa, xmm1, xmm1, MemoryAddress{ rsp, plus, std::nullopt, 1, plus, 16 } },
+                     parseInstruction("movdqa xmm1 xmmword ptr [rsp+16]"));
+    checkInstruction(Packed{ paddd, ymm3, ymm2, MemoryAddress{ r8, plus, rcx, 4, minus, 32 }, true },
+                     parseInstruction("vpaddd ymm3 ymm2 ymmword ptr [r8+(rcx*4)-32]"));
+
+    CHECK_THROWS_WITH(parseInstruction("paddq ymm2 ymm3"),
+                      Contains("Expected an xmm register, found 'ymm2'. ymm registers need the v form."));
+    CHECK_THROWS_WITH(parseInstruction("vpaddq ymm2 xmm1 ymm3"), Contains("The size of 'xmm1' doesn't match"));
+    CHECK_THROWS_WITH(parseInstruction("movdqa xmm1 ymmword ptr [rsp]"),
+                      Contains("The size of 'ymmword ptr [rsp]' doesn't match"));
+    CHECK_THROWS_WITH(parseInstruction("por xmm1 rax"), Contains("Expected an xmm or ymm register, found 'rax'"));
+    CHECK_THROWS_WITH(parseInstruction("pand xmm16 xmm1"), Contains("Expected an xmm or ymm register"));
+    CHECK_THROWS_WITH(parseInstruction("vmovdqa xmm0 xmm1 xmm2"), Contains("Trailing output"));
+    CHECK_THROWS_WITH(parseInstruction("mov rax xmm0"), Contains("Unknown register name 'xmm0'"));
+}
+
+TEST_CASE("Instructions without operands")
+{
+    checkInstruction(Pushf{}, parseInstruction("pushf"));
+
+    CHECK_THROWS_WITH(parseInstruction("pushf rax"), Contains("Trailing output ' rax' in 'pushf rax'"));
+}
+
+TEST_CASE("Labels and jumps")
+{
+    checkInstruction(Label{ "loop" }, parseInstruction("loop:"));
+    checkInstruction(Jmp{ "loop" }, parseInstruction("jmp loop"));
+    checkInstruction(Jcc{ ConditionCode::ne, "loop" }, parseInstruction("jne loop"));
+    checkInstruction(Jcc{ ConditionCode::ge, "done" }, parseInstruction("jge done"));
+    checkInstruction(Jcc{ ConditionCode::e, "done" }, parseInstruction("jz done"));
+
+    CHECK_THROWS_WITH(parseInstruction("jmp"), Contains("Failed to parse word from ''"));
+    CHECK_THROWS_WITH(parseInstruction("jxx loop"), Contains("instruction 'jxx' not recognized"));
+    CHECK_THROWS_WITH(parseInstruction("loop: inc rax"), Contains("Trailing output ' inc rax'"));
+}
+
+TEST_CASE("Resolving labels")
+{
+    CHECK_THAT(parse(std::string_view("jmp end\nloop:\ndec rax\njne loop\nend:")),
+               Equals(Source{ Jmp{ "end", 4 }, Label{ "loop" }, Dec{ rax }, Jcc{ ConditionCode::ne, "loop", 1 },
+                              Label{ "end" } }));
+
+    CHECK_THROWS_WITH(parse(std::string_view("jmp nowhere")), Equals("Undefined label 'nowhere'"));
+    CHECK_THROWS_WITH(parse(std::string_view("a:\na:")), Equals("Label 'a' is defined more than once"));
+
+    const auto source = parse(std::string_view("inc rax\nloop:"));
+    CHECK(resolveLabels(Jmp{ "loop" }, source) == Instruction{ Jmp{ "loop", 1 } });
+    CHECK_THROWS_WITH(resolveLabels(Jmp{ "nowhere" }, source), Equals("Undefined label 'nowhere'"));
+}
+
 MemoryAddress parseAndReturnMemoryAddress(const std::string_view &str)
 {
     const auto [memoryAddress, _] = parseMemoryAddress(str);
     return memoryAddress;
 }
 
+TEST_CASE("Operands can be separated by commas and spaces")
+{
+    using enum AdditiveOperator;
+    checkInstruction(Mov{ .destination = rbx, .source = rax }, parseInstruction("mov rbx, rax"));
+    checkInstruction(Add{ .destination = rax, .source = 0xff }, parseInstruction("add\trax,0xff"));
+    checkInstruction(Mov{ .destination = rsi, .source = MemoryAddress{ rax, plus, rbx, 2, minus, 4 } },
+                     parseInstruction("  mov rsi, qword ptr [ rax + (rbx * 2) - 4 ]  "));
+
+    CHECK_THROWS_WITH(parseInstruction("mov rax,"), Contains("Expected a register name, an immediate or a memory address"));
+    CHECK_THROWS_WITH(parseInstruction("mov rax, rbx,"), Contains("Trailing output ','"));
+    CHECK_THROWS_WITH(parseInstruction("mov rax, qword [rbx]"), Contains("Expected 'ptr', found '[rbx]'"));
+    CHECK_THROWS_WITH(parseInstruction("mov rax, qword ptr [rbx"), Contains("Expected ']', found ''"));
+    CHECK_THROWS_WITH(parseInstruction("inc @"), Contains("Expected a register name, found '@'"));
+}
+
 TEST_CASE("Memory address")
 {
     using enum AdditiveOperator;
@@ -84,7 +214,8 @@ TEST_CASE("Memory address")
 
     // TODO standardize error messages, use Equals
     CHECK_THROWS_WITH(parseAndReturnMemoryAddress(""), Contains("Expected a register name"));
-    CHECK_THROWS_WITH(parseAndReturnMemoryAddress("ra"), Contains("Expected a register name"));
+    CHECK_THROWS_WITH(parseAndReturnMemoryAddress("r"), Contains("Expected a register name"));
+    CHECK_THROWS_WITH(parseAndReturnMemoryAddress("ra"), Equals("Unknown register name 'ra'"));
     CHECK_THROWS_WITH(parseAndReturnMemoryAddress("raxrbx"),
                       Equals("Unknown register name 'raxrbx'"));
     CHECK_THROWS_WITH(parseAndReturnMemoryAddress("rax+"), Contains("Failed to parse integer"));
@@ -110,4 +241,179 @@ TEST_CASE("Parsing full source")
     CHECK(Instruction{ Mov{ rbx, 2 } } == parse(std::string_view("mov rbx 2")).at(0));
     CHECK_THAT(parse(std::string_view("inc rax\ndec rbx")),
                Equals(std::vector{ Instruction{ Inc{ rax } }, Instruction{ Dec{ rbx } } }));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Incremental parsing")
+{
+    IncrementalParser parser;
+    Source source;
+    CHECK(parser.update(std::string_view("inc rax\ndec rbx\npush rax"), source) == 0u);
+    CHECK_THAT(source, Equals(Source{ Inc{ rax }, Dec{ rbx }, Push{ rax } }));
+
+    CHECK(parser.update(std::string_view("inc rax\ndec rbx\npush rax"), source) == std::nullopt);
+
+    CHECK(parser.update(std::string_view("inc rax\ndec rcx\npush rax"), source) == 1u);
+    CHECK_THAT(source, Equals(Source{ Inc{ rax }, Dec{ rcx }, Push{ rax } }));
+
+    CHECK(parser.update(std::string_view("inc rax\ndec rcx\npop rdx\npop rsi\npush rax"), source) == 2u);
+    CHECK_THAT(source, Equals(Source{ Inc{ rax }, Dec{ rcx }, Pop{ rdx }, Pop{ rsi }, Push{ rax } }));
+
+    CHECK(parser.update(std::string_view("inc rax\npush rax"), source) == 1u);
+    CHECK_THAT(source, Equals(Source{ Inc{ rax }, Push{ rax } }));
+
+    CHECK_THROWS_WITH(parser.update(std::string_view("inc rax\nlol\npush rax"), source), Contains("Failed to parse 'lol'"));
+    CHECK_THAT(source, Equals(Source{ Inc{ rax }, Push{ rax } }));
+    CHECK(parser.update(std::string_view("inc rax"), source) == 1u);
+    CHECK_THAT(source, Equals(Source{ Inc{ rax } }));
+
+    SECTION("Moving a label changes the jumps to it")
+    {
+        CHECK(parser.update(std::string_view("jmp a\ninc rax\na:\ninc rbx"), source) == 0u);
+        CHECK(parser.update(std::string_view("jmp a\ninc rax\ninc rcx\na:\ninc rbx"), source) == 0u);
+        CHECK(source.at(0) == Instruction{ Jmp{ "a", 3 } });
+
+        CHECK_THROWS_WITH(parser.update(std::string_view("jmp a\ninc rax"), source),
+                          Equals("Undefined label 'a'"));
+        CHECK(source.size() == 5);
+    }
+}
+
+TEST_CASE("Parsing all lines collects every error")
+{
+    const auto result = parseAll(std::string_view("inc rax\nlol\n\nmov rax qword ptr [rbx+(rcx)]\ndec rbx\nadd rax 0x\npush rax rbx"));
+    CHECK_THAT(result.source, Equals(Source{ Inc{ rax }, Dec{ rbx } }));
+    REQUIRE(result.diagnostics.size() == 4);
+
+    CHECK(result.diagnostics[0].line == 2);
+    CHECK(result.diagnostics[0].column == 1);
+    CHECK(result.diagnostics[0].code == ErrorCode::unknownInstruction);
+    CHECK_THAT(result.diagnostics[0].message, Contains("instruction 'lol' not recognized"));
+
+    CHECK(result.diagnostics[1].line == 4);
+    CHECK(result.diagnostics[1].column == 28);
+    CHECK_THAT(result.diagnostics[1].message, Contains("Expected '*', found ')]'"));
+
+    CHECK(result.diagnostics[2].line == 6);
+    CHECK(result.diagnostics[2].column == 9);
+    CHECK_THAT(result.diagnostics[2].message, Contains("Failed to parse immediate value from '0x'"));
+
+    CHECK(result.diagnostics[3].line == 7);
+    CHECK(result.diagnostics[3].column == 9);
+    CHECK_THAT(result.diagnostics[3].message, Equals("Trailing output ' rbx' in 'push rax rbx'"));
+
+    CHECK(parseAll(std::string_view("inc rax\ndec rbx")).diagnostics.empty());
+
+    const auto labels = parseAll(std::string_view("a:\njmp b\nlol\na:"));
+    REQUIRE(labels.diagnostics.size() == 3);
+    CHECK(labels.diagnostics[0].line == 2);
+    CHECK(labels.diagnostics[0].code == ErrorCode::undefinedLabel);
+    CHECK(labels.diagnostics[1].line == 3);
+    CHECK(labels.diagnostics[2].line == 4);
+    CHECK(labels.diagnostics[2].code == ErrorCode::duplicateLabel);
+}
+
+TEST_CASE("Parsing without exceptions")
+{
+    using enum AdditiveOperator;
+    const auto reg = tryParseRegister("rbx rest");
+    REQUIRE(reg);
+    CHECK(std::get<0>(*reg) == rbx);
+    CHECK(std::get<1>(*reg) == " rest");
+
+    const auto address = tryParseMemoryAddress("rax+(rbx*4)-2]");
+    REQUIRE(address);
+    CHECK(std::get<0>(*address) == MemoryAddress{ rax, plus, rbx, 4, minus, 2 });
+    CHECK(std::get<1>(*address) == "]");
+
+    const auto operand = tryParseRegisterOrImmediateOrMemory("0x10");
+    REQUIRE(operand);
+    CHECK(std::get<0>(*operand) == RegisterOrImmediateOrMemory{ 0x10 });
+
+    CHECK(tryParseInstruction("push rax"));
+    CHECK(*tryParseInstruction("push rax") == Instruction{ Push{ rax } });
+
+    CHECK(tryParseRegister("raxrbx").error().code == ErrorCode::unknownRegister);
+    CHECK(tryParseRegister("r").error().code == ErrorCode::expectedRegister);
+    CHECK(tryParseRegister("ra").error().code == ErrorCode::unknownRegister);
+    CHECK(tryParseRegister("rip").error().code == ErrorCode::instructionPointerOperand);
+    CHECK(tryParseMemoryAddress("rax+(rbx)").error().code == ErrorCode::expectedToken);
+    CHECK(tryParseMemoryAddress("rax+rbx+256").error().code == ErrorCode::integerOutOfRange);
+    CHECK(tryParseRegisterOrImmediateOrMemory("").error().code == ErrorCode::expectedOperand);
+    CHECK(tryParseRegisterOrImmediateOrMemory("99999999999999999999").error().code ==
+          ErrorCode::immediateOutOfRange);
+    CHECK(tryParseRegisterOrImmediateOrMemory("12ab").error().code == ErrorCode::invalidImmediate);
+    CHECK(tryParseInstruction("").error().code == ErrorCode::emptyLine);
+    CHECK(tryParseInstruction("lol").error().code == ErrorCode::unknownInstruction);
+    CHECK(tryParseInstruction("inc rax rbx").error().code == ErrorCode::trailingInput);
+
+    const auto error = tryParseInstruction("mov rax qword ptr [rax+(rbx)]").error();
+    CHECK(error.code == ErrorCode::expectedToken);
+    CHECK(error.where == ")]");
+    CHECK(error.message() == "Failed to parse operands from 'rax qword ptr [rax+(rbx)]': Expected '*', found ')]'");
+}
+
+TEST_CASE("Parsing conditions")
+{
+    using enum ComparisonOperator;
+    CHECK(parseCondition("rax == 5") == Condition{ rax, equal, 5 });
+    CHECK(parseCondition("[rsp + 8] >= rbx") ==
+          Condition{ MemoryAddress{ rsp, AdditiveOperator::plus, std::nullopt, 1, AdditiveOperator::plus, 8 },
+                     greaterOrEqual, rbx });
+    CHECK(parseCondition("qword ptr [rsp]<0x10") == Condition{ MemoryAddress{ rsp }, less, 0x10 });
+    CHECK(parseCondition("rax == 5").toString() == "rax == 0x5");
+    CHECK(parseCondition("rip != r15") == Condition{ RegisterName::rip, notEqual, RegisterName::r15 });
+
+    CHECK(tryParseCondition("rax = 5").error().code == ErrorCode::expectedComparisonOperator);
+    CHECK(tryParseCondition("rax == 5 6").error().code == ErrorCode::trailingInput);
+    CHECK(tryParseCondition("== 5").error().code == ErrorCode::expectedRegister);
+    CHECK_THROWS_WITH(parseCondition("rax"), Equals("Expected one of == != < <= > >=, found ''"));
+}
+
+TEST_CASE("Parsing malformed input", "[!benchmark]")
+{
+    const std::vector<std::string> malformed{ "lol wat",
+                                              "inc",
+                                              "inc rax rbx",
+                                              "mov rax qword ptr [rax+(rbx*300)]",
+                                              "add rax 0xfffffffffffffffffff",
+                                              "push rxx",
+                                              "mov rsi qword ptr [rax+(rbx)-4]",
+                                              "pop" };
+    std::string text;
+    for(size_t i = 0; i < 10000; ++i)
+    {
+        text += malformed[i % malformed.size()] + "\n";
+    }
+
+    BENCHMARK("parseAll")
+    {
+        return parseAll(std::string_view(text)).diagnostics.size();
+    };
+
+    BENCHMARK("tryParseInstruction")
+    {
+        size_t errors{ 0 };
+        for(const auto &line : malformed)
+        {
+            errors += tryParseInstruction(line).has_value() ? 0 : 1;
+        }
+        return errors;
+    };
+
+    BENCHMARK("parseInstruction, throwing")
+    {
+        size_t errors{ 0 };
+        for(const auto &line : malformed)
+        {
+            try
+            {
+                parseInstruction(line);
+            }
+            catch(const std::runtime_error &)
+            {
+                ++errors;
+            }
+        }
+        return errors;
+    };
+}
@@ -0,0 +1,50 @@
+#include "catch.hpp"
+
+#include <atomic>
+#include <thread>
+
+import Ostrich;
+
+using namespace ostrich;
+using enum RegisterName;
+
+TEST_CASE("Progress channel never shows a half published progress")
+{
+    ProgressChannel channel;
+    std::atomic<bool> done{ false };
+    std::thread writer{ [&]() {
+        for(uint64_t i = 1; i <= 100000; ++i)
+        {
+            Progress progress{ i, i };
+            progress.registers.fill(i);
+            channel.publish(progress);
+        }
+        done = true;
+    } };
+
+    uint64_t lastSteps{ 0 };
+    bool consistent{ true };
+    while(!done)
+    {
+        const auto progress = channel.read();
+        for(const auto value : progress.registers)
+        {
+            consistent = consistent && value == progress.steps && progress.nextInstruction == progress.steps;
+        }
+        consistent = consistent && progress.steps >= lastSteps;
+        lastSteps = progress.steps;
+    }
+    writer.join();
+    CHECK(consistent);
+    CHECK(channel.read().steps == 100000);
+}
+
+TEST_CASE("Run publishes its progress")
+{
+    Vm vm{ Source(Vm::progressInterval * 2 + 3, Inc{ rbx }), 16 };
+    ProgressChannel progress;
+    CHECK(vm.run(Vm::progressInterval + 1, nullptr, &progress) == Vm::StopReason::stepLimit);
+    CHECK(progress.read().steps == Vm::progressInterval + 1);
+    CHECK(progress.read().nextInstruction == Vm::progressInterval + 1);
+    CHECK(progress.read().registers[static_cast<size_t>(rbx)] == Vm::progressInterval + 1);
+}
@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include <string>
+
+import Ostrich;
+
+using Catch::Matchers::StartsWith;
+using namespace ostrich;
+
+TEST_CASE("First frame redraws everything")
+{
+    Screen screen{ 4, 2 };
+    screen.write(0, 0, "ab");
+    CHECK(screen.present() == "\x1b[2J\x1b[1;1Hab  \x1b[2;1H    ");
+}
+
+TEST_CASE("Unchanged frame sends nothing")
+{
+    Screen screen{ 4, 2 };
+    screen.write(1, 1, "xy");
+    screen.present();
+    screen.clear();
+    screen.write(1, 1, "xy");
+    CHECK(screen.present().empty());
+}
+
+TEST_CASE("Only changed cells are sent")
+{
+    Screen screen{ 20, 3 };
+    screen.write(0, 0, "rax: 0000");
+    screen.write(2, 0, "rbx: 0000");
+    screen.present();
+
+    screen.clear();
+    screen.write(0, 0, "rax: 0001");
+    screen.write(2, 0, "rbx: 1000");
+    CHECK(screen.present() == "\x1b[1;9H1\x1b[3;6H1");
+}
+
+TEST_CASE("Changes close together are sent as one run")
+{
+    Screen screen{ 20, 1 };
+    screen.write(0, 0, "aaaaaaaaaa");
+    screen.present();
+    screen.write(0, 0, "baaaab");
+    CHECK(screen.present() == "\x1b[1;1Hbaaaab");
+}
+
+TEST_CASE("Writes are clipped to the screen")
+{
+    Screen screen{ 4, 1 };
+    screen.write(0, 2, "abcdef");
+    screen.write(1, 0, "abcdef");
+    screen.write(0, 10, "abcdef");
+    CHECK(screen.present() == "\x1b[2J\x1b[1;1H  ab");
+}
+
+TEST_CASE("Invalidating redraws everything")
+{
+    Screen screen{ 2, 1 };
+    screen.present();
+    screen.invalidate();
+    CHECK_THAT(screen.present(), StartsWith("\x1b[2J"));
+}
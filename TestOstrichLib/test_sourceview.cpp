@@ -0,0 +1,49 @@
+#include "catch.hpp"
+
+#include <string>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using enum RegisterName;
+
+namespace
+{
+    Source incs(size_t count)
+    {
+        return Source(count, Inc{ rax });
+    }
+} // namespace
+
+TEST_CASE("Source view shows the whole of a short program")
+{
+    SourceView view{ 5 };
+    CHECK_THAT(view.render(Source{ Inc{ rax }, Dec{ rbx } }, 1),
+               Equals(std::vector<std::string>{ " inc  rax", ">dec  rbx" }));
+}
+
+TEST_CASE("Source view keeps the next instruction in the middle")
+{
+    SourceView view{ 5 };
+    auto source = incs(1000);
+    source[500] = Dec{ rax };
+    source[502] = Dec{ rbx };
+    CHECK_THAT(view.render(source, 500),
+               Equals(std::vector<std::string>{ " inc  rax", " inc  rax", ">dec  rax", " inc  rax", " dec  rbx" }));
+    CHECK(view.render(source, 0)[0] == ">inc  rax");
+    CHECK(view.render(source, 999)[4] == ">inc  rax");
+    CHECK(view.render(source, 1000).size() == 5);
+}
+
+TEST_CASE("Source view notices changed instructions")
+{
+    SourceView view{ 5 };
+    auto source = incs(3);
+    view.render(source, 0);
+    source[1] = Push{ rcx };
+    CHECK(view.render(source, 0)[1] == " push rcx");
+    source.resize(1);
+    CHECK(view.render(source, 0).size() == 1);
+}
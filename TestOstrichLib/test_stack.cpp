@@ -67,4 +67,12 @@ TEST_CASE("Stack underflow during load")
     Stack s{ 9, 9 };
     s.load(9);
     CHECK_THROWS_WITH(s.load(10), Contains("Stack underflow"));
-}
\ No newline at end of file
+}
+TEST_CASE("contains")
+{
+    Stack s{ 16, 15 };
+    CHECK(s.contains(15));
+    CHECK(s.contains(7));
+    CHECK_FALSE(s.contains(16));
+    CHECK_FALSE(s.contains(6));
+}
@@ -0,0 +1,53 @@
+#include "catch.hpp"
+
+#include <string>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Equals;
+using namespace ostrich;
+
+TEST_CASE("Stack view shows one qword per row")
+{
+    Stack stack{ 24, 0x1f };
+    stack.store(0x17, 0x1122334455667788);
+    StackView view{ 5 };
+    CHECK_THAT(view.render(stack, 0x17),
+               Equals(std::vector<std::string>{ " 001F: 0000000000000000", ">0017: 1122334455667788",
+                                                " 000F: 0000000000000000" }));
+}
+
+TEST_CASE("Stack view only renders visible rows")
+{
+    Stack stack{ 8 * 1000, 0xffff };
+    StackView view{ 3 };
+    CHECK(view.render(stack, 0xffff).size() == 3);
+    CHECK(view.render(stack, 0xffff)[0] == ">FFFF: 0000000000000000");
+}
+
+TEST_CASE("Stack view follows the stack pointer")
+{
+    Stack stack{ 8 * 10, 0xffff };
+    StackView view{ 3 };
+    CHECK(view.render(stack, 0xffff - 8 * 4)[0] == " FFEF: 0000000000000000");
+    CHECK(view.render(stack, 0xffff - 8 * 4)[2] == ">FFDF: 0000000000000000");
+    CHECK(view.render(stack, 0xffff - 8)[0] == ">FFF7: 0000000000000000");
+}
+
+TEST_CASE("Stack view pages up and down")
+{
+    Stack stack{ 8 * 10, 0xffff };
+    StackView view{ 3 };
+    view.pageDown();
+    CHECK_FALSE(view.following());
+    CHECK(view.render(stack, 0xffff)[0] == " FFE7: 0000000000000000");
+    view.pageDown();
+    view.pageDown();
+    view.pageDown();
+    CHECK(view.render(stack, 0xffff)[0] == " FFC7: 0000000000000000");
+    view.pageUp();
+    CHECK(view.render(stack, 0xffff)[0] == " FFDF: 0000000000000000");
+    view.follow();
+    CHECK(view.render(stack, 0xffff)[0] == ">FFFF: 0000000000000000");
+}
@@ -0,0 +1,100 @@
+#include "catch.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Contains;
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using enum RegisterName;
+
+namespace
+{
+    Vm pushedVm()
+    {
+        Vm vm{ Source{ Mov{ rax, 0x1122 }, Push{ rax } }, 16 };
+        vm.step();
+        vm.step();
+        return vm;
+    }
+} // namespace
+
+TEST_CASE("State dump of a Vm")
+{
+    const auto dump = StateDump::of(pushedVm());
+    CHECK(dump.nextInstruction == 2);
+    CHECK(dump.historyDepth == 2);
+    CHECK(dump.registers[static_cast<size_t>(rax)] == 0x1122);
+    CHECK(dump.registers[static_cast<size_t>(rsp)] == 0xffff - 8);
+    CHECK(dump.flags == initialFlags);
+    CHECK(dump.memoryAddress == 0xffff + 8 - 16);
+    CHECK_THAT(dump.memory, Equals(std::vector<uint8_t>{ 0, 0, 0, 0, 0, 0, 0, 0, 0x22, 0x11, 0, 0, 0, 0, 0, 0 }));
+}
+
+TEST_CASE("State dump as JSON")
+{
+    std::string vectors;
+    for(size_t i = 0; i < vectorRegisterCount; ++i)
+    {
+        vectors += (i == 0 ? "\"ymm" : ",\"ymm") + std::to_string(i) + "\":\"" + std::string(64, '0') + "\"";
+    }
+    CHECK(StateDump::of(pushedVm()).toJson() ==
+          "{\"nextInstruction\":2,\"registers\":{\"rax\":4386,\"rbx\":0,\"rcx\":0,\"rdx\":0,\"rsi\":0,\"rdi\":0,"
+          "\"rbp\":0,\"rsp\":65527,\"r8\":0,\"r9\":0,\"r10\":0,\"r11\":0,\"r12\":0,\"r13\":0,\"r14\":0,"
+          "\"r15\":0,\"rip\":2},\"flags\":2,\"vectors\":{" +
+          vectors +
+          "},\"historyDepth\":2,\"memory\":{\"address\":65527,"
+          "\"bytes\":\"00000000000000002211000000000000\"}}");
+}
+
+TEST_CASE("State dump of the vector registers")
+{
+    Vm vm{ Source{ Mov{ rax, 0x1122 }, Push{ rax },
+                   Packed{ PackedOperation::movdqu, VectorRegister{ 1 }, VectorRegister{ 1 }, MemoryAddress{ rsp } } },
+           16 };
+    vm.step();
+    vm.step();
+    vm.step();
+    const auto dump = StateDump::of(vm);
+    // Push stores at rsp before decrementing it, so the value is in the upper qword
+    CHECK(dump.vectors[1] == Vector{ { 0, 0x1122, 0, 0 } });
+    CHECK(dump.vectors[0] == Vector{});
+    CHECK_THAT(dump.toJson(), Contains("\"ymm1\":\"00000000000000002211" + std::string(44, '0') + "\""));
+    CHECK(StateDump::fromBinary(dump.toBinary()) == dump);
+}
+
+TEST_CASE("State dump binary round trip")
+{
+    const auto dump = StateDump::of(pushedVm());
+    CHECK(StateDump::fromBinary(dump.toBinary()) == dump);
+
+    CHECK_THROWS_WITH(StateDump::fromBinary(std::vector<uint8_t>{ 1, 2, 3 }), Equals("Not an Ostrich state dump"));
+    auto truncated = dump.toBinary();
+    truncated.pop_back();
+    CHECK_THROWS_WITH(StateDump::fromBinary(truncated), Contains("bytes of memory"));
+}
+
+TEST_CASE("Save state dump")
+{
+    const auto jsonPath = std::filesystem::temp_directory_path() / "ostrich_test_dump.json";
+    const auto binaryPath = std::filesystem::temp_directory_path() / "ostrich_test_dump.bin";
+    const auto dump = StateDump::of(pushedVm());
+    dump.save(jsonPath);
+    dump.save(binaryPath);
+
+    std::ifstream json{ jsonPath };
+    CHECK(std::string{ std::istreambuf_iterator<char>{ json }, {} } == dump.toJson() + "\n");
+    std::ifstream binary{ binaryPath, std::ios::binary };
+    const std::vector<uint8_t> data{ std::istreambuf_iterator<char>{ binary }, {} };
+    CHECK(StateDump::fromBinary(data) == dump);
+
+    json.close();
+    binary.close();
+    std::filesystem::remove(jsonPath);
+    std::filesystem::remove(binaryPath);
+}
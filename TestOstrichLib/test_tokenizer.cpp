@@ -42,6 +42,7 @@ TEST_CASE("Token printing")
     CHECK(streamOut(RightBracket{}) == std::string{ "RightBracket{]}" });
     CHECK(streamOut(LeftParenthesis{}) == std::string{ "LeftParenthesis{(}" });
     CHECK(streamOut(RightParenthesis{}) == std::string{ "RightParenthesis{)}" });
+    CHECK(streamOut(Colon{}) == std::string{ "Colon{:}" });
 }
 
 TEST_CASE("Token equality")
@@ -71,6 +72,7 @@ TEST_CASE("Single tokens")
     CHECK(tokenize("]") == tokens{ RightBracket{} });
     CHECK(tokenize("(") == tokens{ LeftParenthesis{} });
     CHECK(tokenize(")") == tokens{ RightParenthesis{} });
+    CHECK(tokenize(":") == tokens{ Colon{} });
     CHECK(tokenize("+") == tokens{ ArithmeticOperator{ "+" } });
     CHECK(tokenize("-") == tokens{ ArithmeticOperator{ "-" } });
     CHECK(tokenize("*") == tokens{ ArithmeticOperator{ "*" } });
@@ -80,6 +82,31 @@ TEST_CASE("Single number")
 {
     CHECK(tokenize("23") == tokens{ Number{ "23" } });
     CHECK(tokenize("0x123") == tokens{ Number{ "0x123" } });
+    CHECK(tokenize("0xff") == tokens{ Number{ "0xff" } });
+}
+
+TEST_CASE("Unknown characters")
+{
+    CHECK(tokenize("@") == tokens{ Unknown{ "@" } });
+    CHECK(tokenize("inc @rax") == tokens{ Word{ "inc" }, Unknown{ "@" }, Word{ "rax" } });
+}
+
+TEST_CASE("Comparison operators")
+{
+    CHECK(tokenize("rax==1") == tokens{ Word{ "rax" }, ComparisonOperator{ "==" }, Number{ "1" } });
+    CHECK(tokenize("!= < <= > >=") == tokens{ ComparisonOperator{ "!=" }, ComparisonOperator{ "<" },
+                                              ComparisonOperator{ "<=" }, ComparisonOperator{ ">" },
+                                              ComparisonOperator{ ">=" } });
+    CHECK(tokenize("= !") == tokens{ Unknown{ "=" }, Unknown{ "!" } });
+}
+
+TEST_CASE("Tokens are views into the input")
+{
+    const std::string_view input{ "mov rax, 0x12" };
+    const auto result = tokenize(input);
+    REQUIRE(result.size() == 4);
+    CHECK(value(result[2]).data() == input.data() + 7);
+    CHECK(value(result[3]).data() == input.data() + 9);
 }
 
 
@@ -92,6 +119,12 @@ TEST_CASE("Full instructions")
                   RightParenthesis{}, ArithmeticOperator{ "-" }, Number{ "4" }, RightBracket{} });
 }
 
+TEST_CASE("Labels")
+{
+    CHECK(tokenize("loop:") == tokens{ Word{ "loop" }, Colon{} });
+    CHECK(tokenize("jne loop") == tokens{ Word{ "jne" }, Word{ "loop" } });
+}
+
 TEST_CASE("Leading and trailing spaces")
 {
     CHECK(tokenize("\t   foo\t\t  ") == tokens{ Word{ "foo" } });
@@ -0,0 +1,411 @@
+#include "catch.hpp"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+import Ostrich;
+
+using Catch::Matchers::Equals;
+using namespace ostrich;
+using enum RegisterName;
+
+namespace
+{
+    void write(const std::filesystem::path &path, const std::string &text)
+    {
+        std::ofstream{ path } << text;
+    }
+
+    size_t historyDepth(Vm &vm)
+    {
+        size_t depth{ 0 };
+        while(vm.cpu().nextInstruction() > 0)
+        {
+            vm.restorePreviousState();
+            ++depth;
+        }
+        return depth;
+    }
+} // namespace
+
+TEST_CASE("Reloading a changed file keeps the history of the unchanged prefix")
+{
+    const auto path = std::filesystem::temp_directory_path() / "ostrich_test_reload.asm";
+    write(path, "mov rax 1\ninc rax\ninc rax\ninc rax");
+    Vm vm{ Source{}, 64 };
+    vm.load(path);
+    vm.step();
+    vm.step();
+    vm.step();
+    CHECK(vm.cpu().registerValue(rax) == 3);
+
+    SECTION("Unchanged file keeps everything")
+    {
+        vm.load(path);
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.cpu().registerValue(rax) == 3);
+    }
+
+    SECTION("Change after the executed prefix keeps everything")
+    {
+        write(path, "mov rax 1\ninc rax\ninc rax\ndec rax");
+        vm.load(path);
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.cpu().registerValue(rax) == 3);
+        CHECK(vm.source().at(3) == Instruction{ Dec{ rax } });
+        vm.step();
+        CHECK(vm.cpu().registerValue(rax) == 2);
+    }
+
+    SECTION("Change inside the executed prefix goes back to before the change")
+    {
+        write(path, "mov rax 1\ndec rax\ninc rax\ninc rax");
+        vm.load(path);
+        CHECK(vm.cpu().nextInstruction() == 1);
+        CHECK(vm.cpu().registerValue(rax) == 1);
+        CHECK(historyDepth(vm) == 1);
+    }
+
+    SECTION("Loading another file starts over")
+    {
+        const auto other = std::filesystem::temp_directory_path() / "ostrich_test_reload_other.asm";
+        write(other, "mov rax 1\ninc rax\ninc rax\ninc rax");
+        vm.load(other);
+        CHECK(vm.cpu().nextInstruction() == 0);
+        CHECK(vm.cpu().registerValue(rax) == 0);
+        std::filesystem::remove(other);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Reloading a changed file goes back to before a run that may have executed the change")
+{
+    const auto path = std::filesystem::temp_directory_path() / "ostrich_test_reload_run.asm";
+    write(path, "mov rax 3\nloop:\ninc rbx\ndec rax\njne loop\npush rbx");
+    Vm vm{ Source{}, 64 };
+    vm.load(path);
+    vm.step();
+
+    SECTION("Run to the end")
+    {
+        CHECK(vm.run() == Vm::StopReason::end);
+        write(path, "mov rax 3\nloop:\ninc rbx\ndec rax\njne loop\npush rax");
+        vm.load(path);
+        CHECK(vm.cpu().nextInstruction() == 1);
+        CHECK(vm.cpu().registerValue(rbx) == 0);
+        CHECK(historyDepth(vm) == 1);
+    }
+
+    SECTION("Run to a breakpoint before the change, after looping past it")
+    {
+        vm.addBreakpoint(Breakpoint{ size_t{ 2 } });
+        CHECK(vm.run() == Vm::StopReason::breakpoint);
+        CHECK(vm.run() == Vm::StopReason::breakpoint);
+        CHECK(vm.cpu().nextInstruction() == 2);
+        CHECK(vm.cpu().registerValue(rbx) == 1);
+        write(path, "mov rax 3\nloop:\ninc rbx\ndec rax\njmp loop\npush rbx");
+        vm.load(path);
+        CHECK(vm.cpu().nextInstruction() == 1);
+        CHECK(vm.cpu().registerValue(rbx) == 0);
+        CHECK(historyDepth(vm) == 1);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Reloading a file doesn't change copies of the Vm")
+{
+    const auto path = std::filesystem::temp_directory_path() / "ostrich_test_reload_copy.asm";
+    write(path, "mov rax 1\ninc rax\ninc rax\ninc rax");
+    Vm vm{ Source{}, 64 };
+    vm.load(path);
+    vm.step();
+    vm.step();
+    vm.step();
+    Vm copy{ vm };
+    Vm assigned{ Source{}, 64 };
+    assigned = vm;
+
+    write(path, "mov rax 1\ndec rax\ninc rax\ninc rax");
+    vm.load(path);
+    CHECK(vm.cpu().nextInstruction() == 1);
+    for(auto *other : { &copy, &assigned })
+    {
+        CHECK(other->source().at(1) == Instruction{ Inc{ rax } });
+        CHECK(other->cpu().nextInstruction() == 3);
+        CHECK(other->run() == Vm::StopReason::end);
+        CHECK(other->cpu().registerValue(rax) == 4);
+    }
+    CHECK(vm.run() == Vm::StopReason::end);
+    CHECK(vm.cpu().registerValue(rax) == 2);
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Reloading a file changes the width of an instruction")
+{
+    const auto path = std::filesystem::temp_directory_path() / "ostrich_test_reload_width.asm";
+    write(path, "mov rax 255\ninc rax\ninc rax");
+    Vm vm{ Source{}, 64 };
+    vm.load(path);
+    vm.step();
+
+    write(path, "mov rax 255\ninc al\ninc rax");
+    vm.load(path);
+    REQUIRE(vm.cpu().nextInstruction() == 1);
+    vm.step();
+    CHECK(vm.cpu().registerValue(rax) == 0);
+    vm.step();
+    CHECK(vm.cpu().registerValue(rax) == 1);
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Run to the end")
+{
+    Vm vm{ Source{ Mov{ rax, 3 }, Inc{ rax }, Inc{ rax } }, 16 };
+    CHECK(vm.run() == Vm::StopReason::end);
+    CHECK(vm.cpu().registerValue(rax) == 5);
+    CHECK(vm.run() == Vm::StopReason::end);
+
+    // The whole run is one step in the history
+    vm.restorePreviousState();
+    CHECK(vm.cpu().nextInstruction() == 0);
+}
+
+TEST_CASE("Run a number of steps")
+{
+    Vm vm{ Source{ Inc{ rax }, Inc{ rax }, Inc{ rax } }, 16 };
+    CHECK(vm.run(2) == Vm::StopReason::stepLimit);
+    CHECK(vm.cpu().nextInstruction() == 2);
+}
+
+TEST_CASE("Run to instruction breakpoint")
+{
+    Vm vm{ Source{ Inc{ rax }, Inc{ rax }, Inc{ rax }, Inc{ rax } }, 16 };
+    vm.addBreakpoint(Breakpoint{ size_t{ 2 } });
+    vm.addBreakpoint(Breakpoint{ size_t{ 100 } });
+    CHECK(vm.run() == Vm::StopReason::breakpoint);
+    CHECK(vm.cpu().nextInstruction() == 2);
+
+    // Continuing passes the breakpoint it stopped at
+    CHECK(vm.run() == Vm::StopReason::end);
+    CHECK(vm.cpu().registerValue(rax) == 4);
+}
+
+TEST_CASE("Run to condition breakpoint")
+{
+    Vm vm{ Source{ Push{ rax }, Inc{ rax }, Inc{ rax }, Push{ rax }, Dec{ rax }, Inc{ rax } }, 32 };
+    vm.addBreakpoint(parser::parseCondition("rax == 2"));
+    CHECK(vm.run() == Vm::StopReason::breakpoint);
+    CHECK(vm.cpu().nextInstruction() == 3);
+
+    // Stops again only after the condition has been false in between
+    CHECK(vm.run() == Vm::StopReason::breakpoint);
+    CHECK(vm.cpu().nextInstruction() == 6);
+
+    vm.removeBreakpoint(0);
+    vm.addBreakpoint(parser::parseCondition("[rsp + 8] >= 2"));
+    vm.load(vm.source());
+    CHECK(vm.run() == Vm::StopReason::breakpoint);
+    CHECK(vm.cpu().nextInstruction() == 4);
+}
+
+TEST_CASE("Run a loop")
+{
+    using enum ConditionCode;
+    const Source loop{ Mov{ rax, 1000 }, Label{ "loop" }, Inc{ rbx }, Dec{ rax }, Jcc{ ne, "loop" }, Push{ rbx } };
+    Vm vm{ loop, 64 };
+
+    SECTION("to the end")
+    {
+        CHECK(vm.run() == Vm::StopReason::end);
+        CHECK(vm.cpu().registerValue(rbx) == 1000);
+        CHECK(vm.statistics().instructionsExecuted == 1 + 4 * 1000 + 1);
+    }
+
+    SECTION("stops at the step limit inside a block")
+    {
+        CHECK(vm.run(6) == Vm::StopReason::stepLimit);
+        CHECK(vm.cpu().nextInstruction() == 2);
+        CHECK(vm.cpu().registerValue(rbx) == 1);
+        CHECK(vm.run(2) == Vm::StopReason::stepLimit);
+        CHECK(vm.cpu().nextInstruction() == 4);
+        CHECK(vm.run() == Vm::StopReason::end);
+        CHECK(vm.cpu().registerValue(rbx) == 1000);
+    }
+
+    SECTION("stops at a breakpoint inside a block")
+    {
+        vm.addBreakpoint(Breakpoint{ size_t{ 3 } });
+        CHECK(vm.run() == Vm::StopReason::breakpoint);
+        CHECK(vm.run() == Vm::StopReason::breakpoint);
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.cpu().registerValue(rbx) == 2);
+        vm.removeBreakpoint(0);
+        CHECK(vm.run() == Vm::StopReason::end);
+        CHECK(vm.cpu().registerValue(rbx) == 1000);
+    }
+
+    SECTION("stops at a condition")
+    {
+        vm.addBreakpoint(parser::parseCondition("rbx == 500"));
+        CHECK(vm.run() == Vm::StopReason::breakpoint);
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.cpu().registerValue(rax) == 501);
+    }
+
+    SECTION("after loading a new source")
+    {
+        CHECK(vm.run() == Vm::StopReason::end);
+        vm.load(Source{ Mov{ rax, 2 }, Label{ "loop" }, Dec{ rax }, Jcc{ ne, "loop" } });
+        CHECK(vm.run() == Vm::StopReason::end);
+        CHECK(vm.cpu().registerValue(rax) == 0);
+        CHECK(vm.cpu().registerValue(rbx) == 0);
+    }
+}
+
+TEST_CASE("Runs with superinstructions end up where stepping does")
+{
+    using enum ConditionCode;
+    const std::vector<Source> sources{
+        { Mov{ rax, 3 }, Label{ "loop" }, Push{ rax }, Pop{ rbx }, Mov{ rcx, 7 }, Add{ rdx, rcx }, Mov{ rsi, 2 },
+          Add{ rsi, rsi }, Push{ rsp }, Pop{ rdi }, Dec{ rax }, Jcc{ ne, "loop" }, Pushf{} },
+        { Mov{ rax, 0 }, Label{ "loop" }, Mov{ rbx, 0xffffffffffffffff }, Add{ rax, rbx }, Dec{ rcx },
+          Jcc{ ae, "loop" }, Pushf{} },
+        { Push{ rax }, Pop{ rax }, Push{ rsp }, Pop{ rsp } },
+    };
+    for(const auto &source : sources)
+    {
+        Vm run{ source, 64 };
+        run.useJit(false);
+        Vm step{ source, 64 };
+        CHECK(run.run(1000) == Vm::StopReason::end);
+        while(step.cpu().nextInstruction() < source.size())
+        {
+            step.step();
+        }
+        for(const auto &r : step.cpu().registers())
+        {
+            CHECK(run.cpu().registerValue(r.registerName) == r.value);
+        }
+        CHECK(run.cpu().flags() == step.cpu().flags());
+        CHECK(run.stack().content() == step.stack().content());
+        CHECK(run.statistics().instructionsExecuted == step.statistics().instructionsExecuted);
+    }
+
+    SECTION("A fused push that overflows the stack stops at the push")
+    {
+        Vm vm{ Source{ Inc{ rax }, Push{ rax }, Pop{ rbx } }, 64 };
+        vm.execute(Mov{ rsp, 0 });
+        CHECK_THROWS_AS(vm.run(), std::runtime_error);
+        CHECK(vm.cpu().nextInstruction() == 1);
+        CHECK(vm.cpu().registerValue(rbx) == 0);
+    }
+
+    SECTION("Stepping stops between the instructions of a fused pair")
+    {
+        Vm vm{ sources[0], 64 };
+        vm.run();
+        vm.restorePreviousState();
+        CHECK(vm.run(3) == Vm::StopReason::stepLimit);
+        CHECK(vm.cpu().nextInstruction() == 3);
+        CHECK(vm.cpu().registerValue(rsp) == vm.stack().beginning() - 8);
+    }
+}
+
+TEST_CASE("Run can be interrupted")
+{
+    Vm vm{ Source{ Inc{ rax }, Inc{ rax } }, 16 };
+    const std::atomic<bool> interrupt{ true };
+    CHECK(vm.run(10, &interrupt) == Vm::StopReason::interrupted);
+    CHECK(vm.cpu().nextInstruction() == 0);
+}
+
+TEST_CASE("Run to watchpoint")
+{
+    using enum AdditiveOperator;
+    const auto top = MemoryAddress{ rsp, plus, std::nullopt, 1, plus, 8 };
+    Vm vm{ Source{ Push{ rax }, Push{ rax }, Inc{ rax }, Push{ rax }, Pop{ rbx }, Mov{ rcx, top } }, 32 };
+    const auto address = vm.stack().beginning() - 8;
+
+    SECTION("Write")
+    {
+        vm.addWatchpoint(Watchpoint{ address, WatchKind::write });
+        CHECK(vm.run() == Vm::StopReason::watchpoint);
+        CHECK(vm.cpu().nextInstruction() == 2);
+    }
+    SECTION("Change")
+    {
+        vm.addWatchpoint(Watchpoint{ address - 8, WatchKind::change });
+        CHECK(vm.run() == Vm::StopReason::watchpoint);
+        CHECK(vm.cpu().nextInstruction() == 4);
+    }
+    SECTION("Read")
+    {
+        vm.addWatchpoint(Watchpoint{ address, WatchKind::read });
+        CHECK(vm.run() == Vm::StopReason::watchpoint);
+        CHECK(vm.cpu().nextInstruction() == 6);
+    }
+    SECTION("Partial overlap")
+    {
+        vm.addWatchpoint(Watchpoint{ address - 4, WatchKind::write });
+        CHECK(vm.run() == Vm::StopReason::watchpoint);
+        CHECK(vm.cpu().nextInstruction() == 2);
+    }
+    SECTION("Removed")
+    {
+        vm.addWatchpoint(Watchpoint{ address, WatchKind::write });
+        vm.removeWatchpoint(0);
+        CHECK(vm.watchpoints().empty());
+        CHECK(vm.run() == Vm::StopReason::end);
+    }
+    SECTION("Far away")
+    {
+        vm.addWatchpoint(Watchpoint{ address - 0x10000, WatchKind::write });
+        CHECK(vm.run() == Vm::StopReason::end);
+    }
+    SECTION("Copied and moved")
+    {
+        vm.addWatchpoint(Watchpoint{ address - 8, WatchKind::change });
+        vm.step();
+        vm.step();
+        auto moved = std::make_unique<Vm>(std::move(vm));
+        Vm copy{ *moved };
+        moved.reset();
+        copy.restorePreviousState();
+        CHECK(copy.stack().load(address) == 0);
+        CHECK(copy.cpu().memoryValue(MemoryAddress{ rsp }) == 0);
+        CHECK(copy.run() == Vm::StopReason::watchpoint);
+        CHECK(copy.cpu().nextInstruction() == 4);
+    }
+}
+
+TEST_CASE("Statistics")
+{
+    const auto path = std::filesystem::temp_directory_path() / "ostrich_test_statistics.asm";
+    write(path, "inc rax\ninc rax\ninc rax");
+    Vm vm{ Source{}, 16 };
+    vm.load(path);
+    CHECK(vm.statistics().instructionsExecuted == 0);
+    CHECK(vm.statistics().historyStates == 1);
+    CHECK(vm.statistics().lastParseTime.count() > 0);
+
+    vm.step();
+    vm.execute(Inc{ rbx });
+    CHECK(vm.run() == Vm::StopReason::end);
+    vm.step();
+    const auto statistics = vm.statistics();
+    CHECK(statistics.instructionsExecuted == 4);
+    CHECK(statistics.historyStates == 5);
+    CHECK(statistics.historyBytes >= 5 * 16);
+    CHECK(statistics.stepsPerSecond > 0);
+    std::filesystem::remove(path);
+}
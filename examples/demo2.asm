@@ -1,4 +1,4 @@
-mov rax 0xfedcba9876543210
-mov rbx 0x111
+mov rax, 0xfedcba9876543210
+mov rbx, 0x111
 push rax
 dec rbx
@@ -1,4 +1,4 @@
-mov rax 0xffff
-mov rbx 0xfedcba9876543210
+mov rax, 0xffff
+mov rbx, 0xfedcba9876543210
 push rbx
-mov rcx qword ptr [rax]
+mov rcx, qword ptr [rax]
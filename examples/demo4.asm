@@ -0,0 +1,8 @@
+mov rax, 10
+mov rbx, 0
+loop:
+add rbx, rax
+dec rax
+cmp rax, 0
+jne loop
+push rbx